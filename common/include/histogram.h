@@ -0,0 +1,190 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_HISTOGRAM_H
+#define NBDKIT_HISTOGRAM_H
+
+/* Log-linear histograms (similar to HDR histograms) for recording
+ * latencies and request sizes.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS are recorded exactly.  Above
+ * that, each power of 2 range is divided into HISTOGRAM_SUB_BUCKETS
+ * linear buckets, so the relative error of any reported value is at
+ * most 1 / HISTOGRAM_SUB_BUCKETS (6.25%).  The whole range of
+ * uint64_t is covered by a fixed number of buckets.
+ *
+ * histogram_record must only be called by a single thread at a time
+ * (for example by keeping one histogram per thread), but the counters
+ * are updated with relaxed atomic stores, so another thread may
+ * concurrently read the histogram using histogram_add.  The snapshot
+ * read this way may be very slightly out of date.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS \
+  ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+  uint64_t count;               /* Number of values recorded. */
+  uint64_t sum;                 /* Sum of values recorded. */
+  uint64_t max;                 /* Largest value recorded. */
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/* Return the index of the bucket containing v. */
+static inline unsigned
+histogram_bucket (uint64_t v)
+{
+  unsigned e;
+
+  if (v < HISTOGRAM_SUB_BUCKETS)
+    return v;
+
+  e = 63 - __builtin_clzll (v); /* >= HISTOGRAM_SUB_BITS */
+  return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+    (v >> (e - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/* Return the smallest value which falls into bucket i. */
+static inline uint64_t
+histogram_bucket_lower (unsigned i)
+{
+  unsigned g = i / HISTOGRAM_SUB_BUCKETS;
+  uint64_t m = i % HISTOGRAM_SUB_BUCKETS;
+
+  if (g == 0)
+    return i;
+  return (HISTOGRAM_SUB_BUCKETS + m) << (g - 1);
+}
+
+/* Return the largest value which falls into bucket i. */
+static inline uint64_t
+histogram_bucket_upper (unsigned i)
+{
+  unsigned g = i / HISTOGRAM_SUB_BUCKETS;
+
+  if (g == 0)
+    return i;
+  return histogram_bucket_lower (i) + ((UINT64_C(1) << (g - 1)) - 1);
+}
+
+static inline void
+histogram_init (struct histogram *h)
+{
+  memset (h, 0, sizeof *h);
+}
+
+/* Record one value.  See the note about threads above. */
+static inline void
+histogram_record (struct histogram *h, uint64_t v)
+{
+  unsigned i = histogram_bucket (v);
+
+  __atomic_store_n (&h->buckets[i], h->buckets[i] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&h->count, h->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&h->sum, h->sum + v, __ATOMIC_RELAXED);
+  if (v > h->max)
+    __atomic_store_n (&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* Add the values recorded in src to dst.  src may be updated by
+ * another thread at the same time.
+ */
+static inline void
+histogram_add (struct histogram *dst, const struct histogram *src)
+{
+  uint64_t max;
+  unsigned i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    dst->buckets[i] += __atomic_load_n (&src->buckets[i], __ATOMIC_RELAXED);
+  dst->count += __atomic_load_n (&src->count, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n (&src->sum, __ATOMIC_RELAXED);
+  max = __atomic_load_n (&src->max, __ATOMIC_RELAXED);
+  if (max > dst->max)
+    dst->max = max;
+}
+
+/* Subtract an earlier snapshot of the same histogram, leaving only
+ * the values recorded since.  The maximum cannot be subtracted, so it
+ * is recomputed from the highest bucket still in use.
+ */
+static inline void
+histogram_subtract (struct histogram *h, const struct histogram *earlier)
+{
+  unsigned i;
+
+  h->max = 0;
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    h->buckets[i] -= earlier->buckets[i];
+    if (h->buckets[i] > 0)
+      h->max = histogram_bucket_upper (i);
+  }
+  h->count -= earlier->count;
+  h->sum -= earlier->sum;
+}
+
+/* Return the value at the given percentile (0 < p <= 100).  This is
+ * the upper bound of the bucket containing the percentile, but never
+ * more than the maximum value recorded.  Returns 0 if the histogram
+ * is empty.
+ */
+static inline uint64_t
+histogram_percentile (const struct histogram *h, double p)
+{
+  uint64_t rank, seen = 0, v;
+  unsigned i;
+
+  if (h->count == 0)
+    return 0;
+
+  rank = (uint64_t) (h->count * p / 100.0 + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->count)
+    rank = h->count;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      v = histogram_bucket_upper (i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+#endif /* NBDKIT_HISTOGRAM_H */
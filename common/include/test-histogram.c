@@ -0,0 +1,141 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "histogram.h"
+
+static struct histogram h, h2;
+
+int
+main (int argc, char *argv[])
+{
+  uint64_t v, lo, hi;
+  unsigned i, b, last;
+  unsigned errors = 0;
+
+  /* Every bucket's range must follow on from the previous one, and
+   * the buckets must cover the whole range of uint64_t.
+   */
+  if (histogram_bucket_lower (0) != 0) {
+    fprintf (stderr, "%s: bucket 0 does not start at 0\n", argv[0]);
+    errors++;
+  }
+  for (i = 1; i < HISTOGRAM_BUCKETS; ++i) {
+    if (histogram_bucket_lower (i) != histogram_bucket_upper (i-1) + 1) {
+      fprintf (stderr, "%s: gap between buckets %u and %u\n",
+               argv[0], i-1, i);
+      errors++;
+    }
+  }
+  if (histogram_bucket_upper (HISTOGRAM_BUCKETS-1) != UINT64_MAX) {
+    fprintf (stderr, "%s: buckets do not cover uint64_t\n", argv[0]);
+    errors++;
+  }
+
+  /* Values must map to the bucket which contains them, and the
+   * relative error must be bounded.
+   */
+  last = 0;
+  for (v = 0; v < 1000000; v = v < 100 ? v+1 : v * 17 / 16) {
+    b = histogram_bucket (v);
+    lo = histogram_bucket_lower (b);
+    hi = histogram_bucket_upper (b);
+    if (v < lo || v > hi || b < last) {
+      fprintf (stderr, "%s: %" PRIu64 " in wrong bucket %u\n",
+               argv[0], v, b);
+      errors++;
+    }
+    if ((hi - lo) * HISTOGRAM_SUB_BUCKETS > lo) {
+      fprintf (stderr, "%s: bucket %u is too wide\n", argv[0], b);
+      errors++;
+    }
+    last = b;
+  }
+  if (histogram_bucket (UINT64_MAX) != HISTOGRAM_BUCKETS-1) {
+    fprintf (stderr, "%s: UINT64_MAX in wrong bucket\n", argv[0]);
+    errors++;
+  }
+
+  /* Percentiles of 1..1000. */
+  histogram_init (&h);
+  for (v = 1; v <= 1000; ++v)
+    histogram_record (&h, v);
+  if (h.count != 1000 || h.max != 1000 || h.sum != 500500) {
+    fprintf (stderr, "%s: wrong count, max or sum\n", argv[0]);
+    errors++;
+  }
+#define TEST_PERCENTILE(p, expected)                                    \
+  do {                                                                  \
+    uint64_t actual = histogram_percentile (&h, (p));                   \
+    if (actual < (expected) ||                                          \
+        actual > (expected) + (expected) / HISTOGRAM_SUB_BUCKETS) {     \
+      fprintf (stderr,                                                  \
+               "%s: p%g: unexpected result %" PRIu64 ", expecting %d\n", \
+               argv[0], (double) (p), actual, (expected));              \
+      errors++;                                                         \
+    }                                                                   \
+  } while (0)
+  TEST_PERCENTILE (50, 500);
+  TEST_PERCENTILE (90, 900);
+  TEST_PERCENTILE (99, 990);
+  TEST_PERCENTILE (99.9, 999);
+  TEST_PERCENTILE (100, 1000);
+
+  /* Add and subtract. */
+  histogram_init (&h2);
+  histogram_add (&h2, &h);
+  histogram_add (&h2, &h);
+  if (h2.count != 2000 || h2.max != 1000) {
+    fprintf (stderr, "%s: histogram_add failed\n", argv[0]);
+    errors++;
+  }
+  histogram_subtract (&h2, &h);
+  if (h2.count != 1000 || h2.sum != 500500 ||
+      h2.max != histogram_bucket_upper (histogram_bucket (1000))) {
+    fprintf (stderr, "%s: histogram_subtract failed\n", argv[0]);
+    errors++;
+  }
+
+  histogram_init (&h);
+  if (histogram_percentile (&h, 50) != 0) {
+    fprintf (stderr, "%s: empty histogram percentile\n", argv[0]);
+    errors++;
+  }
+
+  exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -71,10 +71,23 @@
     }                                                                   \
   } while (0)
 
+#define TEST_TSDIFF(ts1, ts2, expected)                                 \
+  do {                                                                  \
+    int64_t actual = tsdiff_nsec (&(ts1), &(ts2));                      \
+                                                                        \
+    if (actual != (expected)) {                                         \
+      fprintf (stderr,                                                  \
+               "%s: unexpected result %" PRIi64 ", expecting %" PRIi64 "\n", \
+               argv[0], actual, (int64_t) (expected));                  \
+      errors++;                                                         \
+    }                                                                   \
+  } while (0)
+
 int
 main (int argc, char *argv[])
 {
   struct timeval tv1, tv2;
+  struct timespec ts1, ts2;
   unsigned errors = 0;
 
   tv1.tv_sec = 1000;
@@ -126,5 +139,18 @@ main (int argc, char *argv[])
   TEST_TVDIFF (tv1, tv1, 0);
   TEST_SUBTRACT (tv1, tv1, 0, 0);
 
+  ts1.tv_sec = 1000;
+  ts1.tv_nsec = 999999999;
+  ts2.tv_sec = 1001;
+  ts2.tv_nsec = 1;
+  TEST_TSDIFF (ts1, ts1, 0);
+  TEST_TSDIFF (ts1, ts2, 2);
+  TEST_TSDIFF (ts2, ts1, -2);
+
+  ts2.tv_sec = 1003;
+  ts2.tv_nsec = 999999999;
+  TEST_TSDIFF (ts1, ts2, INT64_C(3000000000));
+  TEST_TSDIFF (ts2, ts1, INT64_C(-3000000000));
+
   exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
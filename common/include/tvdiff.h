@@ -33,10 +33,11 @@
 #ifndef NBDKIT_TVDIFF_H
 #define NBDKIT_TVDIFF_H
 
-/* Compute struct timeval differences. */
+/* Compute struct timeval and struct timespec differences. */
 
 #include <config.h>
 
+#include <time.h>
 #include <sys/time.h>
 
 /* Return the number of µs (microseconds) in y - x. */
@@ -61,4 +62,15 @@ subtract_timeval (const struct timeval *x, const struct timeval *y,
   z->tv_usec = usec % 1000000;
 }
 
+/* Return the number of ns (nanoseconds) in y - x. */
+static inline int64_t
+tsdiff_nsec (const struct timespec *x, const struct timespec *y)
+{
+  int64_t nsec;
+
+  nsec = (y->tv_sec - x->tv_sec) * INT64_C(1000000000);
+  nsec += y->tv_nsec - x->tv_nsec;
+  return nsec;
+}
+
 #endif /* NBDKIT_TVDIFF_H */
@@ -33,6 +33,10 @@
 #ifndef NBDKIT_CLEANUP_H
 #define NBDKIT_CLEANUP_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
 #include <pthread.h>
 #include <assert.h>
 
@@ -52,6 +56,11 @@ extern void cleanup_free (void *ptr);
 extern void cleanup_mutex_unlock (pthread_mutex_t **ptr);
 #define CLEANUP_MUTEX_UNLOCK __attribute__((cleanup (cleanup_mutex_unlock)))
 
+extern void cleanup_rwlock_unlock (pthread_rwlock_t **ptr);
+#define CLEANUP_RWLOCK_UNLOCK __attribute__((cleanup (cleanup_rwlock_unlock)))
+
+#ifndef ENABLE_LOCK_PROFILING
+
 #define ACQUIRE_LOCK_FOR_CURRENT_SCOPE(mutex)                           \
   CLEANUP_MUTEX_UNLOCK pthread_mutex_t *UNIQUE_NAME(_lock) = mutex;     \
   do {                                                                  \
@@ -59,9 +68,6 @@ extern void cleanup_mutex_unlock (pthread_mutex_t **ptr);
     assert (!_r);                                                       \
   } while (0)
 
-extern void cleanup_rwlock_unlock (pthread_rwlock_t **ptr);
-#define CLEANUP_RWLOCK_UNLOCK __attribute__((cleanup (cleanup_rwlock_unlock)))
-
 #define ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE(rwlock)                         \
   CLEANUP_RWLOCK_UNLOCK pthread_rwlock_t *UNIQUE_NAME(_rwlock) = rwlock; \
   do {                                                                   \
@@ -76,6 +82,71 @@ extern void cleanup_rwlock_unlock (pthread_rwlock_t **ptr);
     assert (!_r);                                                        \
   } while (0)
 
+#else /* ENABLE_LOCK_PROFILING */
+
+/* When nbdkit is configured with --enable-lock-profiling, each
+ * ACQUIRE_*_FOR_CURRENT_SCOPE call site gets a static
+ * struct lock_profile_site recording how often the lock was taken
+ * there, how often it was contended, and how long threads waited
+ * for it and held it.  See lock-profile.c.
+ */
+#define ACQUIRE_LOCK_FOR_CURRENT_SCOPE(mutex)                           \
+  static struct lock_profile_site UNIQUE_NAME(_site) =                  \
+    LOCK_PROFILE_SITE_INIT (mutex);                                     \
+  CLEANUP_LOCK_PROFILE_UNLOCK CLANG_UNUSED_VARIABLE_WORKAROUND          \
+  struct lock_profile_hold UNIQUE_NAME(_hold) =                         \
+    lock_profile_mutex_lock ((mutex), &UNIQUE_NAME(_site))
+
+#define ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE(rwlock)                        \
+  static struct lock_profile_site UNIQUE_NAME(_site) =                  \
+    LOCK_PROFILE_SITE_INIT (rwlock);                                    \
+  CLEANUP_LOCK_PROFILE_UNLOCK CLANG_UNUSED_VARIABLE_WORKAROUND          \
+  struct lock_profile_hold UNIQUE_NAME(_hold) =                         \
+    lock_profile_rwlock_wrlock ((rwlock), &UNIQUE_NAME(_site))
+
+#define ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE(rwlock)                        \
+  static struct lock_profile_site UNIQUE_NAME(_site) =                  \
+    LOCK_PROFILE_SITE_INIT (rwlock);                                    \
+  CLEANUP_LOCK_PROFILE_UNLOCK CLANG_UNUSED_VARIABLE_WORKAROUND          \
+  struct lock_profile_hold UNIQUE_NAME(_hold) =                         \
+    lock_profile_rwlock_rdlock ((rwlock), &UNIQUE_NAME(_site))
+
+#endif /* ENABLE_LOCK_PROFILING */
+
+/* lock-profile.c */
+struct lock_profile_site {
+  struct lock_profile_site *next; /* List of sites used so far. */
+  const char *file;
+  int line;
+  const char *lock;               /* The lock expression, as a string. */
+  bool registered;
+  uint64_t acquired;              /* Number of times acquired. */
+  uint64_t contended;             /* Number of times we had to wait. */
+  uint64_t wait_ns;               /* Total time spent waiting. */
+  uint64_t max_wait_ns;           /* Longest single wait. */
+  uint64_t hold_ns;               /* Total time spent holding the lock. */
+};
+#define LOCK_PROFILE_SITE_INIT(expr) \
+  { .file = __FILE__, .line = __LINE__, .lock = #expr }
+
+struct lock_profile_hold {
+  pthread_mutex_t *mutex;         /* Exactly one of mutex or rwlock */
+  pthread_rwlock_t *rwlock;       /* is set. */
+  struct lock_profile_site *site;
+  struct timespec start;
+};
+
+extern struct lock_profile_hold lock_profile_mutex_lock
+  (pthread_mutex_t *mutex, struct lock_profile_site *site);
+extern struct lock_profile_hold lock_profile_rwlock_rdlock
+  (pthread_rwlock_t *rwlock, struct lock_profile_site *site);
+extern struct lock_profile_hold lock_profile_rwlock_wrlock
+  (pthread_rwlock_t *rwlock, struct lock_profile_site *site);
+extern void lock_profile_unlock (struct lock_profile_hold *hold);
+#define CLEANUP_LOCK_PROFILE_UNLOCK \
+  __attribute__((cleanup (lock_profile_unlock)))
+extern void lock_profile_report (FILE *fp);
+
 /* cleanup-nbdkit.c */
 struct nbdkit_extents;
 extern void cleanup_extents_free (struct nbdkit_extents **ptr);
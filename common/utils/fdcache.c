@@ -0,0 +1,334 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cleanup.h"
+#include "tvdiff.h"
+#include "windows-compat.h"
+
+#include "fdcache.h"
+
+struct fdcache_entry {
+  struct fdcache_entry *hash_next;
+  struct fdcache_entry *lru_prev, *lru_next; /* Only while refs == 0. */
+  char *path;
+  int flags;
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  unsigned refs;
+  bool stale;                   /* Replaced, no longer in the table. */
+  struct timespec validated;    /* When stat(2) last matched. */
+};
+
+struct fdcache {
+  pthread_mutex_t lock;
+  size_t max_fds;
+  unsigned validate_ms;
+  size_t nr_buckets;
+  struct fdcache_entry **buckets;
+  size_t nr_unused;             /* Number of entries on the LRU list. */
+  struct fdcache_entry *lru_first, *lru_last; /* Most recent first. */
+};
+
+struct fdcache *
+fdcache_new (size_t max_fds, unsigned validate_ms)
+{
+  struct fdcache *c;
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL)
+    return NULL;
+  pthread_mutex_init (&c->lock, NULL);
+  c->max_fds = max_fds;
+  c->validate_ms = validate_ms;
+  c->nr_buckets = 2 * max_fds + 1;
+  c->buckets = calloc (c->nr_buckets, sizeof (struct fdcache_entry *));
+  if (c->buckets == NULL) {
+    pthread_mutex_destroy (&c->lock);
+    free (c);
+    return NULL;
+  }
+  return c;
+}
+
+static void
+free_entry (struct fdcache_entry *e)
+{
+  close (e->fd);
+  free (e->path);
+  free (e);
+}
+
+void
+fdcache_free (struct fdcache *c)
+{
+  size_t i;
+  struct fdcache_entry *e, *next;
+
+  if (c == NULL)
+    return;
+
+  for (i = 0; i < c->nr_buckets; ++i) {
+    for (e = c->buckets[i]; e != NULL; e = next) {
+      next = e->hash_next;
+      free_entry (e);
+    }
+  }
+  free (c->buckets);
+  pthread_mutex_destroy (&c->lock);
+  free (c);
+}
+
+int
+fdcache_fd (const struct fdcache_entry *e)
+{
+  return e->fd;
+}
+
+/* FNV-1a. */
+static size_t
+hash (const struct fdcache *c, const char *path, int flags)
+{
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+  for (; *path; ++path) {
+    h ^= (unsigned char) *path;
+    h *= UINT64_C(0x100000001b3);
+  }
+  h ^= (unsigned) flags;
+  h *= UINT64_C(0x100000001b3);
+  return h % c->nr_buckets;
+}
+
+/* The functions below must be called with c->lock held. */
+
+static struct fdcache_entry *
+lookup (struct fdcache *c, const char *path, int flags)
+{
+  struct fdcache_entry *e;
+
+  for (e = c->buckets[hash (c, path, flags)]; e != NULL; e = e->hash_next) {
+    if (e->flags == flags && strcmp (e->path, path) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static void
+lru_remove (struct fdcache *c, struct fdcache_entry *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    c->lru_first = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    c->lru_last = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+  c->nr_unused--;
+}
+
+static void
+lru_push (struct fdcache *c, struct fdcache_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = c->lru_first;
+  if (c->lru_first)
+    c->lru_first->lru_prev = e;
+  else
+    c->lru_last = e;
+  c->lru_first = e;
+  c->nr_unused++;
+}
+
+/* Take a reference to an entry in the table. */
+static void
+ref (struct fdcache *c, struct fdcache_entry *e)
+{
+  if (e->refs++ == 0)
+    lru_remove (c, e);
+}
+
+/* Remove an entry from the table, closing it now if it is unused or
+ * else when the last reference is dropped.
+ */
+static void
+unhash (struct fdcache *c, struct fdcache_entry *e)
+{
+  struct fdcache_entry **pp;
+
+  for (pp = &c->buckets[hash (c, e->path, e->flags)]; *pp != e;
+       pp = &(*pp)->hash_next)
+    ;
+  *pp = e->hash_next;
+  e->stale = true;
+  if (e->refs == 0) {
+    lru_remove (c, e);
+    free_entry (e);
+  }
+}
+
+/* Close the least recently used entries over the limit. */
+static void
+evict (struct fdcache *c)
+{
+  while (c->nr_unused > c->max_fds)
+    unhash (c, c->lru_last);
+}
+
+static bool
+needs_validation (const struct fdcache *c, const struct fdcache_entry *e,
+                  const struct timespec *now)
+{
+  return tsdiff_nsec (&e->validated, now) >=
+    (int64_t) c->validate_ms * 1000000;
+}
+
+struct fdcache_entry *
+fdcache_get (struct fdcache *c, const char *path, int flags)
+{
+  struct fdcache_entry *e, *old;
+  struct timespec now;
+  struct stat statbuf;
+  bool validate = false;
+
+  flags |= O_CLOEXEC;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+    e = lookup (c, path, flags);
+    if (e) {
+      ref (c, e);
+      validate = needs_validation (c, e, &now);
+    }
+  }
+
+  if (e) {
+    if (!validate)
+      return e;
+
+    /* Check that the path still refers to the file we have open. */
+    if (stat (path, &statbuf) == 0 &&
+        statbuf.st_dev == e->dev && statbuf.st_ino == e->ino) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+      e->validated = now;
+      return e;
+    }
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+      if (!e->stale)
+        unhash (c, e);
+    }
+    fdcache_put (c, e);
+  }
+
+  /* Open the file outside the lock. */
+  e = calloc (1, sizeof *e);
+  if (e == NULL)
+    return NULL;
+  e->path = strdup (path);
+  if (e->path == NULL) {
+    free (e);
+    return NULL;
+  }
+  e->flags = flags;
+  e->fd = open (path, flags);
+  if (e->fd == -1) {
+    int err = errno;
+    free (e->path);
+    free (e);
+    errno = err;
+    return NULL;
+  }
+  if (fstat (e->fd, &statbuf) == -1) {
+    int err = errno;
+    free_entry (e);
+    errno = err;
+    return NULL;
+  }
+  e->dev = statbuf.st_dev;
+  e->ino = statbuf.st_ino;
+  e->refs = 1;
+  e->validated = now;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  /* Another thread may have opened the same file meanwhile.  If so
+   * use theirs, unless ours is a newer file at the same path.
+   */
+  old = lookup (c, path, flags);
+  if (old) {
+    if (old->dev == e->dev && old->ino == e->ino) {
+      ref (c, old);
+      free_entry (e);
+      return old;
+    }
+    unhash (c, old);
+  }
+
+  e->hash_next = c->buckets[hash (c, path, flags)];
+  c->buckets[hash (c, path, flags)] = e;
+  return e;
+}
+
+void
+fdcache_put (struct fdcache *c, struct fdcache_entry *e)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (--e->refs > 0)
+    return;
+  if (e->stale)
+    free_entry (e);
+  else {
+    lru_push (c, e);
+    evict (c);
+  }
+}
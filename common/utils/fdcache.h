@@ -0,0 +1,67 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_FDCACHE_H
+#define NBDKIT_FDCACHE_H
+
+#include <stddef.h>
+
+/* A cache of open file descriptors shared by all threads of a
+ * plugin, for plugins which serve many host files and would
+ * otherwise open and close a file for each request or connection.
+ *
+ * Files are looked up by path and open(2) flags.  The cache holds at
+ * most max_fds descriptors which are not in use, closing the least
+ * recently used.  A cached descriptor is checked with stat(2) before
+ * it is reused if validate_ms milliseconds have passed since it was
+ * last checked (0 means check every time), so that a file which has
+ * been replaced or deleted is reopened.
+ */
+struct fdcache;
+struct fdcache_entry;
+
+extern struct fdcache *fdcache_new (size_t max_fds, unsigned validate_ms);
+extern void fdcache_free (struct fdcache *c);
+
+/* Return a reference to the file opened with flags, opening it if
+ * necessary.  O_CLOEXEC is always added.  On error returns NULL and
+ * sets errno.  The caller must release the reference with
+ * fdcache_put.
+ */
+extern struct fdcache_entry *fdcache_get (struct fdcache *c,
+                                          const char *path, int flags);
+extern void fdcache_put (struct fdcache *c, struct fdcache_entry *e);
+
+/* The file descriptor of an entry.  Do not close it. */
+extern int fdcache_fd (const struct fdcache_entry *e);
+
+#endif /* NBDKIT_FDCACHE_H */
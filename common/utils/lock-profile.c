@@ -0,0 +1,250 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Lock contention profiling, enabled by ./configure --enable-lock-profiling.
+ *
+ * Each ACQUIRE_*_FOR_CURRENT_SCOPE call site has a static
+ * struct lock_profile_site, which is added to a list the first time
+ * the site is used.  When the plugin, filter or server containing
+ * this copy of the library is unloaded or exits, the list is printed
+ * on stderr sorted by total wait time, so the most contended locks
+ * are at the top.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "cleanup.h"
+#include "tvdiff.h"
+
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lock_profile_site *sites;
+
+static void
+register_site (struct lock_profile_site *site)
+{
+  if (__atomic_load_n (&site->registered, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock (&sites_lock);
+  if (!site->registered) {
+    site->next = sites;
+    sites = site;
+    __atomic_store_n (&site->registered, true, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock (&sites_lock);
+}
+
+/* Common code after the lock has been acquired.  If the lock was
+ * contended then wait_start is the time we started waiting, and the
+ * current time is both the end of the wait and the start of the hold.
+ */
+static struct lock_profile_hold
+acquired (struct lock_profile_site *site, bool contended,
+          const struct timespec *wait_start)
+{
+  struct lock_profile_hold hold = { .site = site };
+
+  clock_gettime (CLOCK_MONOTONIC, &hold.start);
+  register_site (site);
+  __atomic_fetch_add (&site->acquired, 1, __ATOMIC_RELAXED);
+  if (contended) {
+    uint64_t ns = tsdiff_nsec (wait_start, &hold.start);
+    uint64_t max = __atomic_load_n (&site->max_wait_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add (&site->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&site->wait_ns, ns, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n (&site->max_wait_ns, &max, ns, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+  return hold;
+}
+
+struct lock_profile_hold
+lock_profile_mutex_lock (pthread_mutex_t *mutex,
+                         struct lock_profile_site *site)
+{
+  struct lock_profile_hold hold;
+  struct timespec wait_start = { 0 };
+  bool contended = false;
+  int r;
+
+  r = pthread_mutex_trylock (mutex);
+  if (r == EBUSY) {
+    contended = true;
+    clock_gettime (CLOCK_MONOTONIC, &wait_start);
+    r = pthread_mutex_lock (mutex);
+  }
+  assert (!r);
+
+  hold = acquired (site, contended, &wait_start);
+  hold.mutex = mutex;
+  return hold;
+}
+
+struct lock_profile_hold
+lock_profile_rwlock_rdlock (pthread_rwlock_t *rwlock,
+                            struct lock_profile_site *site)
+{
+  struct lock_profile_hold hold;
+  struct timespec wait_start = { 0 };
+  bool contended = false;
+  int r;
+
+  r = pthread_rwlock_tryrdlock (rwlock);
+  if (r == EBUSY) {
+    contended = true;
+    clock_gettime (CLOCK_MONOTONIC, &wait_start);
+    r = pthread_rwlock_rdlock (rwlock);
+  }
+  assert (!r);
+
+  hold = acquired (site, contended, &wait_start);
+  hold.rwlock = rwlock;
+  return hold;
+}
+
+struct lock_profile_hold
+lock_profile_rwlock_wrlock (pthread_rwlock_t *rwlock,
+                            struct lock_profile_site *site)
+{
+  struct lock_profile_hold hold;
+  struct timespec wait_start = { 0 };
+  bool contended = false;
+  int r;
+
+  r = pthread_rwlock_trywrlock (rwlock);
+  if (r == EBUSY) {
+    contended = true;
+    clock_gettime (CLOCK_MONOTONIC, &wait_start);
+    r = pthread_rwlock_wrlock (rwlock);
+  }
+  assert (!r);
+
+  hold = acquired (site, contended, &wait_start);
+  hold.rwlock = rwlock;
+  return hold;
+}
+
+void
+lock_profile_unlock (struct lock_profile_hold *hold)
+{
+  struct timespec end;
+  int r;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  __atomic_fetch_add (&hold->site->hold_ns, tsdiff_nsec (&hold->start, &end),
+                      __ATOMIC_RELAXED);
+
+  if (hold->mutex)
+    r = pthread_mutex_unlock (hold->mutex);
+  else
+    r = pthread_rwlock_unlock (hold->rwlock);
+  assert (!r);
+}
+
+static int
+compare_wait (const void *v1, const void *v2)
+{
+  const struct lock_profile_site *s1 = *(struct lock_profile_site * const *)v1;
+  const struct lock_profile_site *s2 = *(struct lock_profile_site * const *)v2;
+
+  if (s1->wait_ns != s2->wait_ns)
+    return s1->wait_ns < s2->wait_ns ? 1 : -1;
+  if (s1->hold_ns != s2->hold_ns)
+    return s1->hold_ns < s2->hold_ns ? 1 : -1;
+  return 0;
+}
+
+/* Print the contention report.  Counters may still be changing if
+ * other threads are running, so the report is only a snapshot.
+ */
+void
+lock_profile_report (FILE *fp)
+{
+  struct lock_profile_site *site, **sorted;
+  size_t i, n = 0;
+
+  pthread_mutex_lock (&sites_lock);
+  for (site = sites; site != NULL; site = site->next)
+    n++;
+  if (n == 0) {
+    pthread_mutex_unlock (&sites_lock);
+    return;
+  }
+  sorted = malloc (n * sizeof *sorted);
+  if (sorted == NULL) {
+    pthread_mutex_unlock (&sites_lock);
+    perror ("malloc");
+    return;
+  }
+  for (i = 0, site = sites; site != NULL; site = site->next)
+    sorted[i++] = site;
+  pthread_mutex_unlock (&sites_lock);
+
+  qsort (sorted, n, sizeof *sorted, compare_wait);
+
+  fprintf (fp, "lock profile (sorted by total wait time):\n");
+  fprintf (fp, "%-32s %-24s %10s %10s %12s %12s %12s\n",
+           "site", "lock", "acquired", "contended",
+           "wait ms", "max wait us", "hold ms");
+  for (i = 0; i < n; ++i) {
+    char where[256];
+
+    site = sorted[i];
+    snprintf (where, sizeof where, "%s:%d", site->file, site->line);
+    fprintf (fp, "%-32s %-24s %10" PRIu64 " %10" PRIu64
+             " %12.3f %12.3f %12.3f\n",
+             where, site->lock, site->acquired, site->contended,
+             site->wait_ns / 1e6, site->max_wait_ns / 1e3,
+             site->hold_ns / 1e6);
+  }
+  free (sorted);
+}
+
+static void lock_profile_report_at_exit (void) __attribute__((destructor));
+
+static void
+lock_profile_report_at_exit (void)
+{
+  lock_profile_report (stderr);
+}
@@ -0,0 +1,205 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the file descriptor cache. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#undef NDEBUG /* Keep test strong even for nbdkit built without assertions */
+#include <assert.h>
+
+#include "fdcache.h"
+
+static char dir[] = "/tmp/fdcacheXXXXXX";
+static char path_a[64], path_b[64], path_c[64], path_tmp[64];
+
+static void
+create (const char *path, const char *content)
+{
+  FILE *fp = fopen (path, "w");
+
+  assert (fp != NULL);
+  fputs (content, fp);
+  assert (fclose (fp) == 0);
+}
+
+static char
+first_byte (struct fdcache_entry *e)
+{
+  char c;
+
+  assert (pread (fdcache_fd (e), &c, 1, 0) == 1);
+  return c;
+}
+
+static bool
+is_open (int fd)
+{
+  return fcntl (fd, F_GETFD) != -1;
+}
+
+/* Unused entries are reused, and the least recently used are
+ * closed when there are too many.
+ */
+static void
+test_lru (void)
+{
+  struct fdcache *c = fdcache_new (3, 60000);
+  struct fdcache_entry *a, *a2, *b, *cc, *a_rw;
+  int fd_a;
+
+  assert (c != NULL);
+  a = fdcache_get (c, path_a, O_RDONLY);
+  assert (a != NULL);
+  fd_a = fdcache_fd (a);
+  assert (first_byte (a) == 'a');
+
+  /* While in use, getting it again returns the same descriptor. */
+  a2 = fdcache_get (c, path_a, O_RDONLY);
+  assert (a2 == a);
+  fdcache_put (c, a2);
+  fdcache_put (c, a);
+  assert (is_open (fd_a));
+
+  /* Different flags are a different entry. */
+  a_rw = fdcache_get (c, path_a, O_RDWR);
+  assert (a_rw != NULL && a_rw != a);
+  fdcache_put (c, a_rw);
+
+  /* The read-only entry for a is now least recently used, and is
+   * closed when a fourth unused entry is added.
+   */
+  b = fdcache_get (c, path_b, O_RDONLY);
+  assert (b != NULL && first_byte (b) == 'b');
+  fdcache_put (c, b);
+  assert (is_open (fd_a));
+  cc = fdcache_get (c, path_c, O_RDONLY);
+  assert (cc != NULL && first_byte (cc) == 'c');
+  fdcache_put (c, cc);
+  assert (!is_open (fd_a));
+
+  a = fdcache_get (c, path_a, O_RDONLY);
+  assert (a != NULL && first_byte (a) == 'a');
+  fdcache_put (c, a);
+
+  fdcache_free (c);
+}
+
+/* Entries in use are never closed by eviction. */
+static void
+test_in_use (void)
+{
+  struct fdcache *c = fdcache_new (0, 60000);
+  struct fdcache_entry *a, *b;
+  int fd_a;
+
+  assert (c != NULL);
+  a = fdcache_get (c, path_a, O_RDONLY);
+  b = fdcache_get (c, path_b, O_RDONLY);
+  assert (a != NULL && b != NULL);
+  fd_a = fdcache_fd (a);
+  fdcache_put (c, b);
+  assert (is_open (fd_a));
+  assert (first_byte (a) == 'a');
+  fdcache_put (c, a);
+  assert (!is_open (fd_a));
+  fdcache_free (c);
+}
+
+/* Files which are replaced or deleted are noticed. */
+static void
+test_validate (void)
+{
+  struct fdcache *c = fdcache_new (10, 0);
+  struct fdcache_entry *a, *a2;
+  int fd_a;
+
+  assert (c != NULL);
+  a = fdcache_get (c, path_a, O_RDONLY);
+  assert (a != NULL && first_byte (a) == 'a');
+  fd_a = fdcache_fd (a);
+
+  /* Replace the file while it is in use.  The old reference remains
+   * valid, but new references get the new file.
+   */
+  create (path_tmp, "A");
+  assert (rename (path_tmp, path_a) == 0);
+  a2 = fdcache_get (c, path_a, O_RDONLY);
+  assert (a2 != NULL && a2 != a);
+  assert (first_byte (a2) == 'A');
+  assert (first_byte (a) == 'a');
+  fdcache_put (c, a);
+  assert (!is_open (fd_a));
+  fdcache_put (c, a2);
+
+  /* Delete the file. */
+  assert (unlink (path_a) == 0);
+  a = fdcache_get (c, path_a, O_RDONLY);
+  assert (a == NULL);
+  assert (errno == ENOENT);
+
+  fdcache_free (c);
+}
+
+int
+main (void)
+{
+  if (mkdtemp (dir) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+  snprintf (path_a, sizeof path_a, "%s/a", dir);
+  snprintf (path_b, sizeof path_b, "%s/b", dir);
+  snprintf (path_c, sizeof path_c, "%s/c", dir);
+  snprintf (path_tmp, sizeof path_tmp, "%s/tmp", dir);
+  create (path_a, "a");
+  create (path_b, "b");
+  create (path_c, "c");
+
+  test_lru ();
+  test_in_use ();
+  test_validate ();
+
+  unlink (path_b);
+  unlink (path_c);
+  rmdir (dir);
+  exit (EXIT_SUCCESS);
+}
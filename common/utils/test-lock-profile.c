@@ -0,0 +1,145 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test lock contention profiling.  This is always compiled with
+ * ENABLE_LOCK_PROFILING (see Makefile.am).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#undef NDEBUG /* Keep test strong even for nbdkit built without assertions */
+#include <assert.h>
+
+#include "cleanup.h"
+
+#define NR_THREADS 4
+#define NR_LOOPS 50
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Hold the mutex for a while so that the other threads must wait. */
+static void
+hold_mutex (void)
+{
+  const struct timespec ts = { .tv_nsec = 100000 };
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&mutex);
+  nanosleep (&ts, NULL);
+}
+
+/* Readers never contend with each other. */
+static void
+hold_rdlock (void)
+{
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&rwlock);
+}
+
+static void *
+start_thread (void *arg)
+{
+  size_t i;
+
+  for (i = 0; i < NR_LOOPS; ++i) {
+    hold_mutex ();
+    hold_rdlock ();
+  }
+  return NULL;
+}
+
+int
+main (void)
+{
+  pthread_t threads[NR_THREADS];
+  FILE *fp;
+  char line[512];
+  size_t i, nr_sites = 0;
+  char site[256], lock[64];
+  uint64_t acquired, contended;
+  double wait_ms, max_wait_us, hold_ms;
+  int r;
+
+  for (i = 0; i < NR_THREADS; ++i) {
+    r = pthread_create (&threads[i], NULL, start_thread, NULL);
+    assert (r == 0);
+  }
+  for (i = 0; i < NR_THREADS; ++i) {
+    r = pthread_join (threads[i], NULL);
+    assert (r == 0);
+  }
+
+  fp = tmpfile ();
+  assert (fp != NULL);
+  lock_profile_report (fp);
+  rewind (fp);
+
+  /* Skip the two header lines. */
+  assert (fgets (line, sizeof line, fp) != NULL);
+  assert (strstr (line, "lock profile") != NULL);
+  assert (fgets (line, sizeof line, fp) != NULL);
+
+  while (fgets (line, sizeof line, fp) != NULL) {
+    printf ("%s", line);
+    r = sscanf (line, "%255s %63s %" SCNu64 " %" SCNu64 " %lf %lf %lf",
+                site, lock, &acquired, &contended,
+                &wait_ms, &max_wait_us, &hold_ms);
+    assert (r == 7);
+    assert (strstr (site, "test-lock-profile.c:") != NULL);
+    assert (acquired == NR_THREADS * NR_LOOPS);
+    assert (contended <= acquired);
+
+    /* The mutex is the most contended so it must be sorted first. */
+    if (nr_sites == 0) {
+      assert (strcmp (lock, "&mutex") == 0);
+      assert (contended > 0);
+      assert (wait_ms > 0);
+      assert (hold_ms >= NR_THREADS * NR_LOOPS * 0.1);
+    }
+    else {
+      assert (strcmp (lock, "&rwlock") == 0);
+      assert (contended == 0);
+    }
+    nr_sites++;
+  }
+  assert (nr_sites == 2);
+  fclose (fp);
+
+  exit (EXIT_SUCCESS);
+}
@@ -48,22 +48,91 @@
 #include "minmax.h"
 #include "rounding.h"
 
-#define BLOCKSIZE_MIN_LIMIT (64U * 1024)
+#define BLOCKSIZE_MIN_LIMIT (32U * 1024 * 1024)
 
-/* In order to handle parallel requests safely, this lock must be held
- * when using the bounce buffer.
+/* Each thread has its own bounce buffer for alignment purposes,
+ * allocated on first use and sized to minblock.  It is freed when the
+ * thread exits.
  */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t bounce_key;
 
-/* A single bounce buffer for alignment purposes, guarded by the lock.
- * Size it to the maximum we allow for minblock.
+/* A read-modify-write cycle of a block must not race with another
+ * read-modify-write of the same block, else one of the updates could
+ * be lost.  Requests touching unrelated blocks can run in parallel, so
+ * we use a small array of locks indexed by block number.
  */
-static char bounce[BLOCKSIZE_MIN_LIMIT];
+#define NR_RMW_LOCKS 64
+static pthread_mutex_t rmw_locks[NR_RMW_LOCKS];
 
 static unsigned int minblock;
 static unsigned int maxdata;
 static unsigned int maxlen;
 
+static void
+free_bounce (void *bounce)
+{
+  free (bounce);
+}
+
+static void
+blocksize_load (void)
+{
+  size_t i;
+  int err;
+
+  err = pthread_key_create (&bounce_key, free_bounce);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_key_create: %m");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_RMW_LOCKS; ++i)
+    pthread_mutex_init (&rmw_locks[i], NULL);
+}
+
+static void
+blocksize_unload (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_RMW_LOCKS; ++i)
+    pthread_mutex_destroy (&rmw_locks[i]);
+  pthread_key_delete (bounce_key);
+}
+
+/* Return the bounce buffer for the current thread. */
+static char *
+get_bounce (int *err)
+{
+  char *bounce = pthread_getspecific (bounce_key);
+  int r;
+
+  if (bounce == NULL) {
+    bounce = malloc (minblock);
+    if (bounce == NULL) {
+      *err = errno;
+      nbdkit_error ("malloc: %m");
+      return NULL;
+    }
+    r = pthread_setspecific (bounce_key, bounce);
+    if (r) {
+      free (bounce);
+      *err = r;
+      errno = r;
+      nbdkit_error ("pthread_setspecific: %m");
+      return NULL;
+    }
+  }
+  return bounce;
+}
+
+/* Return the lock protecting read-modify-write of the block at offs. */
+static pthread_mutex_t *
+rmw_lock (uint64_t offs)
+{
+  return &rmw_locks[(offs / minblock) % NR_RMW_LOCKS];
+}
+
 static int
 blocksize_parse (const char *name, const char *s, unsigned int *v)
 {
@@ -140,7 +209,7 @@ blocksize_config_complete (nbdkit_next_config_complete *next,
 }
 
 #define blocksize_config_help \
-  "minblock=<SIZE>      Minimum block size, power of 2 <= 64k (default 1).\n" \
+  "minblock=<SIZE>      Minimum block size, power of 2 <= 32M (default 1).\n" \
   "maxdata=<SIZE>       Maximum size for read/write (default 64M).\n" \
   "maxlen=<SIZE>        Maximum size for trim/zero (default 4G-minblock)."
 
@@ -162,12 +231,15 @@ blocksize_pread (nbdkit_next *next,
                  uint32_t flags, int *err)
 {
   char *buf = b;
+  char *bounce;
   uint32_t keep;
   uint32_t drop;
 
   /* Unaligned head */
   if (offs & (minblock - 1)) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    bounce = get_bounce (err);
+    if (bounce == NULL)
+      return -1;
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
     if (next->pread (next, bounce, minblock, offs - drop, flags, err) == -1)
@@ -190,7 +262,9 @@ blocksize_pread (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    bounce = get_bounce (err);
+    if (bounce == NULL)
+      return -1;
     if (next->pread (next, bounce, minblock, offs, flags, err) == -1)
       return -1;
     memcpy (buf, bounce, count);
@@ -205,6 +279,7 @@ blocksize_pwrite (nbdkit_next *next,
                   uint32_t flags, int *err)
 {
   const char *buf = b;
+  char *bounce = NULL;
   uint32_t keep;
   uint32_t drop;
   bool need_flush = false;
@@ -215,9 +290,15 @@ blocksize_pwrite (nbdkit_next *next,
     need_flush = true;
   }
 
+  if ((offs | count) & (minblock - 1)) {
+    bounce = get_bounce (err);
+    if (bounce == NULL)
+      return -1;
+  }
+
   /* Unaligned head */
   if (offs & (minblock - 1)) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
     if (next->pread (next, bounce, minblock, offs - drop, 0, err) == -1)
@@ -242,7 +323,7 @@ blocksize_pwrite (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     if (next->pread (next, bounce, minblock, offs, 0, err) == -1)
       return -1;
     memcpy (bounce, buf, count);
@@ -298,6 +379,7 @@ blocksize_zero (nbdkit_next *next,
                 void *handle, uint32_t count, uint64_t offs, uint32_t flags,
                 int *err)
 {
+  char *bounce = NULL;
   uint32_t keep;
   uint32_t drop;
   bool need_flush = false;
@@ -320,9 +402,15 @@ blocksize_zero (nbdkit_next *next,
     need_flush = true;
   }
 
+  if ((offs | count) & (minblock - 1)) {
+    bounce = get_bounce (err);
+    if (bounce == NULL)
+      return -1;
+  }
+
   /* Unaligned head */
   if (offs & (minblock - 1)) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     drop = offs & (minblock - 1);
     keep = MIN (minblock - drop, count);
     if (next->pread (next, bounce, minblock, offs - drop, 0, err) == -1)
@@ -346,7 +434,7 @@ blocksize_zero (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (rmw_lock (offs));
     if (next->pread (next, bounce, minblock, offs, 0, err) == -1)
       return -1;
     memset (bounce, 0, count);
@@ -428,6 +516,8 @@ blocksize_cache (nbdkit_next *next,
 static struct nbdkit_filter filter = {
   .name              = "blocksize",
   .longname          = "nbdkit blocksize filter",
+  .load              = blocksize_load,
+  .unload            = blocksize_unload,
   .config            = blocksize_config,
   .config_complete   = blocksize_config_complete,
   .config_help       = blocksize_config_help,
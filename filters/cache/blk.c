@@ -88,11 +88,10 @@ static int fd = -1;
  */
 static struct bitmap bm;
 
-enum bm_entry {
-  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
-  BLOCK_CLEAN = 1,
-  BLOCK_DIRTY = 3,
-};
+/* Statistics for --metrics-socket.  These are updated with the lock
+ * held but read without it, so use atomics.
+ */
+static uint64_t hits, misses, dirty_blocks;
 
 static const char *
 state_to_string (enum bm_entry state)
@@ -108,6 +107,64 @@ state_to_string (enum bm_entry state)
 /* Extra debugging (-D cache.verbose=1). */
 NBDKIT_DLL_PUBLIC int cache_debug_verbose = 0;
 
+void
+blk_set_state (struct bitmap *bitmap, uint64_t blknum, enum bm_entry state)
+{
+  enum bm_entry old = bitmap_get_blk (bitmap, blknum, BLOCK_NOT_CACHED);
+
+  if (old != BLOCK_DIRTY && state == BLOCK_DIRTY)
+    __atomic_add_fetch (&dirty_blocks, 1, __ATOMIC_RELAXED);
+  else if (old == BLOCK_DIRTY && state != BLOCK_DIRTY)
+    __atomic_sub_fetch (&dirty_blocks, 1, __ATOMIC_RELAXED);
+  bitmap_set_blk (bitmap, blknum, state);
+}
+
+static double
+get_hits (void *opaque)
+{
+  return __atomic_load_n (&hits, __ATOMIC_RELAXED);
+}
+
+static double
+get_misses (void *opaque)
+{
+  return __atomic_load_n (&misses, __ATOMIC_RELAXED);
+}
+
+static double
+get_hit_ratio (void *opaque)
+{
+  uint64_t h = __atomic_load_n (&hits, __ATOMIC_RELAXED);
+  uint64_t m = __atomic_load_n (&misses, __ATOMIC_RELAXED);
+
+  return h + m > 0 ? (double) h / (h + m) : 0;
+}
+
+static double
+get_dirty_bytes (void *opaque)
+{
+  return (double) __atomic_load_n (&dirty_blocks, __ATOMIC_RELAXED) * blksize;
+}
+
+int
+blk_register_metrics (void)
+{
+  if (nbdkit_metric_counter ("cache_hits_total",
+                             "Blocks read from the cache.",
+                             get_hits, NULL) == -1 ||
+      nbdkit_metric_counter ("cache_misses_total",
+                             "Blocks read from the plugin.",
+                             get_misses, NULL) == -1 ||
+      nbdkit_metric_gauge ("cache_hit_ratio",
+                           "Fraction of blocks read from the cache.",
+                           get_hit_ratio, NULL) == -1 ||
+      nbdkit_metric_gauge ("cache_dirty_bytes",
+                           "Bytes in the cache not yet written back.",
+                           get_dirty_bytes, NULL) == -1)
+    return -1;
+  return 0;
+}
+
 int
 blk_init (void)
 {
@@ -189,6 +246,18 @@ static uint64_t size = 0;
 int
 blk_set_size (uint64_t new_size)
 {
+  uint64_t blknum;
+
+  /* If the disk has shrunk, forget any dirty blocks beyond the new
+   * end so they are not counted by the cache_dirty_bytes metric.
+   * blk_set_state keeps the count up to date.
+   */
+  for (blknum = DIV_ROUND_UP (new_size, blksize);
+       blknum < DIV_ROUND_UP (size, blksize); ++blknum) {
+    if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY)
+      blk_set_state (&bm, blknum, BLOCK_NOT_CACHED);
+  }
+
   size = new_size;
 
   if (bitmap_resize (&bm, size) == -1)
@@ -234,6 +303,9 @@ _blk_read_multiple (nbdkit_next *next,
       break;
   }
 
+  __atomic_add_fetch (not_cached ? &misses : &hits, runblocks,
+                      __ATOMIC_RELAXED);
+
   if (not_cached) {             /* Read underlying plugin. */
     unsigned n, tail = 0;
 
@@ -267,7 +339,7 @@ _blk_read_multiple (nbdkit_next *next,
         return -1;
       }
       for (b = 0; b < runblocks; ++b) {
-        bitmap_set_blk (&bm, blknum + b, BLOCK_CLEAN);
+        blk_set_state (&bm, blknum + b, BLOCK_CLEAN);
         lru_set_recently_accessed (blknum + b);
       }
     }
@@ -352,7 +424,7 @@ blk_cache (nbdkit_next *next,
       nbdkit_error ("pwrite: %m");
       return -1;
     }
-    bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+    blk_set_state (&bm, blknum, BLOCK_CLEAN);
     lru_set_recently_accessed (blknum);
   }
   else {
@@ -397,7 +469,7 @@ blk_writethrough (nbdkit_next *next,
   if (next->pwrite (next, block, n, offset, flags, err) == -1)
     return -1;
 
-  bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
+  blk_set_state (&bm, blknum, BLOCK_CLEAN);
   lru_set_recently_accessed (blknum);
 
   return 0;
@@ -427,7 +499,7 @@ blk_write (nbdkit_next *next,
     nbdkit_error ("pwrite: %m");
     return -1;
   }
-  bitmap_set_blk (&bm, blknum, BLOCK_DIRTY);
+  blk_set_state (&bm, blknum, BLOCK_DIRTY);
   lru_set_recently_accessed (blknum);
 
   return 0;
@@ -33,12 +33,23 @@
 #ifndef NBDKIT_BLK_H
 #define NBDKIT_BLK_H
 
+struct bitmap;
+
+enum bm_entry {
+  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
+  BLOCK_CLEAN = 1,
+  BLOCK_DIRTY = 3,
+};
+
 /* Initialize the cache and bitmap. */
 extern int blk_init (void);
 
 /* Close the cache, free the bitmap. */
 extern void blk_free (void);
 
+/* Register the cache statistics with nbdkit_metric_*. */
+extern int blk_register_metrics (void);
+
 /*----------------------------------------------------------------------
  * ** NOTE **
  *
@@ -46,6 +57,13 @@ extern void blk_free (void);
  * this line.
  */
 
+/* Set the state of a block in the bitmap, keeping count of dirty
+ * blocks.
+ */
+extern void blk_set_state (struct bitmap *bitmap, uint64_t blknum,
+                           enum bm_entry state)
+  __attribute__((__nonnull__ (1)));
+
 /* Allocate or resize the cache file and bitmap. */
 extern int blk_set_size (uint64_t new_size);
 
@@ -234,6 +234,8 @@ cache_get_ready (int thread_model)
 {
   if (blk_init () == -1)
     return -1;
+  if (blk_register_metrics () == -1)
+    return -1;
 
   return 0;
 }
@@ -48,6 +48,7 @@
 #include "bitmap.h"
 
 #include "cache.h"
+#include "blk.h"
 #include "reclaim.h"
 #include "lru.h"
 
@@ -200,7 +201,7 @@ reclaim_block (int fd, struct bitmap *bm)
 #error "no implementation for punching holes"
 #endif
 
-  bitmap_set_blk (bm, reclaim_blk, 0);
+  blk_set_state (bm, reclaim_blk, BLOCK_NOT_CACHED);
 }
 
 #endif /* HAVE_CACHE_RECLAIM */
@@ -39,54 +39,355 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <nbdkit-filter.h>
 
-static unsigned delay_read_ms = 0;   /* read delay (milliseconds) */
-static unsigned delay_write_ms = 0;  /* write delay (milliseconds) */
-static unsigned delay_zero_ms = 0;   /* zero delay (milliseconds) */
-static unsigned delay_trim_ms = 0;   /* trim delay (milliseconds) */
-static unsigned delay_extents_ms = 0;/* extents delay (milliseconds) */
-static unsigned delay_cache_ms = 0;  /* cache delay (milliseconds) */
-static unsigned delay_open_ms = 0;   /* open delay (milliseconds) */
-static unsigned delay_close_ms = 0;  /* close delay (milliseconds) */
+#include "cleanup.h"
+#include "random.h"
+
+/* How the length of each delay is chosen. */
+enum distribution {
+  DIST_FIXED,                   /* Always a (nanoseconds). */
+  DIST_UNIFORM,                 /* Uniform between a and b. */
+  DIST_NORMAL,                  /* Mean a, standard deviation b. */
+  DIST_LOGNORMAL,               /* Median a, shape sigma. */
+  DIST_EMPIRICAL,               /* Weighted values read from a file. */
+};
+
+struct delay {
+  enum distribution dist;
+  uint64_t a, b;                /* Nanoseconds. */
+  double sigma;
+  /* For DIST_EMPIRICAL, the values (ns) and the cumulative weights. */
+  size_t nr_values;
+  uint64_t *values;
+  uint64_t *cumulative;
+};
+
+static struct delay read_dist;      /* read delay */
+static struct delay write_dist;     /* write delay */
+static struct delay zero_dist;      /* zero delay */
+static struct delay trim_dist;      /* trim delay */
+static struct delay extents_dist;   /* extents delay */
+static struct delay cache_dist;     /* cache delay */
+static struct delay open_dist;      /* open delay */
+static struct delay close_dist;     /* close delay */
 
 static int delay_fast_zero = 1; /* whether delaying zero includes fast zero */
 
+/* Bandwidth (bytes per second) for size-proportional delays, 0 = none. */
+static uint64_t read_bandwidth;
+static uint64_t write_bandwidth;
+
+/* If > 0, the maximum number of requests which may be delayed or in
+ * the plugin at the same time.  Other requests queue in FIFO order.
+ */
+static unsigned concurrency;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t queue_next_ticket;
+static uint64_t queue_done;
+
+/* Random state, seeded from delay-seed or the time. */
+static bool seeded;
+static uint64_t seed;
+static struct random_state random_state;
+static pthread_mutex_t random_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+delay_unload (void)
+{
+  struct delay *delays[] = {
+    &read_dist, &write_dist, &zero_dist, &trim_dist,
+    &extents_dist, &cache_dist, &open_dist, &close_dist,
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof delays / sizeof delays[0]; ++i) {
+    free (delays[i]->values);
+    free (delays[i]->cumulative);
+  }
+}
+
+/* Parse a time, either SECS, NNms or NNus, into nanoseconds. */
 static int
-parse_delay (const char *key, const char *value, unsigned *r)
+parse_time (const char *key, const char *value, uint64_t *r)
 {
   size_t len = strlen (value);
+  unsigned u;
 
   if (len > 2 && strcmp (&value[len-2], "ms") == 0) {
     /* We have to use sscanf here instead of nbdkit_parse_unsigned
      * because that function will reject the "ms" suffix.
      */
-    if (sscanf (value, "%u", r) == 1)
+    if (sscanf (value, "%u", &u) == 1) {
+      *r = u * UINT64_C (1000000);
       return 0;
+    }
     else {
       nbdkit_error ("cannot parse %s in milliseconds parameter: %s",
                     key, value);
       return -1;
     }
   }
+  else if (len > 2 && strcmp (&value[len-2], "us") == 0) {
+    if (sscanf (value, "%u", &u) == 1) {
+      *r = u * UINT64_C (1000);
+      return 0;
+    }
+    else {
+      nbdkit_error ("cannot parse %s in microseconds parameter: %s",
+                    key, value);
+      return -1;
+    }
+  }
   else {
-    if (nbdkit_parse_unsigned (key, value, r) == -1)
+    if (nbdkit_parse_unsigned (key, value, &u) == -1)
       return -1;
-    if (*r * 1000U > UINT_MAX) {
+    if (u * 1000ULL > UINT_MAX) {
       nbdkit_error ("seconds parameter %s is too large: %s", key, value);
       return -1;
     }
-    *r *= 1000;
+    *r = u * UINT64_C (1000000000);
     return 0;
   }
 }
 
+/* Read an empirical distribution from a file.  Each line contains a
+ * delay and an optional integer weight (default 1).  Blank lines and
+ * lines starting with '#' are ignored.
+ */
+static int
+parse_empirical (const char *key, const char *filename, struct delay *d)
+{
+  FILE *fp;
+  CLEANUP_FREE char *line = NULL;
+  size_t len = 0, alloc = 0, lineno = 0;
+  ssize_t n;
+  uint64_t total = 0;
+  char value[64];
+  unsigned weight;
+  int i;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    nbdkit_error ("%s: %s: %m", key, filename);
+    return -1;
+  }
+
+  free (d->values);
+  free (d->cumulative);
+  d->values = d->cumulative = NULL;
+  d->nr_values = 0;
+
+  while ((n = getline (&line, &len, fp)) != -1) {
+    lineno++;
+    if (n > 0 && line[n-1] == '\n')
+      line[--n] = '\0';
+    if (line[strspn (line, " \t")] == '\0' || line[0] == '#')
+      continue;
+
+    weight = 1;
+    i = sscanf (line, "%63s %u", value, &weight);
+    if (i < 1 || weight == 0) {
+      nbdkit_error ("%s: %s:%zu: cannot parse line: %s",
+                    key, filename, lineno, line);
+      goto err;
+    }
+
+    if (d->nr_values == alloc) {
+      uint64_t *v, *c;
+
+      alloc = alloc ? alloc * 2 : 64;
+      v = realloc (d->values, alloc * sizeof *v);
+      if (v == NULL) goto realloc_err;
+      d->values = v;
+      c = realloc (d->cumulative, alloc * sizeof *c);
+      if (c == NULL) goto realloc_err;
+      d->cumulative = c;
+    }
+    if (parse_time (key, value, &d->values[d->nr_values]) == -1)
+      goto err;
+    total += weight;
+    d->cumulative[d->nr_values] = total;
+    d->nr_values++;
+  }
+
+  if (d->nr_values == 0) {
+    nbdkit_error ("%s: %s: no values found", key, filename);
+    goto err;
+  }
+
+  fclose (fp);
+  d->dist = DIST_EMPIRICAL;
+  return 0;
+
+ realloc_err:
+  nbdkit_error ("realloc: %m");
+ err:
+  fclose (fp);
+  return -1;
+}
+
+/* Parse a delay parameter.  This is either a fixed time (see
+ * parse_time) or one of:
+ *
+ *   uniform:MIN:MAX
+ *   normal:MEAN:STDDEV
+ *   lognormal:MEDIAN:SIGMA
+ *   empirical:FILE
+ */
+static int
+parse_delay (const char *key, const char *value, struct delay *d)
+{
+  const char *p;
+  CLEANUP_FREE char *arg1 = NULL;
+  const char *arg2;
+
+  if (strncmp (value, "empirical:", 10) == 0)
+    return parse_empirical (key, &value[10], d);
+
+  p = strchr (value, ':');
+  if (p == NULL) {
+    d->dist = DIST_FIXED;
+    return parse_time (key, value, &d->a);
+  }
+
+  /* Split "DIST:ARG1:ARG2". */
+  arg1 = strdup (p+1);
+  if (arg1 == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  p = strchr (arg1, ':');
+  if (p == NULL) {
+    nbdkit_error ("%s: expecting DISTRIBUTION:ARG1:ARG2: %s", key, value);
+    return -1;
+  }
+  arg1[p-arg1] = '\0';
+  arg2 = p+1;
+
+  if (strncmp (value, "uniform:", 8) == 0) {
+    d->dist = DIST_UNIFORM;
+    if (parse_time (key, arg1, &d->a) == -1 ||
+        parse_time (key, arg2, &d->b) == -1)
+      return -1;
+    if (d->a > d->b) {
+      nbdkit_error ("%s: uniform minimum must be <= maximum", key);
+      return -1;
+    }
+  }
+  else if (strncmp (value, "normal:", 7) == 0) {
+    d->dist = DIST_NORMAL;
+    if (parse_time (key, arg1, &d->a) == -1 ||
+        parse_time (key, arg2, &d->b) == -1)
+      return -1;
+  }
+  else if (strncmp (value, "lognormal:", 10) == 0) {
+    int n;
+
+    d->dist = DIST_LOGNORMAL;
+    if (parse_time (key, arg1, &d->a) == -1)
+      return -1;
+    if (sscanf (arg2, "%lg%n", &d->sigma, &n) != 1 || arg2[n] != '\0' ||
+        d->sigma < 0) {
+      nbdkit_error ("%s: cannot parse lognormal sigma: %s", key, arg2);
+      return -1;
+    }
+  }
+  else {
+    nbdkit_error ("%s: unknown distribution: %s", key, value);
+    return -1;
+  }
+  return 0;
+}
+
+static bool
+delay_enabled (const struct delay *d)
+{
+  return d->dist != DIST_FIXED || d->a > 0;
+}
+
+/* Returns a random double in [0, 1).  Must be called with
+ * random_lock held.
+ */
+static double
+random_double (void)
+{
+  return (xrandom (&random_state) >> 11) * 0x1.0p-53;
+}
+
+/* Returns a standard normal random variable (Box-Muller).  Must be
+ * called with random_lock held.
+ */
+static double
+random_normal (void)
+{
+  double u1, u2;
+
+  do
+    u1 = random_double ();
+  while (u1 == 0);
+  u2 = random_double ();
+  return sqrt (-2 * log (u1)) * cos (2 * M_PI * u2);
+}
+
+/* Choose the length of the next delay, in nanoseconds. */
+static uint64_t
+sample (const struct delay *d)
+{
+  double v;
+  uint64_t r;
+  size_t lo, hi, mid;
+
+  if (d->dist == DIST_FIXED)
+    return d->a;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&random_lock);
+  switch (d->dist) {
+  case DIST_UNIFORM:
+    return d->a + (uint64_t) ((d->b - d->a) * random_double ());
+
+  case DIST_NORMAL:
+    v = d->a + d->b * random_normal ();
+    return v > 0 ? (uint64_t) v : 0;
+
+  case DIST_LOGNORMAL:
+    v = d->a * exp (d->sigma * random_normal ());
+    return v < (double) UINT64_MAX / 2 ? (uint64_t) v : UINT64_MAX / 2;
+
+  case DIST_EMPIRICAL:
+    /* Find the first value whose cumulative weight exceeds r. */
+    r = xrandom (&random_state) % d->cumulative[d->nr_values-1];
+    lo = 0;
+    hi = d->nr_values - 1;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (d->cumulative[mid] > r)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return d->values[lo];
+
+  case DIST_FIXED: default:
+    abort ();
+  }
+}
+
 static int
-delay (unsigned ms, int *err)
+delay (const struct delay *d, uint64_t bytes, uint64_t bandwidth, int *err)
 {
-  if (ms > 0 && nbdkit_nanosleep (ms / 1000, (ms % 1000) * 1000000) == -1) {
+  uint64_t ns = delay_enabled (d) ? sample (d) : 0;
+
+  if (bandwidth > 0)
+    ns += bytes * 1000000000 / bandwidth;
+
+  if (ns > 0 &&
+      nbdkit_nanosleep (ns / 1000000000, ns % 1000000000) == -1) {
     *err = errno;
     return -1;
   }
@@ -94,47 +395,84 @@ delay (unsigned ms, int *err)
 }
 
 static int
-read_delay (int *err)
+read_delay (uint32_t count, int *err)
 {
-  return delay (delay_read_ms, err);
+  return delay (&read_dist, count, read_bandwidth, err);
 }
 
 static int
-write_delay (int *err)
+write_delay (uint32_t count, int *err)
 {
-  return delay (delay_write_ms, err);
+  return delay (&write_dist, count, write_bandwidth, err);
 }
 
 static int
 zero_delay (int *err)
 {
-  return delay (delay_zero_ms, err);
+  return delay (&zero_dist, 0, 0, err);
 }
 
 static int
 trim_delay (int *err)
 {
-  return delay (delay_trim_ms, err);
+  return delay (&trim_dist, 0, 0, err);
 }
 
 static int
 extents_delay (int *err)
 {
-  return delay (delay_extents_ms, err);
+  return delay (&extents_dist, 0, 0, err);
 }
 
 static int
 cache_delay (int *err)
 {
-  return delay (delay_cache_ms, err);
+  return delay (&cache_dist, 0, 0, err);
 }
 
 static int
 open_delay (int *err)
 {
-  return delay (delay_open_ms, err);
+  return delay (&open_dist, 0, 0, err);
+}
+
+/* With delay-concurrency=N, wait until this request is one of the
+ * oldest N requests still in progress.  This emulates a backend which
+ * can only process N requests at the same time.
+ */
+static void
+queue_enter (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&queue_lock);
+  uint64_t ticket = queue_next_ticket++;
+
+  while (ticket >= queue_done + concurrency)
+    pthread_cond_wait (&queue_cond, &queue_lock);
 }
 
+static void
+queue_leave (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&queue_lock);
+  queue_done++;
+  pthread_cond_broadcast (&queue_cond);
+}
+
+static void
+queue_leave_cleanup (bool *queued)
+{
+  if (*queued)
+    queue_leave ();
+}
+
+/* Wait for a slot (if delay-concurrency is set) which is released
+ * when the request returns.
+ */
+#define QUEUE_FOR_CURRENT_SCOPE()                               \
+  __attribute__((cleanup (queue_leave_cleanup)))                \
+  bool _queued = concurrency > 0;                               \
+  if (_queued) queue_enter ()
+
 /* Called for each key=value passed on the command line. */
 static int
 delay_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
@@ -143,26 +481,27 @@ delay_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
   if (strcmp (key, "rdelay") == 0 ||
       strcmp (key, "delay-read") == 0 ||
       strcmp (key, "delay-reads") == 0) {
-    if (parse_delay (key, value, &delay_read_ms) == -1)
+    if (parse_delay (key, value, &read_dist) == -1)
       return -1;
     return 0;
   }
   else if (strcmp (key, "wdelay") == 0) {
-    if (parse_delay (key, value, &delay_write_ms) == -1)
-      return -1;
     /* Historically wdelay set all write-related delays. */
-    delay_zero_ms = delay_trim_ms = delay_write_ms;
+    if (parse_delay (key, value, &write_dist) == -1 ||
+        parse_delay (key, value, &zero_dist) == -1 ||
+        parse_delay (key, value, &trim_dist) == -1)
+      return -1;
     return 0;
   }
   else if (strcmp (key, "delay-write") == 0 ||
            strcmp (key, "delay-writes") == 0) {
-    if (parse_delay (key, value, &delay_write_ms) == -1)
+    if (parse_delay (key, value, &write_dist) == -1)
       return -1;
     return 0;
   }
   else if (strcmp (key, "delay-zero") == 0 ||
            strcmp (key, "delay-zeroes") == 0) {
-    if (parse_delay (key, value, &delay_zero_ms) == -1)
+    if (parse_delay (key, value, &zero_dist) == -1)
       return -1;
     return 0;
   }
@@ -170,18 +509,18 @@ delay_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
            strcmp (key, "delay-trims") == 0 ||
            strcmp (key, "delay-discard") == 0 ||
            strcmp (key, "delay-discards") == 0) {
-    if (parse_delay (key, value, &delay_trim_ms) == -1)
+    if (parse_delay (key, value, &trim_dist) == -1)
       return -1;
     return 0;
   }
   else if (strcmp (key, "delay-extent") == 0 ||
            strcmp (key, "delay-extents") == 0) {
-    if (parse_delay (key, value, &delay_extents_ms) == -1)
+    if (parse_delay (key, value, &extents_dist) == -1)
       return -1;
     return 0;
   }
   else if (strcmp (key, "delay-cache") == 0) {
-    if (parse_delay (key, value, &delay_cache_ms) == -1)
+    if (parse_delay (key, value, &cache_dist) == -1)
       return -1;
     return 0;
   }
@@ -192,13 +531,36 @@ delay_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     return 0;
   }
   else if (strcmp (key, "delay-open") == 0) {
-    if (parse_delay (key, value, &delay_open_ms) == -1)
+    if (parse_delay (key, value, &open_dist) == -1)
       return -1;
     return 0;
   }
   else if (strcmp (key, "delay-close") == 0) {
-    if (parse_delay (key, value, &delay_close_ms) == -1)
+    if (parse_delay (key, value, &close_dist) == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "delay-bandwidth") == 0 ||
+           strcmp (key, "delay-read-bandwidth") == 0 ||
+           strcmp (key, "delay-write-bandwidth") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (strcmp (key, "delay-write-bandwidth") != 0)
+      read_bandwidth = r;
+    if (strcmp (key, "delay-read-bandwidth") != 0)
+      write_bandwidth = r;
+    return 0;
+  }
+  else if (strcmp (key, "delay-concurrency") == 0) {
+    if (nbdkit_parse_unsigned (key, value, &concurrency) == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "delay-seed") == 0) {
+    if (nbdkit_parse_uint64_t (key, value, &seed) == -1)
       return -1;
+    seeded = true;
     return 0;
   }
   else
@@ -216,7 +578,26 @@ delay_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
   "wdelay=<NN>[ms]                Write, zero and trim delay in secs/msecs.\n" \
   "delay-fast-zero=<BOOL>         Delay fast zero requests (default true).\n" \
   "delay-open=<NN>[ms]            Open delay in seconds/milliseconds.\n" \
-  "delay-close=<NN>[ms]           Close delay in seconds/milliseconds."
+  "delay-close=<NN>[ms]           Close delay in seconds/milliseconds.\n" \
+  "delay-*=uniform:MIN:MAX        Uniformly distributed delay.\n" \
+  "delay-*=normal:MEAN:STDDEV     Normally distributed delay.\n" \
+  "delay-*=lognormal:MEDIAN:SIGMA Log-normally distributed delay.\n" \
+  "delay-*=empirical:FILE         Delay distribution read from FILE.\n" \
+  "delay-bandwidth=<SIZE>         Add delay proportional to request size.\n" \
+  "delay-concurrency=<N>          Limit concurrent requests to N.\n" \
+  "delay-seed=<SEED>              Seed for random delays."
+
+/* Seed the random number generator. */
+static int
+delay_config_complete (nbdkit_next_config_complete *next,
+                       nbdkit_backend *nxdata)
+{
+  if (!seeded)
+    seed = time (NULL);
+  xsrandom (seed, &random_state);
+
+  return next (nxdata);
+}
 
 /* Override the plugin's .can_fast_zero if needed */
 static int
@@ -224,7 +605,7 @@ delay_can_fast_zero (nbdkit_next *next,
                      void *handle)
 {
   /* Advertise if we are handling fast zero requests locally */
-  if (delay_zero_ms && !delay_fast_zero)
+  if (delay_enabled (&zero_dist) && !delay_fast_zero)
     return 1;
   return next->can_fast_zero (next);
 }
@@ -263,13 +644,13 @@ delay_open (nbdkit_next_open *next, nbdkit_context *nxdata,
 static int
 delay_finalize (nbdkit_next *next, void *handle)
 {
-  const unsigned ms = delay_close_ms;
+  const uint64_t ns = delay_enabled (&close_dist) ? sample (&close_dist) : 0;
 
-  if (ms > 0) {
+  if (ns > 0) {
     struct timespec ts;
 
-    ts.tv_sec = ms / 1000;
-    ts.tv_nsec = (ms % 1000) * 1000000;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
     /* If nanosleep fails we don't really want to interrupt the chain
      * of finalize calls through the other filters, so ignore any
      * error here.
@@ -286,7 +667,9 @@ delay_pread (nbdkit_next *next,
              void *handle, void *buf, uint32_t count, uint64_t offset,
              uint32_t flags, int *err)
 {
-  if (read_delay (err) == -1)
+  QUEUE_FOR_CURRENT_SCOPE ();
+
+  if (read_delay (count, err) == -1)
     return -1;
   return next->pread (next, buf, count, offset, flags, err);
 }
@@ -298,7 +681,9 @@ delay_pwrite (nbdkit_next *next,
               const void *buf, uint32_t count, uint64_t offset, uint32_t flags,
               int *err)
 {
-  if (write_delay (err) == -1)
+  QUEUE_FOR_CURRENT_SCOPE ();
+
+  if (write_delay (count, err) == -1)
     return -1;
   return next->pwrite (next, buf, count, offset, flags, err);
 }
@@ -309,10 +694,14 @@ delay_zero (nbdkit_next *next,
             void *handle, uint32_t count, uint64_t offset, uint32_t flags,
             int *err)
 {
-  if ((flags & NBDKIT_FLAG_FAST_ZERO) && delay_zero_ms && !delay_fast_zero) {
+  if ((flags & NBDKIT_FLAG_FAST_ZERO) && delay_enabled (&zero_dist) &&
+      !delay_fast_zero) {
     *err = ENOTSUP;
     return -1;
   }
+
+  QUEUE_FOR_CURRENT_SCOPE ();
+
   if (zero_delay (err) == -1)
     return -1;
   return next->zero (next, count, offset, flags, err);
@@ -324,6 +713,8 @@ delay_trim (nbdkit_next *next,
             void *handle, uint32_t count, uint64_t offset,
             uint32_t flags, int *err)
 {
+  QUEUE_FOR_CURRENT_SCOPE ();
+
   if (trim_delay (err) == -1)
     return -1;
   return next->trim (next, count, offset, flags, err);
@@ -335,6 +726,8 @@ delay_extents (nbdkit_next *next,
                void *handle, uint32_t count, uint64_t offset, uint32_t flags,
                struct nbdkit_extents *extents, int *err)
 {
+  QUEUE_FOR_CURRENT_SCOPE ();
+
   if (extents_delay (err) == -1)
     return -1;
   return next->extents (next, count, offset, flags, extents, err);
@@ -346,6 +739,8 @@ delay_cache (nbdkit_next *next,
              void *handle, uint32_t count, uint64_t offset, uint32_t flags,
              int *err)
 {
+  QUEUE_FOR_CURRENT_SCOPE ();
+
   if (cache_delay (err) == -1)
     return -1;
   return next->cache (next, count, offset, flags, err);
@@ -354,7 +749,9 @@ delay_cache (nbdkit_next *next,
 static struct nbdkit_filter filter = {
   .name              = "delay",
   .longname          = "nbdkit delay filter",
+  .unload            = delay_unload,
   .config            = delay_config,
+  .config_complete   = delay_config_complete,
   .config_help       = delay_config_help,
   .can_fast_zero     = delay_can_fast_zero,
   .open              = delay_open,
@@ -334,6 +334,8 @@ polling_thread (void *vp)
 
     sleep (pollsecs);
   }
+  /*NOTREACHED*/
+  return NULL;
 }
 
 /* Call this to pause the polling thread.  &lock must be held. */
@@ -0,0 +1,290 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Convert a binary trace written by nbdkit-log-filter with
+ * logformat=binary to the text log format.
+ *
+ * Usage: nbdkit-log-decode [TRACE]
+ *
+ * If TRACE is omitted, the trace is read from stdin.  The text log is
+ * written to stdout.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+
+#include "log-trace.h"
+
+static const char *op_names[LOG_TRACE_NR_OPS] = {
+  [LOG_TRACE_READ] = "Read",
+  [LOG_TRACE_WRITE] = "Write",
+  [LOG_TRACE_FLUSH] = "Flush",
+  [LOG_TRACE_TRIM] = "Trim",
+  [LOG_TRACE_ZERO] = "Zero",
+  [LOG_TRACE_EXTENTS] = "Extents",
+  [LOG_TRACE_CACHE] = "Cache",
+  [LOG_TRACE_CONNECT] = "Connect",
+  [LOG_TRACE_DISCONNECT] = "Disconnect",
+};
+
+/* Each record (except Connect and Disconnect) produces two lines of
+ * output, when the request starts and when it finishes.
+ */
+struct event {
+  uint64_t time;
+  size_t rec;                   /* Index into records. */
+  int leave;
+};
+
+static struct log_trace_record *records;
+static size_t nr_records;
+static uint64_t time_offset;    /* realtime_ns - monotonic_ns */
+
+static int
+compare_events (const void *ap, const void *bp)
+{
+  const struct event *a = ap, *b = bp;
+
+  if (a->time != b->time)
+    return a->time < b->time ? -1 : 1;
+  /* Keep records in file order, and enter before leave. */
+  if (a->rec != b->rec)
+    return a->rec < b->rec ? -1 : 1;
+  return a->leave - b->leave;
+}
+
+static void
+print_timestamp (uint64_t t)
+{
+  time_t secs;
+  struct tm tm;
+  char timestamp[20];
+
+  t += time_offset;
+  secs = t / 1000000000;
+  gmtime_r (&secs, &tm);
+  strftime (timestamp, sizeof timestamp, "%F %T", &tm);
+  printf ("%s.%06" PRIu64, timestamp, (t % 1000000000) / 1000);
+}
+
+static const char *
+error_name (uint32_t err)
+{
+  switch (err) {
+  case NBD_EPERM: return "EPERM";
+  case NBD_EIO: return "EIO";
+  case NBD_ENOMEM: return "ENOMEM";
+  case NBD_ENOSPC: return "ENOSPC";
+  case NBD_ESHUTDOWN: return "ESHUTDOWN";
+  case NBD_ENOTSUP: return "ENOTSUP";
+  case NBD_EOVERFLOW: return "EOVERFLOW";
+  case NBD_EINVAL: default: return "EINVAL";
+  }
+}
+
+static void
+print_event (const struct event *ev)
+{
+  const struct log_trace_record *rec = &records[ev->rec];
+  const char *name;
+  uint16_t op = le16toh (rec->op);
+  uint16_t flags = le16toh (rec->flags);
+  uint64_t offset = le64toh (rec->offset);
+  uint32_t count = le32toh (rec->count);
+  uint32_t error = le32toh (rec->error);
+
+  name = op < LOG_TRACE_NR_OPS ? op_names[op] : "Unknown";
+
+  print_timestamp (ev->time);
+  printf (" connection=%" PRIu64 " %s%s",
+          le64toh (rec->connection), ev->leave ? "..." : "", name);
+
+  switch (op) {
+  case LOG_TRACE_CONNECT:
+    printf (" size=0x%" PRIx64 "\n", offset);
+    return;
+  case LOG_TRACE_DISCONNECT:
+    printf (" transactions=%" PRIu64 "\n", offset);
+    return;
+  }
+
+  printf (" id=%" PRIu64, le64toh (rec->id));
+
+  if (ev->leave) {
+    if (error == 0)
+      printf (" return=0\n");
+    else
+      printf (" return=-1 error=%s\n", error_name (error));
+    return;
+  }
+
+  switch (op) {
+  case LOG_TRACE_READ:
+  case LOG_TRACE_CACHE:
+    printf (" offset=0x%" PRIx64 " count=0x%x", offset, count);
+    break;
+  case LOG_TRACE_WRITE:
+  case LOG_TRACE_TRIM:
+    printf (" offset=0x%" PRIx64 " count=0x%x fua=%d", offset, count,
+            !!(flags & LOG_TRACE_FLAG_FUA));
+    break;
+  case LOG_TRACE_ZERO:
+    printf (" offset=0x%" PRIx64 " count=0x%x trim=%d fua=%d fast=%d",
+            offset, count,
+            !!(flags & LOG_TRACE_FLAG_MAY_TRIM),
+            !!(flags & LOG_TRACE_FLAG_FUA),
+            !!(flags & LOG_TRACE_FLAG_FAST_ZERO));
+    break;
+  case LOG_TRACE_EXTENTS:
+    printf (" offset=0x%" PRIx64 " count=0x%x req_one=%d", offset, count,
+            !!(flags & LOG_TRACE_FLAG_REQ_ONE));
+    break;
+  }
+  printf (" ...\n");
+}
+
+static void
+read_trace (FILE *fp, const char *filename)
+{
+  struct log_trace_header hdr;
+  uint32_t record_size;
+  size_t alloc = 0;
+  char *buf;
+
+  if (fread (&hdr, sizeof hdr, 1, fp) != 1 ||
+      memcmp (hdr.magic, LOG_TRACE_MAGIC, sizeof hdr.magic) != 0) {
+    fprintf (stderr, "nbdkit-log-decode: %s: not an nbdkit binary trace\n",
+             filename);
+    exit (EXIT_FAILURE);
+  }
+  if (le32toh (hdr.version) != LOG_TRACE_VERSION) {
+    fprintf (stderr, "nbdkit-log-decode: %s: unsupported trace version %"
+             PRIu32 "\n", filename, le32toh (hdr.version));
+    exit (EXIT_FAILURE);
+  }
+  /* Later versions may make the records longer, but must not change
+   * the existing fields.
+   */
+  record_size = le32toh (hdr.record_size);
+  if (record_size < sizeof (struct log_trace_record)) {
+    fprintf (stderr, "nbdkit-log-decode: %s: invalid record size %" PRIu32
+             "\n", filename, record_size);
+    exit (EXIT_FAILURE);
+  }
+  time_offset = le64toh (hdr.realtime_ns) - le64toh (hdr.monotonic_ns);
+
+  buf = malloc (record_size);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  while (fread (buf, record_size, 1, fp) == 1) {
+    if (nr_records == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      records = realloc (records, alloc * sizeof *records);
+      if (records == NULL) {
+        perror ("realloc");
+        exit (EXIT_FAILURE);
+      }
+    }
+    memcpy (&records[nr_records++], buf, sizeof *records);
+  }
+  if (ferror (fp)) {
+    fprintf (stderr, "nbdkit-log-decode: %s: read error: %s\n",
+             filename, strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+  free (buf);
+}
+
+int
+main (int argc, char *argv[])
+{
+  FILE *fp;
+  const char *filename;
+  struct event *events;
+  size_t i, n = 0;
+
+  if (argc > 2) {
+    fprintf (stderr, "usage: nbdkit-log-decode [TRACE]\n");
+    exit (EXIT_FAILURE);
+  }
+  if (argc == 2) {
+    filename = argv[1];
+    fp = fopen (filename, "r");
+    if (fp == NULL) {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  }
+  else {
+    filename = "stdin";
+    fp = stdin;
+  }
+  read_trace (fp, filename);
+  if (fp != stdin)
+    fclose (fp);
+
+  events = malloc (2 * nr_records * sizeof *events + 1);
+  if (events == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_records; ++i) {
+    uint64_t t = le64toh (records[i].time);
+    uint16_t op = le16toh (records[i].op);
+
+    events[n++] = (struct event) { .time = t, .rec = i, .leave = 0 };
+    if (op != LOG_TRACE_CONNECT && op != LOG_TRACE_DISCONNECT)
+      events[n++] = (struct event) {
+        .time = t + le64toh (records[i].latency), .rec = i, .leave = 1
+      };
+  }
+  qsort (events, n, sizeof *events, compare_events);
+
+  for (i = 0; i < n; ++i)
+    print_event (&events[i]);
+
+  free (events);
+  free (records);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,96 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Binary trace format written by the log filter when
+ * logformat=binary.  This header is shared by the filter and the
+ * programs which read traces, so it must not depend on nbdkit
+ * headers.
+ *
+ * The file starts with a struct log_trace_header followed by any
+ * number of struct log_trace_record.  All fields are little endian.
+ * Records are written in batches by a background thread, so they are
+ * NOT in time order in the file.  Sort them by the time field.
+ */
+
+#ifndef NBDKIT_LOG_TRACE_H
+#define NBDKIT_LOG_TRACE_H
+
+#include <stdint.h>
+
+#define LOG_TRACE_MAGIC "NBDKTRC"  /* Includes trailing \0, 8 bytes. */
+#define LOG_TRACE_VERSION 1
+
+struct log_trace_header {
+  char magic[8];                /* LOG_TRACE_MAGIC */
+  uint32_t version;             /* LOG_TRACE_VERSION */
+  uint32_t record_size;         /* sizeof (struct log_trace_record) */
+  /* The realtime and monotonic clocks sampled at the same moment when
+   * the trace was started.  Record times use the monotonic clock, so
+   * add (realtime_ns - monotonic_ns) to get wall clock time.
+   */
+  uint64_t realtime_ns;
+  uint64_t monotonic_ns;
+} __attribute__((__packed__));
+
+enum log_trace_op {
+  LOG_TRACE_READ = 0,
+  LOG_TRACE_WRITE,
+  LOG_TRACE_FLUSH,
+  LOG_TRACE_TRIM,
+  LOG_TRACE_ZERO,
+  LOG_TRACE_EXTENTS,
+  LOG_TRACE_CACHE,
+  LOG_TRACE_CONNECT,            /* offset = export size */
+  LOG_TRACE_DISCONNECT,         /* offset = number of transactions */
+  LOG_TRACE_NR_OPS
+};
+
+struct log_trace_record {
+  uint64_t time;                /* Monotonic clock (ns) at start. */
+  uint64_t latency;             /* Time taken (ns). */
+  uint64_t connection;          /* Connection number. */
+  uint64_t id;                  /* Transaction id on this connection. */
+  uint64_t offset;
+  uint32_t count;
+  uint16_t op;                  /* enum log_trace_op */
+  uint16_t flags;               /* NBDKIT_FLAG_* */
+  uint32_t error;               /* 0 = success, else NBD_E* error */
+  uint32_t reserved;
+} __attribute__((__packed__));
+
+/* These match NBDKIT_FLAG_* in <nbdkit-common.h>. */
+#define LOG_TRACE_FLAG_MAY_TRIM  (1<<0)
+#define LOG_TRACE_FLAG_FUA       (1<<1)
+#define LOG_TRACE_FLAG_REQ_ONE   (1<<2)
+#define LOG_TRACE_FLAG_FAST_ZERO (1<<3)
+
+#endif /* NBDKIT_LOG_TRACE_H */
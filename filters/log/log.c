@@ -64,14 +64,22 @@ const char *logfilename;
 FILE *logfile;
 const char *logscript;
 int append;
+static bool binary;
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 pid_t saved_pid;
 
+static void
+log_load (void)
+{
+  trace_load ();
+}
+
 static void
 log_unload (void)
 {
   if (logfile)
     fclose (logfile);
+  trace_close ();
 }
 
 /* Called for each key=value passed on the command line. */
@@ -93,13 +101,43 @@ log_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     logscript = value;
     return 0;
   }
+  if (strcmp (key, "logformat") == 0) {
+    if (strcmp (value, "text") == 0)
+      binary = false;
+    else if (strcmp (value, "binary") == 0)
+      binary = true;
+    else {
+      nbdkit_error ("logformat must be 'text' or 'binary'");
+      return -1;
+    }
+    return 0;
+  }
   return next (nxdata, key, value);
 }
 
 #define log_config_help \
   "logfile=<FILE>               The file to place the log in.\n" \
   "logappend=<BOOL>             True to append to the log (default false).\n" \
-  "logscript=<SCRIPT>           Script to run for logging."
+  "logscript=<SCRIPT>           Script to run for logging.\n" \
+  "logformat=text|binary        Format of logfile (default text)."
+
+static int
+log_config_complete (nbdkit_next_config_complete *next,
+                     nbdkit_backend *nxdata)
+{
+  if (binary) {
+    if (!logfilename) {
+      nbdkit_error ("logformat=binary requires the logfile parameter");
+      return -1;
+    }
+    if (append) {
+      nbdkit_error ("logformat=binary cannot be used with logappend");
+      return -1;
+    }
+  }
+
+  return next (nxdata);
+}
 
 /* Open the logfile. */
 static int
@@ -121,6 +159,11 @@ log_get_ready (int thread_model)
       nbdkit_error ("open: %s: %m", logfilename);
       return -1;
     }
+    if (binary) {
+      if (trace_open (fd) == -1)
+        return -1;
+      goto out;
+    }
     logfile = fdopen (fd, append ? "a" : "w");
     if (!logfile) {
       nbdkit_error ("fdopen: %s: %m", logfilename);
@@ -129,6 +172,7 @@ log_get_ready (int thread_model)
     }
   }
 
+ out:
   saved_pid = getpid ();
 
   print (NULL, "Ready", "thread_model=%d", thread_model);
@@ -142,9 +186,17 @@ log_after_fork (nbdkit_backend *nxdata)
   if (getpid () != saved_pid)
     print (NULL, "Fork", "");
 
+  if (tracefd >= 0)
+    return trace_start_writer ();
   return 0;
 }
 
+static void
+log_cleanup (nbdkit_backend *nxdata)
+{
+  trace_stop_writer ();
+}
+
 /* List exports. */
 static int
 log_list_exports (nbdkit_next_list_exports *next, nbdkit_backend *nxdata,
@@ -280,6 +332,9 @@ log_prepare (nbdkit_next *next, void *handle,
   else
     print (h, "Connect", "");
 
+  if (tracefd >= 0)
+    trace_record (h, 0, LOG_TRACE_CONNECT, size, 0, 0, trace_now (), 0, NULL);
+
   return 0;
 }
 
@@ -289,6 +344,9 @@ log_finalize (nbdkit_next *next, void *handle)
   struct handle *h = handle;
 
   print (h, "Disconnect", "transactions=%" PRId64, h->id);
+  if (tracefd >= 0)
+    trace_record (h, 0, LOG_TRACE_DISCONNECT, h->id, 0, 0, trace_now (),
+                  0, NULL);
   return 0;
 }
 
@@ -302,6 +360,7 @@ log_pread (nbdkit_next *next,
   int r;
 
   LOG (h, "Read", r, err, "offset=0x%" PRIx64 " count=0x%x", offs, count);
+  TRACE (h, LOG_TRACE_READ, offs, count, flags, r, err);
 
   assert (!flags);
   return r = next->pread (next, buf, count, offs, flags, err);
@@ -319,6 +378,7 @@ log_pwrite (nbdkit_next *next,
   LOG (h, "Write", r, err,
        "offset=0x%" PRIx64 " count=0x%x fua=%d",
        offs, count, !!(flags & NBDKIT_FLAG_FUA));
+  TRACE (h, LOG_TRACE_WRITE, offs, count, flags, r, err);
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   return r = next->pwrite (next, buf, count, offs, flags, err);
@@ -333,6 +393,7 @@ log_flush (nbdkit_next *next, void *handle,
   int r;
 
   LOG (h, "Flush", r, err, "");
+  TRACE (h, LOG_TRACE_FLUSH, 0, 0, flags, r, err);
 
   assert (!flags);
   return r = next->flush (next, flags, err);
@@ -350,6 +411,7 @@ log_trim (nbdkit_next *next,
   LOG (h, "Trim", r, err,
        "offset=0x%" PRIx64 " count=0x%x fua=%d",
        offs, count, !!(flags & NBDKIT_FLAG_FUA));
+  TRACE (h, LOG_TRACE_TRIM, offs, count, flags, r, err);
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   return r = next->trim (next, count, offs, flags, err);
@@ -369,6 +431,7 @@ log_zero (nbdkit_next *next,
        offs, count, !!(flags & NBDKIT_FLAG_MAY_TRIM),
        !!(flags & NBDKIT_FLAG_FUA),
        !!(flags & NBDKIT_FLAG_FAST_ZERO));
+  TRACE (h, LOG_TRACE_ZERO, offs, count, flags, r, err);
 
   assert (!(flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
                       NBDKIT_FLAG_FAST_ZERO)));
@@ -384,6 +447,7 @@ log_extents (nbdkit_next *next,
   struct handle *h = handle;
   log_id_t id = get_id (h);
   int r;
+  TRACE (h, LOG_TRACE_EXTENTS, offs, count, flags, r, err);
 
   assert (!(flags & ~(NBDKIT_FLAG_REQ_ONE)));
   enter (h, id, "Extents",
@@ -438,6 +502,7 @@ log_cache (nbdkit_next *next,
   int r;
 
   LOG (h, "Cache", r, err, "offset=0x%" PRIx64 " count=0x%x", offs, count);
+  TRACE (h, LOG_TRACE_CACHE, offs, count, flags, r, err);
 
   assert (!flags);
   return r = next->cache (next, count, offs, flags, err);
@@ -447,10 +512,13 @@ static struct nbdkit_filter filter = {
   .name              = "log",
   .longname          = "nbdkit log filter",
   .config            = log_config,
+  .config_complete   = log_config_complete,
   .config_help       = log_config_help,
+  .load              = log_load,
   .unload            = log_unload,
   .get_ready         = log_get_ready,
   .after_fork        = log_after_fork,
+  .cleanup           = log_cleanup,
   .list_exports      = log_list_exports,
   .preconnect        = log_preconnect,
   .open              = log_open,
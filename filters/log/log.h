@@ -35,9 +35,12 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include <pthread.h>
 
+#include "log-trace.h"
+
 typedef uint64_t log_id_t;
 
 struct handle {
@@ -58,8 +61,7 @@ extern pthread_mutex_t lock;
 static inline log_id_t
 get_id (struct handle *h)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  return ++h->id;
+  return __atomic_add_fetch (&h->id, 1, __ATOMIC_RELAXED);
 }
 
 /* enter() and leave() are called on entry and exit to every filter
@@ -103,4 +105,52 @@ extern void leave_simple2 (struct leave_simple_params *params);
   struct leave_simple_params _params = { h, id, act, &r, err };         \
   enter ((h), id, (act), ##__VA_ARGS__)
 
+/* Binary trace output (logformat=binary), see trace.c.  tracefd is
+ * the log file, or -1 if we are not writing a binary trace.
+ */
+extern int tracefd;
+extern void trace_load (void);
+extern int trace_open (int fd);
+extern int trace_start_writer (void);
+extern void trace_stop_writer (void);
+extern void trace_close (void);
+extern void trace_record (struct handle *h, log_id_t id,
+                          enum log_trace_op op,
+                          uint64_t offset, uint32_t count, uint32_t flags,
+                          uint64_t start, int r, const int *err);
+
+static inline uint64_t
+trace_now (void)
+{
+  struct timespec ts;
+
+  if (tracefd == -1)
+    return 0;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* Like LOG, the TRACE macro records the request in the binary trace
+ * on each exit path.  It must be used after LOG.
+ */
+struct trace_params {
+  struct handle *h;
+  log_id_t id;
+  enum log_trace_op op;
+  uint64_t offset;
+  uint32_t count;
+  uint32_t flags;
+  uint64_t start;
+  int *r;
+  int *err;
+};
+
+extern void trace_leave (struct trace_params *params);
+
+#define TRACE(h, op, offset, count, flags, r, err)                      \
+  __attribute__((cleanup (trace_leave)))                                \
+  CLANG_UNUSED_VARIABLE_WORKAROUND                                      \
+  struct trace_params _tparams =                                        \
+    { h, id, op, offset, count, flags, trace_now (), &r, err }
+
 #endif /* NBDKIT_LOG_H */
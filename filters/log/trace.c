@@ -0,0 +1,401 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Binary trace output for the log filter (logformat=binary).
+ *
+ * Each thread appends fixed size records to its own ring buffer
+ * without taking a lock.  A background thread drains all the rings
+ * to the log file.  If a ring fills up faster than the writer can
+ * drain it, the thread producing records waits for space, so records
+ * are never dropped.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <nbdkit-filter.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "nbd-protocol.h"
+#include "vector.h"
+
+#include "log.h"
+#include "log-trace.h"
+
+/* Number of records in each per-thread ring.  Must be a power of 2. */
+#define RING_SIZE 2048
+#define RING_MASK (RING_SIZE-1)
+
+/* How often the writer thread wakes up to drain the rings (ms). */
+#define WRITER_INTERVAL_MS 10
+
+struct ring {
+  /* head is only written by the owning thread, tail only by the
+   * writer (with trace_lock held).  Both are free running counters.
+   */
+  uint64_t head;
+  uint64_t tail;
+  bool dead;                    /* Owning thread has exited. */
+  struct log_trace_record rec[RING_SIZE];
+};
+
+DEFINE_VECTOR_TYPE(ring_vector, struct ring *);
+
+int tracefd = -1;
+
+/* trace_lock protects the list of rings, draining, and the state of
+ * the writer thread.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static ring_vector rings = empty_vector;
+static pthread_key_t ring_key;
+static pthread_t writer_thread;
+static bool writer_running;
+static bool writer_stop;
+static bool write_failed;
+
+static void
+free_ring (void *vp)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&trace_lock);
+  struct ring *r = vp;
+
+  /* The writer frees the ring once it has been drained. */
+  r->dead = true;
+}
+
+void
+trace_load (void)
+{
+  int err;
+
+  err = pthread_key_create (&ring_key, free_ring);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_key_create: %m");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Write the whole buffer, retrying on short writes. */
+static void
+write_all (const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t r;
+
+  if (write_failed)
+    return;
+
+  while (len > 0) {
+    r = write (tracefd, p, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_debug ("log: write: %s: %m", logfilename);
+      write_failed = true;
+      return;
+    }
+    p += r;
+    len -= r;
+  }
+}
+
+/* Write the records in a ring to the file.  Must be called with
+ * trace_lock held.
+ */
+static void
+drain_ring (struct ring *r)
+{
+  uint64_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = r->tail;
+  size_t start, n;
+
+  while (tail < head) {
+    start = tail & RING_MASK;
+    n = head - tail;
+    if (n > RING_SIZE - start)
+      n = RING_SIZE - start;
+    write_all (&r->rec[start], n * sizeof r->rec[0]);
+    tail += n;
+  }
+  __atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Drain all rings, and free rings of threads which have exited.  Must
+ * be called with trace_lock held.
+ */
+static void
+drain_all (void)
+{
+  size_t i;
+
+  for (i = 0; i < rings.len; ) {
+    struct ring *r = rings.ptr[i];
+
+    drain_ring (r);
+    if (r->dead) {
+      ring_vector_remove (&rings, i);
+      free (r);
+    }
+    else
+      i++;
+  }
+  pthread_cond_broadcast (&space_cond);
+}
+
+static void *
+writer_fn (void *vp)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&trace_lock);
+  struct timespec ts;
+
+  while (!writer_stop) {
+    drain_all ();
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += WRITER_INTERVAL_MS * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait (&writer_cond, &trace_lock, &ts);
+  }
+  drain_all ();
+  return NULL;
+}
+
+int
+trace_open (int fd)
+{
+  struct log_trace_header hdr;
+  struct timespec rt, mt;
+
+  tracefd = fd;
+
+  clock_gettime (CLOCK_REALTIME, &rt);
+  clock_gettime (CLOCK_MONOTONIC, &mt);
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, LOG_TRACE_MAGIC, sizeof hdr.magic);
+  hdr.version = htole32 (LOG_TRACE_VERSION);
+  hdr.record_size = htole32 (sizeof (struct log_trace_record));
+  hdr.realtime_ns = htole64 (rt.tv_sec * UINT64_C (1000000000) + rt.tv_nsec);
+  hdr.monotonic_ns = htole64 (mt.tv_sec * UINT64_C (1000000000) + mt.tv_nsec);
+  write_all (&hdr, sizeof hdr);
+  if (write_failed) {
+    nbdkit_error ("write: %s: %m", logfilename);
+    return -1;
+  }
+  return 0;
+}
+
+int
+trace_start_writer (void)
+{
+  int err;
+
+  err = pthread_create (&writer_thread, NULL, writer_fn, NULL);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  writer_running = true;
+  return 0;
+}
+
+void
+trace_stop_writer (void)
+{
+  if (writer_running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&trace_lock);
+      writer_stop = true;
+      pthread_cond_signal (&writer_cond);
+    }
+    pthread_join (writer_thread, NULL);
+    writer_running = false;
+  }
+}
+
+void
+trace_close (void)
+{
+  size_t i;
+
+  pthread_key_delete (ring_key);
+
+  if (tracefd >= 0) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&trace_lock);
+    drain_all ();
+    close (tracefd);
+    tracefd = -1;
+  }
+
+  for (i = 0; i < rings.len; ++i)
+    free (rings.ptr[i]);
+  ring_vector_reset (&rings);
+}
+
+/* Get the ring for the current thread, creating it on first use. */
+static struct ring *
+get_ring (void)
+{
+  struct ring *r = pthread_getspecific (ring_key);
+
+  if (r == NULL) {
+    r = calloc (1, sizeof *r);
+    if (r == NULL) {
+      nbdkit_debug ("log: calloc: %m");
+      return NULL;
+    }
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&trace_lock);
+      if (ring_vector_append (&rings, r) == -1) {
+        nbdkit_debug ("log: realloc: %m");
+        free (r);
+        return NULL;
+      }
+    }
+    pthread_setspecific (ring_key, r);
+  }
+  return r;
+}
+
+/* The ring is full.  Wait for the writer to make space, or drain it
+ * ourselves if there is no writer thread.
+ */
+static void
+wait_for_space (struct ring *r, uint64_t head)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&trace_lock);
+
+  while (head - r->tail >= RING_SIZE) {
+    if (!writer_running || writer_stop) {
+      drain_ring (r);
+      return;
+    }
+    pthread_cond_signal (&writer_cond);
+    pthread_cond_wait (&space_cond, &trace_lock);
+  }
+}
+
+/* Map errno to the NBD error which will be sent to the client.  This
+ * must match server/protocol.c:nbd_errno() and leave_simple().
+ */
+static uint32_t
+nbd_error (int err)
+{
+  switch (err) {
+  case EROFS:
+  case EPERM:
+    return NBD_EPERM;
+  case EIO:
+    return NBD_EIO;
+  case ENOMEM:
+    return NBD_ENOMEM;
+#ifdef EDQUOT
+  case EDQUOT:
+#endif
+  case EFBIG:
+  case ENOSPC:
+    return NBD_ENOSPC;
+#ifdef ESHUTDOWN
+  case ESHUTDOWN:
+    return NBD_ESHUTDOWN;
+#endif
+  case ENOTSUP:
+#if ENOTSUP != EOPNOTSUPP
+  case EOPNOTSUPP:
+#endif
+    return NBD_ENOTSUP;
+  case EOVERFLOW:
+    return NBD_EOVERFLOW;
+  case EINVAL:
+  default:
+    return NBD_EINVAL;
+  }
+}
+
+void
+trace_record (struct handle *h, log_id_t id, enum log_trace_op op,
+              uint64_t offset, uint32_t count, uint32_t flags,
+              uint64_t start, int r, const int *err)
+{
+  struct ring *ring;
+  struct log_trace_record *rec;
+  uint64_t head, tail;
+
+  ring = get_ring ();
+  if (ring == NULL)
+    return;
+
+  head = ring->head;
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= RING_SIZE)
+    wait_for_space (ring, head);
+
+  rec = &ring->rec[head & RING_MASK];
+  rec->time = htole64 (start);
+  rec->latency = htole64 (trace_now () - start);
+  rec->connection = htole64 (h->connection);
+  rec->id = htole64 (id);
+  rec->offset = htole64 (offset);
+  rec->count = htole32 (count);
+  rec->op = htole16 (op);
+  rec->flags = htole16 (flags);
+  rec->error = htole32 (r == -1 ? nbd_error (*err) : 0);
+  rec->reserved = 0;
+
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_leave (struct trace_params *params)
+{
+  if (tracefd >= 0)
+    trace_record (params->h, params->id, params->op,
+                  params->offset, params->count, params->flags,
+                  params->start, *params->r, params->err);
+}
@@ -62,6 +62,8 @@ static enum TrackDirtyMode {
 
 static bool byname = false;
 
+static bool group_commit = true;
+
 enum dirty {
   WRITE = 1, /* A write may have populated a cache */
   READ = 2, /* A read may have populated a cache */
@@ -83,12 +85,25 @@ struct group {
   conns_vector conns;
   char *name;
   bool dirty; /* True if any connection in group is dirty */
+
+  /* Group commit of flushes, all protected by lock.  flush_started
+   * and flush_done count the flushes begun and completed in this
+   * group, and at most one is running at a time.  flush_failed is the
+   * number of the most recent flush which failed, with flush_err its
+   * errno.  flush_cond is signalled when a flush completes.
+   */
+  pthread_cond_t flush_cond;
+  bool flush_running;
+  uint64_t flush_started;
+  uint64_t flush_done;
+  uint64_t flush_failed;
+  int flush_err;
 };
 DEFINE_VECTOR_TYPE(group_vector, struct group *);
 static group_vector groups = empty_vector;
 
-/* Accept 'multi-conn-mode=mode', 'multi-conn-track-dirty=level', and
- * 'multi-conn-exportname=bool'.
+/* Accept 'multi-conn-mode=mode', 'multi-conn-track-dirty=level',
+ * 'multi-conn-exportname=bool' and 'multi-conn-group-commit=bool'.
  */
 static int
 multi_conn_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
@@ -135,6 +150,15 @@ multi_conn_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     byname = r;
     return 0;
   }
+  else if (strcmp (key, "multi-conn-group-commit") == 0) {
+    int r;
+
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    group_commit = r;
+    return 0;
+  }
   return next (nxdata, key, value);
 }
 
@@ -142,7 +166,8 @@ multi_conn_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
   "multi-conn-mode=<MODE>          'auto' (default), 'emulate', 'plugin',\n" \
   "                                'disable', or 'unsafe'.\n" \
   "multi-conn-track-dirty=<LEVEL>  'conn' (default), 'fast', or 'off'.\n" \
-  "multi-conn-exportname=<BOOL>    true to limit emulation by export name.\n"
+  "multi-conn-exportname=<BOOL>    true to limit emulation by export name.\n" \
+  "multi-conn-group-commit=<BOOL>  false to disable flush coalescing.\n"
 
 static int
 multi_conn_get_ready (int thread_model)
@@ -224,6 +249,7 @@ multi_conn_prepare (nbdkit_next *next, void *handle, int readonly)
     }
     if (group_vector_append (&groups, g) == -1)
       return -1;
+    pthread_cond_init (&g->flush_cond, NULL);
     g->name = h->name;
     h->name = NULL;
     new_group = true;
@@ -231,6 +257,7 @@ multi_conn_prepare (nbdkit_next *next, void *handle, int readonly)
   if (conns_vector_append (&g->conns, h) == -1) {
     if (new_group) {
       group_vector_remove (&groups, groups.len - 1);
+      pthread_cond_destroy (&g->flush_cond);
       free (g->name);
       free (g);
     }
@@ -250,6 +277,12 @@ multi_conn_finalize (nbdkit_next *next, void *handle)
   assert (h->next == next);
   assert (h->group);
 
+  /* A group commit in another thread may be flushing this connection,
+   * so wait for it to finish before we go away.
+   */
+  while (h->group->flush_running)
+    pthread_cond_wait (&h->group->flush_cond, &lock);
+
   /* XXX should we add a config param to flush if the client forgot? */
   for (i = 0; i < h->group->conns.len; i++) {
     if (h->group->conns.ptr[i] == h) {
@@ -261,6 +294,7 @@ multi_conn_finalize (nbdkit_next *next, void *handle)
     for (i = 0; i < groups.len; i++)
       if (groups.ptr[i] == h->group) {
         group_vector_remove (&groups, i);
+        pthread_cond_destroy (&h->group->flush_cond);
         free (h->group->name);
         free (h->group);
         break;
@@ -441,14 +475,13 @@ multi_conn_cache (nbdkit_next *next,
   return next->cache (next, count, offs, flags, err);
 }
 
+/* Flush without group commit. */
 static int
-multi_conn_flush (nbdkit_next *next,
-                  void *handle, uint32_t flags, int *err)
+flush_single (nbdkit_next *next, struct handle *h, uint32_t flags, int *err)
 {
-  struct handle *h = handle, *h2;
+  struct handle *h2;
   size_t i;
 
-  assert (h->group);
   if (h->mode == EMULATE) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     for (i = 0; i < h->group->conns.len; i++) {
@@ -493,6 +526,182 @@ multi_conn_flush (nbdkit_next *next,
   return 0;
 }
 
+/* One connection to be flushed by a group commit (when emulating),
+ * or whose dirty state is reset by it.
+ */
+struct flush_job {
+  struct handle *h;
+  enum dirty dirty;     /* Saved dirty state, restored on failure */
+  pthread_t thread;
+  bool threaded;
+  int r;
+  int err;
+};
+DEFINE_VECTOR_TYPE(flush_jobs, struct flush_job);
+
+static void *
+flush_job_run (void *vp)
+{
+  struct flush_job *job = vp;
+
+  job->err = 0;
+  job->r = job->h->next->flush (job->h->next, 0, &job->err);
+  return NULL;
+}
+
+/* Run the flushes in parallel, the first in the current thread and
+ * the others in short-lived helper threads.  If a thread cannot be
+ * created, that flush runs in the current thread instead.
+ */
+static int
+flush_jobs_run (flush_jobs *jobs, int *err)
+{
+  size_t i;
+  int r = 0;
+
+  for (i = 1; i < jobs->len; i++) {
+    jobs->ptr[i].threaded =
+      pthread_create (&jobs->ptr[i].thread, NULL,
+                      flush_job_run, &jobs->ptr[i]) == 0;
+    if (!jobs->ptr[i].threaded)
+      flush_job_run (&jobs->ptr[i]);
+  }
+  if (jobs->len > 0)
+    flush_job_run (&jobs->ptr[0]);
+
+  for (i = 0; i < jobs->len; i++) {
+    if (jobs->ptr[i].threaded)
+      pthread_join (jobs->ptr[i].thread, NULL);
+    if (jobs->ptr[i].r == -1 && r == 0) {
+      *err = jobs->ptr[i].err;
+      r = -1;
+    }
+  }
+  return r;
+}
+
+/* Perform one group commit, called with lock held by the thread which
+ * has become the leader.  The lock is dropped while flushing, and the
+ * dirty flags are cleared beforehand, so that writes which race with
+ * the flush mark the connection dirty again for the next flush.
+ */
+static int
+flush_leader (nbdkit_next *next, struct handle *h, int *err)
+{
+  struct group *g = h->group;
+  flush_jobs jobs = empty_vector;
+  struct handle *h2;
+  bool group_dirty = g->dirty;
+  bool include;
+  size_t i;
+  int r;
+
+  for (i = 0; i < g->conns.len; i++) {
+    h2 = g->conns.ptr[i];
+    if (h->mode == EMULATE)
+      include = track == OFF ||
+        (g->dirty && (track == FAST || h2->dirty & READ)) ||
+        h2->dirty & WRITE;
+    else
+      include = track == CONN;
+    if (include) {
+      struct flush_job job = { .h = h2, .dirty = h2->dirty };
+
+      if (flush_jobs_append (&jobs, job) == -1) {
+        *err = errno;
+        nbdkit_error ("realloc: %m");
+        for (i = 0; i < jobs.len; i++)
+          jobs.ptr[i].h->dirty = jobs.ptr[i].dirty;
+        flush_jobs_reset (&jobs);
+        return -1;
+      }
+      h2->dirty = 0;
+    }
+  }
+  g->dirty = false;
+
+  pthread_mutex_unlock (&lock);
+  if (h->mode == EMULATE)
+    r = flush_jobs_run (&jobs, err);
+  else
+    r = next->flush (next, 0, err);
+  pthread_mutex_lock (&lock);
+
+  if (r == -1) {
+    /* Connections may still be dirty. */
+    for (i = 0; i < jobs.len; i++)
+      jobs.ptr[i].h->dirty |= jobs.ptr[i].dirty;
+    g->dirty |= group_dirty;
+  }
+  flush_jobs_reset (&jobs);
+  return r;
+}
+
+/* Flush using group commit.  A flush only has to wait for a single
+ * flush of the whole group which starts after it arrived, so any
+ * flushes which arrive while one is running share the next one.
+ */
+static int
+flush_group_commit (nbdkit_next *next, struct handle *h, int *err)
+{
+  struct group *g = h->group;
+  uint64_t needed, mine;
+  int r;
+
+  pthread_mutex_lock (&lock);
+  needed = g->flush_started + 1;
+  while (g->flush_done < needed && g->flush_running)
+    pthread_cond_wait (&g->flush_cond, &lock);
+
+  if (g->flush_done >= needed) {
+    /* Another thread did the flush for us. */
+    r = 0;
+    if (g->flush_failed >= needed) {
+      *err = g->flush_err;
+      r = -1;
+    }
+    pthread_mutex_unlock (&lock);
+    return r;
+  }
+
+  /* Become the leader. */
+  g->flush_running = true;
+  mine = ++g->flush_started;
+  r = flush_leader (next, h, err);
+  g->flush_done = mine;
+  if (r == -1) {
+    g->flush_failed = mine;
+    g->flush_err = *err;
+  }
+  g->flush_running = false;
+  pthread_cond_broadcast (&g->flush_cond);
+  pthread_mutex_unlock (&lock);
+  return r;
+}
+
+static int
+multi_conn_flush (nbdkit_next *next,
+                  void *handle, uint32_t flags, int *err)
+{
+  struct handle *h = handle;
+
+  assert (h->group);
+
+  /* Group commit is only possible when a flush covers every
+   * connection in the group, ie. when emulating, or when the plugin
+   * is multi-conn consistent.
+   */
+  if (group_commit && h->mode == EMULATE)
+    return flush_group_commit (next, h, err);
+  if (group_commit && h->mode == PLUGIN && next->can_multi_conn (next) == 1) {
+    /* Check if the image is clean, allowing us to skip a flush. */
+    if (track != OFF && !h->group->dirty)
+      return 0;
+    return flush_group_commit (next, h, err);
+  }
+  return flush_single (next, h, flags, err);
+}
+
 static struct nbdkit_filter filter = {
   .name              = "multi-conn",
   .longname          = "nbdkit multi-conn filter",
@@ -42,9 +42,9 @@
  * bucket we store the last time we were called and add the
  * appropriate number of tokens when we are called next.
  *
- * The bucket capacity controls the burstiness allowed.  This is
- * hard-coded at the moment but could be configurable.  All buckets
- * start off full.
+ * The bucket capacity controls the burstiness allowed.  It is set
+ * with the rate-burst parameter of the filter.  All buckets start
+ * off full.
  *
  * When a packet is to be read or written, if there are sufficient
  * tokens in the bucket then the packet may be immediately passed
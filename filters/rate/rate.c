@@ -42,24 +42,33 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
 #include <pthread.h>
 
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
 #include "getline.h"
+#include "minmax.h"
+#include "vector.h"
 #include "windows-compat.h"
 
 #include "bucket.h"
 
-/* Per-connection and global limit, both in bits per second, with zero
- * meaning not set / not enforced.  These are only used when reading
- * the command line and initializing the buckets for the first time.
- * They are not involved in dynamic rate adjustment.
+/* Per-connection, per-client and global limit, all in bits per
+ * second, with zero meaning not set / not enforced.  These are only
+ * used when reading the command line and initializing the buckets for
+ * the first time.  They are not involved in dynamic rate adjustment.
  */
 static uint64_t connection_rate = 0;
+static uint64_t client_rate = 0;
 static uint64_t rate = 0;
 
 /* Files for dynamic rate adjustment. */
@@ -68,10 +77,17 @@ static char *rate_file = NULL;
 
 /* Bucket capacity controls the burst rate.  It is expressed as the
  * length of time in "rate-equivalent seconds" that the client can
- * burst for after a period of inactivity.  This could be adjustable
- * in future.
+ * burst for after a period of inactivity.
+ */
+static double bucket_capacity = 2.0;
+
+/* Large requests are split into slices of at most this many bytes,
+ * and each slice is charged against the buckets and passed to the
+ * underlying layer separately.  This avoids a single long, lumpy
+ * sleep when the request size is much larger than the rate.  0 means
+ * don't split requests.
  */
-#define BUCKET_CAPACITY 2.0
+static uint32_t slice = 65536;
 
 /* Global read and write buckets. */
 static struct bucket read_bucket;
@@ -79,6 +95,27 @@ static pthread_mutex_t read_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct bucket write_bucket;
 static pthread_mutex_t write_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Per-client buckets, shared by all connections from the same
+ * address.  Clients connecting over a Unix domain socket (or any other
+ * non-IP transport) all share a single entry.
+ */
+struct client_key {
+  int family;
+  unsigned char addr[16];       /* IPv4 or IPv6 address, else zero */
+};
+
+struct client {
+  struct client_key key;
+  size_t refs;                  /* Number of connections using this. */
+  struct bucket read_bucket;
+  pthread_mutex_t read_bucket_lock;
+  struct bucket write_bucket;
+  pthread_mutex_t write_bucket_lock;
+};
+DEFINE_VECTOR_TYPE(client_vector, struct client *);
+static client_vector clients = empty_vector;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Per-connection handle. */
 struct rate_handle {
   /* Per-connection read and write buckets. */
@@ -86,6 +123,9 @@ struct rate_handle {
   pthread_mutex_t read_bucket_lock;
   struct bucket write_bucket;
   pthread_mutex_t write_bucket_lock;
+
+  /* Per-client buckets, or NULL if client-rate is not used. */
+  struct client *client;
 };
 
 static void
@@ -93,6 +133,27 @@ rate_unload (void)
 {
   free (connection_rate_file);
   free (rate_file);
+  client_vector_reset (&clients);
+}
+
+static int
+parse_rate (const char *key, const char *value, uint64_t *retp)
+{
+  int64_t r;
+
+  if (*retp > 0) {
+    nbdkit_error ("%s set twice on the command line", key);
+    return -1;
+  }
+  r = nbdkit_parse_size (value);
+  if (r == -1)
+    return -1;
+  if (r == 0) {
+    nbdkit_error ("%s cannot be set to 0", key);
+    return -1;
+  }
+  *retp = r;
+  return 0;
 }
 
 /* Called for each key=value passed on the command line. */
@@ -100,32 +161,38 @@ static int
 rate_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
              const char *key, const char *value)
 {
-  if (strcmp (key, "rate") == 0) {
-    if (rate > 0) {
-      nbdkit_error ("rate set twice on the command line");
+  if (strcmp (key, "rate") == 0)
+    return parse_rate (key, value, &rate);
+  else if (strcmp (key, "connection-rate") == 0)
+    return parse_rate (key, value, &connection_rate);
+  else if (strcmp (key, "client-rate") == 0)
+    return parse_rate (key, value, &client_rate);
+  else if (strcmp (key, "rate-burst") == 0) {
+    double d;
+    int n;
+
+    if (sscanf (value, "%lg%n", &d, &n) != 1 || value[n] != '\0') {
+      nbdkit_error ("could not parse rate-burst '%s'", value);
       return -1;
     }
-    rate = nbdkit_parse_size (value);
-    if (rate == -1)
-      return -1;
-    if (rate == 0) {
-      nbdkit_error ("rate cannot be set to 0");
+    if (!(d > 0) || d > 3600) {
+      nbdkit_error ("rate-burst must be > 0 and <= 3600 seconds");
       return -1;
     }
+    bucket_capacity = d;
     return 0;
   }
-  else if (strcmp (key, "connection-rate") == 0) {
-    if (connection_rate > 0) {
-      nbdkit_error ("connection-rate set twice on the command line");
-      return -1;
-    }
-    connection_rate = nbdkit_parse_size (value);
-    if (connection_rate == -1)
+  else if (strcmp (key, "rate-slice") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
       return -1;
-    if (connection_rate == 0) {
-      nbdkit_error ("connection-rate cannot be set to 0");
+    if (r > UINT32_MAX) {
+      nbdkit_error ("rate-slice is too large");
       return -1;
     }
+    slice = r;
     return 0;
   }
   else if (strcmp (key, "rate-file") == 0) {
@@ -150,8 +217,8 @@ static int
 rate_get_ready (int thread_model)
 {
   /* Initialize the global buckets. */
-  bucket_init (&read_bucket, rate, BUCKET_CAPACITY);
-  bucket_init (&write_bucket, rate, BUCKET_CAPACITY);
+  bucket_init (&read_bucket, rate, bucket_capacity);
+  bucket_init (&write_bucket, rate, bucket_capacity);
 
   return 0;
 }
@@ -159,8 +226,113 @@ rate_get_ready (int thread_model)
 #define rate_config_help \
   "rate=BITSPERSEC                Limit total bandwidth.\n" \
   "connection-rate=BITSPERSEC     Limit per-connection bandwidth.\n" \
+  "client-rate=BITSPERSEC         Limit per-client (IP address) bandwidth.\n" \
   "rate-file=FILENAME             Dynamically adjust total bandwidth.\n" \
-  "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth."
+  "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth.\n" \
+  "rate-burst=SECS                Length of burst allowed (default 2).\n" \
+  "rate-slice=SIZE                Split requests larger than SIZE (default 64K)."
+
+/* Work out the key identifying the client of the current connection. */
+static void
+get_client_key (struct client_key *key)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof addr;
+
+  memset (key, 0, sizeof *key);
+
+  /* If the peer name is not available (eg. with nbdkit -s on a pipe)
+   * then all such clients share one set of buckets, like other
+   * non-IP transports below.
+   */
+  if (nbdkit_peer_name ((struct sockaddr *) &addr, &addrlen) == -1) {
+    nbdkit_debug ("rate: peer name not available, "
+                  "using shared client-rate buckets");
+    return;
+  }
+
+  key->family = addr.ss_family;
+  switch (addr.ss_family) {
+#ifdef HAVE_NETINET_IN_H
+  case AF_INET: {
+    const struct sockaddr_in *sin = (struct sockaddr_in *) &addr;
+    memcpy (key->addr, &sin->sin_addr, sizeof sin->sin_addr);
+    break;
+  }
+  case AF_INET6: {
+    const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &addr;
+    memcpy (key->addr, &sin6->sin6_addr, sizeof sin6->sin6_addr);
+    break;
+  }
+#endif
+  default:
+    /* Other transports are not split by address. */
+    break;
+  }
+}
+
+/* Find or create the per-client buckets for this connection. */
+static struct client *
+get_client (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&clients_lock);
+  struct client_key key;
+  struct client *c;
+  size_t i;
+
+  get_client_key (&key);
+
+  for (i = 0; i < clients.len; ++i) {
+    c = clients.ptr[i];
+    if (memcmp (&c->key, &key, sizeof key) == 0) {
+      c->refs++;
+      return c;
+    }
+  }
+
+  c = malloc (sizeof *c);
+  if (c == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  c->key = key;
+  c->refs = 1;
+  bucket_init (&c->read_bucket, client_rate, bucket_capacity);
+  bucket_init (&c->write_bucket, client_rate, bucket_capacity);
+  pthread_mutex_init (&c->read_bucket_lock, NULL);
+  pthread_mutex_init (&c->write_bucket_lock, NULL);
+  if (client_vector_append (&clients, c) == -1) {
+    nbdkit_error ("realloc: %m");
+    pthread_mutex_destroy (&c->read_bucket_lock);
+    pthread_mutex_destroy (&c->write_bucket_lock);
+    free (c);
+    return NULL;
+  }
+  return c;
+}
+
+/* Drop a reference to the per-client buckets, freeing them when the
+ * last connection from this client goes away.
+ */
+static void
+put_client (struct client *c)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&clients_lock);
+  size_t i;
+
+  if (--c->refs > 0)
+    return;
+
+  for (i = 0; i < clients.len; ++i) {
+    if (clients.ptr[i] == c) {
+      client_vector_remove (&clients, i);
+      break;
+    }
+  }
+  pthread_mutex_destroy (&c->read_bucket_lock);
+  pthread_mutex_destroy (&c->write_bucket_lock);
+  free (c);
+}
 
 /* Create the per-connection handle. */
 static void *
@@ -178,8 +350,17 @@ rate_open (nbdkit_next_open *next, nbdkit_context *nxdata,
     return NULL;
   }
 
-  bucket_init (&h->read_bucket, connection_rate, BUCKET_CAPACITY);
-  bucket_init (&h->write_bucket, connection_rate, BUCKET_CAPACITY);
+  h->client = NULL;
+  if (client_rate > 0) {
+    h->client = get_client ();
+    if (h->client == NULL) {
+      free (h);
+      return NULL;
+    }
+  }
+
+  bucket_init (&h->read_bucket, connection_rate, bucket_capacity);
+  bucket_init (&h->write_bucket, connection_rate, bucket_capacity);
   pthread_mutex_init (&h->read_bucket_lock, NULL);
   pthread_mutex_init (&h->write_bucket_lock, NULL);
 
@@ -192,6 +373,8 @@ rate_close (void *handle)
 {
   struct rate_handle *h = handle;
 
+  if (h->client)
+    put_client (h->client);
   pthread_mutex_destroy (&h->read_bucket_lock);
   pthread_mutex_destroy (&h->write_bucket_lock);
   free (h);
@@ -273,6 +456,37 @@ maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
   return 0;
 }
 
+/* Charge one slice of a request against the global, per-client and
+ * per-connection buckets, in that order.
+ */
+static int
+charge_read (struct rate_handle *h, uint32_t count, int *err)
+{
+  if (maybe_sleep (&read_bucket, &read_bucket_lock, count, err))
+    return -1;
+  if (h->client &&
+      maybe_sleep (&h->client->read_bucket, &h->client->read_bucket_lock,
+                   count, err))
+    return -1;
+  if (maybe_sleep (&h->read_bucket, &h->read_bucket_lock, count, err))
+    return -1;
+  return 0;
+}
+
+static int
+charge_write (struct rate_handle *h, uint32_t count, int *err)
+{
+  if (maybe_sleep (&write_bucket, &write_bucket_lock, count, err))
+    return -1;
+  if (h->client &&
+      maybe_sleep (&h->client->write_bucket, &h->client->write_bucket_lock,
+                   count, err))
+    return -1;
+  if (maybe_sleep (&h->write_bucket, &h->write_bucket_lock, count, err))
+    return -1;
+  return 0;
+}
+
 /* Read data. */
 static int
 rate_pread (nbdkit_next *next,
@@ -280,15 +494,22 @@ rate_pread (nbdkit_next *next,
             uint32_t flags, int *err)
 {
   struct rate_handle *h = handle;
+  uint32_t n;
 
   maybe_adjust (rate_file, &read_bucket, &read_bucket_lock);
-  if (maybe_sleep (&read_bucket, &read_bucket_lock, count, err))
-    return -1;
   maybe_adjust (connection_rate_file, &h->read_bucket, &h->read_bucket_lock);
-  if (maybe_sleep (&h->read_bucket, &h->read_bucket_lock, count, err))
-    return -1;
 
-  return next->pread (next, buf, count, offset, flags, err);
+  while (count > 0) {
+    n = slice > 0 ? MIN (count, slice) : count;
+    if (charge_read (h, n, err) == -1)
+      return -1;
+    if (next->pread (next, buf, n, offset, flags, err) == -1)
+      return -1;
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+  return 0;
 }
 
 /* Write data. */
@@ -299,15 +520,25 @@ rate_pwrite (nbdkit_next *next,
              int *err)
 {
   struct rate_handle *h = handle;
+  uint32_t n;
 
   maybe_adjust (rate_file, &write_bucket, &write_bucket_lock);
-  if (maybe_sleep (&write_bucket, &write_bucket_lock, count, err))
-    return -1;
   maybe_adjust (connection_rate_file, &h->write_bucket, &h->write_bucket_lock);
-  if (maybe_sleep (&h->write_bucket, &h->write_bucket_lock, count, err))
-    return -1;
 
-  return next->pwrite (next, buf, count, offset, flags, err);
+  /* If the request is split, FUA is passed on every slice so that
+   * all of the data is persistent when we return.
+   */
+  while (count > 0) {
+    n = slice > 0 ? MIN (count, slice) : count;
+    if (charge_write (h, n, err) == -1)
+      return -1;
+    if (next->pwrite (next, buf, n, offset, flags, err) == -1)
+      return -1;
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+  return 0;
 }
 
 static struct nbdkit_filter filter = {
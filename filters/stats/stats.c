@@ -38,6 +38,8 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -47,30 +49,76 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "histogram.h"
 #include "tvdiff.h"
+#include "vector.h"
 #include "windows-compat.h"
 
 static char *filename;
 static bool append;
 static FILE *fp;
-static struct timeval start_t;
+static struct timespec start_t;
 
+static enum { FORMAT_TEXT, FORMAT_JSON } format = FORMAT_TEXT;
+static unsigned interval;       /* statsinterval, 0 = no interval dumps */
+static bool per_connection;     /* statsconnections */
+
+enum command { READ, WRITE, TRIM, ZERO, EXTENTS, CACHE, FLUSH, NR_COMMANDS };
+static const char *command_names[NR_COMMANDS] = {
+  "read", "write", "trim", "zero", "extents", "cache", "flush"
+};
+
+/* Statistics for one command.  The latency histogram is in
+ * nanoseconds, so latency.count is the number of operations and
+ * latency.sum the total time.  size.sum is the total bytes.
+ */
 typedef struct {
-  const char *name;
-  uint64_t ops;
-  uint64_t bytes;
-  uint64_t usecs;
+  struct histogram latency;
+  struct histogram size;
 } nbdstat;
 
-/* This lock protects all the stats. */
+struct stats {
+  nbdstat cmd[NR_COMMANDS];
+};
+
+/* Each thread records into its own stats, so no lock is needed to
+ * record an operation.  The per-thread stats are merged when we print
+ * them.  When a thread exits its stats are added to 'retired'.
+ *
+ * This lock protects the list of threads, 'retired', the list of
+ * connections, and the output file.
+ */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static nbdstat pread_st   = { "read" };
-static nbdstat pwrite_st  = { "write" };
-static nbdstat trim_st    = { "trim" };
-static nbdstat zero_st    = { "zero" };
-static nbdstat extents_st = { "extents" };
-static nbdstat cache_st   = { "cache" };
-static nbdstat flush_st   = { "flush" };
+static pthread_key_t thread_key;
+DEFINE_VECTOR_TYPE(stats_vector, struct stats *);
+static stats_vector threads = empty_vector;
+static struct stats retired;
+
+/* Per-connection totals, only used if statsconnections=true.  These
+ * may be updated by several threads at the same time, so they are
+ * updated atomically.
+ */
+struct conn_total {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t nsecs;
+};
+
+struct handle {
+  uint64_t id;
+  struct conn_total cmd[NR_COMMANDS];
+};
+DEFINE_VECTOR_TYPE(handle_vector, struct handle *);
+static handle_vector handles = empty_vector;
+static uint64_t next_id = 1;
+
+/* Background thread for statsinterval. */
+static pthread_t interval_thread;
+static bool interval_thread_running;
+static bool interval_thread_stop;
+static pthread_cond_t interval_cond = PTHREAD_COND_INITIALIZER;
+static struct stats last_interval; /* Snapshot at the last dump. */
+static struct timespec last_interval_t;
 
 #define KiB 1024
 #define MiB 1048576
@@ -102,23 +150,71 @@ humanrate (uint64_t bytes, uint64_t usecs)
   return secs != 0.0 ? humansize (bytes / secs) : NULL;
 }
 
+static char *
+humantime (uint64_t nsecs)
+{
+  int r;
+  char *ret;
+
+  if (nsecs < 1000)
+    r = asprintf (&ret, "%" PRIu64 " ns", nsecs);
+  else if (nsecs < 1000000)
+    r = asprintf (&ret, "%.1f us", nsecs / 1000.0);
+  else if (nsecs < 1000000000)
+    r = asprintf (&ret, "%.1f ms", nsecs / 1000000.0);
+  else
+    r = asprintf (&ret, "%.3f s", nsecs / 1000000000.0);
+  if (r == -1)
+    ret = NULL;
+  return ret;
+}
+
 static inline const char *
 maybe (char *s)
 {
   return s ? s : "(n/a)";
 }
 
+/* Percentiles that we print. */
+static const double percentiles[] = { 50, 90, 99, 99.9 };
+#define NR_PERCENTILES (sizeof percentiles / sizeof percentiles[0])
+
 static void
-print_stat (const nbdstat *st, int64_t usecs)
+print_distribution (const char *what, const struct histogram *h,
+                    char *(*human) (uint64_t))
 {
-  if (st->ops > 0) {
-    char *size = humansize (st->bytes);
-    char *op_rate = humanrate (st->bytes, st->usecs);
-    char *total_rate = humanrate (st->bytes, usecs);
+  char *s;
+  size_t i;
+
+  fprintf (fp, "  %s:", what);
+  for (i = 0; i < NR_PERCENTILES; ++i) {
+    s = human (histogram_percentile (h, percentiles[i]));
+    fprintf (fp, " p%g %s,", percentiles[i], maybe (s));
+    free (s);
+  }
+  s = human (h->max);
+  fprintf (fp, " max %s\n", maybe (s));
+  free (s);
+}
+
+static void
+print_stat (const char *name, const nbdstat *st, int64_t usecs)
+{
+  uint64_t ops = st->latency.count;
+  uint64_t bytes = st->size.sum;
+  uint64_t op_usecs = st->latency.sum / 1000;
+
+  if (ops > 0) {
+    char *size = humansize (bytes);
+    char *op_rate = humanrate (bytes, op_usecs);
+    char *total_rate = humanrate (bytes, usecs);
 
     fprintf (fp, "%s: %" PRIu64 " ops, %.6f s, %s, %s/s op, %s/s total\n",
-             st->name, st->ops, st->usecs / 1000000.0, maybe (size),
+             name, ops, op_usecs / 1000000.0, maybe (size),
              maybe (op_rate), maybe (total_rate));
+    print_distribution ("latency", &st->latency, humantime);
+    if (bytes > 0)
+      print_distribution ("size", &st->size, humansize);
 
     free (size);
     free (op_rate);
@@ -126,16 +222,33 @@ print_stat (const nbdstat *st, int64_t usecs)
   }
 }
 
+/* The totals have never included cache requests, and scripts parse
+ * the "total:" line, so keep it that way.
+ */
 static void
-print_totals (uint64_t usecs)
+totals (const struct stats *st, uint64_t *ops, uint64_t *bytes)
 {
-  uint64_t ops = pread_st.ops + pwrite_st.ops + trim_st.ops + zero_st.ops +
-    extents_st.ops + flush_st.ops;
-  uint64_t bytes = pread_st.bytes + pwrite_st.bytes + trim_st.bytes +
-    zero_st.bytes;
-  char *size = humansize (bytes);
-  char *rate = humanrate (bytes, usecs);
+  size_t c;
+
+  *ops = *bytes = 0;
+  for (c = 0; c < NR_COMMANDS; ++c) {
+    if (c == CACHE)
+      continue;
+    *ops += st->cmd[c].latency.count;
+    if (c == READ || c == WRITE || c == TRIM || c == ZERO)
+      *bytes += st->cmd[c].size.sum;
+  }
+}
 
+static void
+print_totals (const struct stats *st, uint64_t usecs)
+{
+  uint64_t ops, bytes;
+  char *size, *rate;
+
+  totals (st, &ops, &bytes);
+  size = humansize (bytes);
+  rate = humanrate (bytes, usecs);
   fprintf (fp, "total: %" PRIu64 " ops, %.6f s, %s, %s/s\n",
            ops, usecs / 1000000.0, maybe (size), maybe (rate));
 
@@ -143,36 +256,257 @@ print_totals (uint64_t usecs)
   free (rate);
 }
 
-static inline void
-print_stats (int64_t usecs)
-{
-  print_totals (usecs);
-  print_stat (&pread_st,   usecs);
-  print_stat (&pwrite_st,  usecs);
-  print_stat (&trim_st,    usecs);
-  print_stat (&zero_st,    usecs);
-  print_stat (&extents_st, usecs);
-  print_stat (&cache_st,   usecs);
-  print_stat (&flush_st,   usecs);
+static void
+print_stats_text (const struct stats *st, int64_t usecs)
+{
+  size_t c;
+
+  print_totals (st, usecs);
+  for (c = 0; c < NR_COMMANDS; ++c)
+    print_stat (command_names[c], &st->cmd[c], usecs);
+}
+
+static void
+print_json_distribution (const char *what, const struct histogram *h)
+{
+  size_t i;
+
+  fprintf (fp, "\"%s\":{", what);
+  for (i = 0; i < NR_PERCENTILES; ++i)
+    fprintf (fp, "\"p%g\":%" PRIu64 ",",
+             percentiles[i], histogram_percentile (h, percentiles[i]));
+  fprintf (fp, "\"max\":%" PRIu64 "}", h->max);
+}
+
+static void
+print_connection_json (const struct handle *h)
+{
+  size_t c;
+
+  fprintf (fp, "{\"id\":%" PRIu64, h->id);
+  for (c = 0; c < NR_COMMANDS; ++c)
+    fprintf (fp, ",\"%s\":{\"ops\":%" PRIu64 ",\"bytes\":%" PRIu64 ","
+             "\"time_ns\":%" PRIu64 "}",
+             command_names[c],
+             __atomic_load_n (&h->cmd[c].ops, __ATOMIC_RELAXED),
+             __atomic_load_n (&h->cmd[c].bytes, __ATOMIC_RELAXED),
+             __atomic_load_n (&h->cmd[c].nsecs, __ATOMIC_RELAXED));
+  fprintf (fp, "}");
+}
+
+/* Print one JSON object on a single line.  type is "interval" for
+ * the statistics since the last interval dump, or "total" for the
+ * statistics since the server started.
+ */
+static void
+print_stats_json (const char *type, const struct stats *st,
+                  int64_t elapsed_nsecs, int64_t nsecs)
+{
+  uint64_t ops, bytes;
+  size_t c, i;
+
+  totals (st, &ops, &bytes);
+  fprintf (fp, "{\"type\":\"%s\",\"elapsed\":%.6f,\"time\":%.6f,"
+           "\"total\":{\"ops\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+           type, elapsed_nsecs / 1000000000.0, nsecs / 1000000000.0,
+           ops, bytes);
+  for (c = 0; c < NR_COMMANDS; ++c) {
+    const nbdstat *cst = &st->cmd[c];
+
+    fprintf (fp, ",\"%s\":{\"ops\":%" PRIu64 ",\"bytes\":%" PRIu64 ","
+             "\"time_ns\":%" PRIu64 ",",
+             command_names[c],
+             cst->latency.count, cst->size.sum, cst->latency.sum);
+    print_json_distribution ("latency_ns", &cst->latency);
+    fprintf (fp, ",");
+    print_json_distribution ("size", &cst->size);
+    fprintf (fp, "}");
+  }
+  if (per_connection) {
+    fprintf (fp, ",\"connections\":[");
+    for (i = 0; i < handles.len; ++i) {
+      if (i > 0)
+        fprintf (fp, ",");
+      print_connection_json (handles.ptr[i]);
+    }
+    fprintf (fp, "]");
+  }
+  fprintf (fp, "}\n");
+}
+
+/* Merge the statistics of all threads into st, which must be zeroed
+ * by the caller.  Must be called with the lock held.
+ */
+static void
+collect_stats (struct stats *st)
+{
+  size_t c, i;
+
+  for (c = 0; c < NR_COMMANDS; ++c) {
+    histogram_add (&st->cmd[c].latency, &retired.cmd[c].latency);
+    histogram_add (&st->cmd[c].size, &retired.cmd[c].size);
+    for (i = 0; i < threads.len; ++i) {
+      histogram_add (&st->cmd[c].latency, &threads.ptr[i]->cmd[c].latency);
+      histogram_add (&st->cmd[c].size, &threads.ptr[i]->cmd[c].size);
+    }
+  }
+}
+
+/* Called when a thread exits, to save its statistics. */
+static void
+free_thread_stats (void *vp)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct stats *st = vp;
+  size_t c, i;
+
+  for (c = 0; c < NR_COMMANDS; ++c) {
+    histogram_add (&retired.cmd[c].latency, &st->cmd[c].latency);
+    histogram_add (&retired.cmd[c].size, &st->cmd[c].size);
+  }
+  for (i = 0; i < threads.len; ++i) {
+    if (threads.ptr[i] == st) {
+      stats_vector_remove (&threads, i);
+      break;
+    }
+  }
+  free (st);
+}
+
+/* Get the statistics for the current thread, creating them on first
+ * use.  Returns NULL if we could not allocate them, in which case the
+ * operation is not counted.
+ */
+static struct stats *
+get_thread_stats (void)
+{
+  struct stats *st = pthread_getspecific (thread_key);
+
+  if (st == NULL) {
+    st = calloc (1, sizeof *st);
+    if (st == NULL) {
+      nbdkit_debug ("stats: calloc: %m");
+      return NULL;
+    }
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      if (stats_vector_append (&threads, st) == -1) {
+        nbdkit_debug ("stats: realloc: %m");
+        free (st);
+        return NULL;
+      }
+    }
+    pthread_setspecific (thread_key, st);
+  }
+  return st;
+}
+
+/* Print the statistics since the last interval dump.  Must be called
+ * with the lock held.
+ */
+static void
+print_interval (void)
+{
+  CLEANUP_FREE struct stats *now = calloc (1, sizeof *now);
+  CLEANUP_FREE struct stats *delta = malloc (sizeof *delta);
+  struct timespec t;
+  size_t c;
+
+  if (now == NULL || delta == NULL) {
+    nbdkit_debug ("stats: malloc: %m");
+    return;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  collect_stats (now);
+  memcpy (delta, now, sizeof *delta);
+  for (c = 0; c < NR_COMMANDS; ++c) {
+    histogram_subtract (&delta->cmd[c].latency, &last_interval.cmd[c].latency);
+    histogram_subtract (&delta->cmd[c].size, &last_interval.cmd[c].size);
+  }
+
+  if (format == FORMAT_JSON)
+    print_stats_json ("interval", delta,
+                      tsdiff_nsec (&start_t, &t),
+                      tsdiff_nsec (&last_interval_t, &t));
+  else {
+    fprintf (fp, "interval: %.6f s, elapsed: %.6f s\n",
+             tsdiff_nsec (&last_interval_t, &t) / 1000000000.0,
+             tsdiff_nsec (&start_t, &t) / 1000000000.0);
+    print_stats_text (delta, tsdiff_nsec (&last_interval_t, &t) / 1000);
+  }
   fflush (fp);
+
+  memcpy (&last_interval, now, sizeof last_interval);
+  last_interval_t = t;
+}
+
+static void *
+interval_thread_fn (void *vp)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct timespec deadline;
+  int r;
+
+  /* pthread_cond_timedwait uses CLOCK_REALTIME by default. */
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  while (!interval_thread_stop) {
+    deadline.tv_sec += interval;
+    do {
+      r = pthread_cond_timedwait (&interval_cond, &lock, &deadline);
+    } while (!interval_thread_stop && r != ETIMEDOUT);
+    if (!interval_thread_stop)
+      print_interval ();
+  }
+  return NULL;
+}
+
+static void
+stats_load (void)
+{
+  int err;
+
+  err = pthread_key_create (&thread_key, free_thread_stats);
+  if (err) {
+    errno = err;
+    nbdkit_error ("pthread_key_create: %m");
+    exit (EXIT_FAILURE);
+  }
 }
 
 static void
 stats_unload (void)
 {
-  struct timeval now;
-  int64_t usecs;
+  struct timespec now;
+  int64_t nsecs;
+
+  /* Don't run the destructor on threads which exit after this. */
+  pthread_key_delete (thread_key);
 
-  gettimeofday (&now, NULL);
-  usecs = tvdiff_usec (&start_t, &now);
-  if (fp && usecs > 0) {
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  nsecs = tsdiff_nsec (&start_t, &now);
+  if (fp && nsecs > 0) {
     ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    print_stats (usecs);
+    CLEANUP_FREE struct stats *st = calloc (1, sizeof *st);
+
+    if (st) {
+      collect_stats (st);
+      if (format == FORMAT_JSON)
+        print_stats_json ("total", st, nsecs, nsecs);
+      else
+        print_stats_text (st, nsecs / 1000);
+      fflush (fp);
+    }
   }
 
-  if (fp)
+  if (fp) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     fclose (fp);
+    fp = NULL;
+  }
   free (filename);
+  stats_vector_reset (&threads);
+  handle_vector_reset (&handles);
 }
 
 static int
@@ -195,6 +529,29 @@ stats_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     append = r;
     return 0;
   }
+  else if (strcmp (key, "statsformat") == 0) {
+    if (strcmp (value, "text") == 0)
+      format = FORMAT_TEXT;
+    else if (strcmp (value, "json") == 0)
+      format = FORMAT_JSON;
+    else {
+      nbdkit_error ("statsformat must be 'text' or 'json'");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "statsinterval") == 0) {
+    if (nbdkit_parse_unsigned (key, value, &interval) == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "statsconnections") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    per_connection = r;
+    return 0;
+  }
 
   return next (nxdata, key, value);
 }
@@ -235,28 +592,144 @@ stats_get_ready (int thread_model)
     return -1;
   }
 
-  gettimeofday (&start_t, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start_t);
+  last_interval_t = start_t;
 
   return 0;
 }
 
+/* After forking, start the background thread for interval dumps. */
+static int
+stats_after_fork (nbdkit_backend *nxdata)
+{
+  int err;
+
+  if (interval == 0)
+    return 0;
+
+  err = pthread_create (&interval_thread, NULL, interval_thread_fn, NULL);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  interval_thread_running = true;
+  return 0;
+}
+
+static void
+stats_cleanup (nbdkit_backend *nxdata)
+{
+  if (interval_thread_running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      interval_thread_stop = true;
+      pthread_cond_signal (&interval_cond);
+    }
+    pthread_join (interval_thread, NULL);
+    interval_thread_running = false;
+  }
+}
+
 #define stats_config_help \
   "statsfile=<FILE>    (required) The file to place the log in.\n" \
-  "statsappend=<BOOL>  True to append to the log (default false).\n"
+  "statsappend=<BOOL>  True to append to the log (default false).\n" \
+  "statsformat=text|json  Output format (default text).\n" \
+  "statsinterval=<SECS>   Also write stats every SECS seconds.\n" \
+  "statsconnections=<BOOL> True to write per-connection stats.\n"
+
+/* Create the per-connection handle. */
+static void *
+stats_open (nbdkit_next_open *next, nbdkit_context *nxdata,
+            int readonly, const char *exportname, int is_tls)
+{
+  struct handle *h;
+
+  if (next (nxdata, readonly, exportname) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  h->id = next_id++;
+  if (per_connection && handle_vector_append (&handles, h) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (h);
+    return NULL;
+  }
+  return h;
+}
+
+/* Write the per-connection stats and free the handle. */
+static void
+stats_close (void *handle)
+{
+  struct handle *h = handle;
+  size_t c, i;
+
+  if (per_connection) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+    for (i = 0; i < handles.len; ++i) {
+      if (handles.ptr[i] == h) {
+        handle_vector_remove (&handles, i);
+        break;
+      }
+    }
+
+    if (fp == NULL)             /* Raced with unload. */
+      goto out;
+    if (format == FORMAT_JSON) {
+      fprintf (fp, "{\"type\":\"connection\",\"connection\":");
+      print_connection_json (h);
+      fprintf (fp, "}\n");
+    }
+    else {
+      fprintf (fp, "connection %" PRIu64 ":", h->id);
+      for (c = 0; c < NR_COMMANDS; ++c) {
+        if (h->cmd[c].ops > 0) {
+          char *size = humansize (h->cmd[c].bytes);
+          fprintf (fp, " %s: %" PRIu64 " ops, %.6f s, %s;",
+                   command_names[c], h->cmd[c].ops,
+                   h->cmd[c].nsecs / 1000000000.0, maybe (size));
+          free (size);
+        }
+      }
+      fprintf (fp, "\n");
+    }
+    fflush (fp);
+  }
+
+ out:
+  free (h);
+}
 
 static inline void
-record_stat (nbdstat *st, uint32_t count, const struct timeval *start)
+record_stat (struct handle *h, enum command c, uint32_t count,
+             const struct timespec *start)
 {
-  struct timeval end;
-  uint64_t usecs;
+  struct timespec end;
+  struct stats *st;
+  uint64_t nsecs;
 
-  gettimeofday (&end, NULL);
-  usecs = tvdiff_usec (start, &end);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  nsecs = tsdiff_nsec (start, &end);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  st->ops++;
-  st->bytes += count;
-  st->usecs += usecs;
+  st = get_thread_stats ();
+  if (st) {
+    histogram_record (&st->cmd[c].latency, nsecs);
+    histogram_record (&st->cmd[c].size, count);
+  }
+
+  if (per_connection) {
+    __atomic_fetch_add (&h->cmd[c].ops, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->cmd[c].bytes, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->cmd[c].nsecs, nsecs, __ATOMIC_RELAXED);
+  }
 }
 
 /* Read. */
@@ -265,12 +738,12 @@ stats_pread (nbdkit_next *next,
              void *handle, void *buf, uint32_t count, uint64_t offset,
              uint32_t flags, int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->pread (next, buf, count, offset, flags, err);
-  if (r == 0) record_stat (&pread_st, count, &start);
+  if (r == 0) record_stat (handle, READ, count, &start);
   return r;
 }
 
@@ -281,12 +754,12 @@ stats_pwrite (nbdkit_next *next,
               const void *buf, uint32_t count, uint64_t offset,
               uint32_t flags, int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->pwrite (next, buf, count, offset, flags, err);
-  if (r == 0) record_stat (&pwrite_st, count, &start);
+  if (r == 0) record_stat (handle, WRITE, count, &start);
   return r;
 }
 
@@ -297,12 +770,12 @@ stats_trim (nbdkit_next *next,
             uint32_t count, uint64_t offset, uint32_t flags,
             int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->trim (next, count, offset, flags, err);
-  if (r == 0) record_stat (&trim_st, count, &start);
+  if (r == 0) record_stat (handle, TRIM, count, &start);
   return r;
 }
 
@@ -312,12 +785,12 @@ stats_flush (nbdkit_next *next,
              void *handle, uint32_t flags,
              int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->flush (next, flags, err);
-  if (r == 0) record_stat (&flush_st, 0, &start);
+  if (r == 0) record_stat (handle, FLUSH, 0, &start);
   return r;
 }
 
@@ -328,12 +801,12 @@ stats_zero (nbdkit_next *next,
             uint32_t count, uint64_t offset, uint32_t flags,
             int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->zero (next, count, offset, flags, err);
-  if (r == 0) record_stat (&zero_st, count, &start);
+  if (r == 0) record_stat (handle, ZERO, count, &start);
   return r;
 }
 
@@ -344,16 +817,16 @@ stats_extents (nbdkit_next *next,
                uint32_t count, uint64_t offset, uint32_t flags,
                struct nbdkit_extents *extents, int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->extents (next, count, offset, flags, extents, err);
   /* XXX There's a case for trying to determine how long the extents
    * will be that are returned to the client (instead of simply using
    * count), given the flags and the complex rules in the protocol.
    */
-  if (r == 0) record_stat (&extents_st, count, &start);
+  if (r == 0) record_stat (handle, EXTENTS, count, &start);
   return r;
 }
 
@@ -364,23 +837,28 @@ stats_cache (nbdkit_next *next,
              uint32_t count, uint64_t offset, uint32_t flags,
              int *err)
 {
-  struct timeval start;
+  struct timespec start;
   int r;
 
-  gettimeofday (&start, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &start);
   r = next->cache (next, count, offset, flags, err);
-  if (r == 0) record_stat (&cache_st, count, &start);
+  if (r == 0) record_stat (handle, CACHE, count, &start);
   return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "stats",
   .longname          = "nbdkit stats filter",
+  .load              = stats_load,
   .unload            = stats_unload,
   .config            = stats_config,
   .config_complete   = stats_config_complete,
   .config_help       = stats_config_help,
   .get_ready         = stats_get_ready,
+  .after_fork        = stats_after_fork,
+  .cleanup           = stats_cleanup,
+  .open              = stats_open,
+  .close             = stats_close,
   .pread             = stats_pread,
   .pwrite            = stats_pwrite,
   .trim              = stats_trim,
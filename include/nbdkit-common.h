@@ -137,6 +137,13 @@ NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_uid, (void));
 NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_gid, (void));
 NBDKIT_EXTERN_DECL (void, nbdkit_shutdown, (void));
 
+NBDKIT_EXTERN_DECL (int, nbdkit_metric_gauge,
+                    (const char *name, const char *help,
+                     double (*get) (void *opaque), void *opaque));
+NBDKIT_EXTERN_DECL (int, nbdkit_metric_counter,
+                    (const char *name, const char *help,
+                     double (*get) (void *opaque), void *opaque));
+
 NBDKIT_EXTERN_DECL (const char *, nbdkit_strdup_intern,
                     (const char *str));
 NBDKIT_EXTERN_DECL (const char *, nbdkit_strndup_intern,
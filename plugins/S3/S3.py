@@ -32,6 +32,12 @@
 
 import nbdkit
 import boto3
+import bisect
+import re
+import threading
+from botocore.config import Config
+from collections import OrderedDict
+from concurrent.futures import ThreadPoolExecutor
 from contextlib import closing
 
 
@@ -42,7 +48,47 @@ secret_key = None
 session_token = None
 endpoint_url = None
 bucket_name = None
-key_name = None
+key_names = []
+connections = 8
+chunk_size = 8 * 1024 * 1024
+cache_size = 0
+
+# S3 requires every part of a multipart upload except the last to be
+# at least 5 MiB, and allows at most 10000 parts per object.
+MIN_PART_SIZE = 5 * 1024 * 1024
+MAX_PARTS = 10000
+
+# Shared by all connections, set up in after_fork.
+s3 = None
+executor = None
+
+# The objects which are concatenated to make the export.  sizes[i] is
+# the size of the i'th object and starts[i] is its offset in the export.
+sizes = []
+starts = []
+export_size = 0
+
+# Blocks are chunk_size-aligned pieces of a single object, indexed by
+# (object, block number).  Writes are held in ‘dirty’ until the next
+# flush, which moves them to ‘committing’ while the upload is running.
+# Clean blocks may be kept in the LRU ‘cache’.  ‘commit_gen’ is
+# incremented after each commit so that a block fetched from S3 while a
+# commit was in progress is never used to fill the cache or a dirty
+# block.
+lock = threading.Lock()
+flush_lock = threading.Lock()
+dirty = {}
+committing = {}
+cache = OrderedDict()
+commit_gen = 0
+
+
+def parse_size(key, value):
+    m = re.fullmatch(r"(\d+)([kKmMgGtT]?)", value.strip())
+    if m is None:
+        raise Exception("%s: could not parse size: %s" % (key, value))
+    shift = {"": 0, "k": 10, "m": 20, "g": 30, "t": 40}[m.group(2).lower()]
+    return int(m.group(1)) << shift
 
 
 def thread_model():
@@ -51,7 +97,7 @@ def thread_model():
 
 def config(key, value):
     global access_key, secret_key, session_token, endpoint_url, \
-           bucket_name, key_name
+           bucket_name, connections, chunk_size, cache_size
 
     if key == "access-key" or key == "access_key":
         access_key = value
@@ -64,7 +110,17 @@ def config(key, value):
     elif key == "bucket":
         bucket_name = value
     elif key == "key":
-        key_name = value
+        key_names.append(value)
+    elif key == "connections":
+        connections = int(value)
+        if connections < 1:
+            raise Exception("connections must be >= 1")
+    elif key == "chunk-size" or key == "chunk_size":
+        chunk_size = parse_size(key, value)
+        if chunk_size < 512:
+            raise Exception("chunk-size must be at least 512 bytes")
+    elif key == "cache":
+        cache_size = parse_size(key, value)
     else:
         raise Exception("unknown parameter %s" % key)
 
@@ -72,37 +128,251 @@ def config(key, value):
 def config_complete():
     if bucket_name is None:
         raise Exception("bucket parameter missing")
-    if key_name is None:
+    if not key_names:
         raise Exception("key parameter missing")
 
 
-def open(readonly):
-    global access_key, secret_key, session_token, endpoint_url
+def after_fork():
+    global s3, executor, export_size
 
+    # boto3 clients are thread safe, so one client (and its pool of
+    # HTTP connections) is shared by all NBD connections.
     s3 = boto3.client("s3",
                       aws_access_key_id=access_key,
                       aws_secret_access_key=secret_key,
                       aws_session_token=session_token,
-                      endpoint_url=endpoint_url)
+                      endpoint_url=endpoint_url,
+                      config=Config(max_pool_connections=connections))
     if s3 is None:
         raise Exception("could not connect to S3")
-    return s3
+    executor = ThreadPoolExecutor(max_workers=connections)
+
+    for key in key_names:
+        resp = s3.head_object(Bucket=bucket_name, Key=key)
+        starts.append(export_size)
+        sizes.append(int(resp['ContentLength']))
+        export_size += sizes[-1]
+    nbdkit.debug("S3: %d object(s), total size %d" %
+                 (len(key_names), export_size))
+
+
+def open(readonly):
+    if not readonly:
+        if chunk_size < MIN_PART_SIZE:
+            raise Exception("chunk-size must be at least %d bytes "
+                            "for write support, or use nbdkit -r"
+                            % MIN_PART_SIZE)
+        for i in range(len(sizes)):
+            if nr_blocks(i) > MAX_PARTS:
+                raise Exception("%s: object too large for chunk-size, "
+                                "increase chunk-size or use nbdkit -r"
+                                % key_names[i])
+    return 1
 
 
-def get_size(s3):
-    global bucket_name, key_name
+def close(h):
+    # Don't lose writes if the client disconnects without flushing.
+    flush(h, 0)
 
-    resp = s3.get_object(Bucket=bucket_name, Key=key_name)
-    size = resp['ResponseMetadata']['HTTPHeaders']['content-length']
-    return int(size)
 
+def get_size(h):
+    return export_size
 
-def pread(s3, buf, offset, flags):
-    global bucket_name, key_name
 
-    size = len(buf)
-    rnge = 'bytes=%d-%d' % (offset, offset+size-1)
-    resp = s3.get_object(Bucket=bucket_name, Key=key_name, Range=rnge)
+def can_multi_conn(h):
+    return True
+
+
+def nr_blocks(i):
+    return (sizes[i] + chunk_size - 1) // chunk_size
+
+
+def block_len(i, b):
+    return min(chunk_size, sizes[i] - b * chunk_size)
+
+
+def pieces(count, offset):
+    """
+    Split a request into the blocks that it touches.  Yields tuples of
+    (object, block, offset in block, length, offset in request).
+    """
+    i = bisect.bisect_right(starts, offset) - 1
+    done = 0
+    while done < count:
+        while offset - starts[i] >= sizes[i]:
+            i += 1
+        obj_offset = offset - starts[i]
+        b = obj_offset // chunk_size
+        boff = obj_offset % chunk_size
+        n = min(count - done, block_len(i, b) - boff)
+        yield (i, b, boff, n, done)
+        offset += n
+        done += n
+
+
+def get_range(i, offset, count):
+    rnge = 'bytes=%d-%d' % (offset, offset+count-1)
+    resp = s3.get_object(Bucket=bucket_name, Key=key_names[i], Range=rnge)
     body = resp['Body']
     with closing(body):
-        buf[:] = body.read(size)
+        data = body.read(count)
+    if len(data) != count:
+        raise Exception("%s: short read from S3" % key_names[i])
+    return data
+
+
+def lookup(i, b):
+    """Return the block from memory, or None.  Call with lock held."""
+    blk = dirty.get((i, b))
+    if blk is None:
+        blk = committing.get((i, b))
+    if blk is None:
+        blk = cache.get((i, b))
+        if blk is not None:
+            cache.move_to_end((i, b))
+    return blk
+
+
+def cache_insert(i, b, data, gen):
+    """Call with lock held."""
+    if cache_size < chunk_size or gen != commit_gen:
+        return
+    cache[(i, b)] = data
+    cache.move_to_end((i, b))
+    while len(cache) * chunk_size > cache_size:
+        cache.popitem(last=False)
+
+
+def fetch(buf, i, b, boff, n, pos):
+    if cache_size < chunk_size:
+        buf[pos:pos+n] = get_range(i, b * chunk_size + boff, n)
+    else:
+        with lock:
+            gen = commit_gen
+        data = get_range(i, b * chunk_size, block_len(i, b))
+        buf[pos:pos+n] = data[boff:boff+n]
+        with lock:
+            cache_insert(i, b, data, gen)
+
+
+def pread(h, buf, offset, flags):
+    # Satisfy what we can from memory, then fetch the rest from S3
+    # using concurrent ranged GETs.
+    todo = []
+    with lock:
+        for (i, b, boff, n, pos) in pieces(len(buf), offset):
+            blk = lookup(i, b)
+            if blk is not None:
+                buf[pos:pos+n] = blk[boff:boff+n]
+            else:
+                todo.append((i, b, boff, n, pos))
+
+    if len(todo) == 1:
+        fetch(buf, *todo[0])
+    elif todo:
+        futures = [executor.submit(fetch, buf, *t) for t in todo]
+        for f in futures:
+            f.result()
+
+
+def pwrite(h, buf, offset, flags):
+    for (i, b, boff, n, pos) in pieces(len(buf), offset):
+        data = buf[pos:pos+n]
+        while True:
+            with lock:
+                blk = dirty.get((i, b))
+                if blk is None:
+                    src = lookup(i, b)
+                    if src is not None:
+                        blk = bytearray(src)
+                    elif n == block_len(i, b):
+                        blk = bytearray(n)
+                    if blk is not None:
+                        dirty[(i, b)] = blk
+                if blk is not None:
+                    blk[boff:boff+n] = data
+                    break
+                gen = commit_gen
+
+            # Partial write to a block we don't have: read-modify-write.
+            src = get_range(i, b * chunk_size, block_len(i, b))
+            with lock:
+                if gen == commit_gen and (i, b) not in dirty:
+                    dirty[(i, b)] = bytearray(src)
+
+
+def upload_part(i, b, upload_id):
+    key = key_names[i]
+    if (i, b) in committing:
+        resp = s3.upload_part(Bucket=bucket_name, Key=key,
+                              UploadId=upload_id, PartNumber=b+1,
+                              Body=bytes(committing[(i, b)]))
+        etag = resp['ETag']
+    else:
+        rnge = 'bytes=%d-%d' % (b * chunk_size,
+                                b * chunk_size + block_len(i, b) - 1)
+        resp = s3.upload_part_copy(Bucket=bucket_name, Key=key,
+                                   UploadId=upload_id, PartNumber=b+1,
+                                   CopySource={'Bucket': bucket_name,
+                                               'Key': key},
+                                   CopySourceRange=rnge)
+        etag = resp['CopyPartResult']['ETag']
+    return {'ETag': etag, 'PartNumber': b+1}
+
+
+def commit(i):
+    """
+    S3 objects cannot be modified in place, so rewrite the object
+    using a multipart upload, where each block is one part.  Dirty
+    blocks are uploaded and clean blocks are copied server-side.
+    """
+    key = key_names[i]
+    nblocks = nr_blocks(i)
+    if nblocks == 1:
+        s3.put_object(Bucket=bucket_name, Key=key,
+                      Body=bytes(committing[(i, 0)]))
+        return
+
+    nbdkit.debug("S3: committing %s" % key)
+    resp = s3.create_multipart_upload(Bucket=bucket_name, Key=key)
+    upload_id = resp['UploadId']
+    try:
+        futures = [executor.submit(upload_part, i, b, upload_id)
+                   for b in range(nblocks)]
+        parts = [f.result() for f in futures]
+        s3.complete_multipart_upload(Bucket=bucket_name, Key=key,
+                                     UploadId=upload_id,
+                                     MultipartUpload={'Parts': parts})
+    except Exception:
+        s3.abort_multipart_upload(Bucket=bucket_name, Key=key,
+                                  UploadId=upload_id)
+        raise
+
+
+def flush(h, flags):
+    global dirty, committing, commit_gen
+
+    with flush_lock:
+        with lock:
+            if not dirty:
+                return
+            committing = dirty
+            dirty = {}
+
+        try:
+            for i in sorted(set(i for (i, b) in committing)):
+                commit(i)
+        except Exception:
+            # Put back the blocks so that a later flush can retry.
+            with lock:
+                for k, blk in committing.items():
+                    dirty.setdefault(k, blk)
+                committing = {}
+                commit_gen += 1
+            raise
+
+        with lock:
+            commit_gen += 1
+            for (i, b), blk in committing.items():
+                cache_insert(i, b, bytes(blk), commit_gen)
+            committing = {}
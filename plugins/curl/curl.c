@@ -68,6 +68,7 @@ const char *url = NULL;         /* required */
 
 const char *cainfo = NULL;
 const char *capath = NULL;
+unsigned connections = 4;
 char *cookie = NULL;
 const char *cookiefile = NULL;
 const char *cookiejar = NULL;
@@ -75,6 +76,7 @@ const char *cookie_script = NULL;
 unsigned cookie_script_renew = 0;
 bool followlocation = true;
 struct curl_slist *headers = NULL;
+bool multiplex = false;
 const char *header_script = NULL;
 unsigned header_script_renew = 0;
 char *password = NULL;
@@ -117,6 +119,7 @@ curl_unload (void)
   free (password);
   free (proxy_password);
   scripts_unload ();
+  pool_unload ();
   curl_global_cleanup ();
 }
 
@@ -210,6 +213,15 @@ curl_config (const char *key, const char *value)
     capath =  value;
   }
 
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections == 0) {
+      nbdkit_error ("connections parameter must not be 0");
+      return -1;
+    }
+  }
+
   else if (strcmp (key, "cookie") == 0) {
     free (cookie);
     if (nbdkit_read_password (value, &cookie) == -1)
@@ -273,6 +285,13 @@ curl_config (const char *key, const char *value)
       return -1;
   }
 
+  else if (strcmp (key, "multiplex") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    multiplex = r;
+  }
+
   else if (strcmp (key, "password") == 0) {
     free (password);
     if (nbdkit_read_password (value, &password) == -1)
@@ -395,9 +414,22 @@ curl_config_complete (void)
   return 0;
 }
 
+static int
+curl_get_ready (void)
+{
+  return pool_get_ready ();
+}
+
+static int
+curl_after_fork (void)
+{
+  return pool_after_fork ();
+}
+
 #define curl_config_help \
   "cainfo=<CAINFO>            Path to Certificate Authority file.\n" \
   "capath=<CAPATH>            Path to directory with CA certificates.\n" \
+  "connections=<N>            Number of HTTP connections to use (default 4).\n" \
   "cookie=<COOKIE>            Set HTTP/HTTPS cookies.\n" \
   "cookiefile=                Enable cookie processing.\n" \
   "cookiefile=<FILENAME>      Read cookies from file.\n" \
@@ -408,6 +440,7 @@ curl_config_complete (void)
   "header=<HEADER>            Set HTTP/HTTPS header.\n" \
   "header-script=<SCRIPT>     Script to set HTTP/HTTPS headers.\n" \
   "header-script-renew=<SECS> Time to renew HTTP/HTTPS headers.\n" \
+  "multiplex=true             Multiplex requests over HTTP/2 connections.\n" \
   "password=<PASSWORD>        The password for the user account.\n" \
   "protocols=PROTO,PROTO,..   Limit protocols allowed.\n" \
   "proxy=<PROXY>              Set proxy URL.\n" \
@@ -438,17 +471,17 @@ static size_t header_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t write_cb (char *ptr, size_t size, size_t nmemb, void *opaque);
 static size_t read_cb (void *ptr, size_t size, size_t nmemb, void *opaque);
 
-/* Create the per-connection handle. */
-static void *
-curl_open (int readonly)
+/* The per-connection handle. */
+struct handle {
+  int64_t exportsize;
+};
+
+/* Create a curl easy handle for the pool. */
+struct curl_handle *
+allocate_handle (void)
 {
   struct curl_handle *h;
   CURLcode r;
-#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
-  curl_off_t o;
-#else
-  double d;
-#endif
 
   h = calloc (1, sizeof *h);
   if (h == NULL) {
@@ -583,83 +616,129 @@ curl_open (int readonly)
   if (user_agent)
     curl_easy_setopt (h->c, CURLOPT_USERAGENT, user_agent);
 
-  /* Get the file size and also whether the remote HTTP server
-   * supports byte ranges.
-   *
-   * We must run the scripts if necessary and set headers in the
+  /* Get set up for reading and writing. */
+  curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
+  curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
+  curl_easy_setopt (h->c, CURLOPT_READDATA, h);
+
+  return h;
+
+ err:
+  if (h->c)
+    curl_easy_cleanup (h->c);
+  free (h);
+  return NULL;
+}
+
+void
+free_handle (struct curl_handle *h)
+{
+  curl_easy_cleanup (h->c);
+  if (h->headers_copy)
+    curl_slist_free_all (h->headers_copy);
+  free (h);
+}
+
+/* Get the file size and also whether the remote HTTP server supports
+ * byte ranges.
+ */
+static int
+get_content_length (struct curl_handle *ch, int64_t *size)
+{
+  CURLcode r;
+#ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
+  curl_off_t o;
+#else
+  double d;
+#endif
+
+  /* We must run the scripts if necessary and set headers in the
    * handle.
    */
-  if (do_scripts (h) == -1) goto err;
-  h->accept_range = false;
-  curl_easy_setopt (h->c, CURLOPT_NOBODY, 1L); /* No Body, not nobody! */
-  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, header_cb);
-  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, h);
-  r = curl_easy_perform (h->c);
+  if (do_scripts (ch) == -1)
+    return -1;
+  ch->accept_range = false;
+  curl_easy_setopt (ch->c, CURLOPT_NOBODY, 1L); /* No Body, not nobody! */
+  curl_easy_setopt (ch->c, CURLOPT_HEADERFUNCTION, header_cb);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERDATA, ch);
+  r = run_request (ch);
+  curl_easy_setopt (ch->c, CURLOPT_NOBODY, 0L);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt (ch->c, CURLOPT_HEADERDATA, NULL);
   if (r != CURLE_OK) {
-    display_curl_error (h, r,
+    display_curl_error (ch, r,
                         "problem doing HEAD request to fetch size of URL [%s]",
                         url);
-    goto err;
+    return -1;
   }
 
 #ifdef HAVE_CURLINFO_CONTENT_LENGTH_DOWNLOAD_T
-  r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
+  r = curl_easy_getinfo (ch->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &o);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "could not get length of remote file [%s]", url);
-    goto err;
+    display_curl_error (ch, r, "could not get length of remote file [%s]", url);
+    return -1;
   }
 
   if (o == -1) {
     nbdkit_error ("could not get length of remote file [%s], "
                   "is the URL correct?", url);
-    goto err;
+    return -1;
   }
 
-  h->exportsize = o;
+  *size = o;
 #else
-  r = curl_easy_getinfo (h->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
+  r = curl_easy_getinfo (ch->c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
   if (r != CURLE_OK) {
-    display_curl_error (h, r, "could not get length of remote file [%s]", url);
-    goto err;
+    display_curl_error (ch, r, "could not get length of remote file [%s]", url);
+    return -1;
   }
 
   if (d == -1) {
     nbdkit_error ("could not get length of remote file [%s], "
                   "is the URL correct?", url);
-    goto err;
+    return -1;
   }
 
-  h->exportsize = d;
+  *size = d;
 #endif
-  nbdkit_debug ("content length: %" PRIi64, h->exportsize);
+  nbdkit_debug ("content length: %" PRIi64, *size);
 
   if (ascii_strncasecmp (url, "http://", strlen ("http://")) == 0 ||
       ascii_strncasecmp (url, "https://", strlen ("https://")) == 0) {
-    if (!h->accept_range) {
+    if (!ch->accept_range) {
       nbdkit_error ("server does not support 'range' (byte range) requests");
-      goto err;
+      return -1;
     }
 
     nbdkit_debug ("accept range supported (for HTTP/HTTPS)");
   }
 
-  /* Get set up for reading and writing. */
-  curl_easy_setopt (h->c, CURLOPT_HEADERFUNCTION, NULL);
-  curl_easy_setopt (h->c, CURLOPT_HEADERDATA, NULL);
-  curl_easy_setopt (h->c, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt (h->c, CURLOPT_WRITEDATA, h);
-  if (!readonly) {
-    curl_easy_setopt (h->c, CURLOPT_READFUNCTION, read_cb);
-    curl_easy_setopt (h->c, CURLOPT_READDATA, h);
+  return 0;
+}
+
+/* Create the per-connection handle. */
+static void *
+curl_open (int readonly)
+{
+  struct handle *h;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
   }
 
-  return h;
+  {
+    GET_HANDLE_FOR_CURRENT_SCOPE (ch);
+    if (ch == NULL ||
+        get_content_length (ch, &h->exportsize) == -1) {
+      free (h);
+      return NULL;
+    }
+  }
 
- err:
-  if (h->c)
-    curl_easy_cleanup (h->c);
-  free (h);
-  return NULL;
+  return h;
 }
 
 /* When using CURLOPT_VERBOSE, this callback is used to redirect
@@ -744,21 +823,18 @@ header_cb (void *ptr, size_t size, size_t nmemb, void *opaque)
 static void
 curl_close (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct handle *h = handle;
 
-  curl_easy_cleanup (h->c);
-  if (h->headers_copy)
-    curl_slist_free_all (h->headers_copy);
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 curl_get_size (void *handle)
 {
-  struct curl_handle *h = handle;
+  struct handle *h = handle;
 
   return h->exportsize;
 }
@@ -775,9 +851,12 @@ curl_get_size (void *handle)
 static int
 curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
   CURLcode r;
   char range[128];
+  GET_HANDLE_FOR_CURRENT_SCOPE (h);
+
+  if (h == NULL)
+    return -1;
 
   /* Run the scripts if necessary and set headers in the handle. */
   if (do_scripts (h) == -1) return -1;
@@ -796,7 +875,7 @@ curl_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (h->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = run_request (h);
   if (r != CURLE_OK) {
     display_curl_error (h, r, "pread: curl_easy_perform");
     return -1;
@@ -839,9 +918,12 @@ write_cb (char *ptr, size_t size, size_t nmemb, void *opaque)
 static int
 curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
-  struct curl_handle *h = handle;
   CURLcode r;
   char range[128];
+  GET_HANDLE_FOR_CURRENT_SCOPE (h);
+
+  if (h == NULL)
+    return -1;
 
   /* Run the scripts if necessary and set headers in the handle. */
   if (do_scripts (h) == -1) return -1;
@@ -860,7 +942,7 @@ curl_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   curl_easy_setopt (h->c, CURLOPT_RANGE, range);
 
   /* The assumption here is that curl will look after timeouts. */
-  r = curl_easy_perform (h->c);
+  r = run_request (h);
   if (r != CURLE_OK) {
     display_curl_error (h, r, "pwrite: curl_easy_perform");
     return -1;
@@ -903,6 +985,8 @@ static struct nbdkit_plugin plugin = {
   .config_complete   = curl_config_complete,
   .config_help       = curl_config_help,
   .magic_config_key  = "url",
+  .get_ready         = curl_get_ready,
+  .after_fork        = curl_after_fork,
   .open              = curl_open,
   .close             = curl_close,
   .get_size          = curl_get_size,
@@ -33,12 +33,15 @@
 #ifndef NBDKIT_CURLDEFS_H
 #define NBDKIT_CURLDEFS_H
 
+#include <pthread.h>
+
 #include "windows-compat.h"
 
 extern const char *url;
 
 extern const char *cainfo;
 extern const char *capath;
+extern unsigned connections;
 extern char *cookie;
 extern const char *cookiefile;
 extern const char *cookiejar;
@@ -46,6 +49,7 @@ extern const char *cookie_script;
 extern unsigned cookie_script_renew;
 extern bool followlocation;
 extern struct curl_slist *headers;
+extern bool multiplex;
 extern const char *header_script;
 extern unsigned header_script_renew;
 extern char *password;
@@ -61,19 +65,51 @@ extern const char *unix_socket_path;
 extern const char *user;
 extern const char *user_agent;
 
-/* The per-connection handle. */
+/* A curl easy handle, taken from the pool (see pool.c) for the
+ * duration of each request.
+ */
 struct curl_handle {
   CURL *c;
   bool accept_range;
-  int64_t exportsize;
   char errbuf[CURL_ERROR_SIZE];
   char *write_buf;
   uint32_t write_count;
   const char *read_buf;
   uint32_t read_count;
   struct curl_slist *headers_copy;
+
+  /* Used by pool.c. */
+  bool in_use;
+  bool done;                    /* Request finished (multiplex=true) */
+  CURLcode result;
+  pthread_cond_t cond;
 };
 
+/* curl.c */
+extern struct curl_handle *allocate_handle (void);
+extern void free_handle (struct curl_handle *h);
+
+/* pool.c */
+extern int pool_get_ready (void);
+extern int pool_after_fork (void);
+extern void pool_unload (void);
+extern struct curl_handle *get_handle (void);
+extern void put_handle (struct curl_handle *h);
+extern CURLcode run_request (struct curl_handle *h);
+
+/* Get a handle from the pool, returning it automatically when the
+ * variable goes out of scope.
+ */
+static inline void
+cleanup_put_handle (struct curl_handle **hp)
+{
+  if (*hp)
+    put_handle (*hp);
+}
+#define GET_HANDLE_FOR_CURRENT_SCOPE(h)                                 \
+  __attribute__ ((cleanup (cleanup_put_handle)))                        \
+  struct curl_handle *h = get_handle ()
+
 /* scripts.c */
 extern int do_scripts (struct curl_handle *h);
 extern void scripts_unload (void);
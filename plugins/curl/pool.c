@@ -0,0 +1,351 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The curl handle pool.
+ *
+ * Curl easy handles are not tied to NBD connections.  Instead each
+ * request takes a handle from this pool, waiting if they are all in
+ * use, and returns it when done.  Up to ‘connections’ handles are
+ * created on demand.  All handles share DNS, TLS session and (unless
+ * multiplexing) connection caches through a CURLSH share handle.
+ *
+ * With multiplex=true requests are not run in the calling thread.
+ * Instead they are added to a single curl multi handle driven by a
+ * background thread, which lets curl multiplex several requests over
+ * one HTTP/2 connection.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "vector.h"
+
+#include "curldefs.h"
+
+DEFINE_VECTOR_TYPE(curl_handle_list, struct curl_handle *);
+
+/* Protects the fields below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when a handle is returned to the pool. */
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* All of the handles. */
+static curl_handle_list curl_handles = empty_vector;
+
+/* Share handle, and one lock for each type of shared data. */
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7, 68, 0)
+#define HAVE_CURL_MULTI_WAKEUP
+#endif
+#endif
+
+#ifdef HAVE_CURL_MULTI_WAKEUP
+/* Multi handle and background thread used when multiplexing.  The
+ * queue of handles to be added to the multi handle is protected by
+ * lock.
+ */
+static CURLM *multi;
+static pthread_t multi_thread;
+static bool multi_thread_running;
+static bool multi_stop;
+static curl_handle_list multi_queue = empty_vector;
+
+static void *multi_worker (void *);
+#endif
+
+static void
+share_lock (CURL *c, curl_lock_data data, curl_lock_access access,
+            void *opaque)
+{
+  pthread_mutex_lock (&share_locks[data]);
+}
+
+static void
+share_unlock (CURL *c, curl_lock_data data, void *opaque)
+{
+  pthread_mutex_unlock (&share_locks[data]);
+}
+
+int
+pool_get_ready (void)
+{
+  size_t i;
+
+#ifndef HAVE_CURL_MULTI_WAKEUP
+  if (multiplex) {
+    nbdkit_error ("multiplex=true requires curl >= 7.68");
+    return -1;
+  }
+#endif
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    pthread_mutex_init (&share_locks[i], NULL);
+
+  share = curl_share_init ();
+  if (share == NULL) {
+    nbdkit_error ("curl_share_init: failed");
+    return -1;
+  }
+  curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7, 57, 0)
+  /* Handles added to a multi handle already share its connections. */
+  if (!multiplex)
+    curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+#endif
+
+  return 0;
+}
+
+/* The multiplexing thread must be started after we fork. */
+int
+pool_after_fork (void)
+{
+#ifdef HAVE_CURL_MULTI_WAKEUP
+  if (multiplex) {
+    multi = curl_multi_init ();
+    if (multi == NULL) {
+      nbdkit_error ("curl_multi_init: failed");
+      return -1;
+    }
+    curl_multi_setopt (multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    if ((errno = pthread_create (&multi_thread, NULL, multi_worker, NULL))) {
+      nbdkit_error ("pthread_create: %m");
+      return -1;
+    }
+    multi_thread_running = true;
+  }
+#endif
+  return 0;
+}
+
+void
+pool_unload (void)
+{
+  size_t i;
+
+#ifdef HAVE_CURL_MULTI_WAKEUP
+  if (multi_thread_running) {
+    __atomic_store_n (&multi_stop, true, __ATOMIC_SEQ_CST);
+    curl_multi_wakeup (multi);
+    pthread_join (multi_thread, NULL);
+    multi_thread_running = false;
+  }
+  free (multi_queue.ptr);
+#endif
+
+  for (i = 0; i < curl_handles.len; ++i) {
+    pthread_cond_destroy (&curl_handles.ptr[i]->cond);
+    free_handle (curl_handles.ptr[i]);
+  }
+  free (curl_handles.ptr);
+  curl_handles = (curl_handle_list) empty_vector;
+
+#ifdef HAVE_CURL_MULTI_WAKEUP
+  if (multi)
+    curl_multi_cleanup (multi);
+  multi = NULL;
+#endif
+
+  if (share) {
+    curl_share_cleanup (share);
+    share = NULL;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+      pthread_mutex_destroy (&share_locks[i]);
+  }
+}
+
+/* Get a free handle from the pool, creating one if there are fewer
+ * than ‘connections’ handles, or else waiting for one to be returned.
+ * Returns NULL on error.
+ */
+struct curl_handle *
+get_handle (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct curl_handle *h;
+  size_t i;
+
+  for (;;) {
+    for (i = 0; i < curl_handles.len; ++i) {
+      h = curl_handles.ptr[i];
+      if (!h->in_use) {
+        h->in_use = true;
+        return h;
+      }
+    }
+
+    if (curl_handles.len < connections) {
+      h = allocate_handle ();
+      if (h == NULL)
+        return NULL;
+      if (curl_handle_list_append (&curl_handles, h) == -1) {
+        nbdkit_error ("realloc: %m");
+        free_handle (h);
+        return NULL;
+      }
+      pthread_cond_init (&h->cond, NULL);
+      curl_easy_setopt (h->c, CURLOPT_SHARE, share);
+      curl_easy_setopt (h->c, CURLOPT_PRIVATE, h);
+      if (multiplex) {
+        curl_easy_setopt (h->c, CURLOPT_HTTP_VERSION,
+                          (long) CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt (h->c, CURLOPT_PIPEWAIT, 1L);
+      }
+      nbdkit_debug ("curl: allocated handle %zu", curl_handles.len);
+      h->in_use = true;
+      return h;
+    }
+
+    pthread_cond_wait (&cond, &lock);
+  }
+}
+
+/* Return a handle to the pool. */
+void
+put_handle (struct curl_handle *h)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  assert (h->in_use);
+  h->in_use = false;
+  pthread_cond_signal (&cond);
+}
+
+/* Perform the request which has been set up in the handle, like
+ * curl_easy_perform.
+ */
+CURLcode
+run_request (struct curl_handle *h)
+{
+#ifdef HAVE_CURL_MULTI_WAKEUP
+  if (multiplex) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      h->done = false;
+      if (curl_handle_list_append (&multi_queue, h) == -1)
+        return CURLE_OUT_OF_MEMORY;
+    }
+    curl_multi_wakeup (multi);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    while (!h->done)
+      pthread_cond_wait (&h->cond, &lock);
+    return h->result;
+  }
+#endif
+
+  return curl_easy_perform (h->c);
+}
+
+#ifdef HAVE_CURL_MULTI_WAKEUP
+/* Background thread driving the multi handle. */
+static void *
+multi_worker (void *arg)
+{
+  while (!__atomic_load_n (&multi_stop, __ATOMIC_SEQ_CST)) {
+    CURLMsg *msg;
+    CURLMcode mc;
+    int running, n;
+    size_t i;
+
+    /* Add any newly queued requests. */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      for (i = 0; i < multi_queue.len; ++i) {
+        struct curl_handle *h = multi_queue.ptr[i];
+
+        mc = curl_multi_add_handle (multi, h->c);
+        if (mc != CURLM_OK) {
+          nbdkit_error ("curl_multi_add_handle: %s",
+                        curl_multi_strerror (mc));
+          h->result = CURLE_FAILED_INIT;
+          h->done = true;
+          pthread_cond_signal (&h->cond);
+        }
+      }
+      multi_queue.len = 0;
+    }
+
+    mc = curl_multi_perform (multi, &running);
+    if (mc != CURLM_OK)
+      nbdkit_error ("curl_multi_perform: %s", curl_multi_strerror (mc));
+
+    /* Complete any finished requests. */
+    while ((msg = curl_multi_info_read (multi, &n)) != NULL) {
+      struct curl_handle *h;
+      CURLcode result;
+      CURL *c;
+
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      /* msg is freed by curl_multi_remove_handle. */
+      c = msg->easy_handle;
+      result = msg->data.result;
+      curl_easy_getinfo (c, CURLINFO_PRIVATE, (char **) &h);
+      curl_multi_remove_handle (multi, c);
+
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      h->result = result;
+      h->done = true;
+      pthread_cond_signal (&h->cond);
+    }
+
+    mc = curl_multi_poll (multi, NULL, 0, 1000, NULL);
+    if (mc != CURLM_OK)
+      nbdkit_error ("curl_multi_poll: %s", curl_multi_strerror (mc));
+  }
+
+  return NULL;
+}
+#endif /* HAVE_CURL_MULTI_WAKEUP */
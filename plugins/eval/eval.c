@@ -68,6 +68,8 @@ static const char *known_methods[] = {
   "close",
   "config",
   "config_complete",
+  "coprocess",
+  "coprocess_mode",
   "default_export",
   "dump_plugin",
   "export_description",
@@ -231,6 +233,8 @@ eval_unload (void)
   const char *method = "unload";
   const char *script = get_script (method);
 
+  sh_unload_coprocess ();
+
   /* Run the unload method.  Ignore all errors. */
   if (script) {
     const char *args[] = { script, method, NULL };
@@ -46,6 +46,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <dirent.h>
 
@@ -60,15 +61,23 @@
 #endif
 
 #if defined (__linux__)
-#include <linux/fs.h>       /* For BLKZEROOUT */
+#include <linux/fs.h>       /* For BLKZEROOUT, FS_IOC_FIEMAP */
+#include <linux/fiemap.h>
 #endif
 
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "fdcache.h"
 #include "isaligned.h"
 #include "fdatasync.h"
+#include "minmax.h"
+#include "rounding.h"
+#include "vector.h"
+
+#include "mmap.h"
+#include "uring.h"
 
 static char *filename = NULL;
 static char *directory = NULL;
@@ -83,7 +92,48 @@ static int fadvise_mode =
   ;
 
 /* cache mode */
-static enum { cache_default, cache_none } cache_mode = cache_default;
+static enum { cache_default, cache_none, cache_direct } cache_mode =
+  cache_default;
+
+#ifdef O_DIRECT
+/* With cache=direct, unaligned writes read, modify and write whole
+ * blocks.  This lock prevents two such writes which touch the same
+ * block from losing each others' changes.
+ */
+static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Maximum size of the bounce buffer used for unaligned requests. */
+#define BOUNCE_SIZE (1024 * 1024)
+#endif
+
+/* I/O engine. */
+static enum { engine_sync, engine_io_uring, engine_mmap } engine =
+  engine_sync;
+static bool sqpoll = false;
+
+/* Use FIEMAP for extents if the filesystem supports it. */
+static bool fiemap = true;
+
+/* Cache the extent map of each handle.  Any write, trim or zero on
+ * any handle increments extents_generation, invalidating all cached
+ * maps.
+ */
+static bool extents_cache = false;
+static uint64_t extents_generation;
+
+/* Declare this variable at the top of callbacks which change the
+ * allocation of the file.  When the callback returns (after the
+ * change has been made) all cached extent maps are invalidated.
+ */
+static void
+invalidate_extents (int *unused)
+{
+  if (extents_cache)
+    __atomic_add_fetch (&extents_generation, 1, __ATOMIC_RELEASE);
+}
+#define INVALIDATE_EXTENTS_ON_RETURN                            \
+  __attribute__ ((cleanup (invalidate_extents)))                \
+  CLANG_UNUSED_VARIABLE_WORKAROUND int invalidate_extents_var = 0
 
 /* Any callbacks using lseek must be protected by this lock. */
 static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -97,11 +147,29 @@ is_enotsup (int err)
   return err == ENOTSUP || err == EOPNOTSUPP;
 }
 
+#if HAVE_DECL_IORING_OP_FALLOCATE
+/* Size of the io_uring submission queue.  The completion queue is
+ * twice this size.  Each worker thread has at most nine operations in
+ * flight (a request split into eight parts, or one write and its
+ * linked flush), and the kernel does not drop completions if the
+ * completion queue overflows.
+ */
+#define URING_ENTRIES 128
+#endif
+
+/* In directory mode, files stay open after the connection closes so
+ * that clients which repeatedly connect to the same export do not
+ * reopen it every time.
+ */
+#define DIR_FD_CACHE_SIZE 64
+static struct fdcache *dir_fds;
+
 static void
 file_unload (void)
 {
   free (filename);
   free (directory);
+  fdcache_free (dir_fds);
 }
 
 /* Called for each key=value passed on the command line.  This plugin
@@ -164,11 +232,55 @@ file_config (const char *key, const char *value)
       cache_mode = cache_default;
     else if (strcmp (value, "none") == 0)
       cache_mode = cache_none;
+    else if (strcmp (value, "direct") == 0) {
+#ifdef O_DIRECT
+      cache_mode = cache_direct;
+#else
+      nbdkit_error ("cache=direct is not supported on this platform");
+      return -1;
+#endif
+    }
     else {
       nbdkit_error ("unknown cache mode: %s", value);
       return -1;
     }
   }
+  else if (strcmp (key, "engine") == 0) {
+    if (strcmp (value, "sync") == 0)
+      engine = engine_sync;
+    else if (strcmp (value, "io_uring") == 0) {
+#if HAVE_DECL_IORING_OP_FALLOCATE
+      engine = engine_io_uring;
+#else
+      nbdkit_error ("engine=io_uring is not supported on this platform");
+      return -1;
+#endif
+    }
+    else if (strcmp (value, "mmap") == 0)
+      engine = engine_mmap;
+    else {
+      nbdkit_error ("unknown engine: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "fiemap") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    fiemap = r;
+  }
+  else if (strcmp (key, "extents-cache") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    extents_cache = r;
+  }
+  else if (strcmp (key, "sqpoll") == 0) {
+    int r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    sqpoll = r;
+  }
   else if (strcmp (key, "rdelay") == 0 ||
            strcmp (key, "wdelay") == 0) {
     nbdkit_error ("add --filter=delay on the command line");
@@ -219,6 +331,23 @@ file_config_complete (void)
     nbdkit_error ("expecting a directory: %s", directory);
     return -1;
   }
+  else {
+    /* Check on every open that the export was not replaced. */
+    dir_fds = fdcache_new (DIR_FD_CACHE_SIZE, 0);
+    if (dir_fds == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+  }
+
+  if (sqpoll && engine != engine_io_uring) {
+    nbdkit_error ("sqpoll=true requires engine=io_uring");
+    return -1;
+  }
+  if (engine == engine_mmap && cache_mode != cache_default) {
+    nbdkit_error ("engine=mmap cannot be used with cache=none or cache=direct");
+    return -1;
+  }
 
   return 0;
 }
@@ -226,8 +355,12 @@ file_config_complete (void)
 #define file_config_help \
   "[file=]<FILENAME>     The filename to serve.\n" \
   "dir=<DIRNAME>         A directory containing files to serve.\n" \
-  "cache=<MODE>          Set use of caching (default, none).\n" \
+  "cache=<MODE>          Set use of caching (default, none, direct).\n" \
+  "engine=<ENGINE>       I/O engine (sync, io_uring, mmap).\n" \
+  "sqpoll=true           Use a kernel polling thread with io_uring.\n" \
   "fadise=<LEVEL>        Set fadvise hint (normal, random, sequential).\n" \
+  "fiemap=false          Use lseek instead of FIEMAP for extents.\n" \
+  "extents-cache=true    Cache the extent map.\n" \
 
 /* Print some extra information about how the plugin was compiled. */
 static void
@@ -245,6 +378,91 @@ file_dump_plugin (void)
 #ifdef FALLOC_FL_ZERO_RANGE
   printf ("file_falloc_fl_zero_range=yes\n");
 #endif
+#ifdef FS_IOC_FIEMAP
+  printf ("file_fiemap=yes\n");
+#endif
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  printf ("file_io_uring=yes\n");
+#endif
+}
+
+/* Set up the selected engine after forking into the background.
+ * For engine=io_uring this ensures the ring (and any SQPOLL kernel
+ * thread) belongs to the server process.  For engine=mmap this
+ * installs the SIGBUS handler which turns faults on a truncated file
+ * into EIO errors.
+ */
+static int
+file_after_fork (void)
+{
+  if (engine == engine_mmap && mapping_init_sigbus () == -1) {
+    nbdkit_error ("sigaction: SIGBUS: %m");
+    return -1;
+  }
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  if (engine == engine_io_uring)
+    return uring_init (URING_ENTRIES, sqpoll);
+#endif
+  return 0;
+}
+
+static void
+file_cleanup (void)
+{
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  uring_free ();
+#endif
+}
+
+/* Wrappers around the system calls which use the selected engine. */
+static ssize_t
+do_pread (int fd, void *buf, size_t count, off_t offset)
+{
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  if (engine == engine_io_uring)
+    return uring_pread (fd, buf, count, offset);
+#endif
+  return pread (fd, buf, count, offset);
+}
+
+/* If datasync is true the engine may also flush the data to disk, in
+ * which case it sets *synced.
+ */
+static ssize_t
+do_pwrite (int fd, const void *buf, size_t count, off_t offset,
+           bool datasync, bool *synced)
+{
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  if (engine == engine_io_uring)
+    return uring_pwrite (fd, buf, count, offset, datasync, synced);
+#endif
+  *synced = false;
+  return pwrite (fd, buf, count, offset);
+}
+
+static int
+do_fdatasync (int fd)
+{
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  if (engine == engine_io_uring)
+    return uring_fdatasync (fd);
+#endif
+  return fdatasync (fd);
+}
+
+/* With engine=mmap, the madvise(2) advice corresponding to fadvise=. */
+static int
+mmap_advice (void)
+{
+#if defined (POSIX_FADV_RANDOM) && defined (MADV_RANDOM)
+  if (fadvise_mode == POSIX_FADV_RANDOM)
+    return MADV_RANDOM;
+#endif
+#if defined (POSIX_FADV_SEQUENTIAL) && defined (MADV_SEQUENTIAL)
+  if (fadvise_mode == POSIX_FADV_SEQUENTIAL)
+    return MADV_SEQUENTIAL;
+#endif
+  return -1;
 }
 
 static int
@@ -299,18 +517,110 @@ file_list_exports (int readonly, int default_only,
   return 0;
 }
 
+/* A cached extent, see extents-cache. */
+struct cached_extent {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t type;
+};
+DEFINE_VECTOR_TYPE(extent_map, struct cached_extent);
+
 /* The per-connection handle. */
 struct handle {
   int fd;
   bool is_block_device;
   int sector_size;
+  uint32_t dio_align;           /* cache=direct: offset and size alignment */
+  uint32_t dio_mem_align;       /* cache=direct: buffer alignment */
   bool can_write;
   bool can_punch_hole;
   bool can_zero_range;
   bool can_fallocate;
   bool can_zeroout;
+  bool can_fiemap;
+  struct mapping mapping;       /* engine=mmap */
+  struct fdcache_entry *fd_entry; /* dir=, NULL otherwise */
+
+  /* extents-cache=true.  The map is valid if map_generation equals
+   * extents_generation.
+   */
+  pthread_mutex_t map_lock;
+  extent_map map;
+  bool map_valid;
+  uint64_t map_generation;
 };
 
+/* For cache=direct, find the alignment required by O_DIRECT.  Linux
+ * >= 6.1 can tell us for both files and block devices.  Otherwise use
+ * the logical sector size, which is always safe for block devices and
+ * for files on local filesystems.
+ */
+static int
+get_direct_alignment (struct handle *h, const char *file,
+                      const struct stat *statbuf)
+{
+  h->dio_align = h->dio_mem_align = h->sector_size;
+
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+
+  if (statx (h->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+      (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0) {
+    h->dio_align = stx.stx_dio_offset_align;
+    h->dio_mem_align = MAX (stx.stx_dio_mem_align, 1);
+  }
+#endif
+
+  nbdkit_debug ("cache=direct: %s: alignment %" PRIu32
+                ", memory alignment %" PRIu32,
+                file, h->dio_align, h->dio_mem_align);
+
+  /* We cannot write the last block of a file whose size is not
+   * aligned without extending the file.
+   */
+  if (!h->is_block_device &&
+      !IS_ALIGNED (statbuf->st_size, h->dio_align)) {
+    nbdkit_error ("cache=direct: %s: file size must be a multiple of "
+                  "%" PRIu32 " bytes", file, h->dio_align);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int64_t file_get_size (void *handle);
+
+/* Open the file, or get it from the cache in directory mode. */
+static int
+open_fd (struct handle *h, const char *file, int flags)
+{
+  CLEANUP_FREE char *path = NULL;
+
+  if (!directory) {
+    h->fd_entry = NULL;
+    h->fd = open (file, flags);
+    return h->fd;
+  }
+
+  h->fd_entry = NULL;
+  h->fd = -1;
+  if (asprintf (&path, "%s/%s", directory, file) == -1)
+    return -1;
+  h->fd_entry = fdcache_get (dir_fds, path, flags);
+  if (h->fd_entry != NULL)
+    h->fd = fdcache_fd (h->fd_entry);
+  return h->fd;
+}
+
+static void
+close_fd (struct handle *h)
+{
+  if (h->fd_entry)
+    fdcache_put (dir_fds, h->fd_entry);
+  else
+    close (h->fd);
+}
+
 /* Create the per-connection handle. */
 static void *
 file_open (int readonly)
@@ -319,7 +629,6 @@ file_open (int readonly)
   struct stat statbuf;
   int flags;
   const char *file;
-  int dfd = -1;
 
   if (directory) {
     file = nbdkit_export_name ();
@@ -328,11 +637,6 @@ file_open (int readonly)
       errno = EINVAL;
       return NULL;
     }
-    dfd = open (directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-    if (dfd == -1) {
-      nbdkit_error ("open %s: %m", directory);
-      return NULL;
-    }
   }
   else
     file = filename;
@@ -344,6 +648,10 @@ file_open (int readonly)
   }
 
   flags = O_CLOEXEC|O_NOCTTY;
+#ifdef O_DIRECT
+  if (cache_mode == cache_direct)
+    flags |= O_DIRECT;
+#endif
   if (readonly) {
     flags |= O_RDONLY;
     h->can_write = false;
@@ -353,26 +661,26 @@ file_open (int readonly)
     h->can_write = true;
   }
 
-  h->fd = openat (dfd, file, flags);
-  if (h->fd == -1 && !readonly) {
+  if (open_fd (h, file, flags) == -1 && !readonly) {
     nbdkit_debug ("open O_RDWR failed, falling back to read-only: %s: %m",
                   file);
     flags = (flags & ~O_ACCMODE) | O_RDONLY;
-    h->fd = openat (dfd, file, flags);
+    open_fd (h, file, flags);
     h->can_write = false;
   }
   if (h->fd == -1) {
-    nbdkit_error ("open: %s: %m", file);
-    if (dfd != -1)
-      close (dfd);
+    if (errno == EINVAL && cache_mode == cache_direct)
+      nbdkit_error ("open: %s: the filesystem may not support "
+                    "O_DIRECT (cache=direct): %m", file);
+    else
+      nbdkit_error ("open: %s: %m", file);
     free (h);
     return NULL;
   }
-  if (dfd != -1)
-    close (dfd);
 
   if (fstat (h->fd, &statbuf) == -1) {
     nbdkit_error ("fstat: %s: %m", file);
+    close_fd (h);
     free (h);
     return NULL;
   }
@@ -394,7 +702,7 @@ file_open (int readonly)
     h->is_block_device = false;
   else {
     nbdkit_error ("file is not regular or block device: %s", file);
-    close (h->fd);
+    close_fd (h);
     free (h);
     return NULL;
   }
@@ -407,6 +715,13 @@ file_open (int readonly)
   }
 #endif
 
+  if (cache_mode == cache_direct &&
+      get_direct_alignment (h, file, &statbuf) == -1) {
+    close_fd (h);
+    free (h);
+    return NULL;
+  }
+
 #ifdef FALLOC_FL_PUNCH_HOLE
   h->can_punch_hole = true;
 #else
@@ -422,6 +737,37 @@ file_open (int readonly)
   h->can_fallocate = true;
   h->can_zeroout = h->is_block_device;
 
+  h->can_fiemap = false;
+#ifdef FS_IOC_FIEMAP
+  if (fiemap) {
+    /* With fm_extent_count == 0 this only counts the extents. */
+    struct fiemap fm = { .fm_length = FIEMAP_MAX_OFFSET };
+
+    if (ioctl (h->fd, FS_IOC_FIEMAP, &fm) == 0)
+      h->can_fiemap = true;
+    else
+      nbdkit_debug ("FIEMAP not supported, using lseek: %s: %m", file);
+  }
+#endif
+
+  if (engine == engine_mmap) {
+    int64_t size = file_get_size (h);
+
+    if (size == -1 ||
+        mapping_init (&h->mapping, h->fd, size, h->can_write,
+                      mmap_advice ()) == -1) {
+      if (size != -1)
+        nbdkit_error ("malloc: %m");
+      close_fd (h);
+      free (h);
+      return NULL;
+    }
+  }
+
+  pthread_mutex_init (&h->map_lock, NULL);
+  h->map = (extent_map) empty_vector;
+  h->map_valid = false;
+
   return h;
 }
 
@@ -431,7 +777,11 @@ file_close (void *handle)
 {
   struct handle *h = handle;
 
-  close (h->fd);
+  if (engine == engine_mmap)
+    mapping_free (&h->mapping);
+  close_fd (h);
+  pthread_mutex_destroy (&h->map_lock);
+  extent_map_reset (&h->map);
   free (h);
 }
 
@@ -533,7 +883,13 @@ file_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
 
-  if (fdatasync (h->fd) == -1) {
+  if (engine == engine_mmap &&
+      mapping_sync (&h->mapping, h->mapping.size, 0) == -1) {
+    nbdkit_error ("msync: %m");
+    return -1;
+  }
+
+  if (do_fdatasync (h->fd) == -1) {
     nbdkit_error ("fdatasync: %m");
     return -1;
   }
@@ -541,6 +897,187 @@ file_flush (void *handle, uint32_t flags)
   return 0;
 }
 
+#ifdef O_DIRECT
+/* cache=direct.
+ *
+ * The file is opened with O_DIRECT, which requires the file offset,
+ * size and buffer address of each I/O to be aligned.  Aligned parts
+ * of the request whose buffer is also aligned in memory (the usual
+ * case, since the server's request buffers are page aligned) are
+ * read or written directly.  Unaligned heads and tails, and parts
+ * whose buffer is not aligned in memory, go through an aligned bounce
+ * buffer.
+ */
+static void *
+alloc_bounce (struct handle *h)
+{
+  void *bounce;
+  int err;
+
+  err = posix_memalign (&bounce, MAX (h->dio_mem_align, h->dio_align),
+                        BOUNCE_SIZE);
+  if (err) {
+    errno = err;
+    nbdkit_error ("posix_memalign: %m");
+    return NULL;
+  }
+  return bounce;
+}
+
+static int
+direct_read_full (struct handle *h, void *buf, size_t count, uint64_t offset)
+{
+  while (count > 0) {
+    ssize_t r = do_pread (h->fd, buf, count, offset);
+    if (r == -1) {
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+    if (r == 0) {
+      nbdkit_error ("pread: unexpected end of file");
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+direct_write_full (struct handle *h, const void *buf, size_t count,
+                   uint64_t offset)
+{
+  bool synced;
+
+  while (count > 0) {
+    ssize_t r = do_pwrite (h->fd, buf, count, offset, false, &synced);
+    if (r == -1) {
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+/* Work out how much of the request at offset/buf can be done in one
+ * step.  Returns the length of the aligned range starting at
+ * (offset - *skip) that must go through the bounce buffer, or 0 if
+ * the first *n bytes can be done directly.
+ */
+static uint32_t
+direct_step (struct handle *h, const void *buf, uint32_t count,
+             uint64_t offset, uint32_t *skip, uint32_t *n)
+{
+  const uint32_t align = h->dio_align;
+  uint64_t len;
+
+  *skip = offset & (align - 1);
+  if (*skip == 0 && count >= align &&
+      IS_ALIGNED ((uintptr_t) buf, h->dio_mem_align)) {
+    *n = ROUND_DOWN (count, align);
+    return 0;
+  }
+
+  /* If the rest of the buffer is aligned in memory after an
+   * unaligned head, only bounce the head.
+   */
+  if (*skip != 0 &&
+      IS_ALIGNED ((uintptr_t) buf + align - *skip, h->dio_mem_align))
+    len = align;
+  else
+    len = MIN (ROUND_UP ((uint64_t) *skip + count, align), BOUNCE_SIZE);
+
+  *n = MIN (count, len - *skip);
+  return ROUND_UP (*skip + *n, align);
+}
+
+static int
+direct_pread (struct handle *h, void *buf, uint32_t count, uint64_t offset)
+{
+  CLEANUP_FREE void *bounce = NULL;
+  uint32_t skip, n, len;
+
+  while (count > 0) {
+    len = direct_step (h, buf, count, offset, &skip, &n);
+    if (len == 0) {
+      if (direct_read_full (h, buf, n, offset) == -1)
+        return -1;
+    }
+    else {
+      if (!bounce && (bounce = alloc_bounce (h)) == NULL)
+        return -1;
+      if (direct_read_full (h, bounce, len, offset - skip) == -1)
+        return -1;
+      memcpy (buf, bounce + skip, n);
+    }
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+/* Write n bytes at offset through the bounce buffer, reading the
+ * partially overwritten first and last blocks first.
+ */
+static int
+direct_pwrite_bounce (struct handle *h, void *bounce, const void *buf,
+                      uint32_t n, uint64_t offset, uint32_t skip,
+                      uint32_t len)
+{
+  const uint32_t align = h->dio_align;
+  const uint64_t start = offset - skip;
+
+  if (skip == 0 && len == n) {
+    memcpy (bounce, buf, n);
+    return direct_write_full (h, bounce, len, start);
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+  if (skip != 0 &&
+      direct_read_full (h, bounce, align, start) == -1)
+    return -1;
+  if (!IS_ALIGNED (skip + n, align) && (skip == 0 || len > align) &&
+      direct_read_full (h, bounce + len - align, align,
+                        start + len - align) == -1)
+    return -1;
+  memcpy (bounce + skip, buf, n);
+  return direct_write_full (h, bounce, len, start);
+}
+
+static int
+direct_pwrite (struct handle *h, const void *buf, uint32_t count,
+               uint64_t offset)
+{
+  CLEANUP_FREE void *bounce = NULL;
+  uint32_t skip, n, len;
+
+  while (count > 0) {
+    len = direct_step (h, buf, count, offset, &skip, &n);
+    if (len == 0) {
+      if (direct_write_full (h, buf, n, offset) == -1)
+        return -1;
+    }
+    else {
+      if (!bounce && (bounce = alloc_bounce (h)) == NULL)
+        return -1;
+      if (direct_pwrite_bounce (h, bounce, buf, n, offset, skip, len) == -1)
+        return -1;
+    }
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+#endif /* O_DIRECT */
+
 /* Read data from the file. */
 static int
 file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
@@ -552,8 +1089,21 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   uint64_t orig_offset = offset;
 #endif
 
+#ifdef O_DIRECT
+  if (cache_mode == cache_direct)
+    return direct_pread (h, buf, count, offset);
+#endif
+
+  if (engine == engine_mmap) {
+    if (mapping_read (&h->mapping, buf, count, offset) == -1) {
+      nbdkit_error ("pread: mmap: %m");
+      return -1;
+    }
+    return 0;
+  }
+
   while (count > 0) {
-    ssize_t r = pread (h->fd, buf, count, offset);
+    ssize_t r = do_pread (h->fd, buf, count, offset);
     if (r == -1) {
       nbdkit_error ("pread: %m");
       return -1;
@@ -582,6 +1132,8 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
              uint32_t flags)
 {
   struct handle *h = handle;
+  bool synced = false;
+  INVALIDATE_EXTENTS_ON_RETURN;
 
 #if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
   uint32_t orig_count = count;
@@ -594,8 +1146,36 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   if (cache_mode == cache_none) flags |= NBDKIT_FLAG_FUA;
 #endif
 
+#ifdef O_DIRECT
+  /* O_DIRECT bypasses the page cache, but the data may still be in a
+   * volatile cache in the device, so FUA still requires a flush.
+   */
+  if (cache_mode == cache_direct) {
+    if (direct_pwrite (h, buf, count, offset) == -1)
+      return -1;
+    if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+      return -1;
+    return 0;
+  }
+#endif
+
+  /* With engine=mmap, FUA only needs to sync the pages just written. */
+  if (engine == engine_mmap) {
+    if (mapping_write (&h->mapping, buf, count, offset) == -1) {
+      nbdkit_error ("pwrite: mmap: %m");
+      return -1;
+    }
+    if ((flags & NBDKIT_FLAG_FUA) &&
+        mapping_sync (&h->mapping, count, offset) == -1) {
+      nbdkit_error ("msync: %m");
+      return -1;
+    }
+    return 0;
+  }
+
   while (count > 0) {
-    ssize_t r = pwrite (h->fd, buf, count, offset);
+    ssize_t r = do_pwrite (h->fd, buf, count, offset,
+                           flags & NBDKIT_FLAG_FUA, &synced);
     if (r == -1) {
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -605,7 +1185,7 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
     offset += r;
   }
 
-  if ((flags & NBDKIT_FLAG_FUA) && file_flush (handle, 0) == -1)
+  if ((flags & NBDKIT_FLAG_FUA) && !synced && file_flush (handle, 0) == -1)
     return -1;
 
 #if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
@@ -621,7 +1201,14 @@ file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 static int
 do_fallocate (int fd, int mode, off_t offset, off_t len)
 {
-  int r = fallocate (fd, mode, offset, len);
+  int r;
+
+#if HAVE_DECL_IORING_OP_FALLOCATE
+  if (engine == engine_io_uring)
+    r = uring_fallocate (fd, mode, offset, len);
+  else
+#endif
+    r = fallocate (fd, mode, offset, len);
   if (r == -1 && errno == ENODEV) {
     /* kernel 3.10 fails with ENODEV for block device. Kernel >= 4.9 fails
        with EOPNOTSUPP in this case. Normalize errno to simplify callers. */
@@ -637,6 +1224,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
   int r;
+  INVALIDATE_EXTENTS_ON_RETURN;
 
 #ifdef FALLOC_FL_PUNCH_HOLE
   if (h->can_punch_hole && (flags & NBDKIT_FLAG_MAY_TRIM)) {
@@ -748,6 +1336,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 static int
 file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
+  INVALIDATE_EXTENTS_ON_RETURN;
 #ifdef FALLOC_FL_PUNCH_HOLE
   struct handle *h = handle;
   int r;
@@ -777,35 +1366,70 @@ file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   return 0;
 }
 
-#ifdef SEEK_HOLE
+#if defined (SEEK_HOLE) || defined (FS_IOC_FIEMAP)
 /* Extents. */
 
 static int
 file_can_extents (void *handle)
 {
   struct handle *h = handle;
-  off_t r;
 
+#ifdef FS_IOC_FIEMAP
+  if (h->can_fiemap)
+    return 1;
+#endif
+
+#ifdef SEEK_HOLE
   /* A simple test to see whether SEEK_HOLE etc is likely to work on
    * the current filesystem.
    */
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
-  r = lseek (h->fd, 0, SEEK_HOLE);
-  if (r == -1) {
+  if (lseek (h->fd, 0, SEEK_HOLE) == -1) {
     nbdkit_debug ("extents disabled: lseek: SEEK_HOLE: %m");
     return 0;
   }
   return 1;
+#else
+  return 0;
+#endif
 }
 
+/* The walkers below report extents through this callback, either
+ * directly to nbdkit or into the cached extent map.
+ */
+typedef int (*add_extent_fn) (void *opaque,
+                              uint64_t offset, uint64_t length, uint32_t type);
+
 static int
-do_extents (void *handle, uint32_t count, uint64_t offset,
-            uint32_t flags, struct nbdkit_extents *extents)
+add_to_extents (void *extents, uint64_t offset, uint64_t length, uint32_t type)
 {
-  struct handle *h = handle;
-  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
-  uint64_t end = offset + count;
+  return nbdkit_add_extent (extents, offset, length, type);
+}
+
+static int
+add_to_map (void *map, uint64_t offset, uint64_t length, uint32_t type)
+{
+  extent_map *m = map;
+  const struct cached_extent e =
+    { .offset = offset, .length = length, .type = type };
+
+  if (m->len > 0 && m->ptr[m->len-1].type == type) {
+    m->ptr[m->len-1].length += length;
+    return 0;
+  }
+  if (extent_map_append (map, e) == -1) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  return 0;
+}
 
+#ifdef SEEK_HOLE
+/* The caller must hold lseek_lock. */
+static int
+lseek_extents (struct handle *h, uint64_t offset, uint64_t end, bool req_one,
+               add_extent_fn add, void *opaque)
+{
   do {
     off_t pos;
 
@@ -827,8 +1451,8 @@ do_extents (void *handle, uint32_t count, uint64_t offset,
 
     /* We know there is a hole from offset to pos-1. */
     if (pos > offset) {
-      if (nbdkit_add_extent (extents, offset, pos - offset,
-                             NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+      if (add (opaque, offset, pos - offset,
+               NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
         return -1;
       if (req_one)
         break;
@@ -846,8 +1470,7 @@ do_extents (void *handle, uint32_t count, uint64_t offset,
 
     /* We know there is data from offset to pos-1. */
     if (pos > offset) {
-      if (nbdkit_add_extent (extents, offset, pos - offset,
-                             0 /* allocated data */) == -1)
+      if (add (opaque, offset, pos - offset, 0 /* allocated data */) == -1)
         return -1;
       if (req_one)
         break;
@@ -858,15 +1481,185 @@ do_extents (void *handle, uint32_t count, uint64_t offset,
 
   return 0;
 }
+#endif /* SEEK_HOLE */
+
+#ifdef FS_IOC_FIEMAP
+/* Number of extents fetched by each FS_IOC_FIEMAP call. */
+#define FIEMAP_BATCH 256
+
+/* Unlike lseek, FIEMAP does not use the file offset so it needs no
+ * lock, and each call returns up to FIEMAP_BATCH extents.
+ */
+static int
+fiemap_extents (struct handle *h, uint64_t offset, uint64_t end, bool req_one,
+                add_extent_fn add, void *opaque)
+{
+  CLEANUP_FREE struct fiemap *fm = NULL;
+  uint64_t pos = offset;        /* Everything before pos has been added. */
+  uint32_t i;
+
+  fm = malloc (sizeof *fm + FIEMAP_BATCH * sizeof (struct fiemap_extent));
+  if (fm == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  while (pos < end) {
+    const uint64_t batch_start = pos;
+
+    memset (fm, 0, sizeof *fm);
+    fm->fm_start = pos;
+    fm->fm_length = end - pos;
+    fm->fm_extent_count = FIEMAP_BATCH;
+    if (ioctl (h->fd, FS_IOC_FIEMAP, fm) == -1) {
+      nbdkit_error ("ioctl: FS_IOC_FIEMAP: %" PRIu64 ": %m", pos);
+      return -1;
+    }
+
+    /* No more extents, the rest of the range is a hole. */
+    if (fm->fm_mapped_extents == 0)
+      break;
+
+    for (i = 0; i < fm->fm_mapped_extents; ++i) {
+      const struct fiemap_extent *fe = &fm->fm_extents[i];
+      const uint64_t fe_end = MIN (fe->fe_logical + fe->fe_length, end);
+
+      /* Gap before this extent. */
+      if (fe->fe_logical > pos) {
+        if (add (opaque, pos, MIN (fe->fe_logical, end) - pos,
+                 NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+          return -1;
+        if (req_one)
+          return 0;
+        pos = MIN (fe->fe_logical, end);
+      }
+
+      if (fe_end > pos) {
+#ifdef SEEK_HOLE
+        /* Unwritten (preallocated) extents read as zeroes, but they
+         * may have dirty data in the page cache which FIEMAP does not
+         * see.  lseek does check the page cache, so use that to split
+         * the extent into holes and data.
+         */
+        if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) {
+          ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
+          if (lseek_extents (h, pos, fe_end, req_one, add, opaque) == -1)
+            return -1;
+        }
+        else
+#endif
+        if (add (opaque, pos, fe_end - pos, 0 /* allocated data */) == -1)
+          return -1;
+        if (req_one)
+          return 0;
+        pos = fe_end;
+      }
+
+      if (pos >= end || (fe->fe_flags & FIEMAP_EXTENT_LAST))
+        goto out;
+    }
+
+    if (pos == batch_start) {
+      nbdkit_error ("ioctl: FS_IOC_FIEMAP: no progress at %" PRIu64, pos);
+      return -1;
+    }
+  }
+
+ out:
+  /* Hole at the end of the range. */
+  if (pos < end &&
+      add (opaque, pos, end - pos,
+           NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+    return -1;
+
+  return 0;
+}
+#endif /* FS_IOC_FIEMAP */
+
+static int
+walk_extents (struct handle *h, uint64_t offset, uint64_t end, bool req_one,
+              add_extent_fn add, void *opaque)
+{
+#ifdef FS_IOC_FIEMAP
+  if (h->can_fiemap)
+    return fiemap_extents (h, offset, end, req_one, add, opaque);
+#endif
+
+#ifdef SEEK_HOLE
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
+  return lseek_extents (h, offset, end, req_one, add, opaque);
+#else
+  abort ();                     /* file_can_extents returned false */
+#endif
+}
+
+/* extents-cache=true: Answer from the extent map of the whole file,
+ * rebuilding it if a write, trim or zero happened since it was built.
+ */
+static int
+cached_extents (struct handle *h, uint64_t offset, uint64_t end, bool req_one,
+                struct nbdkit_extents *extents)
+{
+  uint64_t generation;
+  size_t lo, hi;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->map_lock);
+
+  /* Read the generation before building the map, so that a write
+   * which completes while we are building it invalidates the map.
+   */
+  generation = __atomic_load_n (&extents_generation, __ATOMIC_ACQUIRE);
+  if (!h->map_valid || h->map_generation != generation) {
+    int64_t size = file_get_size (h);
+
+    if (size == -1)
+      return -1;
+    h->map_valid = false;
+    h->map.len = 0;
+    if (walk_extents (h, 0, size, false, add_to_map, &h->map) == -1)
+      return -1;
+    h->map_generation = generation;
+    h->map_valid = true;
+  }
+
+  /* Find the first cached extent which ends after offset. */
+  lo = 0;
+  hi = h->map.len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const struct cached_extent *e = &h->map.ptr[mid];
+
+    if (e->offset + e->length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < h->map.len && h->map.ptr[lo].offset < end; ++lo) {
+    const struct cached_extent *e = &h->map.ptr[lo];
+
+    if (nbdkit_add_extent (extents, e->offset, e->length, e->type) == -1)
+      return -1;
+    if (req_one)
+      break;
+  }
+
+  return 0;
+}
 
 static int
 file_extents (void *handle, uint32_t count, uint64_t offset,
               uint32_t flags, struct nbdkit_extents *extents)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
-  return do_extents (handle, count, offset, flags, extents);
+  struct handle *h = handle;
+  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
+
+  if (extents_cache)
+    return cached_extents (h, offset, offset + count, req_one, extents);
+  return walk_extents (h, offset, offset + count, req_one,
+                       add_to_extents, extents);
 }
-#endif /* SEEK_HOLE */
+#endif /* SEEK_HOLE || FS_IOC_FIEMAP */
 
 #if HAVE_POSIX_FADVISE
 /* Caching. */
@@ -876,6 +1669,16 @@ file_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   struct handle *h = handle;
   int r;
 
+#ifdef MADV_WILLNEED
+  if (engine == engine_mmap) {
+    if (mapping_advise (&h->mapping, count, offset, MADV_WILLNEED) == -1) {
+      nbdkit_error ("madvise: %m");
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
   /* Cache is advisory, we don't care if this fails */
   r = posix_fadvise (h->fd, offset, count, POSIX_FADV_WILLNEED);
   if (r) {
@@ -897,6 +1700,8 @@ static struct nbdkit_plugin plugin = {
   .config_help       = file_config_help,
   .magic_config_key  = "file",
   .dump_plugin       = file_dump_plugin,
+  .after_fork        = file_after_fork,
+  .cleanup           = file_cleanup,
   .list_exports      = file_list_exports,
   .open              = file_open,
   .close             = file_close,
@@ -911,7 +1716,7 @@ static struct nbdkit_plugin plugin = {
   .flush             = file_flush,
   .trim              = file_trim,
   .zero              = file_zero,
-#ifdef SEEK_HOLE
+#if defined (SEEK_HOLE) || defined (FS_IOC_FIEMAP)
   .can_extents       = file_can_extents,
   .extents           = file_extents,
 #endif
@@ -0,0 +1,266 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* engine=mmap.
+ *
+ * Reads and writes are copies to and from a shared mapping of the
+ * file, which saves a system call for each request when the data is
+ * in the page cache.  Huge files are mapped in windows of MAP_WINDOW
+ * bytes, each created on first access and kept until the handle is
+ * closed, so we only use address space for the parts of the file
+ * which are actually accessed.
+ *
+ * If the file is truncated by another process while it is mapped,
+ * accessing a page beyond the new end of file raises SIGBUS.  Before
+ * each copy the thread saves its context in a thread-local jump
+ * buffer, and the signal handler jumps back to it so the request
+ * fails with EIO.  The handler is installed with SA_NODEFER so that
+ * SIGBUS is not left blocked after jumping out of it, so we do not
+ * need to save and restore the signal mask for every copy.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
+
+#include "mmap.h"
+
+/* Size of each window, a multiple of the page size. */
+#if UINTPTR_MAX > 0xffffffff
+#define MAP_WINDOW (UINT64_C(1) << 30)
+#else
+#define MAP_WINDOW (UINT64_C(1) << 26)
+#endif
+
+/* Set while the current thread is copying to or from a mapping. */
+static __thread sigjmp_buf *sigbus_jmp;
+
+static void
+sigbus_handler (int sig, siginfo_t *info, void *context)
+{
+  sigjmp_buf *jmp = sigbus_jmp;
+
+  if (jmp != NULL)
+    siglongjmp (*jmp, 1);
+
+  /* Not caused by a copy from a mapping.  Restore the default action
+   * and return, so the faulting instruction is retried and kills the
+   * process as if we had not installed a handler.
+   */
+  signal (SIGBUS, SIG_DFL);
+}
+
+int
+mapping_init_sigbus (void)
+{
+  struct sigaction sa;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_sigaction = sigbus_handler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset (&sa.sa_mask);
+  return sigaction (SIGBUS, &sa, NULL);
+}
+
+/* memcpy which returns EIO instead of crashing on SIGBUS. */
+static int
+safe_copy (void *dst, const void *src, size_t n)
+{
+  sigjmp_buf jmp;
+
+  if (sigsetjmp (jmp, 0) != 0) {
+    sigbus_jmp = NULL;
+    errno = EIO;
+    return -1;
+  }
+
+  sigbus_jmp = &jmp;
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  memcpy (dst, src, n);
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  sigbus_jmp = NULL;
+  return 0;
+}
+
+int
+mapping_init (struct mapping *m, int fd, uint64_t size,
+              bool writable, int advice)
+{
+  m->fd = fd;
+  m->size = size;
+  m->writable = writable;
+  m->advice = advice;
+  pthread_mutex_init (&m->lock, NULL);
+  m->nr_windows = DIV_ROUND_UP (size, MAP_WINDOW);
+  m->windows = calloc (m->nr_windows, sizeof (char *));
+  if (m->nr_windows > 0 && m->windows == NULL) {
+    pthread_mutex_destroy (&m->lock);
+    return -1;
+  }
+  return 0;
+}
+
+void
+mapping_free (struct mapping *m)
+{
+  size_t i;
+
+  for (i = 0; i < m->nr_windows; ++i) {
+    if (m->windows[i])
+      munmap (m->windows[i], MIN (MAP_WINDOW, m->size - i * MAP_WINDOW));
+  }
+  free (m->windows);
+  pthread_mutex_destroy (&m->lock);
+}
+
+/* Return the i'th window, mapping it if necessary. */
+static char *
+get_window (struct mapping *m, size_t i)
+{
+  char *p;
+  uint64_t len;
+
+  p = __atomic_load_n (&m->windows[i], __ATOMIC_ACQUIRE);
+  if (p != NULL)
+    return p;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&m->lock);
+  p = m->windows[i];
+  if (p != NULL)
+    return p;
+
+  len = MIN (MAP_WINDOW, m->size - i * MAP_WINDOW);
+  p = mmap (NULL, len, PROT_READ | (m->writable ? PROT_WRITE : 0),
+            MAP_SHARED, m->fd, i * MAP_WINDOW);
+  if (p == MAP_FAILED)
+    return NULL;
+  if (m->advice != -1 && madvise (p, len, m->advice) == -1)
+    nbdkit_debug ("madvise: %m (ignored)");
+
+  __atomic_store_n (&m->windows[i], p, __ATOMIC_RELEASE);
+  return p;
+}
+
+int
+mapping_read (struct mapping *m, void *buf, uint32_t count, uint64_t offset)
+{
+  while (count > 0) {
+    const size_t i = offset / MAP_WINDOW;
+    const uint64_t woffset = offset % MAP_WINDOW;
+    const uint32_t n = MIN (count, MAP_WINDOW - woffset);
+    char *p = get_window (m, i);
+
+    if (p == NULL || safe_copy (buf, p + woffset, n) == -1)
+      return -1;
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+int
+mapping_write (struct mapping *m,
+               const void *buf, uint32_t count, uint64_t offset)
+{
+  while (count > 0) {
+    const size_t i = offset / MAP_WINDOW;
+    const uint64_t woffset = offset % MAP_WINDOW;
+    const uint32_t n = MIN (count, MAP_WINDOW - woffset);
+    char *p = get_window (m, i);
+
+    if (p == NULL || safe_copy (p + woffset, buf, n) == -1)
+      return -1;
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+int
+mapping_sync (struct mapping *m, uint64_t count, uint64_t offset)
+{
+  const uint64_t page_size = sysconf (_SC_PAGESIZE);
+  const uint64_t end = offset + count;
+
+  while (offset < end) {
+    const size_t i = offset / MAP_WINDOW;
+    const uint64_t wstart = ROUND_DOWN (offset % MAP_WINDOW, page_size);
+    const uint64_t wlen = MIN (MAP_WINDOW, m->size - i * MAP_WINDOW);
+    const uint64_t wend = MIN (end - i * MAP_WINDOW, wlen);
+    char *p = __atomic_load_n (&m->windows[i], __ATOMIC_ACQUIRE);
+
+    if (p != NULL && msync (p + wstart, wend - wstart, MS_SYNC) == -1)
+      return -1;
+    offset = (i + 1) * MAP_WINDOW;
+  }
+  return 0;
+}
+
+int
+mapping_advise (struct mapping *m, uint64_t count, uint64_t offset,
+                int advice)
+{
+  const uint64_t page_size = sysconf (_SC_PAGESIZE);
+  const uint64_t end = offset + count;
+
+  while (offset < end) {
+    const size_t i = offset / MAP_WINDOW;
+    const uint64_t wstart = ROUND_DOWN (offset % MAP_WINDOW, page_size);
+    const uint64_t wlen = MIN (MAP_WINDOW, m->size - i * MAP_WINDOW);
+    const uint64_t wend = MIN (end - i * MAP_WINDOW, wlen);
+    char *p = get_window (m, i);
+
+    if (p == NULL || madvise (p + wstart, wend - wstart, advice) == -1)
+      return -1;
+    offset = (i + 1) * MAP_WINDOW;
+  }
+  return 0;
+}
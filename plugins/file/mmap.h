@@ -0,0 +1,76 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_FILE_MMAP_H
+#define NBDKIT_FILE_MMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* engine=mmap.  The file is mapped in windows which are created the
+ * first time they are accessed.  These functions return -1 and set
+ * errno on error.  Accessing part of the file which has been
+ * truncated by another process returns EIO.
+ */
+struct mapping {
+  int fd;
+  uint64_t size;
+  bool writable;
+  int advice;                   /* madvise(2) advice for windows, or -1 */
+  pthread_mutex_t lock;         /* Protects creating windows. */
+  size_t nr_windows;
+  char **windows;               /* NULL until mapped. */
+};
+
+/* Install the SIGBUS handler.  Call this once before any mapping is
+ * accessed.
+ */
+extern int mapping_init_sigbus (void);
+
+extern int mapping_init (struct mapping *m, int fd, uint64_t size,
+                         bool writable, int advice);
+extern void mapping_free (struct mapping *m);
+
+extern int mapping_read (struct mapping *m,
+                         void *buf, uint32_t count, uint64_t offset);
+extern int mapping_write (struct mapping *m,
+                          const void *buf, uint32_t count, uint64_t offset);
+
+/* msync(2) the windows which overlap the range and are mapped. */
+extern int mapping_sync (struct mapping *m, uint64_t count, uint64_t offset);
+
+/* madvise(2) the range, mapping windows if necessary. */
+extern int mapping_advise (struct mapping *m, uint64_t count, uint64_t offset,
+                           int advice);
+
+#endif /* NBDKIT_FILE_MMAP_H */
@@ -0,0 +1,533 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* engine=io_uring.
+ *
+ * The plugin uses the nbdkit parallel thread model, so there are up
+ * to "nbdkit -t" worker threads each performing one request at a
+ * time.  Rather than give each thread its own ring we use a single
+ * ring shared by all of them, so that the kernel sees all of the
+ * outstanding I/O together (and with SQPOLL there is only one kernel
+ * polling thread).
+ *
+ * Submission is serialized by sq_lock.  At most one waiting thread
+ * at a time (the "reaper") waits in the kernel for completions.  Only
+ * the reaper, or a thread holding cq_lock while there is no reaper,
+ * may consume completions, since otherwise the reaper could sleep in
+ * the kernel waiting for a completion which another thread has
+ * already taken.  After reaping it wakes up the other threads whose
+ * operations have completed.  Each submitted entry points to a struct
+ * op on the stack of the submitting thread.
+ *
+ * Large reads and writes are split into several entries which the
+ * kernel can run in parallel, so each worker thread may have up to
+ * URING_MAX_SPLIT operations in flight.
+ *
+ * We use the raw system calls from <linux/io_uring.h> rather than
+ * liburing, since we only need a small subset.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if HAVE_DECL_IORING_OP_FALLOCATE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+
+#include "uring.h"
+
+static int ring_fd = -1;
+static bool sqpoll;
+
+/* The mmapped rings. */
+static void *ring_ptr;
+static size_t ring_size;
+static struct io_uring_sqe *sqes;
+static size_t sqes_size;
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_flags;
+static unsigned *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads and writes larger than URING_SPLIT_SIZE are split into at
+ * most URING_MAX_SPLIT operations.  Each part is a multiple of 4096
+ * bytes, so aligned requests stay aligned for cache=direct.
+ */
+#define URING_SPLIT_SIZE (256 * 1024)
+#define URING_MAX_SPLIT 8
+
+/* Completion handling, see comment at the top of the file. */
+static pthread_mutex_t cq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cq_cond = PTHREAD_COND_INITIALIZER;
+static bool reaping;
+
+struct op {
+  bool done;
+  int res;
+};
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (unsigned to_submit, unsigned min_complete,
+                    unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                  flags, NULL, 0);
+}
+
+int
+uring_init (unsigned entries, bool use_sqpoll)
+{
+  struct io_uring_params p;
+
+  memset (&p, 0, sizeof p);
+  if (use_sqpoll) {
+    p.flags |= IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = 1000 /* ms */;
+  }
+
+  ring_fd = sys_io_uring_setup (entries, &p);
+  if (ring_fd == -1) {
+    nbdkit_error ("io_uring_setup: %m");
+    return -1;
+  }
+  sqpoll = use_sqpoll;
+
+  /* We rely on the kernel not dropping completions when the CQ
+   * overflows (Linux >= 5.5) and on being able to map the SQ and CQ
+   * rings with a single mmap (Linux >= 5.4).
+   */
+  if (!(p.features & IORING_FEAT_NODROP) ||
+      !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    nbdkit_error ("engine=io_uring: this kernel is too old");
+    goto err;
+  }
+
+  ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  if (ring_size < p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe))
+    ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  ring_ptr = mmap (NULL, ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (ring_ptr == MAP_FAILED) {
+    nbdkit_error ("mmap: io_uring rings: %m");
+    ring_ptr = NULL;
+    goto err;
+  }
+
+  sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  sqes = mmap (NULL, sqes_size, PROT_READ|PROT_WRITE,
+               MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    nbdkit_error ("mmap: io_uring submission queue entries: %m");
+    sqes = NULL;
+    goto err;
+  }
+
+  sq_head = ring_ptr + p.sq_off.head;
+  sq_tail = ring_ptr + p.sq_off.tail;
+  sq_mask = ring_ptr + p.sq_off.ring_mask;
+  sq_entries = ring_ptr + p.sq_off.ring_entries;
+  sq_flags = ring_ptr + p.sq_off.flags;
+  sq_array = ring_ptr + p.sq_off.array;
+  cq_head = ring_ptr + p.cq_off.head;
+  cq_tail = ring_ptr + p.cq_off.tail;
+  cq_mask = ring_ptr + p.cq_off.ring_mask;
+  cqes = ring_ptr + p.cq_off.cqes;
+
+  nbdkit_debug ("io_uring: %u submission entries, %u completion entries%s",
+                p.sq_entries, p.cq_entries, sqpoll ? ", sqpoll" : "");
+  return 0;
+
+ err:
+  uring_free ();
+  return -1;
+}
+
+void
+uring_free (void)
+{
+  if (sqes)
+    munmap (sqes, sqes_size);
+  sqes = NULL;
+  if (ring_ptr)
+    munmap (ring_ptr, ring_size);
+  ring_ptr = NULL;
+  if (ring_fd >= 0)
+    close (ring_fd);
+  ring_fd = -1;
+}
+
+/* Get the next free submission queue entry.  Must be called with
+ * sq_lock held.  Returns NULL if the queue is full, which can only
+ * happen with SQPOLL when the kernel thread has not caught up.
+ */
+static struct io_uring_sqe *
+get_sqe (unsigned *tail)
+{
+  unsigned head = __atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_sqe *sqe;
+
+  if (*tail - head >= *sq_entries)
+    return NULL;
+
+  sqe = &sqes[*tail & *sq_mask];
+  memset (sqe, 0, sizeof *sqe);
+  sq_array[*tail & *sq_mask] = *tail & *sq_mask;
+  (*tail)++;
+  return sqe;
+}
+
+/* Submit the n operations prepared by the prep callback.  */
+typedef void (*prep_fn) (struct io_uring_sqe *sqe, size_t i, void *opaque);
+
+static int
+submit (size_t n, prep_fn prep, void *opaque, struct op *ops)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sq_lock);
+  unsigned tail = *sq_tail;
+  size_t i;
+  int r;
+
+  for (i = 0; i < n; ++i) {
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = get_sqe (&tail)) == NULL) {
+      /* Wait for the SQPOLL thread to consume some entries. */
+      if (sys_io_uring_enter (0, 0, IORING_ENTER_SQ_WAIT) == -1 &&
+          errno != EINTR)
+        return -1;
+    }
+    ops[i].done = false;
+    prep (sqe, i, opaque);
+    sqe->user_data = (uintptr_t) &ops[i];
+  }
+  __atomic_store_n (sq_tail, tail, __ATOMIC_RELEASE);
+
+  if (!sqpoll) {
+    size_t submitted = 0;
+
+    while (submitted < n) {
+      r = sys_io_uring_enter (n - submitted, 0, 0);
+      if (r == -1) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+          continue;
+        goto fatal;
+      }
+      submitted += r;
+    }
+  }
+  else if (__atomic_load_n (sq_flags, __ATOMIC_ACQUIRE) &
+           IORING_SQ_NEED_WAKEUP) {
+    if (sys_io_uring_enter (0, 0, IORING_ENTER_SQ_WAKEUP) == -1)
+      goto fatal;
+  }
+
+  return 0;
+
+ fatal:
+  /* The entries are already visible to the kernel, so we cannot
+   * return (and free ops) without risking it writing to them later.
+   */
+  nbdkit_error ("io_uring_enter: %m");
+  abort ();
+}
+
+/* Move any available completions to their ops.  Must be called with
+ * cq_lock held, and either by the reaper or when there is no reaper.
+ * Returns the number of completions reaped.
+ */
+static unsigned
+reap (void)
+{
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n (cq_tail, __ATOMIC_ACQUIRE);
+  unsigned n = tail - head;
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    struct op *op = (struct op *) (uintptr_t) cqe->user_data;
+
+    op->res = cqe->res;
+    op->done = true;
+    head++;
+  }
+  __atomic_store_n (cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* Wait until all n ops are done. */
+static void
+wait_ops (size_t n, struct op *ops)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cq_lock);
+  size_t i;
+  int r, err;
+
+  for (i = 0; i < n; ++i) {
+    while (!ops[i].done) {
+      if (reaping) {
+        pthread_cond_wait (&cq_cond, &cq_lock);
+        continue;
+      }
+
+      /* There is no reaper, so it is safe to pick up any completions
+       * which are already available without entering the kernel.
+       */
+      if (reap () > 0)
+        pthread_cond_broadcast (&cq_cond);
+      if (ops[i].done)
+        break;
+
+      /* Become the reaper.  Drop the lock while we wait in the
+       * kernel so that other threads can see their completions as
+       * soon as we have reaped them.
+       */
+      reaping = true;
+      pthread_mutex_unlock (&cq_lock);
+      r = sys_io_uring_enter (0, 1, IORING_ENTER_GETEVENTS);
+      err = errno;
+      pthread_mutex_lock (&cq_lock);
+      reaping = false;
+      reap ();
+      pthread_cond_broadcast (&cq_cond);
+      if (r == -1 && err != EINTR && err != EAGAIN && err != EBUSY) {
+        /* We cannot return while the kernel may still write to ops
+         * on our stack, and there is no way to recover the ring.
+         */
+        errno = err;
+        nbdkit_error ("io_uring_enter: %m");
+        abort ();
+      }
+    }
+  }
+}
+
+struct rw {
+  int fd;
+  void *buf;
+  size_t count;
+  off_t offset;
+  int mode;
+  bool write;
+  bool datasync;
+  size_t chunk;                 /* size of each part */
+  size_t nr_chunks;             /* number of parts */
+};
+
+static void
+prep_rw (struct io_uring_sqe *sqe, size_t i, void *opaque)
+{
+  const struct rw *rw = opaque;
+
+  sqe->fd = rw->fd;
+  if (i < rw->nr_chunks) {
+    size_t start = i * rw->chunk;
+    size_t len = rw->count - start;
+
+    if (len > rw->chunk)
+      len = rw->chunk;
+    sqe->opcode = rw->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->addr = (uintptr_t) rw->buf + start;
+    sqe->len = len;
+    sqe->off = rw->offset + start;
+    if (rw->datasync && rw->nr_chunks == 1)
+      sqe->flags = IOSQE_IO_LINK;
+  }
+  else {
+    /* The linked fdatasync.  If the write is short the kernel cancels
+     * this with -ECANCELED.
+     */
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  }
+}
+
+static ssize_t
+do_rw (struct rw *rw, bool *synced)
+{
+  struct op ops[URING_MAX_SPLIT + 1];
+  size_t i, n, chunk_count;
+  ssize_t total = 0;
+
+  /* Work out how to split the request. */
+  rw->nr_chunks = 1;
+  rw->chunk = rw->count;
+  if (rw->count > URING_SPLIT_SIZE) {
+    rw->nr_chunks = (rw->count + URING_SPLIT_SIZE - 1) / URING_SPLIT_SIZE;
+    if (rw->nr_chunks > URING_MAX_SPLIT)
+      rw->nr_chunks = URING_MAX_SPLIT;
+    rw->chunk = (rw->count + rw->nr_chunks - 1) / rw->nr_chunks;
+    rw->chunk = (rw->chunk + 4095) & ~(size_t) 4095;
+    rw->nr_chunks = (rw->count + rw->chunk - 1) / rw->chunk;
+  }
+
+  /* A single write can have the fdatasync linked to it.  Linking
+   * several writes would serialize them, so in that case we flush
+   * separately after they have all completed.
+   */
+  n = rw->nr_chunks;
+  if (rw->datasync && n == 1)
+    n++;
+
+  if (submit (n, prep_rw, rw, ops) == -1)
+    return -1;
+  wait_ops (n, ops);
+
+  /* Like pread and pwrite, return the length of the initial part of
+   * the request which succeeded.  The caller retries the rest, so any
+   * error in a later part is reported then.
+   */
+  for (i = 0; i < rw->nr_chunks; ++i) {
+    chunk_count = rw->count - i * rw->chunk;
+    if (chunk_count > rw->chunk)
+      chunk_count = rw->chunk;
+    if (ops[i].res < 0) {
+      if (i == 0) {
+        errno = -ops[i].res;
+        return -1;
+      }
+      break;
+    }
+    total += ops[i].res;
+    if ((size_t) ops[i].res < chunk_count)
+      break;
+  }
+
+  if (synced && rw->datasync && (size_t) total == rw->count) {
+    if (rw->nr_chunks == 1)
+      *synced = ops[1].res == 0;
+    else
+      *synced = uring_fdatasync (rw->fd) == 0;
+  }
+  return total;
+}
+
+ssize_t
+uring_pread (int fd, void *buf, size_t count, off_t offset)
+{
+  struct rw rw = { .fd = fd, .buf = buf, .count = count, .offset = offset };
+
+  return do_rw (&rw, NULL);
+}
+
+ssize_t
+uring_pwrite (int fd, const void *buf, size_t count, off_t offset,
+              bool datasync, bool *synced)
+{
+  struct rw rw = { .fd = fd, .buf = (void *) buf, .count = count,
+                   .offset = offset, .write = true, .datasync = datasync };
+
+  *synced = false;
+  return do_rw (&rw, synced);
+}
+
+static void
+prep_fdatasync (struct io_uring_sqe *sqe, size_t i, void *opaque)
+{
+  const struct rw *rw = opaque;
+
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = rw->fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+int
+uring_fdatasync (int fd)
+{
+  struct rw rw = { .fd = fd };
+  struct op op;
+
+  if (submit (1, prep_fdatasync, &rw, &op) == -1)
+    return -1;
+  wait_ops (1, &op);
+  if (op.res < 0) {
+    errno = -op.res;
+    return -1;
+  }
+  return 0;
+}
+
+static void
+prep_fallocate (struct io_uring_sqe *sqe, size_t i, void *opaque)
+{
+  const struct rw *rw = opaque;
+
+  /* Yes, really: the kernel takes the length in addr and the mode in
+   * len for this operation.
+   */
+  sqe->opcode = IORING_OP_FALLOCATE;
+  sqe->fd = rw->fd;
+  sqe->off = rw->offset;
+  sqe->addr = rw->count;
+  sqe->len = rw->mode;
+}
+
+int
+uring_fallocate (int fd, int mode, off_t offset, off_t len)
+{
+  struct rw rw = { .fd = fd, .mode = mode, .offset = offset, .count = len };
+  struct op op;
+
+  if (submit (1, prep_fallocate, &rw, &op) == -1)
+    return -1;
+  wait_ops (1, &op);
+  if (op.res < 0) {
+    errno = -op.res;
+    return -1;
+  }
+  return 0;
+}
+
+#endif /* HAVE_DECL_IORING_OP_FALLOCATE */
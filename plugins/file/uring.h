@@ -0,0 +1,60 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_FILE_URING_H
+#define NBDKIT_FILE_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* engine=io_uring.  All worker threads share a single ring.  These
+ * functions behave like the system calls they replace: they return
+ * -1 and set errno on error.
+ */
+extern int uring_init (unsigned entries, bool sqpoll);
+extern void uring_free (void);
+
+extern ssize_t uring_pread (int fd, void *buf, size_t count, off_t offset);
+
+/* If datasync is true then the data is also flushed: with a linked
+ * fdatasync for writes which fit in one operation, so both are in
+ * flight together, or with a separate fdatasync after a write which
+ * was split.  The fdatasync only counts as done if the whole write
+ * completed, which is reported by setting *synced to true.
+ */
+extern ssize_t uring_pwrite (int fd, const void *buf, size_t count,
+                             off_t offset, bool datasync, bool *synced);
+extern int uring_fdatasync (int fd);
+extern int uring_fallocate (int fd, int mode, off_t offset, off_t len);
+
+#endif /* NBDKIT_FILE_URING_H */
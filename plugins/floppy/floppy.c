@@ -40,6 +40,7 @@
 
 #include <nbdkit-plugin.h>
 
+#include "fdcache.h"
 #include "regions.h"
 
 #include "virtual-floppy.h"
@@ -56,6 +57,13 @@ static uint64_t size = 0;
 /* Virtual floppy. */
 static struct virtual_floppy floppy;
 
+/* Host files are kept open between reads.  Check that a cached file
+ * has not been replaced at most this often.
+ */
+#define FD_CACHE_SIZE 64
+#define FD_CACHE_VALIDATE_MS 1000
+static struct fdcache *fds;
+
 static void
 floppy_load (void)
 {
@@ -67,6 +75,7 @@ floppy_unload (void)
 {
   free (dir);
   free_virtual_floppy (&floppy);
+  fdcache_free (fds);
 }
 
 static int
@@ -120,6 +129,11 @@ floppy_config_complete (void)
 static int
 floppy_get_ready (void)
 {
+  fds = fdcache_new (FD_CACHE_SIZE, FD_CACHE_VALIDATE_MS);
+  if (fds == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
   return create_virtual_floppy (dir, label, size, &floppy);
 }
 
@@ -161,7 +175,7 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
     const struct region *region = find_region (&floppy.regions, offset);
     size_t i, len;
     const char *host_path;
-    int fd;
+    struct fdcache_entry *e;
     ssize_t r;
 
     /* Length to end of region. */
@@ -174,23 +188,23 @@ floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
       i = region->u.i;
       assert (i < floppy.files.len);
       host_path = floppy.files.ptr[i].host_path;
-      fd = open (host_path, O_RDONLY|O_CLOEXEC);
-      if (fd == -1) {
+      e = fdcache_get (fds, host_path, O_RDONLY);
+      if (e == NULL) {
         nbdkit_error ("open: %s: %m", host_path);
         return -1;
       }
-      r = pread (fd, buf, len, offset - region->start);
+      r = pread (fdcache_fd (e), buf, len, offset - region->start);
       if (r == -1) {
         nbdkit_error ("pread: %s: %m", host_path);
-        close (fd);
+        fdcache_put (fds, e);
         return -1;
       }
       if (r == 0) {
         nbdkit_error ("pread: %s: unexpected end of file", host_path);
-        close (fd);
+        fdcache_put (fds, e);
         return -1;
       }
-      close (fd);
+      fdcache_put (fds, e);
       len = r;
       break;
 
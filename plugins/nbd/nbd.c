@@ -48,6 +48,14 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_SYS_EVENTFD_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define USE_EPOLL 1
+#else
+#define USE_EPOLL 0
+#endif
+
 #include <libnbd.h>
 
 #define NBDKIT_API_VERSION 2
@@ -57,6 +65,7 @@
 #include "ascii-string.h"
 #include "byte-swapping.h"
 #include "cleanup.h"
+#include "minmax.h"
 #include "utils.h"
 #include "vector.h"
 
@@ -77,17 +86,80 @@ struct transaction {
   nbd_completion_callback cb;
 };
 
-/* The per-connection handle */
-struct handle {
+/* Maximum value of the connections parameter. */
+#define MAX_CONNECTIONS 16
+
+/* A single connection to the remote server */
+struct conn {
   /* These fields are read-only once initialized */
   struct nbd_handle *nbd;
+#if USE_EPOLL
+  struct event_loop *loop;
+  sem_t done; /* Posted when the event loop drops the connection */
+
+  /* Set when a command is started, accessed atomically. */
+  bool dirty;
+
+  /* Only accessed from the event loop thread. */
+  uint32_t events; /* Events currently registered with epoll */
+  bool removed;
+#else
   int fds[2]; /* Pipe for kicking the reader thread */
-  bool readonly;
   pthread_t reader;
+#endif
+
+  /* Number of commands in flight, accessed atomically. */
+  unsigned in_flight;
 };
 
-/* Connect to server via URI */
+/* The per-connection handle */
+struct handle {
+  /* These fields are read-only once initialized */
+  bool readonly;
+  size_t nr_conns;
+  struct conn conns[MAX_CONNECTIONS];
+};
+
+#if USE_EPOLL
+/* Number of event loop threads shared by all connections. */
+#define NR_EVENT_LOOPS 4
+
+DEFINE_VECTOR_TYPE(conn_vector, struct conn *);
+
+/* An event loop thread, multiplexing many connections using epoll. */
+struct event_loop {
+  int epfd;
+  int efd;                      /* eventfd for kicking the thread */
+  pthread_t thread;
+  bool running;
+
+  /* Accessed atomically.  True if efd has been signalled and the
+   * thread has not yet woken up, so further kicks can be skipped.
+   */
+  bool kicked;
+  bool stopping;
+
+  pthread_mutex_t lock;         /* Protects conns */
+  conn_vector conns;
+};
+
+static struct event_loop loops[NR_EVENT_LOOPS];
+static unsigned next_loop;
+
+static int nbdplug_start_loops (void);
+static void nbdplug_stop_loops (void);
+#endif
+
+/* Connect to server via URI.  If more than one uri parameter is
+ * given the export is striped across all of the servers, and uri is
+ * the first one.
+ */
 static const char *uri;
+static string_vector uris = empty_vector;
+
+/* Stripe size when striping across several servers */
+static uint64_t stripe_size = 65536;
+static bool striped;
 
 /* Connect to server via absolute name of Unix socket */
 static char *sockname;
@@ -122,6 +194,9 @@ static unsigned retry;
 static bool shared;
 static struct handle *shared_handle;
 
+/* Number of connections to the server per handle */
+static unsigned connections = 1;
+
 /* Control TLS settings */
 static int tls = -1;
 static char *tls_certificates;
@@ -138,10 +213,14 @@ nbdplug_unload (void)
 {
   if (shared && shared_handle)
     nbdplug_close_handle (shared_handle);
+#if USE_EPOLL
+  nbdplug_stop_loops ();
+#endif
   free (sockname);
   free (tls_certificates);
   free (tls_psk);
   free (command.ptr); /* the strings are statically allocated */
+  free (uris.ptr);
 }
 
 /* Called for each key=value passed on the command line.  See
@@ -166,8 +245,23 @@ nbdplug_config (const char *key, const char *value)
   else if (strcmp (key, "vsock") == 0 ||
            strcmp (key, "cid") == 0)
     raw_cid = value;
-  else if (strcmp (key, "uri") == 0)
-    uri = value;
+  else if (strcmp (key, "uri") == 0) {
+    if (string_vector_append (&uris, value) == -1) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+  }
+  else if (strcmp (key, "stripe-size") == 0) {
+    int64_t r64 = nbdkit_parse_size (value);
+    if (r64 == -1)
+      return -1;
+    if (r64 < 512 || r64 > UINT32_MAX || r64 % 512 != 0) {
+      nbdkit_error ("stripe-size must be a multiple of 512 "
+                    "between 512 and 4G-512");
+      return -1;
+    }
+    stripe_size = r64;
+  }
   else if (strcmp (key, "command") == 0 || strcmp (key, "arg") == 0) {
     if (string_vector_append (&command, value) == -1) {
       nbdkit_error ("realloc: %m");
@@ -200,6 +294,15 @@ nbdplug_config (const char *key, const char *value)
       return -1;
     shared = r;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections < 1 || connections > MAX_CONNECTIONS) {
+      nbdkit_error ("connections must be between 1 and %d",
+                    MAX_CONNECTIONS);
+      return -1;
+    }
+  }
   else if (strcmp (key, "tls") == 0) {
     if (ascii_strcasecmp (value, "require") == 0 ||
         ascii_strcasecmp (value, "required") == 0 ||
@@ -243,7 +346,7 @@ nbdplug_config (const char *key, const char *value)
 static int
 nbdplug_config_complete (void)
 {
-  int c = !!sockname + !!hostname + !!uri +
+  int c = !!sockname + !!hostname + (uris.len > 0) +
     (command.len > 0) + (socket_fd >= 0) + !!raw_cid;
 
   /* Check the user passed exactly one connection parameter. */
@@ -265,7 +368,7 @@ nbdplug_config_complete (void)
     return -1;
   }
 
-  if (uri) {
+  if (uris.len > 0) {
     struct nbd_handle *nbd = nbd_create ();
 
     if (!nbd) {
@@ -278,6 +381,21 @@ nbdplug_config_complete (void)
       return -1;
     }
     nbd_close (nbd);
+
+    uri = uris.ptr[0];
+    if (uris.len > 1) {
+      if (uris.len > MAX_CONNECTIONS) {
+        nbdkit_error ("cannot stripe across more than %d servers",
+                      MAX_CONNECTIONS);
+        return -1;
+      }
+      if (connections > 1) {
+        nbdkit_error ("‘connections’ cannot be used when striping "
+                      "across several servers");
+        return -1;
+      }
+      striped = true;
+    }
   }
   else if (sockname) {
     struct sockaddr_un sock;
@@ -304,6 +422,10 @@ nbdplug_config_complete (void)
 #endif
   }
   else if (command.len > 0) {
+    if (connections > 1) {
+      nbdkit_error ("‘connections’ cannot be used with ‘command’");
+      return -1;
+    }
     /* Add NULL sentinel to the command. */
     if (string_vector_append (&command, NULL) == -1) {
       nbdkit_error ("realloc: %m");
@@ -312,6 +434,10 @@ nbdplug_config_complete (void)
     shared = true;
   }
   else if (socket_fd >= 0) {
+    if (connections > 1) {
+      nbdkit_error ("‘connections’ cannot be used with ‘socket-fd’");
+      return -1;
+    }
     shared = true;
   }
   else {
@@ -363,12 +489,16 @@ nbdplug_config_complete (void)
   return 0;
 }
 
-/* Create the shared connection.  Because this may create a background
- * thread it must be done after we fork.
+/* Create the event loop threads and the shared connection.  Because
+ * these create background threads they must be done after we fork.
  */
 static int
 nbdplug_after_fork (void)
 {
+#if USE_EPOLL
+  if (nbdplug_start_loops () == -1)
+    return -1;
+#endif
   if (shared && (shared_handle = nbdplug_open_handle (false, NULL)) == NULL)
     return -1;
   return 0;
@@ -376,6 +506,8 @@ nbdplug_after_fork (void)
 
 #define nbdplug_config_help \
   "[uri=]<URI>            URI of an NBD socket to connect to (if supported).\n" \
+  "                       Repeat to stripe across several servers.\n" \
+  "stripe-size=<SIZE>     Stripe size when striping (default 64K).\n" \
   "socket=<SOCKNAME>      The Unix socket to connect to.\n" \
   "hostname=<HOST>        The hostname for the TCP socket to connect to.\n" \
   "port=<PORT>            TCP/VSOCK port or service name to use (default 10809).\n" \
@@ -388,6 +520,8 @@ nbdplug_after_fork (void)
   "retry=<N>              Retry connection up to N seconds (default 0).\n" \
   "shared=<BOOL>          True to share one server connection among all clients,\n" \
   "                       rather than a connection per client (default false).\n" \
+  "connections=<N>        Open N connections to the server per handle\n" \
+  "                       if it supports multi-conn (default 1).\n" \
   "tls=<MODE>             How to use TLS; one of 'off', 'on', or 'require'.\n" \
   "tls-certificates=<DIR> Directory containing files for X.509 certificates.\n" \
   "tls-verify=<BOOL>      True (default for X.509) to validate server.\n" \
@@ -417,11 +551,279 @@ nbdplug_dump_plugin (void)
 
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
+#if USE_EPOLL
+
+/* Maximum number of events handled per call to epoll_wait. */
+#define MAX_EVENTS 64
+
+/* Called from the event loop thread after an event on the connection
+ * or after a command was started, to update the events we are
+ * waiting for.  When the connection has been closed it is removed
+ * from epoll and the thread closing it is woken up.
+ */
+static void
+nbdplug_rearm (struct event_loop *loop, struct conn *c)
+{
+  struct epoll_event ev = { .data.ptr = c };
+  unsigned dir;
+
+  if (c->removed)
+    return;
+
+  if (nbd_aio_is_dead (c->nbd) || nbd_aio_is_closed (c->nbd)) {
+    nbdkit_debug ("state machine changed to %s",
+                  nbd_connection_state (c->nbd));
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_DEL, nbd_aio_get_fd (c->nbd),
+                   NULL) == -1)
+      nbdkit_debug ("epoll_ctl: %m");
+    c->removed = true;
+    if (sem_post (&c->done)) {
+      nbdkit_error ("failed to post semaphore: %m");
+      abort ();
+    }
+    return;
+  }
+
+  dir = nbd_aio_get_direction (c->nbd);
+  if (dir & LIBNBD_AIO_DIRECTION_READ)
+    ev.events |= EPOLLIN;
+  if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+    ev.events |= EPOLLOUT;
+  if (ev.events == c->events)
+    return;
+  if (epoll_ctl (loop->epfd, EPOLL_CTL_MOD, nbd_aio_get_fd (c->nbd),
+                 &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    return;
+  }
+  c->events = ev.events;
+}
+
+/* Event loop thread, driving the state machines of all the
+ * connections assigned to it.
+ */
+static void *
+nbdplug_event_loop (void *opaque)
+{
+  struct event_loop *loop = opaque;
+  struct epoll_event events[MAX_EVENTS];
+
+  nbdkit_debug ("nbd: started event loop thread");
+
+  while (!__atomic_load_n (&loop->stopping, __ATOMIC_SEQ_CST)) {
+    bool kicked = false;
+    int i, n;
+
+    n = epoll_wait (loop->epfd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("epoll_wait: %m");
+      break;
+    }
+
+    for (i = 0; i < n; ++i) {
+      struct conn *c = events[i].data.ptr;
+      uint32_t revents = events[i].events;
+      unsigned dir;
+      int r;
+
+      if (c == NULL) {
+        uint64_t v;
+
+        if (read (loop->efd, &v, sizeof v) == -1 && errno != EAGAIN)
+          nbdkit_error ("failed to read eventfd: %m");
+        kicked = true;
+        continue;
+      }
+
+      /* Errors and hangups are reported even if we did not ask for
+       * them, and are handled by whichever direction the state
+       * machine is currently expecting.
+       */
+      if (revents & (EPOLLERR|EPOLLHUP))
+        revents |= EPOLLIN|EPOLLOUT;
+
+      dir = nbd_aio_get_direction (c->nbd);
+      r = 0;
+      if ((dir & LIBNBD_AIO_DIRECTION_READ) && (revents & EPOLLIN))
+        r = nbd_aio_notify_read (c->nbd);
+      else if ((dir & LIBNBD_AIO_DIRECTION_WRITE) && (revents & EPOLLOUT))
+        r = nbd_aio_notify_write (c->nbd);
+      if (r == -1)
+        nbdkit_error ("%s", nbd_get_error ());
+      nbdplug_rearm (loop, c);
+    }
+
+    /* Clear the kicked flag before looking at the connections, so
+     * that a command started after this point kicks us again.
+     */
+    if (kicked) {
+      size_t j;
+
+      __atomic_store_n (&loop->kicked, false, __ATOMIC_SEQ_CST);
+
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&loop->lock);
+      for (j = 0; j < loop->conns.len; ++j) {
+        struct conn *c = loop->conns.ptr[j];
+
+        if (__atomic_exchange_n (&c->dirty, false, __ATOMIC_SEQ_CST))
+          nbdplug_rearm (loop, c);
+      }
+    }
+  }
+
+  nbdkit_debug ("exiting event loop thread");
+  return NULL;
+}
+
+/* Kick the event loop thread of a connection after starting a
+ * command.  The eventfd is only written if the thread has not already
+ * been kicked since it last woke up.
+ */
+static void
+nbdplug_kick (struct conn *c)
+{
+  struct event_loop *loop = c->loop;
+  uint64_t v = 1;
+
+  __atomic_store_n (&c->dirty, true, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n (&loop->kicked, true, __ATOMIC_SEQ_CST))
+    return;
+  if (write (loop->efd, &v, sizeof v) == -1 && errno != EAGAIN)
+    nbdkit_debug ("failed to kick event loop thread: %m");
+}
+
+static int
+nbdplug_start_loops (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_EVENT_LOOPS; ++i) {
+    struct event_loop *loop = &loops[i];
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    loop->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+      nbdkit_error ("epoll_create1: %m");
+      return -1;
+    }
+    loop->efd = eventfd (0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (loop->efd == -1) {
+      nbdkit_error ("eventfd: %m");
+      close (loop->epfd);
+      return -1;
+    }
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, loop->efd, &ev) == -1) {
+      nbdkit_error ("epoll_ctl: %m");
+      goto err;
+    }
+    pthread_mutex_init (&loop->lock, NULL);
+    if ((errno = pthread_create (&loop->thread, NULL,
+                                 nbdplug_event_loop, loop))) {
+      nbdkit_error ("failed to initialize event loop thread: %m");
+      pthread_mutex_destroy (&loop->lock);
+      goto err;
+    }
+    loop->running = true;
+    continue;
+
+  err:
+    close (loop->efd);
+    close (loop->epfd);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+nbdplug_stop_loops (void)
+{
+  size_t i;
+  uint64_t v = 1;
+
+  for (i = 0; i < NR_EVENT_LOOPS; ++i) {
+    struct event_loop *loop = &loops[i];
+
+    if (!loop->running)
+      continue;
+    __atomic_store_n (&loop->stopping, true, __ATOMIC_SEQ_CST);
+    if (write (loop->efd, &v, sizeof v) == -1)
+      nbdkit_debug ("failed to kick event loop thread: %m");
+    if ((errno = pthread_join (loop->thread, NULL)))
+      nbdkit_debug ("failed to join event loop thread: %m");
+    close (loop->efd);
+    close (loop->epfd);
+    pthread_mutex_destroy (&loop->lock);
+    free (loop->conns.ptr);
+    loop->running = false;
+  }
+}
+
+/* Assign a newly connected connection to one of the event loops. */
+static int
+nbdplug_start_conn (struct conn *c)
+{
+  unsigned n = __atomic_fetch_add (&next_loop, 1, __ATOMIC_RELAXED);
+  struct event_loop *loop = &loops[n % NR_EVENT_LOOPS];
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+
+  if (sem_init (&c->done, 0, 0)) {
+    nbdkit_error ("sem_init: %m");
+    return -1;
+  }
+  c->loop = loop;
+  c->events = ev.events;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&loop->lock);
+  if (conn_vector_append (&loop->conns, c) == -1) {
+    nbdkit_error ("realloc: %m");
+    sem_destroy (&c->done);
+    return -1;
+  }
+  if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, nbd_aio_get_fd (c->nbd),
+                 &ev) == -1) {
+    nbdkit_error ("epoll_ctl: %m");
+    conn_vector_remove (&loop->conns, loop->conns.len - 1);
+    sem_destroy (&c->done);
+    return -1;
+  }
+  /* Let the event loop pick up the real direction. */
+  nbdplug_kick (c);
+  return 0;
+}
+
+/* Wait for the event loop to drop a connection which is being
+ * disconnected, and remove it from the event loop.
+ */
+static void
+nbdplug_stop_conn (struct conn *c)
+{
+  struct event_loop *loop = c->loop;
+  size_t i;
+
+  nbdplug_kick (c);
+  while (sem_wait (&c->done) == -1 && errno == EINTR)
+    /* try again */;
+  sem_destroy (&c->done);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&loop->lock);
+  for (i = 0; i < loop->conns.len; ++i) {
+    if (loop->conns.ptr[i] == c) {
+      conn_vector_remove (&loop->conns, i);
+      break;
+    }
+  }
+}
+
+#else /* !USE_EPOLL */
+
 /* Reader loop. */
 void *
-nbdplug_reader (void *handle)
+nbdplug_reader (void *opaque)
 {
-  struct handle *h = handle;
+  struct conn *h = opaque;
 
   nbdkit_debug ("nbd: started reader thread");
 
@@ -473,6 +875,67 @@ nbdplug_reader (void *handle)
   return NULL;
 }
 
+/* Kick the reader thread after starting a command. */
+static void
+nbdplug_kick (struct conn *h)
+{
+  char c = 0;
+
+  if (write (h->fds[1], &c, 1) == -1 && errno != EAGAIN)
+    nbdkit_debug ("failed to kick reader thread: %m");
+}
+
+/* Create the pipe and reader thread for a newly connected connection. */
+static int
+nbdplug_start_conn (struct conn *h)
+{
+#ifdef HAVE_PIPE2
+  if (pipe2 (h->fds, O_NONBLOCK)) {
+    nbdkit_error ("pipe2: %m");
+    return -1;
+  }
+#else
+  /* This plugin doesn't fork, so we don't care about CLOEXEC. Our use
+   * of pipe2 is merely for convenience.
+   */
+  if (pipe (h->fds)) {
+    nbdkit_error ("pipe: %m");
+    return -1;
+  }
+  if (set_nonblock (h->fds[0]) == -1) {
+    close (h->fds[1]);
+    return -1;
+  }
+  if (set_nonblock (h->fds[1]) == -1) {
+    close (h->fds[0]);
+    return -1;
+  }
+#endif
+
+  /* Spawn a dedicated reader thread */
+  if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
+    nbdkit_error ("failed to initialize reader thread: %m");
+    close (h->fds[0]);
+    close (h->fds[1]);
+    return -1;
+  }
+  return 0;
+}
+
+/* Wait for the reader thread of a connection which is being
+ * disconnected to exit.
+ */
+static void
+nbdplug_stop_conn (struct conn *h)
+{
+  if ((errno = pthread_join (h->reader, NULL)))
+    nbdkit_debug ("failed to join reader thread: %m");
+  close (h->fds[0]);
+  close (h->fds[1]);
+}
+
+#endif /* !USE_EPOLL */
+
 /* Callback used at end of a transaction. */
 static int
 nbdplug_notify (void *opaque, int *error)
@@ -504,12 +967,31 @@ nbdplug_prepare (struct transaction *trans)
   trans->cb.user_data = trans;
 }
 
+/* Choose the least loaded connection for a new command. */
+static struct conn *
+nbdplug_get_conn (struct handle *h)
+{
+  struct conn *c = &h->conns[0];
+  unsigned load = __atomic_load_n (&c->in_flight, __ATOMIC_RELAXED);
+  size_t i;
+
+  for (i = 1; i < h->nr_conns && load > 0; ++i) {
+    unsigned n = __atomic_load_n (&h->conns[i].in_flight, __ATOMIC_RELAXED);
+
+    if (n < load) {
+      c = &h->conns[i];
+      load = n;
+    }
+  }
+
+  __atomic_add_fetch (&c->in_flight, 1, __ATOMIC_RELAXED);
+  return c;
+}
+
 /* Register a cookie and kick the I/O thread. */
 static void
-nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
+nbdplug_register (struct conn *h, struct transaction *trans, int64_t cookie)
 {
-  char c = 0;
-
   if (cookie == -1) {
     nbdkit_error ("command failed: %s", nbd_get_error ());
     trans->early_err = nbd_get_errno ();
@@ -518,14 +1000,14 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
 
   nbdkit_debug ("cookie %" PRId64 " started by state machine", cookie);
   trans->cookie = cookie;
-
-  if (write (h->fds[1], &c, 1) == -1 && errno != EAGAIN)
-    nbdkit_debug ("failed to kick reader thread: %m");
+  nbdplug_kick (h);
 }
 
-/* Perform the reply half of a transaction. */
+/* Perform the reply half of a transaction.  This also releases the
+ * connection obtained from nbdplug_get_conn.
+ */
 static int
-nbdplug_reply (struct handle *h, struct transaction *trans)
+nbdplug_reply (struct conn *h, struct transaction *trans)
 {
   int err;
 
@@ -543,15 +1025,17 @@ nbdplug_reply (struct handle *h, struct transaction *trans)
   }
   if (sem_destroy (&trans->sem))
     abort ();
+  __atomic_sub_fetch (&h->in_flight, 1, __ATOMIC_RELAXED);
   errno = err;
   return err ? -1 : 0;
 }
 
-/* Move an nbd handle from created to negotiating/ready.  Error reporting
- * is left to the caller.
+/* Move an nbd handle from created to negotiating/ready.  server is
+ * the index of the uri to connect to when striping, otherwise 0.
+ * Error reporting is left to the caller.
  */
 static int
-nbdplug_connect (struct nbd_handle *nbd)
+nbdplug_connect (struct nbd_handle *nbd, size_t server)
 {
   if (tls_certificates &&
       nbd_set_tls_certificates (nbd, tls_certificates) == -1)
@@ -563,7 +1047,7 @@ nbdplug_connect (struct nbd_handle *nbd)
   if (tls_psk && nbd_set_tls_psk_file (nbd, tls_psk) == -1)
     return -1;
   if (uri)
-    return nbd_connect_uri (nbd, uri);
+    return nbd_connect_uri (nbd, uris.ptr[server]);
   else if (sockname)
     return nbd_connect_unix (nbd, sockname);
   else if (hostname)
@@ -582,50 +1066,14 @@ nbdplug_connect (struct nbd_handle *nbd)
     abort ();
 }
 
-/* Create the shared or per-connection handle. */
-static struct handle *
-nbdplug_open_handle (int readonly, const char *client_export)
+/* Open one connection to the server (or to one of the servers when
+ * striping).
+ */
+static int
+nbdplug_open_conn (struct conn *h, const char *client_export, size_t server)
 {
-  struct handle *h;
   unsigned long retries = retry;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
-  }
-#ifdef HAVE_PIPE2
-  if (pipe2 (h->fds, O_NONBLOCK)) {
-    nbdkit_error ("pipe2: %m");
-    free (h);
-    return NULL;
-  }
-#else
-  /* This plugin doesn't fork, so we don't care about CLOEXEC. Our use
-   * of pipe2 is merely for convenience.
-   */
-  if (pipe (h->fds)) {
-    nbdkit_error ("pipe: %m");
-    free (h);
-    return NULL;
-  }
-  if (set_nonblock (h->fds[0]) == -1) {
-    close (h->fds[1]);
-    free (h);
-    return NULL;
-  }
-  if (set_nonblock (h->fds[1]) == -1) {
-    close (h->fds[0]);
-    free (h);
-    return NULL;
-  }
-#endif
-
-  if (dynamic_export)
-    assert (client_export);
-  else
-    client_export = export;
-
  retry:
   h->nbd = nbd_create ();
   if (!h->nbd)
@@ -648,7 +1096,7 @@ nbdplug_open_handle (int readonly, const char *client_export)
   }
   if (nbd_set_tls (h->nbd, tls) == -1)
     goto errnbd;
-  if (nbdplug_connect (h->nbd) == -1) {
+  if (nbdplug_connect (h->nbd, server) == -1) {
     if (retries--) {
       nbdkit_debug ("connect failed; will try again: %s", nbd_get_error ());
       nbd_close (h->nbd);
@@ -668,26 +1116,86 @@ nbdplug_open_handle (int readonly, const char *client_export)
   }
 #endif
 
-  if (readonly)
-    h->readonly = true;
-
-  /* Spawn a dedicated reader thread */
-  if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
-    nbdkit_error ("failed to initialize reader thread: %m");
+  if (nbdplug_start_conn (h) == -1)
     goto err;
-  }
 
-  return h;
+  return 0;
 
  errnbd:
   nbdkit_error ("failure while creating nbd handle: %s", nbd_get_error ());
  err:
-  close (h->fds[0]);
-  close (h->fds[1]);
   if (h->nbd)
     nbd_close (h->nbd);
-  free (h);
-  return NULL;
+  h->nbd = NULL;
+  return -1;
+}
+
+/* Create the shared or per-connection handle. */
+static struct handle *
+nbdplug_open_handle (int readonly, const char *client_export)
+{
+  struct handle *h;
+  int i;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  if (dynamic_export)
+    assert (client_export);
+  else
+    client_export = export;
+
+  if (readonly)
+    h->readonly = true;
+
+  if (nbdplug_open_conn (&h->conns[0], client_export, 0) == -1) {
+    free (h);
+    return NULL;
+  }
+  h->nr_conns = 1;
+
+  /* When striping there is one connection to each server. */
+  if (striped) {
+    while (h->nr_conns < uris.len) {
+      if (nbdplug_open_conn (&h->conns[h->nr_conns], client_export,
+                             h->nr_conns) == -1) {
+        nbdplug_close_handle (h);
+        return NULL;
+      }
+      h->nr_conns++;
+    }
+    return h;
+  }
+
+  /* Additional connections are only safe if the server guarantees
+   * that all connections see a consistent view of the export.
+   */
+  if (connections > 1) {
+    i = nbd_can_multi_conn (h->conns[0].nbd);
+    if (i == -1) {
+      nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
+      nbdplug_close_handle (h);
+      return NULL;
+    }
+    if (!i)
+      nbdkit_debug ("server does not support multi-conn, "
+                    "using a single connection");
+    else {
+      while (h->nr_conns < connections) {
+        if (nbdplug_open_conn (&h->conns[h->nr_conns], client_export,
+                               0) == -1) {
+          nbdplug_close_handle (h);
+          return NULL;
+        }
+        h->nr_conns++;
+      }
+    }
+  }
+
+  return h;
 }
 
 #if LIBNBD_HAVE_NBD_OPT_LIST
@@ -715,7 +1223,7 @@ nbdplug_list_exports (int readonly, int is_tls, struct nbdkit_exports *exports)
       goto out;
     if (nbd_set_opt_mode (nbd, 1) == -1)
       goto out;
-    if (nbdplug_connect (nbd) == -1)
+    if (nbdplug_connect (nbd, 0) == -1)
       goto out;
     if (nbd_opt_list (nbd, (nbd_list_callback) { .callback = collect_one,
                                                  .user_data = exports }) == -1)
@@ -759,7 +1267,7 @@ nbdplug_default_export (int readonly, int is_tls)
     goto out;
   if (nbd_set_opt_mode (nbd, 1) == -1)
     goto out;
-  if (nbdplug_connect (nbd) == -1)
+  if (nbdplug_connect (nbd, 0) == -1)
     goto out;
   if (nbd_set_export_name (nbd, "") == -1)
     goto out;
@@ -792,13 +1300,16 @@ nbdplug_open (int readonly)
 static void
 nbdplug_close_handle (struct handle *h)
 {
-  if (nbd_aio_disconnect (h->nbd, 0) == -1)
-    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
-  if ((errno = pthread_join (h->reader, NULL)))
-    nbdkit_debug ("failed to join reader thread: %m");
-  close (h->fds[0]);
-  close (h->fds[1]);
-  nbd_close (h->nbd);
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i) {
+    struct conn *c = &h->conns[i];
+
+    if (nbd_aio_disconnect (c->nbd, 0) == -1)
+      nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
+    nbdplug_stop_conn (c);
+    nbd_close (c->nbd);
+  }
   free (h);
 }
 
@@ -818,90 +1329,118 @@ nbdplug_export_description (void *handle)
 {
 #if LIBNBD_HAVE_NBD_GET_EXPORT_DESCRIPTION
   struct handle *h = handle;
-  CLEANUP_FREE char *desc = nbd_get_export_description (h->nbd);
+  CLEANUP_FREE char *desc = nbd_get_export_description (h->conns[0].nbd);
   if (desc)
     return nbdkit_strdup_intern (desc);
 #endif
   return NULL;
 }
 
-/* Get the file size. */
+/* Get the file size.  When striping this is the size of the smallest
+ * server rounded down to the stripe size, times the number of servers.
+ */
 static int64_t
 nbdplug_get_size (void *handle)
 {
   struct handle *h = handle;
-  int64_t size = nbd_get_size (h->nbd);
+  int64_t size = -1;
+  size_t i;
 
-  if (size == -1) {
-    nbdkit_error ("failure to get size: %s", nbd_get_error ());
-    return -1;
+  for (i = 0; i < (striped ? h->nr_conns : 1); ++i) {
+    int64_t r = nbd_get_size (h->conns[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to get size: %s", nbd_get_error ());
+      return -1;
+    }
+    if (size == -1 || r < size)
+      size = r;
+  }
+
+  if (striped) {
+    size -= size % stripe_size;
+    size *= h->nr_conns;
   }
   return size;
 }
 
+/* Return the number of connections on which flag is true, or -1 on
+ * error.  When striping a feature is only usable if every server
+ * supports it.
+ */
+static int
+nbdplug_count_flag (struct handle *h, int (*flag) (struct nbd_handle *),
+                    const char *what)
+{
+  size_t i;
+  int n = 0;
+
+  for (i = 0; i < h->nr_conns; ++i) {
+    int r = flag (h->conns[i].nbd);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check %s: %s", what, nbd_get_error ());
+      return -1;
+    }
+    if (r)
+      n++;
+  }
+  return n;
+}
+
 static int
 nbdplug_can_write (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_read_only (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_is_read_only, "readonly flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check readonly flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return !(i || h->readonly);
+  return !(n > 0 || h->readonly);
 }
 
 static int
 nbdplug_can_flush (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_flush (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_flush, "flush flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check flush flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i;
+  return (size_t) n == h->nr_conns;
 }
 
 static int
 nbdplug_is_rotational (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_rotational (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_is_rotational, "rotational flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check rotational flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i;
+  return n > 0;
 }
 
 static int
 nbdplug_can_trim (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_trim (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_trim, "trim flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check trim flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i;
+  return (size_t) n == h->nr_conns;
 }
 
 static int
 nbdplug_can_zero (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_zero (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_zero, "zero flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check zero flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i;
+  return (size_t) n == h->nr_conns;
 }
 
 static int
@@ -909,13 +1448,11 @@ nbdplug_can_fast_zero (void *handle)
 {
 #if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
   struct handle *h = handle;
-  int i = nbd_can_fast_zero (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_fast_zero, "fast zero flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check fast zero flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i;
+  return (size_t) n == h->nr_conns;
 #else
   /* libnbd 0.9.8 lacks fast zero support */
   return 0;
@@ -926,52 +1463,268 @@ static int
 nbdplug_can_fua (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_fua (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_fua, "fua flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check fua flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i ? NBDKIT_FUA_NATIVE : NBDKIT_FUA_NONE;
+  return (size_t) n == h->nr_conns ? NBDKIT_FUA_NATIVE : NBDKIT_FUA_NONE;
 }
 
 static int
 nbdplug_can_multi_conn (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_multi_conn (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_multi_conn, "multi-conn flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i;
+  return (size_t) n == h->nr_conns;
 }
 
 static int
 nbdplug_can_cache (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_cache (h->nbd);
+  int n = nbdplug_count_flag (h, nbd_can_cache, "cache flag");
 
-  if (i == -1) {
-    nbdkit_error ("failure to check cache flag: %s", nbd_get_error ());
+  if (n == -1)
     return -1;
-  }
-  return i ? NBDKIT_CACHE_NATIVE : NBDKIT_CACHE_NONE;
+  return (size_t) n == h->nr_conns ? NBDKIT_CACHE_NATIVE : NBDKIT_CACHE_NONE;
 }
 
 static int
 nbdplug_can_extents (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i) {
+    int r = nbd_can_meta_context (h->conns[i].nbd,
+                                  LIBNBD_CONTEXT_BASE_ALLOCATION);
+
+    if (r == -1) {
+      nbdkit_error ("failure to check extents ability: %s", nbd_get_error ());
+      return -1;
+    }
+    if (!r)
+      return 0;
+  }
+  return 1;
+}
+
+/* Striping.
+ *
+ * Stripe s of the export is stored on server s % N at offset
+ * (s / N) * stripe_size.  A request is split into one chunk per
+ * stripe it touches, and the chunks are sent to the servers
+ * concurrently.
+ */
+enum stripe_op { STRIPE_PREAD, STRIPE_PWRITE, STRIPE_ZERO, STRIPE_TRIM,
+                 STRIPE_CACHE, STRIPE_EXTENTS };
+
+struct extent {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t type;
+};
+DEFINE_VECTOR_TYPE(extent_vector, struct extent);
+
+struct chunk {
+  struct conn *c;
+  uint64_t offset;              /* Offset in the export */
+  uint64_t server_offset;       /* Offset on the server */
+  uint32_t count;
+  struct transaction trans;
+  extent_vector extents;        /* Only used by STRIPE_EXTENTS */
+};
+
+/* Maximum number of chunks queried for a single extents request.
+ * Clients may ask about very large ranges, and it is fine to return
+ * only the start of the range.
+ */
+#define MAX_EXTENTS_CHUNKS 64
 
-  if (i == -1) {
-    nbdkit_error ("failure to check extents ability: %s", nbd_get_error ());
+/* Split a request into chunks.  If merge is true (for requests which
+ * do not have a buffer) the chunks belonging to the same server are
+ * merged, since they are contiguous on the server.  Returns the
+ * number of chunks or -1 on error.
+ */
+static ssize_t
+stripe_split (struct handle *h, uint32_t count, uint64_t offset,
+              bool merge, size_t max, struct chunk **chunks_rtn)
+{
+  const uint64_t n = h->nr_conns;
+  struct chunk *chunks;
+  ssize_t merged[MAX_CONNECTIONS];
+  size_t nr = 0, i;
+
+  chunks = calloc (MIN ((count + stripe_size - 1) / stripe_size + 1, max),
+                   sizeof *chunks);
+  if (chunks == NULL) {
+    nbdkit_error ("calloc: %m");
     return -1;
   }
-  return i;
+  for (i = 0; i < MAX_CONNECTIONS; ++i)
+    merged[i] = -1;
+
+  while (count > 0 && nr < max) {
+    const uint64_t stripe = offset / stripe_size;
+    const uint64_t server = stripe % n;
+    const uint64_t skip = offset % stripe_size;
+    const uint32_t len = MIN (stripe_size - skip, count);
+
+    if (merge && merged[server] >= 0)
+      chunks[merged[server]].count += len;
+    else {
+      chunks[nr].c = &h->conns[server];
+      chunks[nr].offset = offset;
+      chunks[nr].server_offset = (stripe / n) * stripe_size + skip;
+      chunks[nr].count = len;
+      if (merge)
+        merged[server] = nr;
+      nr++;
+    }
+
+    offset += len;
+    count -= len;
+  }
+
+  *chunks_rtn = chunks;
+  return nr;
+}
+
+static int
+stripe_extent (void *opaque, const char *metacontext, uint64_t offset,
+               uint32_t *entries, size_t nr_entries, int *error)
+{
+  struct chunk *chunk = opaque;
+
+  assert (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) == 0);
+  assert (nr_entries % 2 == 0);
+  while (nr_entries) {
+    struct extent e = { .offset = offset, .length = entries[0],
+                        .type = entries[1] };
+
+    if (extent_vector_append (&chunk->extents, e) == -1) {
+      *error = errno;
+      return -1;
+    }
+    offset += entries[0];
+    entries += 2;
+    nr_entries -= 2;
+  }
+  return 0;
+}
+
+/* Add the extents returned for each chunk to the reply, in order.
+ * Stop at the first chunk which was not fully described, since the
+ * extents must be contiguous.
+ */
+static int
+stripe_add_extents (struct chunk *chunks, size_t nr,
+                    struct nbdkit_extents *extents)
+{
+  size_t i, j;
+
+  for (i = 0; i < nr; ++i) {
+    struct chunk *chunk = &chunks[i];
+    uint64_t end = chunk->server_offset + chunk->count;
+    uint64_t pos = chunk->server_offset;
+
+    for (j = 0; j < chunk->extents.len && pos < end; ++j) {
+      const struct extent *e = &chunk->extents.ptr[j];
+      uint64_t e_end = MIN (e->offset + e->length, end);
+
+      if (e->offset != pos || e_end <= pos)
+        break;
+      if (nbdkit_add_extent (extents,
+                             chunk->offset + (pos - chunk->server_offset),
+                             e_end - pos, e->type) == -1)
+        return -1;
+      pos = e_end;
+    }
+    if (pos < end)
+      break;
+  }
+  return 0;
+}
+
+/* Perform a request when striping. */
+static int
+stripe_request (struct handle *h, enum stripe_op op, void *buf,
+                uint32_t count, uint64_t offset, uint32_t f,
+                struct nbdkit_extents *extents)
+{
+  CLEANUP_FREE struct chunk *chunks = NULL;
+  const bool merge =
+    op == STRIPE_ZERO || op == STRIPE_TRIM || op == STRIPE_CACHE;
+  size_t max = SIZE_MAX;
+  ssize_t nr, i;
+  int err = 0;
+
+  if (op == STRIPE_EXTENTS)
+    max = f & LIBNBD_CMD_FLAG_REQ_ONE ? 1 : MAX_EXTENTS_CHUNKS;
+
+  nr = stripe_split (h, count, offset, merge, max, &chunks);
+  if (nr == -1)
+    return -1;
+
+  for (i = 0; i < nr; ++i) {
+    struct chunk *chunk = &chunks[i];
+    struct conn *c = chunk->c;
+    char *p = buf ? (char *) buf + (chunk->offset - offset) : NULL;
+    nbd_extent_callback extcb = { stripe_extent, chunk };
+    int64_t cookie = -1;
+
+    __atomic_add_fetch (&c->in_flight, 1, __ATOMIC_RELAXED);
+    nbdplug_prepare (&chunk->trans);
+    switch (op) {
+    case STRIPE_PREAD:
+      cookie = nbd_aio_pread (c->nbd, p, chunk->count, chunk->server_offset,
+                              chunk->trans.cb, f);
+      break;
+    case STRIPE_PWRITE:
+      cookie = nbd_aio_pwrite (c->nbd, p, chunk->count, chunk->server_offset,
+                               chunk->trans.cb, f);
+      break;
+    case STRIPE_ZERO:
+      cookie = nbd_aio_zero (c->nbd, chunk->count, chunk->server_offset,
+                             chunk->trans.cb, f);
+      break;
+    case STRIPE_TRIM:
+      cookie = nbd_aio_trim (c->nbd, chunk->count, chunk->server_offset,
+                             chunk->trans.cb, f);
+      break;
+    case STRIPE_CACHE:
+      cookie = nbd_aio_cache (c->nbd, chunk->count, chunk->server_offset,
+                              chunk->trans.cb, f);
+      break;
+    case STRIPE_EXTENTS:
+      cookie = nbd_aio_block_status (c->nbd, chunk->count,
+                                     chunk->server_offset,
+                                     extcb, chunk->trans.cb, f);
+      break;
+    }
+    nbdplug_register (c, &chunk->trans, cookie);
+  }
+
+  for (i = 0; i < nr; ++i) {
+    if (nbdplug_reply (chunks[i].c, &chunks[i].trans) == -1 && !err)
+      err = errno;
+  }
+
+  if (!err && op == STRIPE_EXTENTS &&
+      stripe_add_extents (chunks, nr, extents) == -1)
+    err = errno;
+
+  for (i = 0; i < nr; ++i)
+    free (chunks[i].extents.ptr);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
 }
 
 /* Read data from the file. */
@@ -980,13 +1733,17 @@ nbdplug_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c;
   struct transaction s;
 
   assert (!flags);
+  if (striped)
+    return stripe_request (h, STRIPE_PREAD, buf, count, offset, 0, NULL);
+  c = nbdplug_get_conn (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pread (h->nbd, buf, count, offset,
+  nbdplug_register (c, &s, nbd_aio_pread (c->nbd, buf, count, offset,
                                           s.cb, 0));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Write data to the file. */
@@ -995,14 +1752,19 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
                 uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c;
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (striped)
+    return stripe_request (h, STRIPE_PWRITE, (void *) buf, count, offset, f,
+                           NULL);
+  c = nbdplug_get_conn (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pwrite (h->nbd, buf, count, offset,
+  nbdplug_register (c, &s, nbd_aio_pwrite (c->nbd, buf, count, offset,
                                            s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Write zeroes to the file. */
@@ -1010,6 +1772,7 @@ static int
 nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c;
   struct transaction s;
   uint32_t f = 0;
 
@@ -1026,9 +1789,12 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 #else
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
+  if (striped)
+    return stripe_request (h, STRIPE_ZERO, NULL, count, offset, f, NULL);
+  c = nbdplug_get_conn (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_zero (c->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (c, &s);
 }
 
 /* Trim a portion of the file. */
@@ -1036,26 +1802,47 @@ static int
 nbdplug_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c;
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
+  if (striped)
+    return stripe_request (h, STRIPE_TRIM, NULL, count, offset, f, NULL);
+  c = nbdplug_get_conn (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_trim (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_trim (c->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (c, &s);
 }
 
-/* Flush the file to disk. */
+/* Flush the file to disk.  The flush is sent on every connection in
+ * parallel, and fails if any of them fails.
+ */
 static int
 nbdplug_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
-  struct transaction s;
+  struct transaction s[MAX_CONNECTIONS];
+  size_t i;
+  int err = 0;
 
   assert (!flags);
-  nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_flush (h->nbd, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  for (i = 0; i < h->nr_conns; ++i) {
+    struct conn *c = &h->conns[i];
+
+    __atomic_add_fetch (&c->in_flight, 1, __ATOMIC_RELAXED);
+    nbdplug_prepare (&s[i]);
+    nbdplug_register (c, &s[i], nbd_aio_flush (c->nbd, s[i].cb, 0));
+  }
+  for (i = 0; i < h->nr_conns; ++i) {
+    if (nbdplug_reply (&h->conns[i], &s[i]) == -1 && !err)
+      err = errno;
+  }
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
 }
 
 static int
@@ -1085,15 +1872,20 @@ nbdplug_extents (void *handle, uint32_t count, uint64_t offset,
                  uint32_t flags, struct nbdkit_extents *extents)
 {
   struct handle *h = handle;
+  struct conn *c;
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_REQ_ONE ? LIBNBD_CMD_FLAG_REQ_ONE : 0;
   nbd_extent_callback extcb = { nbdplug_extent, extents };
 
   assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
+  if (striped)
+    return stripe_request (h, STRIPE_EXTENTS, NULL, count, offset, f,
+                           extents);
+  c = nbdplug_get_conn (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_block_status (h->nbd, count, offset,
+  nbdplug_register (c, &s, nbd_aio_block_status (c->nbd, count, offset,
                                                  extcb, s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Cache a portion of the file. */
@@ -1101,12 +1893,16 @@ static int
 nbdplug_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c;
   struct transaction s;
 
   assert (!flags);
+  if (striped)
+    return stripe_request (h, STRIPE_CACHE, NULL, count, offset, 0, NULL);
+  c = nbdplug_get_conn (h);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_cache (h->nbd, count, offset, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_cache (c->nbd, count, offset, s.cb, 0));
+  return nbdplug_reply (c, &s);
 }
 
 static struct nbdkit_plugin plugin = {
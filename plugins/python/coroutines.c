@@ -0,0 +1,246 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Support for plugin callbacks defined with "async def".  Coroutines
+ * returned by callbacks are run on a single asyncio event loop which
+ * runs in its own thread, so many requests can be waiting on I/O at
+ * the same time while the nbdkit worker threads wait for the results
+ * with the GIL released.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "plugin.h"
+
+/* This module is created the first time it is needed, so that
+ * plugins which don't use coroutines don't pay for importing asyncio.
+ *
+ * Errors set with nbdkit.set_error in a coroutine cannot be stored in
+ * last_error because the coroutine runs in the event loop thread, and
+ * many coroutines may be running at once.  Instead they are stored in
+ * a context variable (each task has its own context) and copied back
+ * to the waiting worker thread in await_result.
+ */
+static const char helper_code[] =
+  "import asyncio\n"
+  "import contextvars\n"
+  "import threading\n"
+  "\n"
+  "error = contextvars.ContextVar('nbdkit_error', default=0)\n"
+  "loop = None\n"
+  "thread = None\n"
+  "\n"
+  "def start():\n"
+  "    global loop, thread\n"
+  "    loop = asyncio.new_event_loop()\n"
+  "    thread = threading.Thread(target=loop.run_forever,\n"
+  "                              name='nbdkit-asyncio', daemon=True)\n"
+  "    thread.start()\n"
+  "\n"
+  "def stop():\n"
+  "    if loop is not None:\n"
+  "        loop.call_soon_threadsafe(loop.stop)\n"
+  "        thread.join()\n"
+  "        loop.close()\n"
+  "\n"
+  "async def wrap(coro, err):\n"
+  "    error.set(0)\n"
+  "    try:\n"
+  "        return await coro\n"
+  "    finally:\n"
+  "        err[0] = error.get()\n"
+  "\n"
+  "def run(coro, err):\n"
+  "    if loop is None:\n"
+  "        return asyncio.run(wrap(coro, err))\n"
+  "    fut = asyncio.run_coroutine_threadsafe(wrap(coro, err), loop)\n"
+  "    return fut.result()\n";
+
+static PyObject *helper;        /* Globals of helper_code. */
+
+static PyObject *
+get_helper (void)
+{
+  PyObject *globals, *r;
+
+  if (helper)
+    return helper;
+
+  globals = PyDict_New ();
+  if (globals == NULL)
+    return NULL;
+  if (PyDict_SetItemString (globals, "__builtins__",
+                            PyEval_GetBuiltins ()) == -1) {
+    Py_DECREF (globals);
+    return NULL;
+  }
+  r = PyRun_String (helper_code, Py_file_input, globals, globals);
+  if (r == NULL) {
+    Py_DECREF (globals);
+    return NULL;
+  }
+  Py_DECREF (r);
+
+  /* Importing may have released the GIL and let another thread get
+   * here first.  The globals are equivalent, so keep whichever was
+   * stored first.
+   */
+  if (helper == NULL)
+    helper = globals;
+  else
+    Py_DECREF (globals);
+  return helper;
+}
+
+static PyObject *
+call_helper (const char *name, PyObject *arg1, PyObject *arg2)
+{
+  PyObject *fn;
+
+  if (get_helper () == NULL)
+    return NULL;
+  fn = PyDict_GetItemString (helper, name);
+  assert (fn != NULL);
+  return PyObject_CallFunctionObjArgs (fn, arg1, arg2, NULL);
+}
+
+/* Is fn a function defined with "async def"? */
+int
+is_coroutine_function (PyObject *fn)
+{
+  PyCodeObject *code;
+
+  if (PyMethod_Check (fn))
+    fn = PyMethod_GET_FUNCTION (fn);
+  if (!PyFunction_Check (fn))
+    return 0;
+  code = (PyCodeObject *) PyFunction_GET_CODE (fn);
+  return (code->co_flags & CO_COROUTINE) != 0;
+}
+
+/* Called from .after_fork.  If the script defines any coroutine
+ * functions, start the event loop thread.  This must not be done
+ * earlier because threads do not survive nbdkit forking into the
+ * background.  Coroutines returned before this (or if there is no
+ * event loop) are run to completion with asyncio.run.
+ */
+int
+start_event_loop (void)
+{
+  PyObject *dict, *value;
+  Py_ssize_t pos = 0;
+  PyObject *r;
+
+  dict = PyModule_GetDict (module);
+  while (PyDict_Next (dict, &pos, NULL, &value)) {
+    if (is_coroutine_function (value)) {
+      nbdkit_debug ("%s: starting asyncio event loop", script);
+      r = call_helper ("start", NULL, NULL);
+      if (check_python_failure ("asyncio") == -1)
+        return -1;
+      Py_DECREF (r);
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+/* Called from .unload with the GIL held. */
+void
+stop_event_loop (void)
+{
+  PyObject *r;
+
+  if (helper == NULL)
+    return;
+
+  r = call_helper ("stop", NULL, NULL);
+  if (check_python_failure ("asyncio") == 0)
+    Py_DECREF (r);
+  Py_CLEAR (helper);
+}
+
+/* Called by nbdkit.set_error. */
+void
+set_coroutine_error (int err)
+{
+  PyObject *var, *value, *token;
+
+  if (helper == NULL)
+    return;
+
+  var = PyDict_GetItemString (helper, "error");
+  value = PyLong_FromLong (err);
+  if (value == NULL)
+    return;
+  token = PyContextVar_Set (var, value);
+  Py_DECREF (value);
+  Py_XDECREF (token);
+}
+
+/* All callbacks pass their result through this function.  If the
+ * result is a coroutine, run it and return its result instead.  This
+ * steals the reference to r.  If r is NULL (the callback raised an
+ * exception) it is returned unchanged.
+ */
+PyObject *
+await_result (PyObject *r)
+{
+  PyObject *err, *ret;
+  long e;
+
+  if (r == NULL || !PyCoro_CheckExact (r))
+    return r;
+
+  err = Py_BuildValue ("[i]", 0);
+  if (err == NULL) {
+    Py_DECREF (r);
+    return NULL;
+  }
+
+  ret = call_helper ("run", r, err);
+  Py_DECREF (r);
+
+  e = PyLong_AsLong (PyList_GET_ITEM (err, 0));
+  Py_DECREF (err);
+  if (e > 0) {
+    nbdkit_set_error (e);
+    last_error = e;
+  }
+
+  return ret;
+}
@@ -82,6 +82,7 @@ set_error (PyObject *self, PyObject *args)
     return NULL;
   nbdkit_set_error (err);
   last_error = err;
+  set_coroutine_error (err);
   Py_RETURN_NONE;
 }
 
@@ -128,6 +129,13 @@ create_nbdkit_module (void)
     exit (EXIT_FAILURE);
   }
 
+#ifdef Py_GIL_DISABLED
+  /* The functions in this module do not rely on the GIL.  Without
+   * this, importing it re-enables the GIL in free-threaded builds.
+   */
+  PyUnstable_Module_SetGIL (m, Py_MOD_GIL_NOT_USED);
+#endif
+
   /* Constants corresponding to various flags. */
 #define ADD_INT_CONSTANT(name)                                      \
   if (PyModule_AddIntConstant (m, #name, NBDKIT_##name) == -1) {    \
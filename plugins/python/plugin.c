@@ -74,6 +74,7 @@ py_unload (void)
 {
   if (tstate) {
     PyEval_RestoreThread (tstate);
+    stop_event_loop ();
     Py_XDECREF (module);
     Py_Finalize ();
   }
@@ -89,6 +90,11 @@ py_dump_plugin (void)
   /* Python version and ABI. */
   printf ("python_version=%s\n", PY_VERSION);
   printf ("python_pep_384_abi_version=%d\n", PYTHON_ABI_VERSION);
+#ifdef Py_GIL_DISABLED
+  printf ("python_free_threaded=1\n");
+#else
+  printf ("python_free_threaded=0\n");
+#endif
 
   /* Maximum nbdkit API version supported. */
   printf ("nbdkit_python_maximum_api_version=%d\n", NBDKIT_API_VERSION);
@@ -98,6 +104,7 @@ py_dump_plugin (void)
     PyErr_Clear ();
 
     r = PyObject_CallObject (fn, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     Py_DECREF (r);
   }
@@ -201,6 +208,7 @@ py_config (const char *key, const char *value)
     PyErr_Clear ();
 
     r = PyObject_CallFunction (fn, "ss", key, value);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("config") == -1)
       return -1;
@@ -227,6 +235,7 @@ py_config_complete (void)
     PyErr_Clear ();
 
     r = PyObject_CallObject (fn, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("config_complete") == -1)
       return -1;
@@ -248,12 +257,22 @@ py_thread_model (void)
     PyErr_Clear ();
 
     r = PyObject_CallObject (fn, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("thread_model") == -1)
       return -1;
     ret = PyLong_AsLong (r);
     Py_DECREF (r);
   }
+  /* Coroutines all run in the single event loop thread and only
+   * interleave at "await", so a plugin with "async def pread" is
+   * given the parallel thread model by default.
+   */
+  else if (script && callback_defined ("pread", &fn)) {
+    if (is_coroutine_function (fn))
+      ret = NBDKIT_THREAD_MODEL_PARALLEL;
+    Py_DECREF (fn);
+  }
 
   return ret;
 }
@@ -269,6 +288,7 @@ py_get_ready (void)
     PyErr_Clear ();
 
     r = PyObject_CallObject (fn, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("get_ready") == -1)
       return -1;
@@ -285,10 +305,14 @@ py_after_fork (void)
   PyObject *fn;
   PyObject *r;
 
+  if (start_event_loop () == -1)
+    return -1;
+
   if (callback_defined ("after_fork", &fn)) {
     PyErr_Clear ();
 
     r = PyObject_CallObject (fn, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("after_fork") == -1)
       return -1;
@@ -309,6 +333,7 @@ py_cleanup (void)
     PyErr_Clear ();
 
     r = PyObject_CallObject (fn, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("cleanup") == -1)
       return;
@@ -331,6 +356,7 @@ py_list_exports (int readonly, int is_tls, struct nbdkit_exports *exports)
   PyErr_Clear ();
 
   r = PyObject_CallFunction (fn, "ii", readonly, is_tls);
+  r = await_result (r);
   Py_DECREF (fn);
   if (check_python_failure ("list_exports") == -1)
     return -1;
@@ -395,6 +421,7 @@ py_default_export (int readonly, int is_tls)
   PyErr_Clear ();
 
   r = PyObject_CallFunction (fn, "ii", readonly, is_tls);
+  r = await_result (r);
   Py_DECREF (fn);
   if (check_python_failure ("default_export") == -1)
     return NULL;
@@ -421,6 +448,7 @@ py_preconnect (int readonly)
 
     r = PyObject_CallFunctionObjArgs (fn, readonly ? Py_True : Py_False,
                                       NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("preconnect") == -1)
       return -1;
@@ -458,6 +486,7 @@ py_open (int readonly)
 
   h->py_h = PyObject_CallFunctionObjArgs (fn, readonly ? Py_True : Py_False,
                                           NULL);
+  h->py_h = await_result (h->py_h);
   Py_DECREF (fn);
   if (check_python_failure ("open") == -1) {
     free (h);
@@ -480,6 +509,7 @@ py_close (void *handle)
     PyErr_Clear ();
 
     r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     check_python_failure ("close");
     Py_XDECREF (r);
@@ -504,6 +534,7 @@ py_export_description (void *handle)
   PyErr_Clear ();
 
   r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+  r = await_result (r);
   Py_DECREF (fn);
   if (check_python_failure ("export_description") == -1)
     return NULL;
@@ -535,6 +566,7 @@ py_get_size (void *handle)
   PyErr_Clear ();
 
   r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+  r = await_result (r);
   Py_DECREF (fn);
   if (check_python_failure ("get_size") == -1)
     return -1;
@@ -576,6 +608,7 @@ py_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
     break;
   default: abort ();
   }
+  r = await_result (r);
   Py_DECREF (fn);
   if (check_python_failure ("pread") == -1)
     return ret;
@@ -635,6 +668,7 @@ py_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
       break;
     default: abort ();
     }
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("pwrite") == -1)
       return -1;
@@ -668,6 +702,7 @@ py_flush (void *handle, uint32_t flags)
       break;
     default: abort ();
     }
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("flush") == -1)
       return -1;
@@ -701,6 +736,7 @@ py_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       break;
     default: abort ();
     }
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("trim") == -1)
       return -1;
@@ -739,6 +775,7 @@ py_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       break;
     default: abort ();
     }
+    r = await_result (r);
     Py_DECREF (fn);
     if (last_error == EOPNOTSUPP || last_error == ENOTSUP) {
       /* When user requests this particular error, we want to
@@ -779,6 +816,7 @@ py_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
       break;
     default: abort ();
     }
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("cache") == -1)
       return -1;
@@ -804,6 +842,7 @@ boolean_callback (void *handle, const char *can_fn, const char *plain_fn)
     PyErr_Clear ();
 
     r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure (can_fn) == -1)
       return -1;
@@ -898,6 +937,7 @@ py_can_fua (void *handle)
     PyErr_Clear ();
 
     r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("can_fua") == -1)
       return -1;
@@ -927,6 +967,7 @@ py_can_cache (void *handle)
     PyErr_Clear ();
 
     r = PyObject_CallFunctionObjArgs (fn, h->py_h, NULL);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("can_cache") == -1)
       return -1;
@@ -965,6 +1006,7 @@ py_extents (void *handle, uint32_t count, uint64_t offset,
     PyErr_Clear ();
 
     r = PyObject_CallFunction (fn, "OiLI", h->py_h, count, offset, flags);
+    r = await_result (r);
     Py_DECREF (fn);
     if (check_python_failure ("extents") == -1)
       return -1;
@@ -65,6 +65,13 @@ extern __thread int last_error;
 extern int callback_defined (const char *name, PyObject **obj_rtn);
 extern char *python_to_string (PyObject *str);
 
+/* coroutines.c */
+extern int is_coroutine_function (PyObject *fn);
+extern int start_event_loop (void);
+extern void stop_event_loop (void);
+extern void set_coroutine_error (int err);
+extern PyObject *await_result (PyObject *r);
+
 /* errors.c */
 extern int check_python_failure (const char *callback);
 
@@ -36,12 +36,14 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -563,3 +565,244 @@ call_write (const char *wbuf, size_t wbuflen, const char **argv)
     return ERROR;
   }
 }
+
+/* A long-running coprocess, see "Coprocess mode" in
+ * nbdkit-sh-plugin(3).  Requests are sent to the coprocess stdin and
+ * replies are read from its stdout.  The coprocess stderr is
+ * inherited from nbdkit.
+ */
+struct coprocess {
+  pthread_mutex_t lock;        /* Serializes requests. */
+  char *argv0;                 /* Script name, used in error messages. */
+  pid_t pid;
+  FILE *in;                    /* Connected to coprocess stdin. */
+  FILE *out;                   /* Connected to coprocess stdout. */
+  bool broken;                 /* Set if the protocol broke down. */
+};
+
+/* Start the coprocess.  Returns NULL on error. */
+struct coprocess *
+coprocess_start (const char **argv)
+{
+  const char *argv0 = argv[0];
+  struct coprocess *cp = NULL;
+  pid_t pid;
+  int in_fd[2] = { -1, -1 };
+  int out_fd[2] = { -1, -1 };
+
+  debug_call (argv);
+
+  /* See the comments about CLOEXEC in call3 above. */
+#ifdef HAVE_PIPE2
+  if (pipe2 (in_fd, O_CLOEXEC) == -1 || pipe2 (out_fd, O_CLOEXEC) == -1) {
+    nbdkit_error ("%s: pipe2: %m", argv0);
+    goto error;
+  }
+#else
+  if (pipe (in_fd) == -1 || pipe (out_fd) == -1) {
+    nbdkit_error ("%s: pipe: %m", argv0);
+    goto error;
+  }
+#endif
+
+  assert (in_fd[0] > STDERR_FILENO && in_fd[1] > STDERR_FILENO &&
+          out_fd[0] > STDERR_FILENO && out_fd[1] > STDERR_FILENO);
+
+  cp = calloc (1, sizeof *cp);
+  if (cp == NULL) {
+    nbdkit_error ("%s: calloc: %m", argv0);
+    goto error;
+  }
+  cp->argv0 = strdup (argv0);
+  if (cp->argv0 == NULL) {
+    nbdkit_error ("%s: strdup: %m", argv0);
+    goto error;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    nbdkit_error ("%s: fork: %m", argv0);
+    goto error;
+  }
+
+  if (pid == 0) {               /* Child. */
+    close (in_fd[1]);
+    close (out_fd[0]);
+    dup2 (in_fd[0], 0);
+    dup2 (out_fd[1], 1);
+    close (in_fd[0]);
+    close (out_fd[1]);
+    signal (SIGPIPE, SIG_DFL);
+    environ = env;
+    execvp (argv[0], (char **) argv);
+    perror (argv[0]);
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Parent. */
+  cp->pid = pid;
+  close (in_fd[0]);  in_fd[0] = -1;
+  close (out_fd[1]); out_fd[1] = -1;
+  cp->in = fdopen (in_fd[1], "w");
+  if (cp->in == NULL) {
+    nbdkit_error ("%s: fdopen: %m", argv0);
+    goto error;
+  }
+  in_fd[1] = -1;
+  cp->out = fdopen (out_fd[0], "r");
+  if (cp->out == NULL) {
+    nbdkit_error ("%s: fdopen: %m", argv0);
+    goto error;
+  }
+  out_fd[0] = -1;
+
+  pthread_mutex_init (&cp->lock, NULL);
+  nbdkit_debug ("%s: started coprocess pid %d", argv0, (int) pid);
+  return cp;
+
+ error:
+  if (in_fd[0] >= 0)
+    close (in_fd[0]);
+  if (in_fd[1] >= 0)
+    close (in_fd[1]);
+  if (out_fd[0] >= 0)
+    close (out_fd[0]);
+  if (out_fd[1] >= 0)
+    close (out_fd[1]);
+  if (cp) {
+    if (cp->in)
+      fclose (cp->in);
+    if (cp->pid > 0)
+      waitpid (cp->pid, NULL, 0);
+    free (cp->argv0);
+    free (cp);
+  }
+  return NULL;
+}
+
+/* Close the coprocess stdin and wait for it to exit. */
+void
+coprocess_stop (struct coprocess *cp)
+{
+  int status;
+
+  if (cp == NULL)
+    return;
+
+  fclose (cp->in);
+  fclose (cp->out);
+  if (waitpid (cp->pid, &status, 0) == -1)
+    nbdkit_debug ("%s: waitpid: %m", cp->argv0);
+  else if (WIFSIGNALED (status))
+    nbdkit_debug ("%s: coprocess terminated by signal %d",
+                  cp->argv0, WTERMSIG (status));
+  else if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
+    nbdkit_debug ("%s: coprocess exited with status %d",
+                  cp->argv0, WEXITSTATUS (status));
+  pthread_mutex_destroy (&cp->lock);
+  free (cp->argv0);
+  free (cp);
+}
+
+/* Send one request to the coprocess and read the reply.  argv has
+ * the same layout as for call(), but argv[0] is ignored.  If rbuf is
+ * NULL then any reply data is discarded.  Returns the status from
+ * the coprocess which has the same meaning as the exit code of the
+ * script.
+ *
+ * Arguments are sent one per line, so if any argument contains a
+ * newline this returns MISSING without contacting the coprocess and
+ * the caller falls back to running the script.
+ */
+exit_code
+coprocess_call (struct coprocess *cp,
+                const char *wbuf, size_t wbuflen,
+                char **rbuf, size_t *rbuflen,
+                const char **argv)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cp->lock);
+  CLEANUP_FREE char *line = NULL;
+  size_t linealloc = 0;
+  CLEANUP_FREE char *buf = NULL;
+  size_t i, nargs, len;
+  int status;
+
+  if (rbuf) {
+    *rbuf = NULL;
+    *rbuflen = 0;
+  }
+
+  for (i = 2; argv[i] != NULL; ++i) {
+    if (strchr (argv[i], '\n') != NULL)
+      return MISSING;
+  }
+  nargs = i - 2;
+
+  if (cp->broken) {
+    nbdkit_error ("%s: coprocess is no longer running", cp->argv0);
+    errno = EIO;
+    return ERROR;
+  }
+
+  /* Send the request. */
+  if (fprintf (cp->in, "%s %zu %zu\n", argv[1], nargs, wbuflen) < 0)
+    goto write_error;
+  for (i = 2; argv[i] != NULL; ++i) {
+    if (fprintf (cp->in, "%s\n", argv[i]) < 0)
+      goto write_error;
+  }
+  if (wbuflen > 0 && fwrite (wbuf, 1, wbuflen, cp->in) != wbuflen)
+    goto write_error;
+  if (fflush (cp->in) == EOF)
+    goto write_error;
+
+  /* Read the reply. */
+  if (getline (&line, &linealloc, cp->out) == -1)
+    goto read_error;
+  if (sscanf (line, "%d %zu", &status, &len) != 2) {
+    nbdkit_error ("%s: coprocess: could not parse reply: %s",
+                  cp->argv0, line);
+    goto broken;
+  }
+  buf = malloc (len + 1);
+  if (buf == NULL) {
+    nbdkit_error ("%s: malloc: %m", cp->argv0);
+    goto broken;
+  }
+  if (len > 0 && fread (buf, 1, len, cp->out) != len)
+    goto read_error;
+  buf[len] = '\0';
+
+  switch (status) {
+  case OK:
+  case MISSING:
+  case RET_FALSE:
+    if (rbuf) {
+      *rbuf = buf;
+      *rbuflen = len;
+      buf = NULL;
+    }
+    return status;
+
+  case ERROR:
+  default:
+    handle_script_error (cp->argv0, buf, len);
+    return ERROR;
+  }
+
+ write_error:
+  nbdkit_error ("%s: coprocess: write: %m", cp->argv0);
+  goto broken;
+ read_error:
+  if (feof (cp->out))
+    nbdkit_error ("%s: coprocess: unexpected end of file", cp->argv0);
+  else
+    nbdkit_error ("%s: coprocess: read: %m", cp->argv0);
+ broken:
+  /* The request and reply can no longer be matched up, so fail all
+   * further requests.
+   */
+  cp->broken = true;
+  errno = EIO;
+  return ERROR;
+}
@@ -60,4 +60,17 @@ extern exit_code call_write (const char *wbuf, size_t wbuflen,
                              const char **argv)
   __attribute__((__nonnull__ (1, 3)));
 
+/* Coprocess mode: the script is started once and speaks a simple
+ * request/reply protocol over its stdin and stdout.
+ */
+struct coprocess;
+extern struct coprocess *coprocess_start (const char **argv)
+  __attribute__((__nonnull__ (1)));
+extern void coprocess_stop (struct coprocess *cp);
+extern exit_code coprocess_call (struct coprocess *cp,
+                                 const char *wbuf, size_t wbuflen,
+                                 char **rbuf, size_t *rbuflen,
+                                 const char **argv)
+  __attribute__((__nonnull__ (1, 6)));
+
 #endif /* NBDKIT_CALL_H */
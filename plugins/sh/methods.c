@@ -140,6 +140,77 @@ sh_thread_model (void)
   }
 }
 
+/* See "Coprocess mode" in nbdkit-sh-plugin(3). */
+static enum {
+  COPROCESS_NONE = 0,
+  COPROCESS_CONNECTION,
+  COPROCESS_GLOBAL,
+} coprocess_mode;
+static struct coprocess *global_coprocess;
+
+static int
+get_coprocess_mode (void)
+{
+  const char *method = "coprocess_mode";
+  const char *script = get_script (method);
+  const char *args[] = { script, method, NULL };
+  CLEANUP_FREE char *s = NULL;
+  size_t slen;
+
+  switch (call_read (&s, &slen, args)) {
+  case OK:
+    if (slen > 0 && s[slen-1] == '\n')
+      s[slen-1] = '\0';
+    if (ascii_strcasecmp (s, "connection") == 0)
+      coprocess_mode = COPROCESS_CONNECTION;
+    else if (ascii_strcasecmp (s, "global") == 0)
+      coprocess_mode = COPROCESS_GLOBAL;
+    else {
+      /* Older scripts may exit 0 for every unknown method, so
+       * anything unrecognized (including "none") disables the
+       * coprocess.
+       */
+      if (ascii_strcasecmp (s, "none") != 0)
+        nbdkit_debug ("%s: ignoring unrecognized coprocess mode: %s",
+                      script, s);
+      coprocess_mode = COPROCESS_NONE;
+    }
+    return 0;
+
+  case MISSING:
+    coprocess_mode = COPROCESS_NONE;
+    return 0;
+
+  case ERROR:
+    return -1;
+
+  case RET_FALSE:
+    nbdkit_error ("%s: %s method returned unexpected code (3/false)",
+                  script, method);
+    errno = EIO;
+    return -1;
+
+  default: abort ();
+  }
+}
+
+static struct coprocess *
+start_coprocess (const char *mode)
+{
+  const char *method = "coprocess";
+  const char *script = get_script (method);
+  const char *args[] = { script, method, mode, NULL };
+
+  return coprocess_start (args);
+}
+
+void
+sh_unload_coprocess (void)
+{
+  coprocess_stop (global_coprocess);
+  global_coprocess = NULL;
+}
+
 int
 sh_get_ready (void)
 {
@@ -150,7 +221,7 @@ sh_get_ready (void)
   switch (call (args)) {
   case OK:
   case MISSING:
-    return 0;
+    return get_coprocess_mode ();
 
   case ERROR:
     return -1;
@@ -175,6 +246,14 @@ sh_after_fork (void)
   switch (call (args)) {
   case OK:
   case MISSING:
+    /* The global coprocess must be started after nbdkit has forked
+     * into the background, otherwise it would not be our child.
+     */
+    if (coprocess_mode == COPROCESS_GLOBAL) {
+      global_coprocess = start_coprocess ("global");
+      if (global_coprocess == NULL)
+        return -1;
+    }
     return 0;
 
   case ERROR:
@@ -222,8 +301,41 @@ struct sh_handle {
   char *h;
   int can_flush;
   int can_zero;
+  struct coprocess *coprocess;  /* Per-connection coprocess or NULL. */
 };
 
+/* Run a method which takes a handle.  If there is a coprocess the
+ * request is sent to it, falling back to running the script if the
+ * coprocess does not implement the method.  wbuf and rbuf may be
+ * NULL, in which case this behaves like call() or call_read().
+ */
+static exit_code
+handle_call (struct sh_handle *h,
+             const char *wbuf, size_t wbuflen,
+             char **rbuf, size_t *rbuflen,
+             const char **argv)
+{
+  struct coprocess *cp = h->coprocess ? : global_coprocess;
+  exit_code r;
+
+  if (cp) {
+    r = coprocess_call (cp, wbuf, wbuflen, rbuf, rbuflen, argv);
+    if (r != MISSING)
+      return r;
+    if (rbuf) {
+      free (*rbuf);
+      *rbuf = NULL;
+    }
+  }
+
+  if (wbuf)
+    return call_write (wbuf, wbuflen, argv);
+  else if (rbuf)
+    return call_read (rbuf, rbuflen, argv);
+  else
+    return call (argv);
+}
+
 /* If @s begins with @prefix, return the next offset, else NULL */
 static const char *
 skip_prefix (const char *s, const char *prefix)
@@ -392,6 +504,7 @@ sh_open (int readonly)
   }
   h->can_flush = -1;
   h->can_zero = -1;
+  h->coprocess = NULL;
 
   /* We store the string returned by open in the handle. */
   switch (call_read (&h->h, &hlen, args)) {
@@ -403,7 +516,7 @@ sh_open (int readonly)
     }
     if (hlen > 0)
       nbdkit_debug ("sh: handle: %s", h->h);
-    return h;
+    break;
 
   case MISSING:
     /* Unlike regular C plugins, open is not required.  If it is
@@ -417,7 +530,7 @@ sh_open (int readonly)
       free (h);
       return NULL;
     }
-    return h;
+    break;
 
   case ERROR:
     free (h->h);
@@ -434,6 +547,16 @@ sh_open (int readonly)
 
   default: abort ();
   }
+
+  if (coprocess_mode == COPROCESS_CONNECTION) {
+    h->coprocess = start_coprocess ("connection");
+    if (h->coprocess == NULL) {
+      sh_close (h);
+      return NULL;
+    }
+  }
+
+  return h;
 }
 
 void
@@ -444,11 +567,12 @@ sh_close (void *handle)
   struct sh_handle *h = handle;
   const char *args[] = { script, method, h->h, NULL };
 
-  switch (call (args)) {
+  switch (handle_call (h, NULL, 0, NULL, NULL, args)) {
   case OK:
   case MISSING:
   case ERROR:
   case RET_FALSE:
+    coprocess_stop (h->coprocess);
     free (h->h);
     free (h);
     return;
@@ -466,7 +590,7 @@ sh_export_description (void *handle)
   CLEANUP_FREE char *s = NULL;
   size_t slen;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (handle_call (h, NULL, 0, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -499,7 +623,7 @@ sh_get_size (void *handle)
   size_t slen;
   int64_t r;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (handle_call (h, NULL, 0, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -541,7 +665,7 @@ sh_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   snprintf (cbuf, sizeof cbuf, "%" PRIu32, count);
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
 
-  switch (call_read (&data, &len, args)) {
+  switch (handle_call (h, NULL, 0, &data, &len, args)) {
   case OK:
     if (count != len) {
       nbdkit_error ("%s: incorrect amount of data read: "
@@ -628,7 +752,7 @@ sh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call_write (buf, count, args)) {
+  switch (handle_call (h, buf, count, NULL, NULL, args)) {
   case OK:
     return 0;
 
@@ -657,7 +781,7 @@ boolean_method (const char *script, const char *method,
   struct sh_handle *h = handle;
   const char *args[] = { script, method, h->h, NULL };
 
-  switch (call (args)) {
+  switch (handle_call (h, NULL, 0, NULL, NULL, args)) {
   case OK:                      /* true */
     return 1;
   case RET_FALSE:               /* false */
@@ -750,7 +874,7 @@ sh_can_fua (void *handle)
   size_t slen;
   int r;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (handle_call (h, NULL, 0, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -805,7 +929,7 @@ sh_can_cache (void *handle)
   size_t slen;
   int r;
 
-  switch (call_read (&s, &slen, args)) {
+  switch (handle_call (h, NULL, 0, &s, &slen, args)) {
   case OK:
     if (slen > 0 && s[slen-1] == '\n')
       s[slen-1] = '\0';
@@ -867,7 +991,7 @@ sh_flush (void *handle, uint32_t flags)
   struct sh_handle *h = handle;
   const char *args[] = { script, method, h->h, NULL };
 
-  switch (call (args)) {
+  switch (handle_call (h, NULL, 0, NULL, NULL, args)) {
   case OK:
     return 0;
 
@@ -901,7 +1025,7 @@ sh_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call (args)) {
+  switch (handle_call (h, NULL, 0, NULL, NULL, args)) {
   case OK:
     return 0;
 
@@ -935,7 +1059,7 @@ sh_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call (args)) {
+  switch (handle_call (h, NULL, 0, NULL, NULL, args)) {
   case OK:
     return 0;
 
@@ -1043,7 +1167,7 @@ sh_extents (void *handle, uint32_t count, uint64_t offset, uint32_t flags,
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   flags_string (flags, fbuf, sizeof fbuf);
 
-  switch (call_read (&s, &slen, args)) {
+  switch (handle_call (h, NULL, 0, &s, &slen, args)) {
   case OK:
     r = parse_extents (script, s, slen, extents);
     return r;
@@ -1085,7 +1209,7 @@ sh_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   snprintf (obuf, sizeof obuf, "%" PRIu64, offset);
   assert (!flags);
 
-  switch (call (args)) {
+  switch (handle_call (h, NULL, 0, NULL, NULL, args)) {
   case OK:
     return 0;
 
@@ -39,6 +39,11 @@
  */
 extern const char *get_script (const char *method);
 
+/* Called by the plugin from .unload() to stop the global coprocess
+ * if there is one.
+ */
+extern void sh_unload_coprocess (void);
+
 extern void sh_dump_plugin (void);
 extern int sh_thread_model (void);
 extern int sh_get_ready (void);
@@ -43,11 +43,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdbool.h>
-#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
-#include "cleanup.h"
 #include "pread.h"
 #include "pwrite.h"
 #include "windows-compat.h"
@@ -57,12 +55,42 @@
 DEFINE_VECTOR_TYPE(string_vector, char *);
 static string_vector filenames = empty_vector;
 
-/* Any callbacks using lseek must be protected by this lock. */
-static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
+/* If non-zero, the files are striped (like RAID-0) instead of being
+ * concatenated.
+ */
+static uint64_t stripe_size = 0;
+
+/* The layout of the files, set up in split_get_ready.  The files must
+ * not be resized while nbdkit is running.
+ */
+struct file {
+  uint64_t offset, size;        /* Offset in the disk, when concatenated. */
+  bool can_extents;
+};
+static struct file *files;
+static uint64_t disk_size;
+
+/* File descriptors opened read-only, which are shared by all
+ * connections to a read-only export.  Since we only use pread and
+ * pwrite, and lseek with SEEK_DATA/SEEK_HOLE returns the result
+ * directly, no callback depends on the file offset of a descriptor, so
+ * descriptors may be used by many threads at once without locking.
+ */
+static int *ro_fds;
 
 static void
 split_unload (void)
 {
+  size_t i;
+
+  if (ro_fds) {
+    for (i = 0; i < filenames.len; ++i) {
+      if (ro_fds[i] >= 0)
+        close (ro_fds[i]);
+    }
+  }
+  free (ro_fds);
+  free (files);
   string_vector_iter (&filenames, (void *) free);
   free (filenames.ptr);
 }
@@ -71,6 +99,7 @@ static int
 split_config (const char *key, const char *value)
 {
   char *s;
+  int64_t r;
 
   if (strcmp (key, "file") == 0) {
     s = nbdkit_realpath (value);
@@ -81,6 +110,16 @@ split_config (const char *key, const char *value)
       return -1;
     }
   }
+  else if (strcmp (key, "stripe-size") == 0) {
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r == 0 || r % 512 != 0) {
+      nbdkit_error ("stripe-size must be a non-zero multiple of 512");
+      return -1;
+    }
+    stripe_size = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -90,102 +129,119 @@ split_config (const char *key, const char *value)
 }
 
 #define split_config_help \
-  "file=<FILENAME>  (required) File(s) to serve."
-
-/* The per-connection handle. */
-struct handle {
-  struct file *files;
-  uint64_t size;                /* Total concatenated size. */
-};
-
-struct file {
-  uint64_t offset, size;
-  int fd;
-  bool can_extents;
-};
+  "file=<FILENAME>  (required) File(s) to serve.\n" \
+  "stripe-size=<SIZE>          Stripe the files instead of concatenating."
 
-/* Create the per-connection handle. */
-static void *
-split_open (int readonly)
+/* Open the files read-only and work out the layout. */
+static int
+split_get_ready (void)
 {
-  struct handle *h;
-  int flags;
   size_t i;
-  uint64_t offset;
+  uint64_t offset, min_size = UINT64_MAX;
   struct stat statbuf;
   off_t r;
 
-  h = malloc (sizeof *h);
-  if (h == NULL) {
+  files = calloc (filenames.len, sizeof (struct file));
+  ro_fds = malloc (filenames.len * sizeof (int));
+  if (files == NULL || ro_fds == NULL) {
     nbdkit_error ("malloc: %m");
-    return NULL;
-  }
-
-  h->files = malloc (filenames.len * sizeof (struct file));
-  if (h->files == NULL) {
-    nbdkit_error ("malloc: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
   for (i = 0; i < filenames.len; ++i)
-    h->files[i].fd = -1;
-
-  /* Open the files. */
-  flags = O_CLOEXEC|O_NOCTTY;
-  if (readonly)
-    flags |= O_RDONLY;
-  else
-    flags |= O_RDWR;
+    ro_fds[i] = -1;
 
+  offset = 0;
   for (i = 0; i < filenames.len; ++i) {
-    h->files[i].fd = open (filenames.ptr[i], flags);
-    if (h->files[i].fd == -1) {
+    ro_fds[i] = open (filenames.ptr[i], O_RDONLY|O_CLOEXEC|O_NOCTTY);
+    if (ro_fds[i] == -1) {
       nbdkit_error ("open: %s: %m", filenames.ptr[i]);
-      goto err;
+      return -1;
     }
-  }
 
-  offset = 0;
-  for (i = 0; i < filenames.len; ++i) {
-    h->files[i].offset = offset;
+    files[i].offset = offset;
 
-    if (fstat (h->files[i].fd, &statbuf) == -1) {
+    if (fstat (ro_fds[i], &statbuf) == -1) {
       nbdkit_error ("stat: %s: %m", filenames.ptr[i]);
-      goto err;
+      return -1;
     }
-    h->files[i].size = statbuf.st_size;
+    files[i].size = statbuf.st_size;
     offset += statbuf.st_size;
+    if (files[i].size < min_size)
+      min_size = files[i].size;
 
     nbdkit_debug ("file[%zu]=%s: offset=%" PRIu64 ", size=%" PRIu64,
-                  i, filenames.ptr[i], h->files[i].offset, h->files[i].size);
+                  i, filenames.ptr[i], files[i].offset, files[i].size);
 
 #ifdef SEEK_HOLE
     /* Test if this file supports extents. */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
-    r = lseek (h->files[i].fd, 0, SEEK_DATA);
+    r = lseek (ro_fds[i], 0, SEEK_DATA);
     if (r == -1 && errno != ENXIO) {
       nbdkit_debug ("disabling extents: lseek on %s: %m", filenames.ptr[i]);
-      h->files[i].can_extents = false;
+      files[i].can_extents = false;
     }
     else
-      h->files[i].can_extents = true;
+      files[i].can_extents = true;
 #else
-    h->files[i].can_extents = false;
+    files[i].can_extents = false;
 #endif
   }
-  h->size = offset;
-  nbdkit_debug ("total size=%" PRIu64, h->size);
 
-  return h;
+  if (stripe_size == 0)
+    disk_size = offset;
+  else {
+    /* Only whole stripes of the smallest file can be used. */
+    disk_size = min_size / stripe_size * stripe_size * filenames.len;
+    nbdkit_debug ("striping: stripe size=%" PRIu64, stripe_size);
+  }
+  nbdkit_debug ("total size=%" PRIu64, disk_size);
+
+  return 0;
+}
+
+/* The per-connection handle. */
+struct handle {
+  int *fds;                     /* Either ro_fds or our own. */
+};
+
+/* Create the per-connection handle. */
+static void *
+split_open (int readonly)
+{
+  struct handle *h;
+  size_t i;
+
+  h = malloc (sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  if (readonly) {
+    h->fds = ro_fds;
+    return h;
+  }
+
+  /* Writable connections open the files again for writing. */
+  h->fds = malloc (filenames.len * sizeof (int));
+  if (h->fds == NULL) {
+    nbdkit_error ("malloc: %m");
+    free (h);
+    return NULL;
+  }
 
- err:
   for (i = 0; i < filenames.len; ++i) {
-    if (h->files[i].fd >= 0)
-      close (h->files[i].fd);
+    h->fds[i] = open (filenames.ptr[i], O_RDWR|O_CLOEXEC|O_NOCTTY);
+    if (h->fds[i] == -1) {
+      nbdkit_error ("open: %s: %m", filenames.ptr[i]);
+      while (i > 0)
+        close (h->fds[--i]);
+      free (h->fds);
+      free (h);
+      return NULL;
+    }
   }
-  free (h->files);
-  free (h);
-  return NULL;
+
+  return h;
 }
 
 /* Free up the per-connection handle. */
@@ -195,21 +251,21 @@ split_close (void *handle)
   struct handle *h = handle;
   size_t i;
 
-  for (i = 0; i < filenames.len; ++i)
-    close (h->files[i].fd);
-  free (h->files);
+  if (h->fds != ro_fds) {
+    for (i = 0; i < filenames.len; ++i)
+      close (h->fds[i]);
+    free (h->fds);
+  }
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the disk size. */
 static int64_t
 split_get_size (void *handle)
 {
-  struct handle *h = handle;
-
-  return (int64_t) h->size;
+  return (int64_t) disk_size;
 }
 
 static int
@@ -238,12 +294,35 @@ compare_offset (const void *offsetp, const void *filep)
   return 0;
 }
 
-static struct file *
-get_file (struct handle *h, uint64_t offset)
+/* Map an offset in the disk to a file index and the offset within
+ * that file, and return the number of bytes (up to count) which are
+ * contiguous in that file.
+ */
+static uint64_t
+map_offset (uint64_t offset, uint32_t count, size_t *i, uint64_t *foffs)
 {
-  return bsearch (&offset, h->files,
-                  filenames.len, sizeof (struct file),
-                  compare_offset);
+  uint64_t max;
+
+  if (stripe_size == 0) {
+    const struct file *file;
+
+    file = bsearch (&offset, files, filenames.len, sizeof (struct file),
+                    compare_offset);
+    *i = file - files;
+    *foffs = offset - file->offset;
+    max = file->size - *foffs;
+  }
+  else {
+    const uint64_t stripe = offset / stripe_size;
+
+    *i = stripe % filenames.len;
+    *foffs = stripe / filenames.len * stripe_size + offset % stripe_size;
+    max = stripe_size - offset % stripe_size;
+  }
+
+  if (max > count)
+    max = count;
+  return max;
 }
 
 /* Read data. */
@@ -253,16 +332,13 @@ split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   struct handle *h = handle;
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
+    size_t i;
+    uint64_t foffs, max;
     ssize_t r;
 
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
+    max = map_offset (offset, count, &i, &foffs);
 
-    r = pread (file->fd, buf, max, foffs);
+    r = pread (h->fds[i], buf, max, foffs);
     if (r == -1) {
       nbdkit_error ("pread: %m");
       return -1;
@@ -286,16 +362,13 @@ split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
   struct handle *h = handle;
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
+    size_t i;
+    uint64_t foffs, max;
     ssize_t r;
 
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
+    max = map_offset (offset, count, &i, &foffs);
 
-    r = pwrite (file->fd, buf, max, offset);
+    r = pwrite (h->fds[i], buf, max, foffs);
     if (r == -1) {
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -317,23 +390,20 @@ split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 
   /* Cache is advisory, we don't care if this fails */
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
+    size_t i;
+    uint64_t foffs, max;
     int r;
 
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
+    max = map_offset (offset, count, &i, &foffs);
 
-    r = posix_fadvise (file->fd, offset, max, POSIX_FADV_WILLNEED);
+    r = posix_fadvise (h->fds[i], foffs, max, POSIX_FADV_WILLNEED);
     if (r) {
       errno = r;
       nbdkit_error ("posix_fadvise: %m");
       return -1;
     }
-    count -= r;
-    offset += r;
+    count -= max;
+    offset += max;
   }
 
   return 0;
@@ -341,8 +411,11 @@ split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 #endif /* HAVE_POSIX_FADVISE */
 
 #ifdef SEEK_HOLE
+/* Add the extents of fd between offset and offset+count-1.  base is
+ * the offset in the disk corresponding to offset 0 in this file.
+ */
 static int64_t
-do_extents (struct file *file, uint32_t count, uint64_t offset,
+do_extents (int fd, uint64_t base, uint32_t count, uint64_t offset,
             bool req_one, struct nbdkit_extents *extents)
 {
   int64_t r = 0;
@@ -351,7 +424,7 @@ do_extents (struct file *file, uint32_t count, uint64_t offset,
   do {
     off_t pos;
 
-    pos = lseek (file->fd, offset, SEEK_DATA);
+    pos = lseek (fd, offset, SEEK_DATA);
     if (pos == -1) {
       if (errno == ENXIO) {
         /* The current man page does not describe this situation well,
@@ -367,9 +440,15 @@ do_extents (struct file *file, uint32_t count, uint64_t offset,
       }
     }
 
+    /* In striped mode the file continues past the end of the stripe,
+     * so we must not report anything beyond end.
+     */
+    if (pos > end)
+      pos = end;
+
     /* We know there is a hole from offset to pos-1. */
     if (pos > offset) {
-      if (nbdkit_add_extent (extents, offset + file->offset, pos - offset,
+      if (nbdkit_add_extent (extents, base + offset, pos - offset,
                              NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
         return -1;
       r += pos - offset;
@@ -381,15 +460,18 @@ do_extents (struct file *file, uint32_t count, uint64_t offset,
     if (offset >= end)
       break;
 
-    pos = lseek (file->fd, offset, SEEK_HOLE);
+    pos = lseek (fd, offset, SEEK_HOLE);
     if (pos == -1) {
       nbdkit_error ("lseek: SEEK_HOLE: %" PRIu64 ": %m", offset);
       return -1;
     }
 
+    if (pos > end)
+      pos = end;
+
     /* We know there is data from offset to pos-1. */
     if (pos > offset) {
-      if (nbdkit_add_extent (extents, offset + file->offset, pos - offset,
+      if (nbdkit_add_extent (extents, base + offset, pos - offset,
                              0 /* allocated data */) == -1)
         return -1;
       r += pos - offset;
@@ -411,19 +493,15 @@ split_extents (void *handle, uint32_t count, uint64_t offset,
   const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
+    size_t i;
+    uint64_t foffs, max;
     int64_t r;
 
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
+    max = map_offset (offset, count, &i, &foffs);
 
-    if (file->can_extents) {
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
-      max = r = do_extents (file, max, foffs, req_one, extents);
-    }
+    if (files[i].can_extents)
+      max = r = do_extents (h->fds[i], offset - foffs, max, foffs,
+                            req_one, extents);
     else
       r = nbdkit_add_extent (extents, offset, max, 0 /* allocated data */);
     if (r == -1)
@@ -445,6 +523,7 @@ static struct nbdkit_plugin plugin = {
   .config            = split_config,
   .config_help       = split_config_help,
   .magic_config_key  = "file",
+  .get_ready         = split_get_ready,
   .open              = split_open,
   .close             = split_close,
   .get_size          = split_get_size,
@@ -42,6 +42,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <libssh/libssh.h>
@@ -66,6 +67,20 @@ static const_string_vector identities = empty_vector;
 static uint32_t timeout = 0;
 static bool compression = false;
 
+/* Maximum number of SSH sessions (each with its own SFTP channel)
+ * opened for each NBD connection.
+ */
+#define MAX_CONNECTIONS 16
+static unsigned connections = 4;
+
+/* Reads and writes are split into requests of at most this size, and
+ * up to MAX_IN_FLIGHT requests are sent before waiting for the first
+ * reply.  OpenSSH limits packets to 256K, so keep requests well below
+ * that.
+ */
+#define MAX_REQUEST_SIZE (64*1024)
+#define MAX_IN_FLIGHT 16
+
 /* config can be:
  * NULL => parse options from default file
  * "" => do NOT parse options
@@ -170,6 +185,16 @@ ssh_config (const char *key, const char *value)
     compression = r;
   }
 
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections < 1 || connections > MAX_CONNECTIONS) {
+      nbdkit_error ("connections must be between 1 and %d",
+                    MAX_CONNECTIONS);
+      return -1;
+    }
+  }
+
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -202,20 +227,40 @@ ssh_config_complete (void)
   "identity=<FILENAME>        Prepend private key (identity) file.\n" \
   "timeout=SECS               Set SSH connection timeout.\n" \
   "verify-remote-host=false   Ignore known_hosts.\n" \
-  "compression=true           Enable compression."
+  "compression=true           Enable compression.\n" \
+  "connections=N              Maximum SSH sessions per client (default 4)."
 
-/* The per-connection handle. */
-struct ssh_handle {
+/* One SSH session with an SFTP channel and the remote file open. */
+struct session {
   ssh_session session;
   sftp_session sftp;
   sftp_file file;
+  size_t max_read, max_write;   /* Maximum size of each SFTP request. */
+  bool in_use;
+};
+
+/* The per-connection handle.
+ *
+ * Each request takes an idle session from the pool.  Only one session
+ * is opened in ssh_open, the others are opened when needed, so clients
+ * which don't send requests in parallel only use one.  If opening an
+ * extra session fails then its slot stays marked as in use, and we
+ * stop trying to open more.
+ */
+struct ssh_handle {
+  int readonly;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t nr_sessions;           /* Slots used in sessions[]. */
+  bool no_more_sessions;
+  struct session sessions[MAX_CONNECTIONS];
 };
 
 /* Verify the remote host.
  * See: http://api.libssh.org/master/libssh_tutor_guided_tour.html
  */
 static int
-do_verify_remote_host (struct ssh_handle *h)
+do_verify_remote_host (struct session *h)
 {
   enum ssh_known_hosts_e state;
 
@@ -283,7 +328,7 @@ authenticate_password (ssh_session session, const char *pass)
 }
 
 static int
-authenticate (struct ssh_handle *h)
+authenticate (struct session *h)
 {
   int method, rc;
 
@@ -326,22 +371,15 @@ authenticate (struct ssh_handle *h)
   return -1;
 }
 
-/* Create the per-connection handle. */
-static void *
-ssh_open (int readonly)
+/* Open an SSH session, the SFTP channel and the remote file. */
+static int
+open_session (struct session *h, int readonly)
 {
-  struct ssh_handle *h;
   const int set = 1;
   size_t i;
   int r;
   int access_type;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("calloc: %m");
-    return NULL;
-  }
-
   /* Set up the SSH session. */
   h->session = ssh_new ();
   if (!h->session) {
@@ -490,9 +528,25 @@ ssh_open (int readonly)
     goto err;
   }
 
+  h->max_read = h->max_write = MAX_REQUEST_SIZE;
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+  /* The new async API fails requests larger than the server limits. */
+  {
+    sftp_limits_t limits = sftp_limits (h->sftp);
+
+    if (limits) {
+      if (limits->max_read_length > 0)
+        h->max_read = MIN (h->max_read, limits->max_read_length);
+      if (limits->max_write_length > 0)
+        h->max_write = MIN (h->max_write, limits->max_write_length);
+      sftp_limits_free (limits);
+    }
+  }
+#endif
+
   nbdkit_debug ("opened libssh handle");
 
-  return h;
+  return 0;
 
  err:
   if (h->file)
@@ -503,15 +557,13 @@ ssh_open (int readonly)
     ssh_disconnect (h->session);
     ssh_free (h->session);
   }
-  free (h);
-  return NULL;
+  memset (h, 0, sizeof *h);
+  return -1;
 }
 
-/* Free up the per-connection handle. */
 static void
-ssh_close (void *handle)
+close_session (struct session *h)
 {
-  struct ssh_handle *h = handle;
   int r;
 
   r = sftp_close (h->file);
@@ -521,44 +573,210 @@ ssh_close (void *handle)
   sftp_free (h->sftp);
   ssh_disconnect (h->session);
   ssh_free (h->session);
+}
+
+/* Create the per-connection handle. */
+static void *
+ssh_open (int readonly)
+{
+  struct ssh_handle *h;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  h->readonly = readonly;
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+
+  /* Open the first session now so that errors are reported early. */
+  if (open_session (&h->sessions[0], readonly) == -1) {
+    pthread_mutex_destroy (&h->lock);
+    pthread_cond_destroy (&h->cond);
+    free (h);
+    return NULL;
+  }
+  h->nr_sessions = 1;
+
+  return h;
+}
+
+/* Free up the per-connection handle. */
+static void
+ssh_close (void *handle)
+{
+  struct ssh_handle *h = handle;
+  size_t i;
+
+  for (i = 0; i < h->nr_sessions; ++i) {
+    if (h->sessions[i].session)
+      close_session (&h->sessions[i]);
+  }
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+/* Take an idle session from the pool, opening a new one if they are
+ * all busy and we are allowed to, else waiting for one to become free.
+ */
+static struct session *
+get_session (struct ssh_handle *h)
+{
+  struct session *s, tmp;
+  size_t i;
+  int r;
+
+  pthread_mutex_lock (&h->lock);
+  for (;;) {
+    for (i = 0; i < h->nr_sessions; ++i) {
+      s = &h->sessions[i];
+      if (!s->in_use) {
+        s->in_use = true;
+        pthread_mutex_unlock (&h->lock);
+        return s;
+      }
+    }
+
+    if (!h->no_more_sessions && h->nr_sessions < connections) {
+      /* Reserve a new slot and open the session without holding the
+       * lock.  The slot is only filled in, with the lock held, once
+       * the session has been opened successfully.  Until then it is
+       * in use with a NULL session, which is also how a failed slot
+       * is left.
+       */
+      s = &h->sessions[h->nr_sessions++];
+      s->in_use = true;
+      pthread_mutex_unlock (&h->lock);
+
+      memset (&tmp, 0, sizeof tmp);
+      r = open_session (&tmp, h->readonly);
+
+      pthread_mutex_lock (&h->lock);
+      if (r == 0) {
+        tmp.in_use = true;
+        *s = tmp;
+        pthread_mutex_unlock (&h->lock);
+        nbdkit_debug ("opened SSH session %zu", (size_t) (s - h->sessions));
+        return s;
+      }
+
+      /* The error has already been reported, but it is not fatal
+       * since there is at least one other session.  Wait for that
+       * instead.
+       */
+      h->no_more_sessions = true;
+      nbdkit_debug ("could not open another SSH session, "
+                    "continuing with %zu", h->nr_sessions - 1);
+      continue;
+    }
+
+    pthread_cond_wait (&h->cond, &h->lock);
+  }
+}
+
+static void
+put_session (struct ssh_handle *h, struct session *s)
+{
+  pthread_mutex_lock (&h->lock);
+  s->in_use = false;
+  /* Broadcast because ssh_flush may be waiting for a particular one. */
+  pthread_cond_broadcast (&h->cond);
+  pthread_mutex_unlock (&h->lock);
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 ssh_get_size (void *handle)
 {
   struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
   sftp_attributes attrs;
   int64_t r;
 
-  attrs = sftp_fstat (h->file);
+  attrs = sftp_fstat (s->file);
+  if (attrs == NULL) {
+    nbdkit_error ("fstat failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
+    return -1;
+  }
   r = attrs->size;
   sftp_attributes_free (attrs);
 
+  put_session (h, s);
   return r;
 }
 
-/* Read data from the remote server. */
+/* An SFTP request in flight. */
+struct request {
+  char *buf;
+  uint32_t count;
+  uint64_t offset;
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+  sftp_aio aio;
+#else
+  uint32_t id;
+#endif
+};
+
+/* Both the old and new async APIs read from or write to the current
+ * file offset and advance it.
+ */
 static int
-ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+begin_read (struct session *s, struct request *req)
+{
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+  if (sftp_aio_begin_read (s->file, req->count, &req->aio) < 0)
+    goto err;
+#else
+  int id = sftp_async_read_begin (s->file, req->count);
+  if (id < 0)
+    goto err;
+  req->id = id;
+#endif
+  return 0;
+
+ err:
+  nbdkit_error ("read failed: %s", ssh_get_error (s->session));
+  return -1;
+}
+
+/* Returns the number of bytes read, which may be short, or -1. */
+static ssize_t
+wait_read (struct session *s, struct request *req)
 {
-  struct ssh_handle *h = handle;
-  int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
-  if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+  rs = sftp_aio_wait_read (&req->aio, req->buf, req->count);
+  sftp_aio_free (req->aio);
+  req->aio = NULL;
+#else
+  do {
+    rs = sftp_async_read (s->file, req->buf, req->count, req->id);
+  } while (rs == SSH_AGAIN);
+#endif
+  return rs < 0 ? -1 : rs;
+}
+
+/* Synchronous read, used to finish off short reads. */
+static int
+read_sync (struct session *s, char *buf, uint32_t count, uint64_t offset)
+{
+  ssize_t rs;
+
+  if (sftp_seek64 (s->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
     return -1;
   }
 
   while (count > 0) {
-    rs = sftp_read (h->file, buf, count);
-    if (rs < 0) {
-      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (h->session), rs);
+    rs = sftp_read (s->file, buf, count);
+    if (rs <= 0) {
+      nbdkit_error ("read failed: %s (%zd)", ssh_get_error (s->session), rs);
       return -1;
     }
     buf += rs;
@@ -568,17 +786,141 @@ ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
-/* Write data to the remote server. */
+/* Read data from the remote server.  The read is split into requests
+ * and up to MAX_IN_FLIGHT of them are kept outstanding, so a large
+ * read costs about one round trip instead of one per request.
+ */
+static int
+ssh_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
+  struct request reqs[MAX_IN_FLIGHT], *req;
+  size_t first = 0, nr = 0;
+  uint32_t sent = 0;
+  ssize_t rs;
+  int err = 0;
+
+  if (sftp_seek64 (s->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
+    return -1;
+  }
+
+  while (sent < count || nr > 0) {
+    /* Keep the pipeline full.  After an error, stop sending requests
+     * but continue to collect the replies to those already sent.
+     */
+    while (!err && sent < count && nr < MAX_IN_FLIGHT) {
+      req = &reqs[(first + nr) % MAX_IN_FLIGHT];
+      req->buf = (char *) buf + sent;
+      req->count = MIN (count - sent, s->max_read);
+      req->offset = offset + sent;
+      if (begin_read (s, req) == -1) {
+        err = -1;
+        break;
+      }
+      sent += req->count;
+      nr++;
+    }
+    if (nr == 0)
+      break;
+
+    /* Wait for the oldest request. */
+    req = &reqs[first];
+    first = (first + 1) % MAX_IN_FLIGHT;
+    nr--;
+    rs = wait_read (s, req);
+    if (err)
+      continue;
+    if (rs == -1) {
+      nbdkit_error ("read failed: %s", ssh_get_error (s->session));
+      err = -1;
+    }
+    else if (rs < req->count) {
+      /* The server may return less than we asked for. */
+      if (read_sync (s, req->buf + rs, req->count - rs,
+                     req->offset + rs) == -1 ||
+          sftp_seek64 (s->file, offset + sent) != SSH_OK)
+        err = -1;
+    }
+  }
+
+  put_session (h, s);
+  return err;
+}
+
+#ifdef HAVE_SFTP_AIO_BEGIN_READ
+
+/* Write data to the remote server, pipelined like ssh_pread. */
+static int
+ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+{
+  struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
+  struct request reqs[MAX_IN_FLIGHT], *req;
+  size_t first = 0, nr = 0;
+  uint32_t sent = 0;
+  ssize_t rs;
+  int err = 0;
+
+  if (sftp_seek64 (s->file, offset) != SSH_OK) {
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
+    return -1;
+  }
+
+  while (sent < count || nr > 0) {
+    while (!err && sent < count && nr < MAX_IN_FLIGHT) {
+      req = &reqs[(first + nr) % MAX_IN_FLIGHT];
+      req->buf = (char *) buf + sent;
+      req->count = MIN (count - sent, s->max_write);
+      req->offset = offset + sent;
+      if (sftp_aio_begin_write (s->file, req->buf, req->count,
+                                &req->aio) < 0) {
+        nbdkit_error ("write failed: %s", ssh_get_error (s->session));
+        err = -1;
+        break;
+      }
+      sent += req->count;
+      nr++;
+    }
+    if (nr == 0)
+      break;
+
+    req = &reqs[first];
+    first = (first + 1) % MAX_IN_FLIGHT;
+    nr--;
+    rs = sftp_aio_wait_write (&req->aio);
+    sftp_aio_free (req->aio);
+    req->aio = NULL;
+    if (!err && rs != req->count) {
+      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (s->session), rs);
+      err = -1;
+    }
+  }
+
+  put_session (h, s);
+  return err;
+}
+
+#else /* !HAVE_SFTP_AIO_BEGIN_READ */
+
+/* Write data to the remote server.  The old libssh API has no
+ * asynchronous writes, so each request waits for its reply.
+ */
 static int
 ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
 {
   struct ssh_handle *h = handle;
+  struct session *s = get_session (h);
   int r;
   ssize_t rs;
 
-  r = sftp_seek64 (h->file, offset);
+  r = sftp_seek64 (s->file, offset);
   if (r != SSH_OK) {
-    nbdkit_error ("seek64 failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("seek64 failed: %s", ssh_get_error (s->session));
+    put_session (h, s);
     return -1;
   }
 
@@ -590,18 +932,22 @@ ssh_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
      * the request.  I don't know whether 256K is a limit that applies
      * to all servers.
      */
-    rs = sftp_write (h->file, buf, MIN (count, 128*1024));
+    rs = sftp_write (s->file, buf, MIN (count, 128*1024));
     if (rs < 0) {
-      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (h->session), rs);
+      nbdkit_error ("write failed: %s (%zd)", ssh_get_error (s->session), rs);
+      put_session (h, s);
       return -1;
     }
     buf += rs;
     count -= rs;
   }
 
+  put_session (h, s);
   return 0;
 }
 
+#endif /* !HAVE_SFTP_AIO_BEGIN_READ */
+
 static int
 ssh_can_flush (void *handle)
 {
@@ -610,7 +956,8 @@ ssh_can_flush (void *handle)
   /* I added this extension to openssh 6.5 (April 2013).  It may not
    * be available in other SSH servers.
    */
-  return sftp_extension_supported (h->sftp, "fsync@openssh.com", "1");
+  return sftp_extension_supported (h->sessions[0].sftp,
+                                   "fsync@openssh.com", "1");
 }
 
 static int
@@ -623,27 +970,70 @@ ssh_can_multi_conn (void *handle)
    * multi-conn.  Other servers may not be safe.  Use the
    * fsync@openssh.com feature as a proxy.
    */
-  return sftp_extension_supported (h->sftp, "fsync@openssh.com", "1");
+  return sftp_extension_supported (h->sessions[0].sftp,
+                                   "fsync@openssh.com", "1");
 }
 
 static int
-ssh_flush (void *handle)
+flush_session (struct session *s)
 {
-  struct ssh_handle *h = handle;
   int r;
 
  again:
-  r = sftp_fsync (h->file);
+  r = sftp_fsync (s->file);
   if (r == SSH_AGAIN)
     goto again;
   else if (r != SSH_OK) {
-    nbdkit_error ("fsync failed: %s", ssh_get_error (h->session));
+    nbdkit_error ("fsync failed: %s", ssh_get_error (s->session));
     return -1;
   }
 
   return 0;
 }
 
+/* Writes may have gone through any of the sessions, so flush all of
+ * them.  Sessions in use by other requests are waited for.
+ */
+static int
+ssh_flush (void *handle)
+{
+  struct ssh_handle *h = handle;
+  struct session *s;
+  size_t i, n;
+  int r = 0;
+
+  pthread_mutex_lock (&h->lock);
+  n = h->nr_sessions;
+  pthread_mutex_unlock (&h->lock);
+
+  for (i = 0; i < n; ++i) {
+    bool opened;
+
+    s = &h->sessions[i];
+
+    /* s->session is only written with the lock held (see
+     * get_session), so only look at it with the lock held.  A slot
+     * which is still being opened or which failed to open has a NULL
+     * session and has never been used, so there is nothing to flush.
+     */
+    pthread_mutex_lock (&h->lock);
+    while (s->in_use && s->session)
+      pthread_cond_wait (&h->cond, &h->lock);
+    opened = s->session != NULL;
+    if (opened)
+      s->in_use = true;
+    pthread_mutex_unlock (&h->lock);
+    if (!opened)
+      continue;
+
+    if (flush_session (s) == -1)
+      r = -1;
+    put_session (h, s);
+  }
+
+  return r;
+}
+
 static struct nbdkit_plugin plugin = {
   .name              = "ssh",
   .version           = PACKAGE_VERSION,
@@ -35,9 +35,13 @@
 #include <cstdlib>
 #include <iostream>
 #include <atomic>
+#include <algorithm>
+#include <map>
+#include <string>
 
 #include <inttypes.h>
 #include <assert.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -61,6 +65,12 @@ static bool seen_torrent = false;
 static char *cache;
 static bool clean_cache_on_exit = true;
 
+/* How far ahead of a sequential reader to ask for pieces (the
+ * readahead parameter).  Not called readahead because of the function
+ * from <fcntl.h>.
+ */
+static int64_t readahead_bytes = 8 * 1024 * 1024;
+
 /* This lock protects all the static fields that might be accessed by
  * the background thread, as well as the condition.
  */
@@ -110,11 +120,34 @@ static libtorrent::alert_category_t alerts =
   | libtorrent::alert_category::storage
   ;
 
-/* This condition is used to signal the plugin when a piece has been
- * downloaded.
+/* This condition is used to signal the plugin when any piece has been
+ * downloaded.  It is only used while waiting for the torrent to start.
  */
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 
+/* Threads waiting in pread for a particular piece wait on the
+ * condition for that piece, so that each downloaded piece only wakes
+ * up the threads which need it.  Protected by lock.
+ */
+struct waiters {
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  unsigned nr = 0;
+};
+static std::map<libtorrent::piece_index_t, struct waiters> waiting;
+
+/* Deadlines (in milliseconds) passed to set_piece_deadline.  Pieces
+ * which a client is waiting for are always more urgent than pieces
+ * which we are reading ahead.
+ */
+#define READ_DEADLINE 0
+#define READAHEAD_DEADLINE 1000
+#define READAHEAD_DEADLINE_STEP 100
+
+/* A reader is treated as sequential after this many consecutive reads
+ * which are each near where the previous one ended.
+ */
+#define SEQUENTIAL_READS 2
+
 static void
 torrent_unload (void)
 {
@@ -219,6 +252,13 @@ torrent_config (const char *key, const char *value)
     return 0;
   }
 
+  else if (strcmp (key, "readahead") == 0) {
+    readahead_bytes = nbdkit_parse_size (value);
+    if (readahead_bytes == -1)
+      return -1;
+    return 0;
+  }
+
   /* Settings. */
   else {
     for (size_t i = 0; i < nr_settings; ++i) {
@@ -245,6 +285,31 @@ torrent_config (const char *key, const char *value)
         return 0;
       }
     }
+
+    /* Any other libtorrent setting may be given by name. */
+    std::string name (key);
+    std::replace (name.begin (), name.end (), '-', '_');
+    int setting = libtorrent::setting_by_name (name);
+    if (setting >= 0) {
+      int vi;
+      switch (setting & libtorrent::settings_pack::type_mask) {
+      case libtorrent::settings_pack::string_type_base:
+        pack.set_str (setting, value);
+        break;
+      case libtorrent::settings_pack::int_type_base:
+        if (nbdkit_parse_int (key, value, &vi) == -1)
+          return -1;
+        pack.set_int (setting, vi);
+        break;
+      case libtorrent::settings_pack::bool_type_base:
+        vi = nbdkit_parse_bool (value);
+        if (vi == -1)
+          return -1;
+        pack.set_bool (setting, vi);
+        break;
+      }
+      return 0;
+    }
   }
 
   nbdkit_error ("unknown parameter '%s'", key);
@@ -277,14 +342,20 @@ torrent_config_complete (void)
                 cache, clean_cache_on_exit ? " (cleaned up on exit)" : "");
   params.save_path = cache;
 
-  pack.set_str (pack.dht_bootstrap_nodes,
-                "router.bittorrent.com:6881,"
-		"router.utorrent.com:6881,"
-		"dht.transmissionbt.com:6881");
-  pack.set_bool (pack.auto_sequential, true);
-  pack.set_bool (pack.strict_end_game_mode, false);
-  pack.set_bool (pack.announce_to_all_trackers, true);
-  pack.set_bool (pack.announce_to_all_tiers, true);
+  /* Our defaults, unless overridden on the command line. */
+  if (!pack.has_val (pack.dht_bootstrap_nodes))
+    pack.set_str (pack.dht_bootstrap_nodes,
+                  "router.bittorrent.com:6881,"
+                  "router.utorrent.com:6881,"
+                  "dht.transmissionbt.com:6881");
+  if (!pack.has_val (pack.auto_sequential))
+    pack.set_bool (pack.auto_sequential, true);
+  if (!pack.has_val (pack.strict_end_game_mode))
+    pack.set_bool (pack.strict_end_game_mode, false);
+  if (!pack.has_val (pack.announce_to_all_trackers))
+    pack.set_bool (pack.announce_to_all_trackers, true);
+  if (!pack.has_val (pack.announce_to_all_tiers))
+    pack.set_bool (pack.announce_to_all_tiers, true);
   pack.set_int (pack.alert_mask, alerts);
 
   return 0;
@@ -293,7 +364,9 @@ torrent_config_complete (void)
 #define torrent_config_help \
   "torrent=<TORRENT>   (required) Torrent or magnet link.\n" \
   "file=DISK.iso                  File to serve within torrent.\n" \
-  "cache=DIR                      Set directory to store partial downloads."
+  "cache=DIR                      Set directory to store partial downloads.\n" \
+  "readahead=SIZE                 Read ahead of sequential readers.\n" \
+  "SETTING=VALUE                  Set any libtorrent setting."
 
 /* We got the metadata. */
 static void
@@ -367,8 +440,11 @@ handle_alert (libtorrent::alert *alert)
       got_metadata ();
   }
 
-  else if (/*piece_finished_alert *p = */
-           alert_cast<piece_finished_alert>(alert)) {
+  else if (piece_finished_alert *p = alert_cast<piece_finished_alert>(alert)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    auto it = waiting.find (p->piece_index);
+    if (it != waiting.end ())
+      pthread_cond_broadcast (&it->second.cond);
     pthread_cond_broadcast (&cond);
   }
 
@@ -446,6 +522,12 @@ torrent_preconnect (int readonly)
 
 struct handle {
   int fd;
+
+  /* For detecting sequential reads, protected by lock. */
+  pthread_mutex_t lock;
+  uint64_t next_offset;         /* End of the previous read. */
+  unsigned sequential;          /* Consecutive sequential reads. */
+  libtorrent::piece_index_t readahead_end; /* First piece not requested. */
 };
 
 static void *
@@ -477,9 +559,12 @@ torrent_open (int readonly)
   h = (struct handle *) calloc (1, sizeof *h);
   if (h == NULL) {
     nbdkit_error ("calloc: %m");
+    close (fd);
     return NULL;
   }
   h->fd = fd;
+  pthread_mutex_init (&h->lock, NULL);
+  h->readahead_end = libtorrent::piece_index_t (0);
 
   return h;
 }
@@ -490,6 +575,7 @@ torrent_close (void *hv)
   struct handle *h = (struct handle *) hv;
 
   close (h->fd);
+  pthread_mutex_destroy (&h->lock);
   free (h);
 }
 
@@ -502,6 +588,78 @@ torrent_get_size (void *hv)
   return size;
 }
 
+/* Wait until we have the piece.  The piece_finished_alert which
+ * wakes us can be lost if libtorrent's alert queue overflows, so also
+ * check again every second rather than waiting forever.
+ */
+static void
+wait_for_piece (libtorrent::piece_index_t piece)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  while (! handle.have_piece (piece)) {
+    struct waiters &w = waiting[piece];
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+    w.nr++;
+    pthread_cond_timedwait (&w.cond, &lock, &ts);
+    if (--w.nr == 0) {
+      pthread_cond_destroy (&w.cond);
+      waiting.erase (piece);
+    }
+  }
+}
+
+/* If this connection is reading sequentially, ask for the pieces
+ * following this read, up to readahead_bytes ahead.  Clients often
+ * have several reads in flight, so a read is counted as sequential if
+ * it starts within readahead_bytes of the end of the previous one.
+ */
+static void
+do_readahead (struct handle *h, uint64_t offset, uint32_t count)
+{
+  auto ti = handle.torrent_file();
+  const uint64_t end = offset + count;
+  libtorrent::piece_index_t first, last;
+  int deadline = READAHEAD_DEADLINE;
+
+  if (readahead_bytes == 0)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+  if (offset + readahead_bytes >= h->next_offset &&
+      offset <= h->next_offset + readahead_bytes) {
+    h->sequential++;
+    h->next_offset = std::max (h->next_offset, end);
+  }
+  else {
+    /* The reader has jumped somewhere else, perhaps backwards, so
+     * forget what we asked for ahead of the old position.
+     */
+    h->sequential = 0;
+    h->next_offset = end;
+    h->readahead_end = libtorrent::piece_index_t (0);
+  }
+  if (h->sequential < SEQUENTIAL_READS || end >= (uint64_t) size)
+    return;
+
+  first = ti->map_file (index_.load(), end, 1).piece;
+  last = ti->map_file (index_.load(),
+                       std::min ((uint64_t) size, end + readahead_bytes) - 1,
+                       1).piece;
+  first = std::max (first, h->readahead_end);
+  for (auto p = first; p <= last; ++p) {
+    if (! handle.have_piece (p)) {
+      handle.set_piece_deadline (p, deadline);
+      deadline += READAHEAD_DEADLINE_STEP;
+    }
+  }
+  if (first <= last)
+    h->readahead_end = ++last;
+}
+
 /* Read data from the file. */
 static int
 torrent_pread (void *hv, void *buf, uint32_t count, uint64_t offset,
@@ -509,34 +667,41 @@ torrent_pread (void *hv, void *buf, uint32_t count, uint64_t offset,
 {
   struct handle *h = (struct handle *) hv;
   auto ti = handle.torrent_file();
+  libtorrent::piece_index_t first, last;
+  int deadline = READ_DEADLINE;
 
-  while (count > 0) {
-    libtorrent::peer_request part =
-      ti->map_file (index_.load(), offset, (int) count);
+  first = ti->map_file (index_.load(), offset, 1).piece;
+  last = ti->map_file (index_.load(), offset + count - 1, 1).piece;
 
-    part.length = std::min (ti->piece_size (part.piece) - part.start,
-                            part.length);
+  /* Ask for all the missing pieces at once, so they are downloaded in
+   * parallel, ahead of everything else.
+   */
+  for (auto p = first; p <= last; ++p) {
+    if (! handle.have_piece (p))
+      handle.set_piece_deadline (p, deadline++);
+  }
 
-    while (! handle.have_piece (part.piece)) {
-      /* Tell the picker that we want this piece sooner. */
-      handle.piece_priority (part.piece, libtorrent::top_priority);
+  do_readahead (h, offset, count);
 
-      /* Wait for a piece to be downloaded. */
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-      pthread_cond_wait (&cond, &lock);
-    }
+  for (auto p = first; p <= last; ++p)
+    wait_for_piece (p);
 
-    /* We've got this piece in full (on disk), so we can copy it to
-     * the buffer.
-     */
-    if (pread (h->fd, buf, part.length, offset) == -1) {
+  /* We've got these pieces in full (on disk), so we can copy them to
+   * the buffer.
+   */
+  while (count > 0) {
+    ssize_t r = pread (h->fd, buf, count, offset);
+    if (r == -1) {
       nbdkit_error ("pread: %m");
       return -1;
     }
-
-    count -= part.length;
-    offset += part.length;
-    buf = (int8_t *)buf + part.length;
+    if (r == 0) {
+      nbdkit_error ("pread: unexpected end of file");
+      return -1;
+    }
+    count -= r;
+    offset += r;
+    buf = (int8_t *)buf + r;
   }
 
   return 0;
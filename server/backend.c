@@ -76,6 +76,7 @@ backend_init (struct backend *b, struct backend *next, size_t index,
     exit (EXIT_FAILURE);
   }
   b->dl = dl;
+  memset (b->profile, 0, sizeof b->profile);
 
   debug ("registering %s %s", type, filename);
 }
@@ -589,6 +590,7 @@ backend_pread (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_PREAD);
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -610,6 +612,7 @@ backend_pwrite (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_PWRITE);
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
   int r;
 
@@ -634,6 +637,7 @@ backend_flush (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_FLUSH);
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -654,6 +658,7 @@ backend_trim (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_TRIM);
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
   int r;
 
@@ -680,6 +685,7 @@ backend_zero (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_ZERO);
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
   bool fast = !!(flags & NBDKIT_FLAG_FAST_ZERO);
   int r;
@@ -715,6 +721,7 @@ backend_extents (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_EXTENTS);
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -746,6 +753,7 @@ backend_cache (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  PROFILE_FOR_CURRENT_SCOPE (b, PROFILE_CACHE);
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
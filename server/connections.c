@@ -317,6 +317,7 @@ new_connection (int sockin, int sockout, int nworkers)
 #endif
   conn->close = raw_close;
 
+  metrics_add_connection (conn);
   threadlocal_set_conn (conn);
 
   return conn;
@@ -345,6 +346,7 @@ free_connection (struct connection *conn)
   if (!conn)
     return;
 
+  metrics_remove_connection (conn);
   conn->close ();
 
   /* Don't call the plugin again if quit has been set because the main
@@ -717,9 +717,11 @@ crypto_negotiate_tls (int sockin, int sockout)
     out = gnutls_handshake_get_last_out (session);
     nbdkit_error ("gnutls_handshake: %s (%d/%d)",
                   gnutls_strerror (err), (int) in, (int) out);
+    metrics_tls_handshake (false);
     goto error;
   }
   debug ("TLS handshake completed");
+  metrics_tls_handshake (true);
   debug_session (session);
 
   /* Set up the connection recv/send/close functions so they call
@@ -36,6 +36,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <time.h>
 #include <pthread.h>
 
 #ifdef HAVE_SYS_SOCKET_H
@@ -126,6 +127,7 @@ extern bool read_only;
 extern const char *run;
 extern bool listen_stdin;
 extern bool configured;
+extern char *metrics_socket;
 extern const char *selinux_label;
 extern unsigned threads;
 extern int tls;
@@ -230,6 +232,9 @@ struct context {
 DEFINE_VECTOR_TYPE(string_vector, char *);
 struct connection {
   pthread_mutex_t request_lock;
+#ifdef ENABLE_LOCK_PROFILING
+  struct lock_profile_hold request_lock_hold;
+#endif
   pthread_mutex_t read_lock;
   pthread_mutex_t write_lock;
   pthread_mutex_t status_lock;
@@ -257,6 +262,9 @@ struct connection {
   connection_recv_function recv;
   connection_send_function send;
   connection_close_function close;
+
+  uint64_t id;                  /* Used to label metrics. */
+  uint32_t in_flight;           /* Requests in flight, for metrics. */
 };
 
 extern void handle_single_connection (int sockin, int sockout);
@@ -298,6 +306,24 @@ extern void add_debug_flag (const char *arg);
 extern void apply_debug_flags (void *dl, const char *name);
 extern void free_debug_flags (void);
 
+/* metrics.c */
+extern void metrics_bind (void);
+extern void metrics_start (void);
+extern void metrics_stop (void);
+extern void metrics_add_connection (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_remove_connection (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+extern void metrics_request_start (struct connection *conn,
+                                   struct timespec *start)
+  __attribute__((__nonnull__ (1, 2)));
+extern void metrics_request_done (struct connection *conn,
+                                  const struct timespec *start,
+                                  uint16_t cmd, uint32_t count,
+                                  uint32_t error)
+  __attribute__((__nonnull__ (1, 2)));
+extern void metrics_tls_handshake (bool ok);
+
 /* log.c */
 extern void log_verror (const char *fs, va_list args);
 
@@ -315,6 +341,45 @@ extern int replace_vfprintf (FILE *f, const char *fmt, va_list args)
   __attribute__((__format__ (printf, 2, 0)));
 #endif
 
+/* profile.c */
+enum profile_cmd {
+  PROFILE_PREAD,
+  PROFILE_PWRITE,
+  PROFILE_FLUSH,
+  PROFILE_TRIM,
+  PROFILE_ZERO,
+  PROFILE_EXTENTS,
+  PROFILE_CACHE,
+  PROFILE_NR_CMDS
+};
+
+/* Counters for one command at one layer, updated atomically. */
+struct backend_profile {
+  uint64_t ops;
+  uint64_t total_ns;            /* Time spent in this layer and below. */
+  uint64_t self_ns;             /* Time spent in this layer only. */
+};
+
+struct profile_scope {
+  struct backend *b;            /* NULL if profiling is disabled. */
+  enum profile_cmd cmd;
+  struct timespec start;
+  uint64_t saved_child_ns;
+};
+
+extern int nbdkit_debug_backend_profile;
+extern struct profile_scope profile_enter (struct backend *b,
+                                           enum profile_cmd cmd)
+  __attribute__((__nonnull__ (1)));
+extern void profile_leave (struct profile_scope *s)
+  __attribute__((__nonnull__ (1)));
+extern void profile_print (void);
+extern void profile_start (void);
+#define CLEANUP_PROFILE_LEAVE __attribute__((cleanup (profile_leave)))
+#define PROFILE_FOR_CURRENT_SCOPE(b, cmd)                               \
+  CLEANUP_PROFILE_LEAVE CLANG_UNUSED_VARIABLE_WORKAROUND                \
+  struct profile_scope UNIQUE_NAME(_prof) = profile_enter ((b), (cmd))
+
 /* backend.c */
 struct backend {
   /* Next filter or plugin in the chain.  This is always NULL for
@@ -341,6 +406,9 @@ struct backend {
   /* The dlopen handle for the backend. */
   void *dl;
 
+  /* Timings collected when -D nbdkit.backend.profile=1, see profile.c. */
+  struct backend_profile profile[PROFILE_NR_CMDS];
+
   /* Backend callbacks. All are required. */
   void (*free) (struct backend *);
   int (*thread_model) (struct backend *);
@@ -522,9 +590,11 @@ extern size_t threadlocal_get_instance_num (void);
 extern void threadlocal_set_error (int err);
 extern int threadlocal_get_error (void);
 extern void *threadlocal_buffer (size_t size);
+extern uint64_t threadlocal_buffer_bytes (void);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
 extern struct context *threadlocal_get_context (void);
+extern uint64_t threadlocal_exchange_child_ns (uint64_t child_ns);
 
 extern struct context *threadlocal_push_context (struct context *ctx);
 extern void threadlocal_pop_context (struct context **ctx);
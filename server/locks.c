@@ -46,6 +46,29 @@ static pthread_mutex_t connection_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t all_requests_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_rwlock_t unload_prevention_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+/* These locks are taken and released in different functions so they
+ * cannot use ACQUIRE_LOCK_FOR_CURRENT_SCOPE.  With
+ * --enable-lock-profiling they are profiled explicitly instead, with
+ * the hold state saved alongside the lock.
+ */
+#ifdef ENABLE_LOCK_PROFILING
+static struct lock_profile_hold connection_lock_hold;
+static struct lock_profile_hold all_requests_lock_hold;
+
+#define MUTEX_LOCK(mutex, hold)                                         \
+  do {                                                                  \
+    static struct lock_profile_site site_ =                             \
+      LOCK_PROFILE_SITE_INIT (mutex);                                   \
+    (hold) = lock_profile_mutex_lock ((mutex), &site_);                 \
+  } while (0)
+#define MUTEX_UNLOCK(mutex, hold) lock_profile_unlock (&(hold))
+#else
+#define MUTEX_LOCK(mutex, hold)                                         \
+  do { if (pthread_mutex_lock (mutex)) abort (); } while (0)
+#define MUTEX_UNLOCK(mutex, hold)                                       \
+  do { if (pthread_mutex_unlock (mutex)) abort (); } while (0)
+#endif
+
 /* Map thread model to string; use only from single-threaded context */
 const char *
 name_of_thread_model (int model)
@@ -77,17 +100,15 @@ lock_init_thread_model (void)
 void
 lock_connection (void)
 {
-  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS &&
-      pthread_mutex_lock (&connection_lock))
-    abort ();
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS)
+    MUTEX_LOCK (&connection_lock, connection_lock_hold);
 }
 
 void
 unlock_connection (void)
 {
-  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS &&
-      pthread_mutex_unlock (&connection_lock))
-    abort ();
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_CONNECTIONS)
+    MUTEX_UNLOCK (&connection_lock, connection_lock_hold);
 }
 
 void
@@ -95,13 +116,11 @@ lock_request (void)
 {
   struct connection *conn = threadlocal_get_conn ();
 
-  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS &&
-      pthread_mutex_lock (&all_requests_lock))
-    abort ();
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS)
+    MUTEX_LOCK (&all_requests_lock, all_requests_lock_hold);
 
-  if (conn && thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS &&
-      pthread_mutex_lock (&conn->request_lock))
-    abort ();
+  if (conn && thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS)
+    MUTEX_LOCK (&conn->request_lock, conn->request_lock_hold);
 
   if (pthread_rwlock_rdlock (&unload_prevention_lock))
     abort ();
@@ -115,13 +134,11 @@ unlock_request ()
   if (pthread_rwlock_unlock (&unload_prevention_lock))
     abort ();
 
-  if (conn && thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS &&
-      pthread_mutex_unlock (&conn->request_lock))
-    abort ();
+  if (conn && thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS)
+    MUTEX_UNLOCK (&conn->request_lock, conn->request_lock_hold);
 
-  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS &&
-      pthread_mutex_unlock (&all_requests_lock))
-    abort ();
+  if (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS)
+    MUTEX_UNLOCK (&all_requests_lock, all_requests_lock_hold);
 }
 
 void
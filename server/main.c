@@ -398,6 +398,13 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case METRICS_SOCKET_OPTION:
+      free (metrics_socket);
+      metrics_socket = nbdkit_absolute_path (optarg);
+      if (metrics_socket == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
     case 'n':
       newstyle = true;
       break;
@@ -735,6 +742,14 @@ main (int argc, char *argv[])
 
   start_serving ();
 
+  /* Print the -D nbdkit.backend.profile table (if enabled). */
+  profile_print ();
+
+  /* Stop serving metrics before unloading the plugin and filters,
+   * since they may have registered metric callbacks.
+   */
+  metrics_stop ();
+
   top->cleanup (top);
   top->free (top);
   top = NULL;
@@ -910,6 +925,8 @@ start_serving (void)
   set_up_signals ();
 #endif
 
+  metrics_bind ();
+
   /* Lock the process into memory if requested. */
   if (swap) {
 #ifdef HAVE_MLOCKALL
@@ -943,6 +960,8 @@ start_serving (void)
     debug ("using socket activation, nr_socks = %zu", socks.len);
     change_user ();
     write_pidfile ();
+    profile_start ();
+    metrics_start ();
     top->after_fork (top);
     accept_incoming_connections (&socks);
     return;
@@ -952,6 +971,8 @@ start_serving (void)
   if (listen_stdin) {
     change_user ();
     write_pidfile ();
+    profile_start ();
+    metrics_start ();
     top->after_fork (top);
     threadlocal_new_server_thread ();
     handle_single_connection (saved_stdin, saved_stdout);
@@ -972,6 +993,8 @@ start_serving (void)
   change_user ();
   fork_into_background ();
   write_pidfile ();
+  profile_start ();
+  metrics_start ();
   top->after_fork (top);
   accept_incoming_connections (&socks);
 }
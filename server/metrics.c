@@ -0,0 +1,681 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Live metrics in Prometheus text format (--metrics-socket).
+ *
+ * The server counters below are updated with atomic operations from
+ * the connection and worker threads.  A separate thread accepts
+ * connections on the metrics socket and writes out a snapshot of the
+ * counters.  It never takes the request locks, so scraping is safe
+ * even when requests are stuck in the plugin.  Client sockets are
+ * non-blocking and each client gets a fixed time to read its reply,
+ * so a stalled scraper cannot hold up the others for long.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#include "ascii-ctype.h"
+#include "ascii-string.h"
+#include "tvdiff.h"
+
+#include "internal.h"
+#include "poll.h"
+#include "utils.h"
+
+char *metrics_socket;           /* --metrics-socket */
+
+/* Upper bounds (in seconds) of the request latency histogram buckets.
+ * There is an implicit final +Inf bucket.
+ */
+static const double buckets[] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+  0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+#define NR_BUCKETS (sizeof buckets / sizeof buckets[0])
+
+/* Indexed by NBD_CMD_*. */
+static const char *command_names[] = {
+  [NBD_CMD_READ] = "read",
+  [NBD_CMD_WRITE] = "write",
+  [NBD_CMD_FLUSH] = "flush",
+  [NBD_CMD_TRIM] = "trim",
+  [NBD_CMD_CACHE] = "cache",
+  [NBD_CMD_WRITE_ZEROES] = "zero",
+  [NBD_CMD_BLOCK_STATUS] = "block_status",
+};
+#define NR_COMMANDS (sizeof command_names / sizeof command_names[0])
+
+struct command_metrics {
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t duration_ns;
+  uint64_t buckets[NR_BUCKETS + 1];
+};
+static struct command_metrics commands[NR_COMMANDS];
+
+static uint64_t connections_total;
+static uint64_t tls_handshakes_ok, tls_handshakes_failed;
+
+/* Live connections, and metrics registered by plugins and filters.
+ * Both are protected by metrics_lock.
+ */
+DEFINE_VECTOR_TYPE(connection_list, struct connection *);
+static connection_list connections = empty_vector;
+
+struct registered_metric {
+  char *name;
+  char *help;
+  const char *type;             /* "gauge" or "counter" */
+  double (*get) (void *opaque);
+  void *opaque;
+};
+DEFINE_VECTOR_TYPE(metric_list, struct registered_metric);
+static metric_list registered = empty_vector;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Time allowed to send the reply to one client, in milliseconds. */
+#define CLIENT_TIMEOUT_MS 5000
+
+static int listen_sock = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t metrics_thread;
+static bool metrics_thread_started;
+
+void
+metrics_add_connection (struct connection *conn)
+{
+  if (!metrics_socket)
+    return;
+
+  conn->id = __atomic_add_fetch (&connections_total, 1, __ATOMIC_RELAXED);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&metrics_lock);
+  /* On failure the connection is simply not listed. */
+  if (connection_list_append (&connections, conn) == -1)
+    nbdkit_debug ("metrics: realloc: %m");
+}
+
+void
+metrics_remove_connection (struct connection *conn)
+{
+  size_t i;
+
+  if (!metrics_socket)
+    return;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&metrics_lock);
+  for (i = 0; i < connections.len; ++i) {
+    if (connections.ptr[i] == conn) {
+      connection_list_remove (&connections, i);
+      break;
+    }
+  }
+}
+
+void
+metrics_request_start (struct connection *conn, struct timespec *start)
+{
+  if (!metrics_socket)
+    return;
+
+  __atomic_add_fetch (&conn->in_flight, 1, __ATOMIC_RELAXED);
+  clock_gettime (CLOCK_MONOTONIC, start);
+}
+
+void
+metrics_request_done (struct connection *conn, const struct timespec *start,
+                      uint16_t cmd, uint32_t count, uint32_t error)
+{
+  struct command_metrics *m;
+  struct timespec end;
+  uint64_t ns;
+  size_t i;
+
+  if (!metrics_socket)
+    return;
+
+  __atomic_sub_fetch (&conn->in_flight, 1, __ATOMIC_RELAXED);
+  if (cmd >= NR_COMMANDS || command_names[cmd] == NULL)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  ns = tsdiff_nsec (start, &end);
+  for (i = 0; i < NR_BUCKETS; ++i)
+    if (ns <= buckets[i] * 1e9)
+      break;
+
+  m = &commands[cmd];
+  __atomic_add_fetch (&m->requests, 1, __ATOMIC_RELAXED);
+  if (error)
+    __atomic_add_fetch (&m->errors, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&m->bytes, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&m->duration_ns, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&m->buckets[i], 1, __ATOMIC_RELAXED);
+}
+
+void
+metrics_tls_handshake (bool ok)
+{
+  __atomic_add_fetch (ok ? &tls_handshakes_ok : &tls_handshakes_failed, 1,
+                      __ATOMIC_RELAXED);
+}
+
+/* Metric names must match [a-zA-Z_][a-zA-Z0-9_]*, and we add an
+ * "nbdkit_" prefix.  (Prometheus also allows ':' but reserves it for
+ * recording rules.)
+ */
+static int
+register_metric (const char *type, const char *name, const char *help,
+                 double (*get) (void *opaque), void *opaque)
+{
+  struct registered_metric m = { .type = type, .get = get, .opaque = opaque };
+  size_t i;
+
+  if (name == NULL || *name == '\0' ||
+      !(ascii_isalpha (*name) || *name == '_')) {
+    nbdkit_error ("nbdkit_metric_%s: invalid metric name", type);
+    return -1;
+  }
+  for (i = 1; name[i]; ++i) {
+    if (!ascii_isalnum (name[i]) && name[i] != '_') {
+      nbdkit_error ("nbdkit_metric_%s: invalid metric name: %s", type, name);
+      return -1;
+    }
+  }
+  if (get == NULL) {
+    nbdkit_error ("nbdkit_metric_%s: %s: callback must not be NULL",
+                  type, name);
+    return -1;
+  }
+
+  /* Nothing reads the metrics unless --metrics-socket was given. */
+  if (!metrics_socket)
+    return 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&metrics_lock);
+
+  /* If the same plugin or filter appears twice in the stack it will
+   * register the same metrics twice.  Keep the first one.
+   */
+  for (i = 0; i < registered.len; ++i) {
+    if (strcmp (registered.ptr[i].name + strlen ("nbdkit_"), name) == 0) {
+      debug ("metrics: %s registered twice, ignoring", name);
+      return 0;
+    }
+  }
+
+  if (asprintf (&m.name, "nbdkit_%s", name) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  m.help = strdup (help ? help : "");
+  if (m.help == NULL) {
+    nbdkit_error ("strdup: %m");
+    free (m.name);
+    return -1;
+  }
+  if (metric_list_append (&registered, m) == -1) {
+    nbdkit_error ("realloc: %m");
+    free (m.name);
+    free (m.help);
+    return -1;
+  }
+  return 0;
+}
+
+NBDKIT_DLL_PUBLIC int
+nbdkit_metric_gauge (const char *name, const char *help,
+                     double (*get) (void *opaque), void *opaque)
+{
+  return register_metric ("gauge", name, help, get, opaque);
+}
+
+NBDKIT_DLL_PUBLIC int
+nbdkit_metric_counter (const char *name, const char *help,
+                       double (*get) (void *opaque), void *opaque)
+{
+  return register_metric ("counter", name, help, get, opaque);
+}
+
+static void
+header (FILE *fp, const char *name, const char *type, const char *help)
+{
+  fprintf (fp, "# HELP %s %s\n", name, help);
+  fprintf (fp, "# TYPE %s %s\n", name, type);
+}
+
+/* Write a snapshot of all metrics to fp. */
+static void
+write_metrics (FILE *fp)
+{
+  size_t i, j;
+
+  header (fp, "nbdkit_connections", "gauge", "Connections currently open.");
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&metrics_lock);
+    fprintf (fp, "nbdkit_connections %zu\n", connections.len);
+  }
+  header (fp, "nbdkit_connections_total", "counter",
+          "Connections accepted since the server started.");
+  fprintf (fp, "nbdkit_connections_total %" PRIu64 "\n",
+           __atomic_load_n (&connections_total, __ATOMIC_RELAXED));
+
+  header (fp, "nbdkit_requests_in_flight", "gauge",
+          "Requests received but not yet replied to, per connection.");
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&metrics_lock);
+    for (i = 0; i < connections.len; ++i) {
+      struct connection *conn = connections.ptr[i];
+
+      fprintf (fp, "nbdkit_requests_in_flight{connection=\"%" PRIu64 "\"} %"
+               PRIu32 "\n",
+               conn->id, __atomic_load_n (&conn->in_flight, __ATOMIC_RELAXED));
+    }
+  }
+
+  header (fp, "nbdkit_requests_total", "counter",
+          "Requests completed, by command.");
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (command_names[i] == NULL) continue;
+    fprintf (fp, "nbdkit_requests_total{command=\"%s\"} %" PRIu64 "\n",
+             command_names[i],
+             __atomic_load_n (&commands[i].requests, __ATOMIC_RELAXED));
+  }
+  header (fp, "nbdkit_request_errors_total", "counter",
+          "Requests which returned an error, by command.");
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (command_names[i] == NULL) continue;
+    fprintf (fp, "nbdkit_request_errors_total{command=\"%s\"} %" PRIu64 "\n",
+             command_names[i],
+             __atomic_load_n (&commands[i].errors, __ATOMIC_RELAXED));
+  }
+  header (fp, "nbdkit_request_bytes_total", "counter",
+          "Sum of the request lengths, by command.");
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (command_names[i] == NULL) continue;
+    fprintf (fp, "nbdkit_request_bytes_total{command=\"%s\"} %" PRIu64 "\n",
+             command_names[i],
+             __atomic_load_n (&commands[i].bytes, __ATOMIC_RELAXED));
+  }
+
+  header (fp, "nbdkit_request_duration_seconds", "histogram",
+          "Time from receiving a request to sending the reply.");
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    const char *cmd = command_names[i];
+    uint64_t cumulative = 0;
+
+    if (cmd == NULL) continue;
+    for (j = 0; j <= NR_BUCKETS; ++j) {
+      cumulative +=
+        __atomic_load_n (&commands[i].buckets[j], __ATOMIC_RELAXED);
+      if (j < NR_BUCKETS)
+        fprintf (fp, "nbdkit_request_duration_seconds_bucket"
+                 "{command=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                 cmd, buckets[j], cumulative);
+      else
+        fprintf (fp, "nbdkit_request_duration_seconds_bucket"
+                 "{command=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+                 cmd, cumulative);
+    }
+    fprintf (fp, "nbdkit_request_duration_seconds_sum{command=\"%s\"} %.9f\n",
+             cmd,
+             __atomic_load_n (&commands[i].duration_ns, __ATOMIC_RELAXED)
+             / 1e9);
+    fprintf (fp, "nbdkit_request_duration_seconds_count{command=\"%s\"} %"
+             PRIu64 "\n", cmd, cumulative);
+  }
+
+  header (fp, "nbdkit_threadlocal_buffer_bytes", "gauge",
+          "Memory used by per-thread request buffers.");
+  fprintf (fp, "nbdkit_threadlocal_buffer_bytes %" PRIu64 "\n",
+           threadlocal_buffer_bytes ());
+
+  header (fp, "nbdkit_tls_handshakes_total", "counter",
+          "TLS handshakes, by result.");
+  fprintf (fp, "nbdkit_tls_handshakes_total{result=\"ok\"} %" PRIu64 "\n",
+           __atomic_load_n (&tls_handshakes_ok, __ATOMIC_RELAXED));
+  fprintf (fp, "nbdkit_tls_handshakes_total{result=\"failed\"} %" PRIu64 "\n",
+           __atomic_load_n (&tls_handshakes_failed, __ATOMIC_RELAXED));
+
+  /* Metrics registered by plugins and filters.  Copy the list under
+   * the lock and call the callbacks without it, so that a slow
+   * callback does not delay connections being added or removed.
+   * Entries are never removed until metrics_stop (after this thread
+   * has exited) so the strings in the copy remain valid.
+   */
+  {
+    metric_list snapshot = empty_vector;
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&metrics_lock);
+      if (registered.len > 0 &&
+          metric_list_reserve (&snapshot, registered.len) == -1) {
+        nbdkit_error ("metrics: realloc: %m");
+        return;
+      }
+      for (i = 0; i < registered.len; ++i)
+        snapshot.ptr[snapshot.len++] = registered.ptr[i];
+    }
+
+    for (i = 0; i < snapshot.len; ++i) {
+      const struct registered_metric *m = &snapshot.ptr[i];
+
+      header (fp, m->name, m->type, m->help);
+      fprintf (fp, "%s %.17g\n", m->name, m->get (m->opaque));
+    }
+    metric_list_reset (&snapshot);
+  }
+}
+
+/* Write to the non-blocking client socket, giving up if the whole
+ * buffer has not been sent by the deadline.
+ */
+static int
+write_all (int fd, const char *buf, size_t len,
+           const struct timespec *deadline)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = send (fd, buf, len, 0);
+    if (r == -1) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      struct timespec now;
+      int64_t ms;
+
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      ms = tsdiff_nsec (&now, deadline) / 1000000;
+      if (ms <= 0 || poll (&pfd, 1, ms) == 0) {
+        debug ("metrics: client did not read the reply in time");
+        return -1;
+      }
+      continue;
+    }
+    buf += r;
+    len -= r;
+  }
+  return 0;
+}
+
+/* Serve one client.  If the client sends an HTTP GET request (as a
+ * Prometheus server or "curl --unix-socket" does) then wrap the reply
+ * in a minimal HTTP response.  If the client sends nothing within a
+ * short time (eg. "socat - UNIX-CONNECT:PATH") reply with the plain
+ * text.
+ */
+static void
+serve_client (int sock)
+{
+  struct pollfd pfd = { .fd = sock, .events = POLLIN };
+  char request[1024];
+  ssize_t n = 0;
+  bool http;
+  CLEANUP_FREE char *body = NULL;
+  size_t len = 0;
+  FILE *fp;
+  struct timespec deadline;
+
+  if (poll (&pfd, 1, 200) == 1) {
+    n = recv (sock, request, sizeof request - 1, 0);
+    if (n == -1)
+      n = 0;
+  }
+  request[n] = '\0';
+  http = ascii_strncasecmp (request, "GET ", 4) == 0;
+
+  fp = open_memstream (&body, &len);
+  if (fp == NULL) {
+    nbdkit_error ("metrics: open_memstream: %m");
+    return;
+  }
+  write_metrics (fp);
+  if (fclose (fp) == EOF) {
+    nbdkit_error ("metrics: fclose: %m");
+    return;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += CLIENT_TIMEOUT_MS / 1000;
+
+  if (http) {
+    char hdr[256];
+
+    snprintf (hdr, sizeof hdr,
+              "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %zu\r\n"
+              "Connection: close\r\n"
+              "\r\n", len);
+    if (write_all (sock, hdr, strlen (hdr), &deadline) == -1)
+      return;
+  }
+  write_all (sock, body, len, &deadline);
+}
+
+static void *
+metrics_thread_main (void *arg)
+{
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("metrics");
+
+  for (;;) {
+    struct pollfd fds[2] = {
+      { .fd = listen_sock, .events = POLLIN },
+      { .fd = stop_pipe[0], .events = POLLIN },
+    };
+    int sock;
+
+    if (poll (fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      nbdkit_error ("metrics: poll: %m");
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    sock = accept (listen_sock, NULL, NULL);
+    if (sock == -1) {
+      if (errno != EINTR && errno != EAGAIN)
+        nbdkit_error ("metrics: accept: %m");
+      continue;
+    }
+    if (set_nonblock (sock) == -1)
+      continue;
+    serve_client (sock);
+    close (sock);
+  }
+  return NULL;
+}
+
+#ifndef WIN32
+
+/* Called early from start_serving, before changing user or forking,
+ * in the same way as the listening sockets.
+ */
+void
+metrics_bind (void)
+{
+  struct sockaddr_un addr;
+  size_t len;
+
+  if (!metrics_socket)
+    return;
+
+  len = strlen (metrics_socket);
+  if (len >= UNIX_PATH_MAX) {
+    fprintf (stderr, "%s: --metrics-socket: path too long: "
+             "length %zu > max %d bytes\n",
+             program_name, len, UNIX_PATH_MAX-1);
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef SOCK_CLOEXEC
+  listen_sock = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+#else
+  listen_sock = set_cloexec (socket (AF_UNIX, SOCK_STREAM, 0));
+#endif
+  if (listen_sock == -1) {
+    perror ("metrics_bind: socket");
+    exit (EXIT_FAILURE);
+  }
+
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, metrics_socket, len+1 /* trailing \0 */);
+  if (bind (listen_sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror (metrics_socket);
+    exit (EXIT_FAILURE);
+  }
+  if (listen (listen_sock, SOMAXCONN) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (stop_pipe, O_CLOEXEC) == -1) {
+    perror ("pipe2");
+    exit (EXIT_FAILURE);
+  }
+#else
+  if (pipe (stop_pipe) == -1 ||
+      set_cloexec (stop_pipe[0]) == -1 || set_cloexec (stop_pipe[1]) == -1) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+#endif
+
+  debug ("metrics: bound to unix socket %s", metrics_socket);
+}
+
+#else /* WIN32 */
+
+void
+metrics_bind (void)
+{
+  if (!metrics_socket)
+    return;
+
+  fprintf (stderr, "%s: --metrics-socket is not supported on Windows\n",
+           program_name);
+  exit (EXIT_FAILURE);
+}
+
+#endif /* WIN32 */
+
+/* Called just before .after_fork, so the thread is not lost by
+ * forking into the background.
+ */
+void
+metrics_start (void)
+{
+  int err;
+
+  if (!metrics_socket)
+    return;
+
+  err = pthread_create (&metrics_thread, NULL, metrics_thread_main, NULL);
+  if (err) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  metrics_thread_started = true;
+}
+
+/* Called after the server has stopped serving, before plugins and
+ * filters are unloaded (since we may call into them).
+ */
+void
+metrics_stop (void)
+{
+  size_t i;
+
+  if (!metrics_socket)
+    return;
+
+  if (metrics_thread_started) {
+    char c = 0;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+    write (stop_pipe[1], &c, 1);
+#pragma GCC diagnostic pop
+    pthread_join (metrics_thread, NULL);
+    metrics_thread_started = false;
+  }
+
+  if (listen_sock >= 0) {
+    close (listen_sock);
+    unlink (metrics_socket);
+  }
+  if (stop_pipe[0] >= 0) {
+    close (stop_pipe[0]);
+    close (stop_pipe[1]);
+  }
+
+  for (i = 0; i < registered.len; ++i) {
+    free (registered.ptr[i].name);
+    free (registered.ptr[i].help);
+  }
+  metric_list_reset (&registered);
+  connection_list_reset (&connections);
+  free (metrics_socket);
+  metrics_socket = NULL;
+}
@@ -0,0 +1,220 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Per-layer time attribution, enabled with -D nbdkit.backend.profile=1.
+ *
+ * Each data path call through backend.c is timed at every layer of
+ * the filter stack.  The total time is the wall clock time spent
+ * between entering and leaving the layer.  The self time is the total
+ * time minus the time spent in calls made to lower layers from the
+ * same thread, so summing the self time over all layers gives the
+ * time the server spent handling the request.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tvdiff.h"
+
+#include "internal.h"
+
+/* Use:
+ * -D nbdkit.backend.profile=1 to collect per-layer timings.
+ */
+NBDKIT_DLL_PUBLIC int nbdkit_debug_backend_profile = 0;
+
+static const char *profile_cmd_names[PROFILE_NR_CMDS] = {
+  [PROFILE_PREAD] = "pread",
+  [PROFILE_PWRITE] = "pwrite",
+  [PROFILE_FLUSH] = "flush",
+  [PROFILE_TRIM] = "trim",
+  [PROFILE_ZERO] = "zero",
+  [PROFILE_EXTENTS] = "extents",
+  [PROFILE_CACHE] = "cache",
+};
+
+struct profile_scope
+profile_enter (struct backend *b, enum profile_cmd cmd)
+{
+  struct profile_scope s = { .b = NULL };
+
+  if (!nbdkit_debug_backend_profile)
+    return s;
+
+  s.b = b;
+  s.cmd = cmd;
+  /* Start a fresh count of the time spent in lower layers, saving
+   * the count belonging to the layer above us.
+   */
+  s.saved_child_ns = threadlocal_exchange_child_ns (0);
+  clock_gettime (CLOCK_MONOTONIC, &s.start);
+  return s;
+}
+
+void
+profile_leave (struct profile_scope *s)
+{
+  struct backend_profile *p;
+  struct timespec end;
+  uint64_t total, child, self;
+
+  if (s->b == NULL)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  total = tsdiff_nsec (&s->start, &end);
+
+  /* The layer above sees all of our time as time spent in its child. */
+  child = threadlocal_exchange_child_ns (s->saved_child_ns + total);
+  self = total > child ? total - child : 0;
+
+  p = &s->b->profile[s->cmd];
+  __atomic_fetch_add (&p->ops, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&p->total_ns, total, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&p->self_ns, self, __ATOMIC_RELAXED);
+}
+
+/* Print the table of timings to stderr.  This may be called while
+ * requests are still in flight, in which case the numbers are only
+ * approximately consistent with each other.
+ */
+void
+profile_print (void)
+{
+  static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+  struct backend *b;
+  uint64_t all_self_ns = 0;
+  size_t i;
+
+  if (!nbdkit_debug_backend_profile || top == NULL)
+    return;
+
+  for (b = top; b != NULL; b = b->next)
+    for (i = 0; i < PROFILE_NR_CMDS; ++i)
+      all_self_ns += __atomic_load_n (&b->profile[i].self_ns,
+                                      __ATOMIC_RELAXED);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&print_lock);
+  flockfile (stderr);
+  fprintf (stderr, "%s: profile:\n", program_name);
+  fprintf (stderr, "%-24s %-8s %12s %14s %14s %12s %7s\n",
+           "layer", "command", "ops",
+           "total ms", "self ms", "self us/op", "self %");
+
+  for (b = top; b != NULL; b = b->next) {
+    char layer[64];
+
+    snprintf (layer, sizeof layer, "%zu %s %s", b->i, b->type, b->name);
+
+    for (i = 0; i < PROFILE_NR_CMDS; ++i) {
+      const struct backend_profile *p = &b->profile[i];
+      uint64_t ops = __atomic_load_n (&p->ops, __ATOMIC_RELAXED);
+      uint64_t total_ns = __atomic_load_n (&p->total_ns, __ATOMIC_RELAXED);
+      uint64_t self_ns = __atomic_load_n (&p->self_ns, __ATOMIC_RELAXED);
+
+      if (ops == 0)
+        continue;
+
+      fprintf (stderr, "%-24s %-8s %12" PRIu64 " %14.3f %14.3f %12.3f %6.1f%%\n",
+               layer, profile_cmd_names[i], ops,
+               total_ns / 1e6, self_ns / 1e6, self_ns / 1e3 / ops,
+               all_self_ns ? 100.0 * self_ns / all_self_ns : 0.0);
+    }
+  }
+  funlockfile (stderr);
+}
+
+#ifdef SIGUSR1
+
+/* SIGUSR1 prints the table without stopping the server.  The signal
+ * is blocked in the main thread (and hence in every thread created
+ * later) and collected synchronously by this thread.
+ */
+static void *
+profile_signal_thread (void *vp)
+{
+  sigset_t *set = vp;
+  int sig;
+
+  for (;;) {
+    if (sigwait (set, &sig) == 0)
+      profile_print ();
+  }
+  /*NOTREACHED*/
+  return NULL;
+}
+
+void
+profile_start (void)
+{
+  static sigset_t set;
+  pthread_t thread;
+  int err;
+
+  if (!nbdkit_debug_backend_profile)
+    return;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR1);
+  err = pthread_sigmask (SIG_BLOCK, &set, NULL);
+  if (err) {
+    errno = err;
+    perror ("pthread_sigmask");
+    exit (EXIT_FAILURE);
+  }
+  err = pthread_create (&thread, NULL, profile_signal_thread, &set);
+  if (err) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  pthread_detach (thread);
+}
+
+#else /* !SIGUSR1 */
+
+void
+profile_start (void)
+{
+  /* The table is only printed on exit on this platform. */
+}
+
+#endif /* !SIGUSR1 */
@@ -626,6 +626,7 @@ protocol_recv_request_send_reply (void)
   uint64_t offset;
   char *buf = NULL;
   CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  struct timespec start;
 
   /* Read the request packet. */
   {
@@ -661,6 +662,8 @@ protocol_recv_request_send_reply (void)
       return connection_set_status (0); /* disconnect */
     }
 
+    metrics_request_start (conn, &start);
+
     /* Validate the request. */
     if (!validate_request (cmd, flags, offset, count, &error)) {
       if (cmd == NBD_CMD_WRITE &&
@@ -720,8 +723,10 @@ protocol_recv_request_send_reply (void)
 
   /* Send the reply packet. */
  send_reply:
-  if (connection_get_status () < 0)
+  if (connection_get_status () < 0) {
+    metrics_request_done (conn, &start, cmd, count, error);
     return -1;
+  }
 
   if (error != 0) {
     /* Since we're about to send only the limited NBD_E* errno to the
@@ -742,19 +747,22 @@ protocol_recv_request_send_reply (void)
       (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS)) {
     if (!error) {
       if (cmd == NBD_CMD_READ)
-        return send_structured_reply_read (request.handle, cmd,
-                                           buf, count, offset);
+        r = send_structured_reply_read (request.handle, cmd,
+                                        buf, count, offset);
       else /* NBD_CMD_BLOCK_STATUS */
-        return send_structured_reply_block_status (request.handle,
-                                                   cmd, flags,
-                                                   count, offset,
-                                                   extents);
+        r = send_structured_reply_block_status (request.handle,
+                                                cmd, flags,
+                                                count, offset,
+                                                extents);
     }
     else
-      return send_structured_reply_error (request.handle, cmd, flags,
-                                          error);
+      r = send_structured_reply_error (request.handle, cmd, flags,
+                                       error);
   }
   else
-    return send_simple_reply (request.handle, cmd, flags, buf, count,
-                              error);
+    r = send_simple_reply (request.handle, cmd, flags, buf, count,
+                           error);
+
+  metrics_request_done (conn, &start, cmd, count, error);
+  return r;
 }
@@ -60,15 +60,21 @@ struct threadlocal {
   size_t buffer_size;
   struct connection *conn;      /* Can be NULL. */
   struct context *ctx;          /* Can be NULL. */
+  uint64_t child_ns;            /* Used by -D nbdkit.backend.profile. */
 };
 
 static pthread_key_t threadlocal_key;
 
+/* Sum of buffer_size over all threads, for --metrics-socket. */
+static uint64_t buffer_bytes;
+
 static void
 free_threadlocal (void *threadlocalv)
 {
   struct threadlocal *threadlocal = threadlocalv;
 
+  __atomic_sub_fetch (&buffer_bytes, threadlocal->buffer_size,
+                      __ATOMIC_RELAXED);
   free (threadlocal->name);
   free (threadlocal->buffer);
   free (threadlocal);
@@ -197,12 +203,28 @@ threadlocal_buffer (size_t size)
   if (threadlocal->buffer_size < size) {
     void *ptr;
 
+#ifdef HAVE_POSIX_MEMALIGN
+    /* Page align the buffer so that plugins using O_DIRECT (such as
+     * nbdkit-file-plugin cache=direct) can read and write it
+     * directly.  The old contents need not be preserved.
+     */
+    int err = posix_memalign (&ptr, 4096, size);
+    if (err) {
+      errno = err;
+      nbdkit_error ("threadlocal_buffer: posix_memalign: %m");
+      return NULL;
+    }
+    free (threadlocal->buffer);
+#else
     ptr = realloc (threadlocal->buffer, size);
     if (ptr == NULL) {
       nbdkit_error ("threadlocal_buffer: realloc: %m");
       return NULL;
     }
+#endif
     memset (ptr, 0, size);
+    __atomic_add_fetch (&buffer_bytes, size - threadlocal->buffer_size,
+                        __ATOMIC_RELAXED);
     threadlocal->buffer = ptr;
     threadlocal->buffer_size = size;
   }
@@ -210,6 +232,13 @@ threadlocal_buffer (size_t size)
   return threadlocal->buffer;
 }
 
+/* Return the total size of the pread/pwrite buffers of all threads. */
+uint64_t
+threadlocal_buffer_bytes (void)
+{
+  return __atomic_load_n (&buffer_bytes, __ATOMIC_RELAXED);
+}
+
 /* Set (or clear) the connection that is using the current thread */
 void
 threadlocal_set_conn (struct connection *conn)
@@ -238,6 +267,24 @@ threadlocal_get_context (void)
   return threadlocal ? threadlocal->ctx : NULL;
 }
 
+/* Replace the time spent in lower layers by the current request,
+ * returning the previous value.  See profile.c.  Threads which are
+ * not server threads always return 0, so in those threads all time
+ * is counted as self time.
+ */
+uint64_t
+threadlocal_exchange_child_ns (uint64_t child_ns)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  uint64_t ret = 0;
+
+  if (threadlocal) {
+    ret = threadlocal->child_ns;
+    threadlocal->child_ns = child_ns;
+  }
+  return ret;
+}
+
 /* Set (or clear) the context using the current thread.  This function
  * should generally not be used directly, instead see the macro
  * PUSH_CONTEXT_FOR_SCOPE.
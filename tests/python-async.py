@@ -0,0 +1,70 @@
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Python plugin which uses "async def" callbacks.  Reads at offset 0
+# sleep for 5 seconds on the event loop, so they only finish quickly
+# if they are served concurrently.
+
+import asyncio
+import errno
+import nbdkit
+
+API_VERSION = 2
+
+disk = bytearray(1024 * 1024)
+
+
+def open(readonly):
+    return {}
+
+
+async def get_size(h):
+    return len(disk)
+
+
+async def pread(h, buf, offset, flags):
+    if offset == 0:
+        await asyncio.sleep(5)
+    end = offset + len(buf)
+    buf[:] = disk[offset:end]
+
+
+async def pwrite(h, buf, offset, flags):
+    await asyncio.sleep(0)
+    end = offset + len(buf)
+    disk[offset:end] = buf
+
+
+# Check that errors set in a coroutine reach nbdkit: this makes
+# nbdkit fall back to pwrite.
+async def zero(h, count, offset, flags):
+    nbdkit.set_error(errno.EOPNOTSUPP)
+    raise Exception
@@ -0,0 +1,664 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Replay a log filter trace against an NBD server, for reproducible
+ * benchmarking of plugins and filters.
+ *
+ * Usage:
+ *   nbdkit -U - PLUGIN [...] --run './replay [OPTIONS] TRACE "$uri"'
+ *
+ * TRACE is either a text log (logfile=FILE) or a binary trace
+ * (logfile=FILE logformat=binary) written by nbdkit-log-filter.
+ * Read, Write, Zero, Trim, Extents, Cache and Flush requests are
+ * reissued.  Write requests send a fixed pattern since the trace
+ * does not contain the data.
+ *
+ * Options:
+ *   -c N, --connections=N   Use N connections (default 1).  Requests
+ *                           from original connection C are issued on
+ *                           connection (C-1) % N, preserving their
+ *                           order.
+ *   -d N, --depth=N         Maximum requests in flight on each
+ *                           connection (default 64).
+ *   -s X, --speed=X         Replay with X times the original speed
+ *                           (default 1).  0 means as fast as possible.
+ *
+ * When finished it prints the throughput and the latency
+ * distribution of each type of request.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "histogram.h"
+#include "tvdiff.h"
+
+#include "log-trace.h"
+
+/* Only these operations are replayed. */
+#define NR_OPS (LOG_TRACE_CACHE+1)
+
+static const char *op_names[NR_OPS] = {
+  [LOG_TRACE_READ] = "read",
+  [LOG_TRACE_WRITE] = "write",
+  [LOG_TRACE_FLUSH] = "flush",
+  [LOG_TRACE_TRIM] = "trim",
+  [LOG_TRACE_ZERO] = "zero",
+  [LOG_TRACE_EXTENTS] = "extents",
+  [LOG_TRACE_CACHE] = "cache",
+};
+
+struct request {
+  uint64_t time;                /* Relative to the first request (ns). */
+  uint64_t connection;
+  uint64_t offset;
+  uint32_t count;
+  uint16_t op;
+  uint16_t flags;               /* LOG_TRACE_FLAG_* */
+};
+
+static struct request *requests;
+static size_t nr_requests, alloc_requests;
+static uint32_t max_count;
+
+struct op_stats {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t skipped;
+  struct histogram latency;     /* ns */
+};
+
+struct worker {
+  pthread_t thread;
+  struct nbd_handle *nbd;
+  struct request **reqs;        /* Requests for this connection. */
+  size_t nr_reqs;
+  size_t in_flight;
+  char *buf;
+  struct op_stats stats[NR_OPS];
+};
+
+/* A request in flight. */
+struct command {
+  struct worker *w;
+  const struct request *req;
+  struct timespec start;
+};
+
+static unsigned connections = 1;
+static unsigned depth = 64;
+static double speed = 1.0;
+static const char *uri;
+static struct timespec start_t;
+
+static void
+add_request (const struct request *req)
+{
+  if (nr_requests == alloc_requests) {
+    alloc_requests = alloc_requests ? alloc_requests * 2 : 1024;
+    requests = realloc (requests, alloc_requests * sizeof *requests);
+    if (requests == NULL) {
+      perror ("realloc");
+      exit (EXIT_FAILURE);
+    }
+  }
+  requests[nr_requests++] = *req;
+  if (req->count > max_count)
+    max_count = req->count;
+}
+
+static void
+read_binary_trace (FILE *fp, const char *filename)
+{
+  struct log_trace_header hdr;
+  struct log_trace_record rec;
+  uint32_t record_size;
+
+  if (fread (&hdr, sizeof hdr, 1, fp) != 1 ||
+      le32toh (hdr.version) != LOG_TRACE_VERSION) {
+    fprintf (stderr, "replay: %s: unsupported binary trace\n", filename);
+    exit (EXIT_FAILURE);
+  }
+  record_size = le32toh (hdr.record_size);
+  if (record_size < sizeof rec) {
+    fprintf (stderr, "replay: %s: invalid record size\n", filename);
+    exit (EXIT_FAILURE);
+  }
+
+  while (fread (&rec, sizeof rec, 1, fp) == 1) {
+    struct request req;
+
+    if (record_size > sizeof rec &&
+        fseek (fp, record_size - sizeof rec, SEEK_CUR) == -1) {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+    req.op = le16toh (rec.op);
+    if (req.op >= NR_OPS)
+      continue;
+    req.time = le64toh (rec.time);
+    req.connection = le64toh (rec.connection);
+    req.offset = le64toh (rec.offset);
+    req.count = le32toh (rec.count);
+    req.flags = le16toh (rec.flags);
+    add_request (&req);
+  }
+}
+
+/* Return the value of " name=" in a log line, or 0 if not present. */
+static uint64_t
+get_field (const char *line, const char *name)
+{
+  const char *p = strstr (line, name);
+
+  if (p == NULL)
+    return 0;
+  return strtoull (p + strlen (name), NULL, 0);
+}
+
+static void
+read_text_log (FILE *fp, const char *filename)
+{
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+  struct tm tm;
+  long usec;
+  int pos;
+  char act[32];
+
+  while ((n = getline (&line, &len, fp)) != -1) {
+    struct request req;
+    const char *p;
+
+    if (n > 0 && line[n-1] == '\n')
+      line[--n] = '\0';
+
+    /* Only request lines, which end with " ...", are replayed. */
+    if (n < 4 || strcmp (&line[n-4], " ...") != 0)
+      continue;
+
+    memset (&tm, 0, sizeof tm);
+    if (sscanf (line, "%d-%d-%d %d:%d:%d.%ld%n",
+                &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &usec, &pos) != 7)
+      continue;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+
+    p = &line[pos];
+    if (sscanf (p, " connection=%" SCNu64 " %31s", &req.connection, act) != 2)
+      continue;
+
+    if (strcmp (act, "Read") == 0) req.op = LOG_TRACE_READ;
+    else if (strcmp (act, "Write") == 0) req.op = LOG_TRACE_WRITE;
+    else if (strcmp (act, "Flush") == 0) req.op = LOG_TRACE_FLUSH;
+    else if (strcmp (act, "Trim") == 0) req.op = LOG_TRACE_TRIM;
+    else if (strcmp (act, "Zero") == 0) req.op = LOG_TRACE_ZERO;
+    else if (strcmp (act, "Extents") == 0) req.op = LOG_TRACE_EXTENTS;
+    else if (strcmp (act, "Cache") == 0) req.op = LOG_TRACE_CACHE;
+    else continue;
+
+    req.time = timegm (&tm) * UINT64_C (1000000000) + usec * 1000;
+    req.offset = get_field (p, " offset=");
+    req.count = get_field (p, " count=");
+    req.flags = 0;
+    if (get_field (p, " fua="))
+      req.flags |= LOG_TRACE_FLAG_FUA;
+    if (get_field (p, " trim="))
+      req.flags |= LOG_TRACE_FLAG_MAY_TRIM;
+    if (get_field (p, " fast="))
+      req.flags |= LOG_TRACE_FLAG_FAST_ZERO;
+    if (get_field (p, " req_one="))
+      req.flags |= LOG_TRACE_FLAG_REQ_ONE;
+    add_request (&req);
+  }
+  if (ferror (fp)) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  free (line);
+}
+
+static int
+compare_requests (const void *ap, const void *bp)
+{
+  const struct request *a = ap, *b = bp;
+
+  if (a->time != b->time)
+    return a->time < b->time ? -1 : 1;
+  return 0;
+}
+
+static void
+read_trace (const char *filename)
+{
+  FILE *fp;
+  char magic[8];
+  size_t i;
+  uint64_t t0;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  if (fread (magic, sizeof magic, 1, fp) == 1 &&
+      memcmp (magic, LOG_TRACE_MAGIC, sizeof magic) == 0) {
+    rewind (fp);
+    read_binary_trace (fp, filename);
+    /* Binary traces are not written in time order. */
+    qsort (requests, nr_requests, sizeof *requests, compare_requests);
+  }
+  else {
+    rewind (fp);
+    read_text_log (fp, filename);
+  }
+  fclose (fp);
+
+  if (nr_requests == 0) {
+    fprintf (stderr, "replay: %s: no requests found\n", filename);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Make times relative to the first request. */
+  t0 = requests[0].time;
+  for (i = 0; i < nr_requests; ++i)
+    requests[i].time = requests[i].time > t0 ? requests[i].time - t0 : 0;
+}
+
+static int
+command_done (void *vp, int *error)
+{
+  struct command *cmd = vp;
+  struct worker *w = cmd->w;
+  struct op_stats *st = &w->stats[cmd->req->op];
+  struct timespec end;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (*error)
+    st->errors++;
+  else {
+    st->ops++;
+    st->bytes += cmd->req->count;
+    histogram_record (&st->latency, tsdiff_nsec (&cmd->start, &end));
+  }
+  w->in_flight--;
+  free (cmd);
+  return 1;                     /* Retire the command. */
+}
+
+static int
+extent_cb (void *vp, const char *metacontext, uint64_t offset,
+           uint32_t *entries, size_t nr_entries, int *error)
+{
+  return 0;
+}
+
+/* Is the request supported by the server?  If not it is skipped. */
+static bool
+is_supported (struct worker *w, const struct request *req, int64_t size)
+{
+  struct nbd_handle *nbd = w->nbd;
+
+  if (req->op != LOG_TRACE_FLUSH && req->offset + req->count > size)
+    return false;
+
+  switch (req->op) {
+  case LOG_TRACE_WRITE: return nbd_is_read_only (nbd) == 0;
+  case LOG_TRACE_FLUSH: return nbd_can_flush (nbd) == 1;
+  case LOG_TRACE_TRIM: return nbd_can_trim (nbd) == 1;
+  case LOG_TRACE_ZERO: return nbd_can_zero (nbd) == 1;
+  case LOG_TRACE_CACHE: return nbd_can_cache (nbd) == 1;
+  case LOG_TRACE_EXTENTS:
+    return nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == 1;
+  default: return true;
+  }
+}
+
+static int64_t
+issue (struct worker *w, const struct request *req)
+{
+  struct nbd_handle *nbd = w->nbd;
+  struct command *cmd;
+  nbd_completion_callback cb;
+  uint32_t flags = 0;
+  int64_t r;
+
+  cmd = malloc (sizeof *cmd);
+  if (cmd == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  cmd->w = w;
+  cmd->req = req;
+  cb = (nbd_completion_callback) { .callback = command_done, .user_data = cmd };
+
+  if (req->flags & LOG_TRACE_FLAG_FUA)
+    flags |= LIBNBD_CMD_FLAG_FUA;
+
+  /* The completion callback decrements this. */
+  w->in_flight++;
+
+  clock_gettime (CLOCK_MONOTONIC, &cmd->start);
+  switch (req->op) {
+  case LOG_TRACE_READ:
+    r = nbd_aio_pread (nbd, w->buf, req->count, req->offset, cb, 0);
+    break;
+  case LOG_TRACE_WRITE:
+    r = nbd_aio_pwrite (nbd, w->buf, req->count, req->offset, cb, flags);
+    break;
+  case LOG_TRACE_FLUSH:
+    r = nbd_aio_flush (nbd, cb, 0);
+    break;
+  case LOG_TRACE_TRIM:
+    r = nbd_aio_trim (nbd, req->count, req->offset, cb, flags);
+    break;
+  case LOG_TRACE_ZERO:
+    if (!(req->flags & LOG_TRACE_FLAG_MAY_TRIM))
+      flags |= LIBNBD_CMD_FLAG_NO_HOLE;
+    if (req->flags & LOG_TRACE_FLAG_FAST_ZERO)
+      flags |= LIBNBD_CMD_FLAG_FAST_ZERO;
+    r = nbd_aio_zero (nbd, req->count, req->offset, cb, flags);
+    break;
+  case LOG_TRACE_EXTENTS:
+    if (req->flags & LOG_TRACE_FLAG_REQ_ONE)
+      flags |= LIBNBD_CMD_FLAG_REQ_ONE;
+    r = nbd_aio_block_status (nbd, req->count, req->offset,
+                              (nbd_extent_callback) { .callback = extent_cb },
+                              cb, flags);
+    break;
+  case LOG_TRACE_CACHE:
+    r = nbd_aio_cache (nbd, req->count, req->offset, cb, 0);
+    break;
+  default:
+    abort ();
+  }
+  if (r == -1) {
+    /* The completion callback is not called if the request could not
+     * be issued at all.
+     */
+    fprintf (stderr, "replay: %s\n", nbd_get_error ());
+    w->stats[req->op].errors++;
+    w->in_flight--;
+    free (cmd);
+    return -1;
+  }
+  return r;
+}
+
+/* How long until the request is due, in milliseconds (0 = now). */
+static int
+due_in (const struct request *req)
+{
+  struct timespec now;
+  int64_t elapsed, due;
+
+  if (speed == 0)
+    return 0;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  elapsed = tsdiff_nsec (&start_t, &now);
+  due = req->time / speed;
+  if (due <= elapsed)
+    return 0;
+  return (due - elapsed + 999999) / 1000000;
+}
+
+static void *
+worker_fn (void *vp)
+{
+  struct worker *w = vp;
+  int64_t size = nbd_get_size (w->nbd);
+  size_t next = 0;
+  int timeout;
+
+  while (next < w->nr_reqs || w->in_flight > 0) {
+    /* Issue all requests which are due, up to the queue depth. */
+    timeout = -1;
+    while (next < w->nr_reqs && w->in_flight < depth) {
+      const struct request *req = w->reqs[next];
+
+      timeout = due_in (req);
+      if (timeout > 0)
+        break;
+      if (is_supported (w, req, size))
+        issue (w, req);
+      else
+        w->stats[req->op].skipped++;
+      next++;
+      timeout = -1;
+    }
+
+    if (w->in_flight > 0) {
+      if (nbd_poll (w->nbd, timeout) == -1) {
+        fprintf (stderr, "replay: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+    else if (timeout > 0)
+      usleep (timeout * 1000);
+  }
+  return NULL;
+}
+
+static void
+print_time (const char *what, uint64_t ns)
+{
+  if (ns < 1000)
+    printf (" %s %" PRIu64 " ns", what, ns);
+  else if (ns < 1000000)
+    printf (" %s %.1f us", what, ns / 1000.0);
+  else if (ns < 1000000000)
+    printf (" %s %.1f ms", what, ns / 1000000.0);
+  else
+    printf (" %s %.3f s", what, ns / 1000000000.0);
+}
+
+static void
+print_report (struct worker *workers, double secs)
+{
+  struct op_stats *total;
+  uint64_t ops = 0, bytes = 0, errors = 0, skipped = 0;
+  size_t i, op;
+
+  total = calloc (NR_OPS, sizeof *total);
+  if (total == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (op = 0; op < NR_OPS; ++op) {
+    for (i = 0; i < connections; ++i) {
+      const struct op_stats *st = &workers[i].stats[op];
+
+      total[op].ops += st->ops;
+      total[op].bytes += st->bytes;
+      total[op].errors += st->errors;
+      total[op].skipped += st->skipped;
+      histogram_add (&total[op].latency, &st->latency);
+    }
+    ops += total[op].ops;
+    if (op != LOG_TRACE_EXTENTS && op != LOG_TRACE_CACHE)
+      bytes += total[op].bytes;
+    errors += total[op].errors;
+    skipped += total[op].skipped;
+  }
+
+  printf ("total: %" PRIu64 " ops, %.6f s, %.1f ops/s, %.2f MiB/s, "
+          "%" PRIu64 " errors, %" PRIu64 " skipped\n",
+          ops, secs, secs > 0 ? ops / secs : 0,
+          secs > 0 ? bytes / secs / 1048576 : 0,
+          errors, skipped);
+
+  for (op = 0; op < NR_OPS; ++op) {
+    const struct op_stats *st = &total[op];
+
+    if (st->ops == 0 && st->errors == 0 && st->skipped == 0)
+      continue;
+    printf ("%s: %" PRIu64 " ops, %" PRIu64 " bytes, "
+            "%" PRIu64 " errors, %" PRIu64 " skipped\n",
+            op_names[op], st->ops, st->bytes, st->errors, st->skipped);
+    if (st->ops > 0) {
+      printf ("  latency:");
+      print_time ("p50", histogram_percentile (&st->latency, 50));
+      print_time ("p90", histogram_percentile (&st->latency, 90));
+      print_time ("p99", histogram_percentile (&st->latency, 99));
+      print_time ("p99.9", histogram_percentile (&st->latency, 99.9));
+      print_time ("max", st->latency.max);
+      printf ("\n");
+    }
+  }
+  free (total);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: replay [-c N] [-d N] [-s SPEED] TRACE URI\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    { "connections", required_argument, NULL, 'c' },
+    { "depth",       required_argument, NULL, 'd' },
+    { "speed",       required_argument, NULL, 's' },
+    { NULL }
+  };
+  struct worker *workers;
+  struct timespec end_t;
+  size_t i, j;
+  int c, err;
+
+  while ((c = getopt_long (argc, argv, "c:d:s:", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'c':
+      if (sscanf (optarg, "%u", &connections) != 1 || connections == 0)
+        usage ();
+      break;
+    case 'd':
+      if (sscanf (optarg, "%u", &depth) != 1 || depth == 0)
+        usage ();
+      break;
+    case 's':
+      if (sscanf (optarg, "%lg", &speed) != 1 || speed < 0)
+        usage ();
+      break;
+    default:
+      usage ();
+    }
+  }
+  if (argc - optind != 2)
+    usage ();
+  uri = argv[optind+1];
+
+  read_trace (argv[optind]);
+
+  workers = calloc (connections, sizeof *workers);
+  if (workers == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < connections; ++i) {
+    struct worker *w = &workers[i];
+
+    w->reqs = malloc (nr_requests * sizeof *w->reqs);
+    w->buf = malloc (max_count > 0 ? max_count : 1);
+    if (w->reqs == NULL || w->buf == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    memset (w->buf, 0x55, max_count);
+
+    w->nbd = nbd_create ();
+    if (w->nbd == NULL ||
+        nbd_add_meta_context (w->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+        nbd_connect_uri (w->nbd, uri) == -1) {
+      fprintf (stderr, "replay: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Assign the requests to connections, keeping the requests from
+   * each original connection together and in order.
+   */
+  for (j = 0; j < nr_requests; ++j) {
+    struct worker *w;
+
+    i = requests[j].connection > 0 ? requests[j].connection - 1 : 0;
+    w = &workers[i % connections];
+    w->reqs[w->nr_reqs++] = &requests[j];
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start_t);
+  for (i = 0; i < connections; ++i) {
+    err = pthread_create (&workers[i].thread, NULL, worker_fn, &workers[i]);
+    if (err) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < connections; ++i)
+    pthread_join (workers[i].thread, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &end_t);
+
+  print_report (workers, tsdiff_nsec (&start_t, &end_t) / 1000000000.0);
+
+  for (i = 0; i < connections; ++i) {
+    if (nbd_shutdown (workers[i].nbd, 0) == -1)
+      fprintf (stderr, "replay: %s\n", nbd_get_error ());
+    nbd_close (workers[i].nbd);
+    free (workers[i].reqs);
+    free (workers[i].buf);
+  }
+  free (workers);
+  free (requests);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test writing through the S3 plugin, which commits changes using
+# multipart uploads, and concatenation of objects.
+
+source ./functions.sh
+set -e
+set -x
+
+requires $PYTHON --version
+requires nbdsh --version
+requires_plugin python
+
+# Python has proven very difficult to valgrind, therefore it is disabled.
+if [ "$NBDKIT_VALGRIND" = "1" ]; then
+    echo "$0: skipping Python test under valgrind."
+    exit 77
+fi
+
+# There is a fake boto3 module in test-S3/ which we use as a test
+# harness for the plugin.
+requires test -d test-S3
+export PYTHONPATH=$srcdir/test-S3:$PYTHONPATH
+
+# MY_KEY is 8K and BIG_KEY is 12M, so the export is the two objects
+# concatenated, and BIG_KEY is rewritten in three 5M parts on flush.
+nbdkit -U - S3 \
+       access-key=TEST_ACCESS_KEY \
+       secret-key=TEST_SECRET_KEY \
+       session-token=TEST_SESSION_TOKEN \
+       endpoint-url=TEST_ENDPOINT \
+       bucket=MY_FILES \
+       key=MY_KEY key=BIG_KEY \
+       chunk-size=5M cache=16M \
+       --run 'nbdsh -u "$uri" -c "
+M = 1024 * 1024
+assert h.get_size() == 8192 + 12*M
+assert h.pread(16, 4088) == b\"x\"*8 + b\"y\"*8
+
+# Writes spanning the two objects and a part boundary in BIG_KEY.
+h.pwrite(b\"a\"*1024, 8192 - 512)
+h.pwrite(b\"b\"*4096, 8192 + 5*M - 2048)
+h.pwrite(b\"c\"*512, 8192 + 12*M - 512)
+assert h.pread(1024, 8192 - 512) == b\"a\"*1024
+h.flush()
+
+# Check the data after the commit.
+assert h.pread(1024, 8192 - 1024) == b\"z\"*512 + b\"a\"*512
+assert h.pread(4096, 8192 + 5*M - 2048) == b\"b\"*4096
+assert h.pread(1024, 8192 + 5*M - 3072) == bytes(1024)
+assert h.pread(1024, 8192 + 12*M - 1024) == bytes(512) + b\"c\"*512
+"'
@@ -31,12 +31,21 @@
 # SUCH DAMAGE.
 
 # This fake boto3 module is used to test the S3 plugin.  See also
-# tests/test-S3.sh
+# tests/test-S3.sh and tests/test-S3-write.sh
+#
+# It implements an in-memory bucket containing a few objects, and just
+# enough of the S3 API (including multipart uploads) for the plugin.
 
 import re
+import threading
 
 
-buf = b'x'*4096 + b'y'*2048 + b'z'*2048
+lock = threading.Lock()
+objects = {
+    'MY_KEY': b'x'*4096 + b'y'*2048 + b'z'*2048,
+    'BIG_KEY': bytes(12 * 1024 * 1024),
+}
+uploads = {}
 
 
 class client(object):
@@ -46,20 +55,34 @@ class client(object):
             aws_access_key_id=None,
             aws_secret_access_key=None,
             aws_session_token=None,
-            endpoint_url=None):
+            endpoint_url=None,
+            config=None):
         assert type == "s3"
         assert aws_access_key_id == "TEST_ACCESS_KEY"
         assert aws_secret_access_key == "TEST_SECRET_KEY"
         assert aws_session_token == "TEST_SESSION_TOKEN"
         assert endpoint_url == "TEST_ENDPOINT"
 
+    def _object(self, Bucket, Key):
+        assert Bucket == "MY_FILES"
+        assert Key in objects
+        return objects[Key]
+
+    def _range(self, Range):
+        # Range must be something like "bytes=N-M".
+        r = re.match("bytes=(\\d+)-(\\d+)", Range)
+        assert r
+        return int(r.group(1)), int(r.group(2))
+
+    def head_object(self, Bucket=None, Key=None):
+        return {'ContentLength': len(self._object(Bucket, Key))}
+
     def get_object(
             self,
             Bucket=None,
             Key=None,
             Range=None):
-        assert Bucket == "MY_FILES"
-        assert Key == "MY_KEY"
+        buf = self._object(Bucket, Key)
 
         if Range is None:
             # Return the size in a 'ResponseMetadata'.
@@ -67,16 +90,65 @@ class client(object):
                     {'HTTPHeaders':
                      {'content-length': len(buf)}}}
         else:
-            # Range must be something like "bytes=N-M".
-            r = re.match("bytes=(\\d+)-(\\d+)", Range)
-            assert r
-            start = int(r.group(1))
-            end = int(r.group(2))
+            start, end = self._range(Range)
             b = buf[start:end+1]
 
             # Return the data in a 'StreamingBody'.
             return {'Body': StreamingBody(b)}
 
+    def put_object(self, Bucket=None, Key=None, Body=None):
+        self._object(Bucket, Key)
+        objects[Key] = bytes(Body)
+
+    def create_multipart_upload(self, Bucket=None, Key=None):
+        self._object(Bucket, Key)
+        with lock:
+            upload_id = "UPLOAD%d" % len(uploads)
+            uploads[upload_id] = (Key, {})
+        return {'UploadId': upload_id}
+
+    def _add_part(self, Key, UploadId, PartNumber, data):
+        assert 1 <= PartNumber <= 10000
+        with lock:
+            key, parts = uploads[UploadId]
+            assert key == Key
+            parts[PartNumber] = data
+        return "ETAG%d" % PartNumber
+
+    def upload_part(self, Bucket=None, Key=None, UploadId=None,
+                    PartNumber=None, Body=None):
+        self._object(Bucket, Key)
+        return {'ETag': self._add_part(Key, UploadId, PartNumber,
+                                       bytes(Body))}
+
+    def upload_part_copy(self, Bucket=None, Key=None, UploadId=None,
+                         PartNumber=None, CopySource=None,
+                         CopySourceRange=None):
+        self._object(Bucket, Key)
+        buf = self._object(CopySource['Bucket'], CopySource['Key'])
+        start, end = self._range(CopySourceRange)
+        etag = self._add_part(Key, UploadId, PartNumber, buf[start:end+1])
+        return {'CopyPartResult': {'ETag': etag}}
+
+    def complete_multipart_upload(self, Bucket=None, Key=None,
+                                  UploadId=None, MultipartUpload=None):
+        self._object(Bucket, Key)
+        with lock:
+            key, parts = uploads.pop(UploadId)
+        assert key == Key
+        numbers = [p['PartNumber'] for p in MultipartUpload['Parts']]
+        assert numbers == list(range(1, len(parts)+1))
+        for p in MultipartUpload['Parts']:
+            assert p['ETag'] == "ETAG%d" % p['PartNumber']
+        # All parts except the last must be at least 5 MiB.
+        for n in numbers[:-1]:
+            assert len(parts[n]) >= 5 * 1024 * 1024
+        objects[Key] = b''.join(parts[n] for n in numbers)
+
+    def abort_multipart_upload(self, Bucket=None, Key=None, UploadId=None):
+        with lock:
+            uploads.pop(UploadId, None)
+
 
 class StreamingBody(object):
     def __init__(self, data):
@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that many parallel unaligned writes are not lost by racing
+# read-modify-write cycles, both when they fall in the same large
+# block and when they are spread over blocks guarded by different
+# locks.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_nbdsh_uri
+
+export script='
+# Issue 256 unaligned writes in parallel, spread round-robin over
+# all 16 of the 1M blocks in the device, so that each block sees 16
+# racing writes and neighbouring writes use different RMW locks.
+def offset(i):
+    return (i % 16) * 1024 * 1024 + (i // 16) * 4096
+
+for i in range(256):
+    h.aio_pwrite(bytearray([i]) * 100, offset(i) + 1)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+
+for i in range(256):
+    buf = h.pread(102, offset(i))
+    assert buf == b"\0" + bytearray([i]) * 100 + b"\0"
+'
+
+nbdkit -U - --filter=blocksize memory 16M minblock=1M \
+       --run 'nbdsh -u "$uri" -c "$script"'
@@ -0,0 +1,127 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the curl plugin issues requests in parallel, against a slow
+# local web server.
+
+source ./functions.sh
+set -e
+set -x
+
+requires python3 --version
+requires nbdsh --version
+
+pidfile=test-curl-parallel.pid
+portfile=test-curl-parallel.port
+maxfile=test-curl-parallel.max
+server=test-curl-parallel.py
+files="$pidfile $portfile $maxfile $server"
+rm -f $files
+cleanup_fn rm -f $files
+
+# A web server which serves 1M of data, where byte i is i & 0xff,
+# with a delay on every range request.  It records the largest number
+# of requests it was serving at once.
+cat > $server <<'PYEOF'
+import http.server, sys, threading, time
+
+data = bytes(i & 0xff for i in range(1024 * 1024))
+lock = threading.Lock()
+current = 0
+maximum = 0
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_HEAD(self):
+        self.send_response(200)
+        self.send_header("Content-Length", str(len(data)))
+        self.send_header("Accept-Ranges", "bytes")
+        self.end_headers()
+
+    def do_GET(self):
+        global current, maximum
+        with lock:
+            current += 1
+            maximum = max(maximum, current)
+            with open(sys.argv[2], "w") as f:
+                f.write("%d\n" % maximum)
+        time.sleep(0.5)
+        start, end = self.headers["Range"][6:].split("-")
+        start, end = int(start), min(int(end), len(data) - 1)
+        self.send_response(206)
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Content-Range",
+                         "bytes %d-%d/%d" % (start, end, len(data)))
+        self.end_headers()
+        self.wfile.write(data[start:end+1])
+        with lock:
+            current -= 1
+
+    def log_message(self, *args):
+        pass
+
+httpd = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+with open(sys.argv[1], "w") as f:
+    f.write("%d\n" % httpd.server_address[1])
+httpd.serve_forever()
+PYEOF
+
+python3 $server $portfile $maxfile &
+echo $! > $pidfile
+cleanup_fn kill $(cat $pidfile)
+
+for i in {1..60}; do
+    if test -s $portfile; then break; fi
+    sleep 1
+done
+port=$(cat $portfile)
+
+# Issue 8 reads at once over a single NBD connection.
+nbdkit -U - curl http://127.0.0.1:$port/disk connections=4 \
+       --run 'nbdsh -u "$uri" -c "
+bufs = [nbd.Buffer(4096) for i in range(8)]
+for i in range(8):
+    h.aio_pread(bufs[i], i * 65536 + 1)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+for i in range(8):
+    expected = bytearray((j & 0xff) for j in range(i * 65536 + 1,
+                                                    i * 65536 + 4097))
+    assert bufs[i].to_bytearray() == expected
+"'
+
+# The requests should have overlapped, but not more than the number
+# of connections.
+cat $maxfile
+test "$(cat $maxfile)" -gt 1
+test "$(cat $maxfile)" -le 4
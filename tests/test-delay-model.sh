@@ -0,0 +1,103 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test delay filter distributions, bandwidth and concurrency limits.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin memory
+requires_filter delay
+requires nbdsh --version
+
+files="delay-model.txt"
+rm -f $files
+cleanup_fn rm -f $files
+
+# An empirical distribution with a single value always gives that delay.
+cat > delay-model.txt <<'EOT'
+# delay    weight
+200ms      1
+EOT
+
+# With delay-concurrency=1, 4 parallel reads of 200ms each must be
+# serialized and take at least 800ms.
+nbdkit -U - memory 1M --filter=delay \
+       delay-read=empirical:delay-model.txt delay-concurrency=1 \
+       --run 'nbdsh -u "$uri" -c "
+import time
+buf = nbd.Buffer(512)
+t = time.monotonic()
+for i in range(4):
+    h.aio_pread(buf, 0)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+elapsed = time.monotonic() - t
+print(elapsed)
+assert elapsed >= 0.8
+"'
+
+# delay-bandwidth adds a delay proportional to the size of the
+# request: 2M at 4M/s is 500ms.
+nbdkit -U - memory 2M --filter=delay delay-bandwidth=4M \
+       --run 'nbdsh -u "$uri" -c "
+import time
+t = time.monotonic()
+h.pread(2*1024*1024, 0)
+elapsed = time.monotonic() - t
+print(elapsed)
+assert elapsed >= 0.5
+"'
+
+# Random delays are within the limits of the distribution.
+nbdkit -U - memory 1M --filter=delay \
+       delay-read=uniform:10ms:30ms delay-seed=1 \
+       --run 'nbdsh -u "$uri" -c "
+import time
+for i in range(10):
+    t = time.monotonic()
+    h.pread(512, 0)
+    elapsed = time.monotonic() - t
+    print(elapsed)
+    assert elapsed >= 0.01
+"'
+
+# Invalid distributions are rejected.
+for d in foo:1:2 uniform:2:1 normal:1 lognormal:1ms:x empirical:/nonexistent
+do
+    if nbdkit memory 1M --filter=delay delay-read=$d --run true; then
+        echo "$0: delay-read=$d should have been rejected"
+        exit 1
+    fi
+done
@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with cache=direct.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin file
+requires_nbdsh_uri
+requires truncate --version
+
+files="file-direct.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+# O_DIRECT is not supported by all filesystems (eg. tmpfs).
+requires dd if=/dev/zero of=file-direct.img bs=4096 count=1 oflag=direct
+
+truncate -s 0 file-direct.img
+truncate -s 1M file-direct.img
+
+# Check that unaligned and unaligned-in-memory requests work.
+nbdkit -U - file file-direct.img cache=direct \
+       --run 'nbdsh -u "$uri" -c "
+import random
+
+size = 1024 * 1024
+model = bytearray(size)
+r = random.Random(1)
+for i in range(1000):
+    off = r.randrange(0, size - 1)
+    n = r.randrange(1, min(size - off, 300000) + 1)
+    if r.random() < 0.5:
+        b = bytes([r.randrange(256)]) * n
+        h.pwrite(b, off)
+        model[off:off+n] = b
+    else:
+        assert h.pread(n, off) == model[off:off+n]
+h.flush()
+assert h.pread(size, 0) == model
+
+with open(\"file-direct.img\", \"rb\") as f:
+    assert f.read() == model
+"'
+
+# The file size must be aligned.
+truncate -s 1000 file-direct.img
+if nbdkit -U - file file-direct.img cache=direct \
+          --run 'nbdsh -u "$uri" -c "h.get_size()"'; then
+    echo "$0: expected cache=direct to fail with unaligned file size"
+    exit 1
+fi
@@ -0,0 +1,112 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Check that the FIEMAP, lseek and cached extents paths in the file
+# plugin return the same extents, including after the file is
+# modified through another connection.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_plugin file
+requires_nbdsh_uri
+requires nbdsh --base-allocation --version
+requires dd --version
+requires truncate --version
+
+disk=file-extents-fiemap.img
+out=file-extents-fiemap.out
+expected=file-extents-fiemap.expected
+files="$disk $out $expected"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create a sparse file with some data, and a preallocated (unwritten)
+# extent if the filesystem supports it.
+truncate -s 10M $disk
+for i in 1 3 4 8 9 40 41 42; do
+    dd if=/dev/urandom of=$disk bs=64K seek=$i count=1 conv=notrunc
+done
+fallocate -n -o 6M -l 256K $disk ||:
+
+# Print the extents of the whole disk, coalescing adjacent types.
+export script='
+def extents(h):
+    size = h.get_size()
+    offs = 0
+    entries = []
+    def f(metacontext, offset, e, err):
+        nonlocal offs
+        assert offs == offset
+        for length, flags in zip(*[iter(e)] * 2):
+            if entries and flags == entries[-1][1]:
+                entries[-1] = (entries[-1][0] + length, flags)
+            else:
+                entries.append((length, flags))
+            offs = offs + length
+    while offs < size:
+        h.block_status(size - offs, offs, f)
+    print(entries)
+'
+
+nbdkit -U - file $disk fiemap=false \
+       --run 'nbdsh --base-allocation -u "$uri" -c "$script" -c "extents(h)"' \
+       > $expected
+cat $expected
+nbdkit -U - file $disk \
+       --run 'nbdsh --base-allocation -u "$uri" -c "$script" -c "extents(h)"' \
+       > $out
+diff -u $expected $out
+nbdkit -U - file $disk extents-cache=true \
+       --run 'nbdsh --base-allocation -u "$uri" -c "$script" -c "extents(h)"' \
+       > $out
+diff -u $expected $out
+
+# Modify the file through a second connection, which must invalidate
+# the cached extents of the first connection.
+nbdkit -U - file $disk extents-cache=true \
+       --run 'nbdsh --base-allocation -u "$uri" -c "$script" -c "
+extents(h)
+h2 = nbd.NBD()
+h2.connect_uri(\"$uri\")
+h2.trim(65536, 65536)
+h2.pwrite(b\"1\" * 65536, 2*65536)
+h2.zero(8*65536, 9*65536)
+extents(h)
+"' > $out
+cat $out
+nbdkit -U - file $disk fiemap=false \
+       --run 'nbdsh --base-allocation -u "$uri" -c "$script" -c "extents(h)"' \
+       > $expected
+diff -u <(tail -1 $out) $expected
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with engine=io_uring.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin file
+requires_nbdsh_uri
+requires truncate --version
+
+if ! nbdkit file --dump-plugin | grep -sq "^file_io_uring=yes"; then
+    echo "$0: file plugin was not compiled with io_uring support"
+    exit 77
+fi
+
+files="file-io-uring.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 16384 file-io-uring.img
+
+# io_uring can be disabled or blocked in containers.
+if ! nbdkit -U - file file-io-uring.img engine=io_uring --run true; then
+    echo "$0: io_uring is not available"
+    exit 77
+fi
+
+for sqpoll in false true; do
+    nbdkit -U - file file-io-uring.img engine=io_uring sqpoll=$sqpoll \
+           --run 'nbdsh -u "$uri" -c "
+buf0 = bytearray(1024)
+buf1 = b\"1\" * 1024
+buf2 = b\"2\" * 1024
+h.pwrite(buf1 + buf2 + buf1 + buf2, 1024)
+buf = h.pread(8192, 0)
+assert buf == buf0 + buf1 + buf2 + buf1 + buf2 + buf0*3
+
+# FUA writes submit a linked write and fdatasync.
+h.pwrite(buf2, 0, nbd.CMD_FLAG_FUA)
+assert h.pread(1024, 0) == buf2
+h.flush()
+
+h.trim(1024, 1024)
+buf = h.pread(8192, 0)
+assert buf == buf2 + buf0 + buf2 + buf1 + buf2 + buf0*3
+
+h.zero(8192, 0)
+assert h.pread(8192, 0) == buf0*8
+"'
+done
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the file plugin with engine=mmap.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin file
+requires_nbdsh_uri
+requires truncate --version
+
+files="file-mmap.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 16384 file-mmap.img
+
+nbdkit -U - file file-mmap.img engine=mmap \
+       --run 'nbdsh -u "$uri" -c "
+import os
+
+buf0 = bytearray(1024)
+buf1 = b\"1\" * 1024
+buf2 = b\"2\" * 1024
+h.pwrite(buf1 + buf2 + buf1 + buf2, 1024)
+buf = h.pread(8192, 0)
+assert buf == buf0 + buf1 + buf2 + buf1 + buf2 + buf0*3
+
+# The writes went to the file through the shared mapping.
+h.pwrite(buf2, 0, nbd.CMD_FLAG_FUA)
+with open(\"file-mmap.img\", \"rb\") as f:
+    assert f.read(2048) == buf2 + buf1
+h.flush()
+
+h.trim(1024, 1024)
+buf = h.pread(8192, 0)
+assert buf == buf2 + buf0 + buf2 + buf1 + buf2 + buf0*3
+
+h.zero(8192, 0)
+assert h.pread(8192, 0) == buf0*8
+
+# Truncating the file underneath nbdkit must cause an error, not a
+# crash, when reading beyond the new end of the file.
+os.truncate(\"file-mmap.img\", 4096)
+try:
+    h.pread(1024, 8192)
+    assert False
+except nbd.Error:
+    pass
+assert h.pread(1024, 0) == buf0
+"'
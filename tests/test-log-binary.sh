@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the log filter binary trace format and nbdkit-log-decode.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+requires_filter log
+
+decode="$abs_top_builddir/filters/log/nbdkit-log-decode"
+requires test -x "$decode"
+
+files="log-binary.bin log-binary.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# logappend cannot be used with the binary format.
+if nbdkit --filter=log null logfile=log-binary.bin logformat=binary logappend=true \
+          --run true; then
+    echo "$0: expected logappend with logformat=binary to fail"
+    exit 1
+fi
+
+nbdsh -c '
+h.connect_command(["nbdkit", "-s", "--filter=log", "memory", "size=10M",
+                   "logfile=log-binary.bin", "logformat=binary"])
+mb = 1024*1024
+h.pwrite(b"x"*(2*mb), mb)
+h.pread(mb, mb*2)
+h.zero(4096, 0, nbd.CMD_FLAG_FUA)
+h.flush()
+'
+
+"$decode" log-binary.bin > log-binary.log
+cat log-binary.log
+
+grep 'connection=1 Connect size=0xa00000' log-binary.log
+grep 'connection=1 Write id=1 offset=0x100000 count=0x200000 fua=0 ...' log-binary.log
+grep 'connection=1 ...Write id=1 return=0' log-binary.log
+grep 'connection=1 Read id=2 offset=0x200000 count=0x100000 ...' log-binary.log
+grep 'connection=1 Zero id=3 offset=0x0 count=0x1000 trim=1 fua=1 fast=0 ...' log-binary.log
+grep 'connection=1 Flush id=4 ...' log-binary.log
+grep 'connection=1 Disconnect transactions=4' log-binary.log
+
+# Decoding something which is not a trace must fail.
+if "$decode" $0; then
+    echo "$0: expected nbdkit-log-decode to fail"
+    exit 1
+fi
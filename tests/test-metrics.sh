@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --metrics-socket.
+
+source ./functions.sh
+set -x
+set -e
+
+requires_run
+requires_filter cache
+requires_filter noextents
+requires nbdcopy --version
+requires curl --version
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+out="test-metrics.out"
+metrics="test-metrics.metrics"
+files="$sock $out $metrics"
+rm -f $files
+cleanup_fn rm -f $files
+
+nbdkit -U - \
+       --metrics-socket=$sock \
+       --filter=noextents \
+       --filter=cache \
+       memory 10M \
+       --run "
+           nbdcopy \$uri $out &&
+           curl -s --unix-socket $sock http://localhost/metrics > $metrics
+       "
+cat $metrics
+
+grep '^# TYPE nbdkit_request_duration_seconds histogram$' $metrics
+grep '^nbdkit_connections_total [1-9]' $metrics
+grep '^nbdkit_requests_total{command="read"} [1-9]' $metrics
+grep '^nbdkit_request_bytes_total{command="read"} [1-9]' $metrics
+grep '^nbdkit_request_duration_seconds_bucket{command="read",le="+Inf"} [1-9]' \
+     $metrics
+grep '^nbdkit_threadlocal_buffer_bytes ' $metrics
+
+# Metrics registered by the cache filter.
+grep '^nbdkit_cache_misses_total [1-9]' $metrics
+grep '^nbdkit_cache_dirty_bytes 0$' $metrics
+
+# The socket is removed when nbdkit exits.
+test ! -S $sock
@@ -0,0 +1,105 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that the multi-conn filter coalesces concurrent flushes from
+# many connections (group commit).  This also acts as a simple
+# benchmark: the time taken with and without group commit is printed.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin eval
+requires_nbdsh_uri
+
+count=$PWD/test-multi-conn-group-commit.count
+files="$count"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Every flush takes 1 second and is recorded in $count.
+plugin=(
+    get_size='echo 1M'
+    pread='dd if=/dev/zero count=$3 iflag=count_bytes'
+    pwrite='cat >/dev/null'
+    flush="sleep 1; echo >> $count"
+    can_multi_conn='exit 0'
+)
+
+export handles script uri
+uri= # will be set by --run later
+handles=8
+script='
+import os, time
+
+uri = os.environ["uri"]
+handles = int(os.environ["handles"])
+h = []
+for i in range(handles):
+    h.append(nbd.NBD())
+    h[i].connect_uri(uri)
+    h[i].pwrite(b"x" * 512, i * 512)
+
+start = time.monotonic()
+for i in range(handles):
+    h[i].aio_flush()
+for i in range(handles):
+    while h[i].aio_in_flight() > 0:
+        h[i].poll(-1)
+print("%d concurrent flushes took %.2f seconds" %
+      (handles, time.monotonic() - start))
+'
+
+run ()
+{
+    rm -f $count
+    touch $count
+    nbdkit -U - --filter=multi-conn eval "${plugin[@]}" "$@" \
+           --run 'nbdsh -c "$script"'
+    flushes=$(wc -l < $count)
+    echo "$@: plugin saw $flushes flushes"
+}
+
+# When the plugin is multi-conn consistent, a single flush covers
+# all the connections.
+run multi-conn-mode=plugin multi-conn-group-commit=true
+test $flushes -le 2
+
+# When emulating multi-conn each dirty connection must be flushed,
+# but only once (and in parallel).
+run multi-conn-mode=emulate multi-conn-group-commit=true
+test $flushes -eq $handles
+
+# For comparison, without group commit.
+run multi-conn-mode=plugin multi-conn-group-commit=false
+run multi-conn-mode=emulate multi-conn-group-commit=false
+test $flushes -ge $handles
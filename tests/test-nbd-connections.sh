@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test the nbd plugin connections parameter.
+requires nbdsh --version
+
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock2=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+pid1="test-nbd-connections.pid1"
+pid2="test-nbd-connections.pid2"
+files="$sock1 $sock2 $pid1 $pid2"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Upstream server.  The memory plugin advertises multi-conn.
+start_nbdkit -P $pid1 -U $sock1 memory 64M
+
+# nbd plugin opening 4 connections to the upstream server.
+start_nbdkit -P $pid2 -U $sock2 nbd socket=$sock1 connections=4
+
+# Write through the nbd plugin, with many requests in flight so that
+# they are spread over the upstream connections.
+nbdsh -u "nbd+unix://?socket=$sock2" -c '
+bufs = []
+for i in range(64):
+    buf = nbd.Buffer.from_bytearray(bytearray([i]) * 65536)
+    bufs.append(h.aio_pwrite(buf, i * 65536))
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+h.flush()
+for i in range(64):
+    assert h.pread(65536, i * 65536) == bytearray([i]) * 65536
+'
+
+# Check the writes reached the upstream server.
+nbdsh -u "nbd+unix://?socket=$sock1" -c '
+for i in range(64):
+    assert h.pread(65536, i * 65536) == bytearray([i]) * 65536
+'
@@ -0,0 +1,99 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+# Test the nbd plugin striping across several servers.
+requires nbdsh --version
+requires_nbdsh_uri
+
+sock0=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock1=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock2=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+sock3=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+pid0="test-nbd-stripe.pid0"
+pid1="test-nbd-stripe.pid1"
+pid2="test-nbd-stripe.pid2"
+pid3="test-nbd-stripe.pid3"
+files="$sock0 $sock1 $sock2 $sock3 $pid0 $pid1 $pid2 $pid3"
+rm -f $files
+cleanup_fn rm -f $files
+export sock0 sock1 sock2
+
+# Three upstream servers of slightly different sizes.
+start_nbdkit -P $pid0 -U $sock0 memory 1M
+start_nbdkit -P $pid1 -U $sock1 memory 1M
+start_nbdkit -P $pid2 -U $sock2 memory 1100K
+
+# Stripe across them.
+start_nbdkit -P $pid3 -U $sock3 \
+             nbd stripe-size=64K \
+             "nbd+unix:///?socket=$sock0" \
+             "nbd+unix:///?socket=$sock1" \
+             "nbd+unix:///?socket=$sock2"
+
+# Write a different byte to each stripe using a request which spans
+# several stripes, and read it back.
+nbdsh -u "nbd+unix://?socket=$sock3" -c '
+assert h.get_size() == 3 * 1024 * 1024
+
+buf = bytearray()
+for s in range(48):
+    buf += bytearray([s]) * 65536
+h.pwrite(buf[1000:-1000], 1000)
+h.flush()
+assert h.pread(len(buf) - 2000, 1000) == buf[1000:-1000]
+
+# Unaligned request within a stripe.
+assert h.pread(100, 65536 * 5 + 10) == bytearray([5]) * 100
+'
+
+# Check where the stripes ended up on each server.
+nbdsh -c '
+import os
+
+for i in range(3):
+    h = nbd.NBD()
+    h.connect_unix(os.environ["sock%d" % i])
+    for row in range(16):
+        s = row * 3 + i
+        data = h.pread(65536, row * 65536)
+        if s == 0:
+            assert data[1000:] == bytearray([s]) * (65536 - 1000)
+        elif s == 47:
+            assert data[:-1000] == bytearray([s]) * (65536 - 1000)
+        else:
+            assert data == bytearray([s]) * 65536
+    h.shutdown()
+'
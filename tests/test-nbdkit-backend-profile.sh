@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test -D nbdkit.backend.profile=1 prints a table of per-layer timings.
+
+source ./functions.sh
+set -x
+set -e
+
+requires_run
+requires nbdcopy --version
+
+out="test-nbdkit-backend-profile.out"
+debug="test-nbdkit-backend-profile.debug"
+files="$out $debug"
+rm -f $files
+cleanup_fn rm -f $files
+
+nbdkit -U - \
+       -D nbdkit.backend.profile=1 \
+       --filter=noextents \
+       memory 10M \
+       --run "nbdcopy \$uri $out" |& tee $debug
+
+# There should be one row per layer for each command issued.
+grep '^nbdkit: profile:' $debug
+grep '^1 filter noextents  *pread ' $debug
+grep '^0 plugin memory  *pread ' $debug
+
+# Without the flag no table should be printed.
+nbdkit -U - \
+       --filter=noextents \
+       memory 10M \
+       --run "nbdcopy \$uri $out" |& tee $debug
+if grep '^nbdkit: profile:' $debug; then
+    echo "$0: unexpected profile output"
+    exit 1
+fi
@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires nbdcopy --version
+
+files="rate-client-1.img rate-client-2.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Two copies are run in parallel over the same Unix domain socket, so
+# they count as the same client and share the client-rate limit.  The
+# connection-rate limit alone would allow both to finish in about 4
+# seconds.  Sharing the client bucket it should take about twice that:
+#   2 * (8 * 5 * 1024 * 1024) / (8 * 1024 * 1024) = 10
+# less the 1 second burst allowed at the start.
+
+start_t=$SECONDS
+nbdkit -U - \
+       --filter=rate \
+       pattern 5M \
+       client-rate=8M connection-rate=10M rate-burst=1 \
+       --run '
+           nbdcopy "$uri" rate-client-1.img &
+           nbdcopy "$uri" rate-client-2.img &
+           wait
+       '
+end_t=$SECONDS
+
+seconds=$(( end_t - start_t ))
+if [ "$seconds" -lt 8 ] || [ "$seconds" -gt 30 ]; then
+    echo "$0: rate filter failed: command took $seconds seconds, expected about 9"
+    exit 1
+fi
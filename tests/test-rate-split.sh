@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires nbdcopy --version
+
+files="rate-split.img rate-split.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Unlike test-rate.sh we don't use the blocksize filter here.  The
+# rate filter should split the large requests issued by nbdcopy into
+# slices itself, so we check both the overall rate and that no single
+# sleep is much longer than the time taken to transfer one slice
+# (64K at 8 Mbps = 0.0625 seconds).
+#
+# Transferring 10M at 8 Mbps should take 10 seconds, less the 1
+# second burst allowed at the start.
+
+start_t=$SECONDS
+nbdkit -U - -v -D rate.bucket=1 \
+       --filter=rate \
+       pattern 10M \
+       rate=8M rate-burst=1 \
+       --run 'nbdcopy "$uri" rate-split.img' \
+       2>rate-split.log
+end_t=$SECONDS
+
+seconds=$(( end_t - start_t ))
+if [ "$seconds" -lt 8 ] || [ "$seconds" -gt 30 ]; then
+    echo "$0: rate filter failed: command took $seconds seconds, expected about 9"
+    exit 1
+fi
+
+# Check the length of the longest sleep.
+max_sleep="$(
+    grep 'sleeping for' rate-split.log |
+    sed 's/.*sleeping for \([0-9.]*\) seconds.*/\1/' |
+    sort -n | tail -1
+)"
+echo "longest sleep: $max_sleep"
+if [ -z "$max_sleep" ]; then
+    echo "$0: rate filter did not sleep"
+    exit 1
+fi
+if awk -v s="$max_sleep" 'BEGIN { exit !(s > 0.2) }'; then
+    echo "$0: rate filter failed: sleep of $max_sleep seconds is too long"
+    exit 1
+fi
@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the replay tool with text and binary traces.
+
+source ./functions.sh
+set -e
+set -x
+
+requires nbdsh --version
+requires_filter log
+requires_plugin memory
+requires_plugin null
+requires test -x replay
+
+files="replay.log replay.bin replay.out replay2.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+export script='
+import time
+for i in range(20):
+    h.pwrite(b"x" * 65536, i * 65536)
+    h.pread(4096, i * 4096)
+    time.sleep(0.01)
+h.zero(4096, 0)
+h.trim(4096, 8192)
+h.flush()
+'
+
+# Capture the same workload in text and binary formats.
+nbdkit -U - --filter=log memory 10M logfile=replay.log \
+       --run 'nbdsh -u "$uri" -c "$script"'
+nbdkit -U - --filter=log memory 10M logfile=replay.bin logformat=binary \
+       --run 'nbdsh -u "$uri" -c "$script"'
+
+# Replay the text log with the original timing.
+nbdkit -U - memory 10M --run './replay replay.log "$uri"' > replay.out
+cat replay.out
+grep '^total: 43 ops,.* 0 errors, 0 skipped' replay.out
+grep '^read: 20 ops, 81920 bytes' replay.out
+grep '^write: 20 ops, 1310720 bytes' replay.out
+grep '^zero: 1 ops' replay.out
+grep '^trim: 1 ops' replay.out
+grep '^flush: 1 ops' replay.out
+grep '^  latency: p50 ' replay.out
+
+# Replay the binary trace as fast as possible over several
+# connections.
+nbdkit -U - null 10M --run './replay -s 0 -c 4 replay.bin "$uri"' > replay.out
+cat replay.out
+grep '^write: 20 ops, 1310720 bytes' replay.out
+grep '^total: 43 ops,.* 0 errors, 0 skipped' replay.out
+
+# Replaying through the log filter should issue the same requests as
+# were originally logged.
+nbdkit -U - --filter=log memory 10M logfile=replay2.log \
+       --run './replay -s 0 replay.log "$uri"'
+diff -u <(grep -o 'connection=1 [A-Za-z]* id=.* \.\.\.$' replay.log) \
+        <(grep -o 'connection=1 [A-Za-z]* id=.* \.\.\.$' replay2.log)
@@ -0,0 +1,178 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the coprocess mode of nbdkit-sh-plugin.  This also acts as a
+# simple benchmark: the number of reads per second with and without a
+# coprocess is printed.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin sh
+requires_nbdsh_uri
+requires python3 --version
+
+script=$PWD/test-sh-coprocess.py
+log=$PWD/test-sh-coprocess.log
+files="$script $log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# The same script implements every method both when it is run once
+# per call and as a coprocess.  The coprocess does not implement
+# get_size so that the fallback to running the script is tested.
+cat > $script <<'PY'
+#!/usr/bin/env python3
+import os
+import sys
+
+tmpdir = os.environ["tmpdir"]
+disk = os.path.join(tmpdir, "disk")
+size = 1024 * 1024
+fd = None
+
+
+def method(name, args, data):
+    if name == "thread_model":
+        return 0, b"parallel"
+    if name == "config" and args[0] == "mode":
+        with open(os.path.join(tmpdir, "mode"), "w") as f:
+            f.write(args[1])
+        return 0, b""
+    if name == "config_complete":
+        with open(disk, "wb") as f:
+            f.truncate(size)
+        return 0, b""
+    if name == "coprocess_mode":
+        with open(os.path.join(tmpdir, "mode")) as f:
+            return 0, f.read().encode()
+    if name == "get_size":
+        return 0, b"%d" % size
+    if name in ("can_write", "can_flush"):
+        return 0, b""
+    if name == "pread":
+        count, offset = int(args[1]), int(args[2])
+        if offset == size - 512:
+            return 1, b"EPERM bad sector"
+        return 0, os.pread(fd, count, offset)
+    if name == "pwrite":
+        os.pwrite(fd, data, int(args[2]))
+        return 0, b""
+    if name == "flush":
+        os.fsync(fd)
+        return 0, b""
+    return 2, b""
+
+
+if sys.argv[1] == "coprocess":
+    with open(os.environ["log"], "a") as f:
+        f.write("started %s\n" % sys.argv[2])
+    fd = os.open(disk, os.O_RDWR)
+    inp = sys.stdin.buffer
+    out = sys.stdout.buffer
+    while True:
+        line = inp.readline()
+        if not line:
+            break
+        name, nargs, length = line.split()
+        args = [inp.readline()[:-1].decode() for i in range(int(nargs))]
+        data = inp.read(int(length))
+        if name == b"get_size":
+            status, reply = 2, b""
+        else:
+            status, reply = method(name.decode(), args, data)
+        out.write(b"%d %d\n" % (status, len(reply)) + reply)
+        out.flush()
+else:
+    if os.path.exists(disk):
+        fd = os.open(disk, os.O_RDWR)
+    data = b""
+    if sys.argv[1] == "pwrite":
+        data = sys.stdin.buffer.read()
+    status, reply = method(sys.argv[1], sys.argv[2:], data)
+    if status == 1:
+        sys.stderr.buffer.write(reply)
+    else:
+        sys.stdout.buffer.write(reply)
+    sys.exit(status)
+PY
+chmod +x $script
+
+export log mode nbdsh_script uri
+uri= # will be set by --run later
+nbdsh_script='
+import os, time
+
+uri = os.environ["uri"]
+h2 = nbd.NBD()
+h2.connect_uri(uri)
+
+assert h.get_size() == 1024 * 1024
+buf = bytes(range(256)) * 16
+h.pwrite(buf, 8192)
+h.flush()
+assert h2.pread(len(buf), 8192) == buf
+assert h2.pread(512, 0) == bytes(512)
+try:
+    h.pread(512, 1024 * 1024 - 512)
+    assert False
+except nbd.Error:
+    pass
+
+n = 0
+start = time.monotonic()
+while time.monotonic() - start < 2:
+    h.pread(4096, n % 256 * 4096)
+    n += 1
+t = time.monotonic() - start
+print("coprocess mode %s: %d reads in %.2f seconds (%d reads/second)" %
+      (os.environ["mode"], n, t, n / t))
+'
+
+run ()
+{
+    mode=$1
+    rm -f $log
+    touch $log
+    nbdkit -U - sh $script mode=$mode --run 'nbdsh -u "$uri" -c "$nbdsh_script"'
+    cat $log
+}
+
+run none
+test $(wc -l < $log) -eq 0
+
+run connection
+test $(grep -c "started connection" $log) -eq 2
+
+run global
+test $(grep -c "started global" $log) -eq 1
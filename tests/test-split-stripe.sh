@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the split plugin in striped mode, and writes in both modes.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_run
+requires_nbdsh_uri
+requires cmp --version
+
+files="test-split-stripe.1 test-split-stripe.2 test-split-stripe.3"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Three files, the last is shorter so only 3 stripes of each are used.
+printf %2048s | tr ' ' a > test-split-stripe.1
+printf %2048s | tr ' ' b > test-split-stripe.2
+printf %1700s | tr ' ' c > test-split-stripe.3
+
+nbdkit -v -U - split $files stripe-size=512 \
+       --run 'nbdsh --uri "$uri" -c "
+assert h.get_size() == 3 * 3 * 512
+assert h.pread(1024, 256) == b\"a\"*256 + b\"b\"*512 + b\"c\"*256
+assert h.pread(512, 1536) == b\"a\"*512
+assert h.pread(512, 4096) == b\"c\"*512
+
+# Write across two stripes.
+h.pwrite(b\"X\"*512, 2048 + 256)
+"'
+
+# The write should have gone to the end of stripe 1 in the second
+# file and the start of stripe 1 in the third file.
+cmp <(printf %768s | tr ' ' b; printf %256s | tr ' ' X; printf %1024s | tr ' ' b) test-split-stripe.2
+cmp <(printf %512s | tr ' ' c; printf %256s | tr ' ' X; printf %932s | tr ' ' c) test-split-stripe.3
+
+# Write in concatenated mode across the second and third files.
+nbdkit -v -U - split $files \
+       --run 'nbdsh --uri "$uri" -c "
+assert h.get_size() == 2048 + 2048 + 1700
+h.pwrite(b\"Y\"*512, 2048 + 2048 - 256)
+"'
+cmp <(printf %768s | tr ' ' b; printf %256s | tr ' ' X; printf %768s | tr ' ' b; printf %256s | tr ' ' Y) test-split-stripe.2
+cmp <(printf %256s | tr ' ' Y; printf %256s | tr ' ' c; printf %256s | tr ' ' X; printf %932s | tr ' ' c) test-split-stripe.3
@@ -0,0 +1,128 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the ssh plugin over a connection with added latency, which
+# exercises pipelined reads and writes and multiple sessions.
+
+source ./functions.sh
+set -e
+set -x
+
+requires test -f disk
+requires sshd -t -f ssh/sshd_config
+requires nbdcopy --version
+requires cut --version
+requires $PYTHON --version
+
+# Check that ssh to localhost will work without any passwords or phrases.
+requires ssh -V
+if ! ssh -o PreferredAuthentications=none,publickey -o StrictHostKeyChecking=no localhost echo </dev/null
+then
+    echo "$0: passwordless/phraseless authentication to localhost not possible"
+    exit 77
+fi
+
+files="ssh-latency.img ssh-latency.copy ssh-latency.port"
+rm -f $files
+cleanup_fn rm -f $files
+
+`which sshd` -f ssh/sshd_config -D -e &
+sshd_pid=$!
+cleanup_fn kill $sshd_pid
+
+# Get the sshd port number which was randomly assigned.
+port="$(grep ^Port ssh/sshd_config | cut -f 2)"
+
+# Run a proxy in front of sshd which delays all data by 25ms in each
+# direction, like netem.
+export port
+$PYTHON -c '
+import asyncio, os, time
+
+DELAY = 0.025
+
+async def pump(reader, writer):
+    q = asyncio.Queue()
+    async def send():
+        while True:
+            t, data = await q.get()
+            await asyncio.sleep(max(0, t - time.monotonic()))
+            if not data:
+                writer.close()
+                return
+            writer.write(data)
+            await writer.drain()
+    task = asyncio.ensure_future(send())
+    while True:
+        data = await reader.read(65536)
+        q.put_nowait((time.monotonic() + DELAY, data))
+        if not data:
+            break
+    await task
+
+async def handle(creader, cwriter):
+    sreader, swriter = await asyncio.open_connection(
+        "localhost", int(os.environ["port"]))
+    await asyncio.gather(pump(creader, swriter), pump(sreader, cwriter),
+                         return_exceptions=True)
+
+async def main():
+    server = await asyncio.start_server(handle, "127.0.0.1", 0)
+    with open("ssh-latency.port", "w") as f:
+        f.write("%d" % server.sockets[0].getsockname()[1])
+    await server.serve_forever()
+
+asyncio.run(main())
+' &
+proxy_pid=$!
+cleanup_fn kill $proxy_pid
+
+for i in {1..60}; do
+    if test -s ssh-latency.port; then break; fi
+    sleep 1
+done
+proxy_port="$(cat ssh-latency.port)"
+
+# Copy the disk using parallel requests.
+nbdkit -v -U - \
+       ssh host=127.0.0.1 port=$proxy_port $PWD/disk \
+       verify-remote-host=false connections=4 \
+       --run 'nbdcopy --requests=8 "$uri" ssh-latency.img'
+cmp disk ssh-latency.img
+
+# Write to a remote file and check the result.
+truncate -r disk ssh-latency.copy
+nbdkit -v -U - \
+       ssh host=127.0.0.1 port=$proxy_port $PWD/ssh-latency.copy \
+       verify-remote-host=false connections=4 \
+       --run 'nbdcopy --requests=8 disk "$uri"'
+cmp disk ssh-latency.copy
@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the stats filter JSON output and latency percentiles.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_nbdsh_uri
+
+out=test-stats-json.out
+files="$out"
+rm -f $files
+cleanup_fn rm -f $files
+
+nbdkit -U - --filter=stats memory 1M \
+       statsfile=$out statsformat=json statsconnections=true \
+       --run 'nbdsh -u "$uri" -c "
+for i in range(10):
+    h.pwrite(b\"x\" * 4096, i * 4096)
+for i in range(20):
+    h.pread(512, i * 512)
+h.flush()
+"'
+
+cat $out
+
+# The last line contains the totals.
+total="$(grep '"type":"total"' $out)"
+echo "$total" | grep -q '"write":{"ops":10,"bytes":40960,'
+echo "$total" | grep -q '"read":{"ops":20,"bytes":10240,'
+echo "$total" | grep -q '"flush":{"ops":1,'
+# All the writes were 4K, so every size percentile is 4096.
+echo "$total" | grep -q '"size":{"p50":4096,"p90":4096,"p99":4096,"p99.9":4096,"max":4096}'
+# Latency percentiles are present.
+echo "$total" | grep -q '"read":{"ops":20,"bytes":10240,"time_ns":[0-9]*,"latency_ns":{"p50":[0-9]*,"p90":[0-9]*,"p99":[0-9]*,"p99.9":[0-9]*,"max":[0-9]*}'
@@ -0,0 +1,119 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the torrent plugin against a seeder running on loopback.  This
+# needs the libtorrent Python bindings to create and seed the torrent.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin torrent
+requires_run
+requires_nbdsh_uri
+requires nbdcopy --version
+requires $PYTHON -c 'import libtorrent'
+
+# Python has proven very difficult to valgrind, therefore it is disabled.
+if [ "$NBDKIT_VALGRIND" = "1" ]; then
+    echo "$0: skipping Python test under valgrind."
+    exit 77
+fi
+
+d=torrent.d
+out=torrent.out
+rm -rf $d $out
+cleanup_fn rm -rf $d $out
+mkdir $d $d/cache
+
+# The file served from the torrent, 64K pieces.
+$PYTHON -c 'import os; open("'$d/disk'", "wb").write(os.urandom(4*1024*1024))'
+
+# Seed it, and write a magnet link with the address of the seeder.
+export d
+$PYTHON -c '
+import libtorrent as lt, os, time
+
+d = os.environ["d"]
+fs = lt.file_storage()
+lt.add_files(fs, d + "/disk")
+t = lt.create_torrent(fs, 65536)
+lt.set_piece_hashes(t, d)
+ti = lt.torrent_info(t.generate())
+
+ses = lt.session({"listen_interfaces": "127.0.0.1:0",
+                  "enable_dht": False, "enable_lsd": False,
+                  "enable_upnp": False, "enable_natpmp": False,
+                  "allow_multiple_connections_per_ip": True})
+atp = lt.add_torrent_params()
+atp.ti = ti
+atp.save_path = d
+atp.flags = lt.torrent_flags.seed_mode
+ses.add_torrent(atp)
+
+with open(d + "/magnet.tmp", "w") as f:
+    f.write(lt.make_magnet_uri(ti) +
+            "&x.pe=127.0.0.1:%d" % ses.listen_port())
+os.rename(d + "/magnet.tmp", d + "/magnet")
+
+while True:
+    time.sleep(1)
+' &
+seeder_pid=$!
+cleanup_fn kill $seeder_pid
+
+for i in {1..60}; do
+    if test -f $d/magnet; then break; fi
+    sleep 1
+done
+magnet="$(cat $d/magnet)"
+
+# Random reads first, so that pieces are fetched on demand, then copy
+# the whole file sequentially.
+nbdkit -v -U - torrent "$magnet" cache=$d/cache \
+       listen-interfaces=127.0.0.1:0 \
+       enable-dht=false enable-lsd=false \
+       enable-upnp=false enable-natpmp=false \
+       allow-multiple-connections-per-ip=true \
+       readahead=1M \
+       --run '
+    nbdsh -u "$uri" -c "
+import os, random
+data = open(os.environ[\"d\"] + \"/disk\", \"rb\").read()
+assert h.get_size() == len(data)
+for i in range(20):
+    off = random.randrange(0, len(data) - 100000)
+    assert h.pread(100000, off) == data[off:off+100000]
+" &&
+    nbdcopy "$uri" '$out'
+'
+cmp $d/disk $out
@@ -64,10 +64,11 @@ static char sockpath[] = "............./sock";
 static int listen_sock = -1;
 static int fd = -1;
 static struct stat statbuf;
-static char request[16384];
+static __thread char request[16384];
 static check_request_t check_request;
 
 static void *start_web_server (void *arg);
+static void *start_connection (void *arg);
 static void handle_requests (int s);
 static void handle_file_request (int s, enum method method);
 static void handle_mirror_redirect_request (int s);
@@ -167,20 +168,38 @@ web_server (const char *filename, check_request_t _check_request)
 static void *
 start_web_server (void *arg)
 {
-  int s;
+  int s, err;
+  pthread_t thread;
 
   fprintf (stderr, "web server: listening on %s\n", sockpath);
 
+  /* The client may keep several connections open at the same time,
+   * so handle each connection in its own thread.
+   */
   for (;;) {
     s = accept (listen_sock, NULL, NULL);
     if (s == -1) {
       perror ("accept");
       exit (EXIT_FAILURE);
     }
-    handle_requests (s);
+    err = pthread_create (&thread, NULL, start_connection,
+                          (void *) (intptr_t) s);
+    if (err) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+    pthread_detach (thread);
   }
 }
 
+static void *
+start_connection (void *arg)
+{
+  handle_requests ((int) (intptr_t) arg);
+  return NULL;
+}
+
 static void
 handle_requests (int s)
 {
@@ -352,16 +371,19 @@ handle_file_request (int s, enum method method)
 static void
 handle_mirror_redirect_request (int s)
 {
+  static pthread_mutex_t rr_lock = PTHREAD_MUTEX_INITIALIZER;
   static char rr = '1';         /* round robin '1', '2', '3' */
   /* Note we send 302 (temporary redirect), same as Fedora's mirrorservice. */
   const char found[] = "HTTP/1.1 302 Found\r\nContent-Length: 0\r\n";
   char location[] = "Location: /mirrorX\r\n";
   const char eol[] = "\r\n";
 
+  pthread_mutex_lock (&rr_lock);
   location[17] = rr;
   rr++;
   if (rr == '4')
     rr = '1';
+  pthread_mutex_unlock (&rr_lock);
 
   xwrite (s, found, strlen (found));
   xwrite (s, location, strlen (location));